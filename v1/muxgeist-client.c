@@ -1,12 +1,26 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MUXGEIST_SOCKET_PATH "/tmp/muxgeist.sock"
-#define MAX_BUFFER_SIZE 8192
+#define MUXGEIST_SYSTEM_SOCKET_PATH "/run/muxgeist/muxgeist.sock"
+#define MAX_BUFFER_SIZE 16384 // Matches the daemon's largest response
+#define CONNECT_RETRY_MS 3000 // Keep retrying this long while a daemon starts
+#define CONNECT_MAX_DELAY_MS 200
+#define FOLLOW_BUFFER_SIZE 65536
+#define FOLLOW_IOV_MAX 1024 // Output iovecs per writev, under IOV_MAX
+#define SPLICE_CHUNK (1 << 20)
 
 typedef enum {
   ERROR_NONE = 0,
@@ -17,24 +31,123 @@ typedef enum {
   ERROR_UNKNOWN = 255
 } client_error_t;
 
-client_error_t send_command(const char *command, char *response,
-                            size_t response_size) {
-  int sock;
-  struct sockaddr_un addr;
+long monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
 
-  sock = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (sock == -1) {
-    perror("socket");
-    return ERROR_SOCKET_CREATE;
+// Start a daemon in the background, detached from this client: the one
+// named by MUXGEIST_DAEMON, else the one next to this binary, else the one
+// on PATH. Racing clients may each start one; the daemon's instance lock
+// keeps only the first.
+void spawn_daemon(void) {
+  char daemon_path[PATH_MAX] = "muxgeist-daemon";
+  const char *configured = getenv("MUXGEIST_DAEMON");
+  if (configured && *configured) {
+    snprintf(daemon_path, sizeof(daemon_path), "%s", configured);
+  } else {
+    char self[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len > 0) {
+      self[len] = '\0';
+      char *slash = strrchr(self, '/');
+      if (slash) {
+        snprintf(slash + 1, sizeof(self) - (slash + 1 - self),
+                 "muxgeist-daemon");
+        if (access(self, X_OK) == 0) {
+          snprintf(daemon_path, sizeof(daemon_path), "%s", self);
+        }
+      }
+    }
   }
 
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Double fork so the daemon is reparented and never a zombie of ours
+    setsid();
+    if (fork() != 0) {
+      _exit(0);
+    }
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+      dup2(null_fd, STDIN_FILENO);
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+    }
+    execlp(daemon_path, daemon_path, (char *)NULL);
+    _exit(127);
+  }
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+}
+
+// Connect, riding out daemon restarts: a missing or refusing socket is
+// retried with jittered exponential backoff for up to CONNECT_RETRY_MS.
+// When the default daemon is not running at all, the first retry starts
+// it (unless MUXGEIST_NO_SPAWN is set).
+int connect_daemon(const char *socket_path, int may_spawn) {
+  struct sockaddr_un addr;
   memset(&addr, 0, sizeof(addr));
   addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, MUXGEIST_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
 
-  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-    perror("connect");
+  long deadline = monotonic_ms() + CONNECT_RETRY_MS;
+  long delay_ms = 5;
+  srand((unsigned)getpid() ^ (unsigned)monotonic_ms());
+  while (1) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+      perror("socket");
+      return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return sock;
+    }
+    int error = errno;
     close(sock);
+    if ((error != ENOENT && error != ECONNREFUSED && error != EAGAIN) ||
+        monotonic_ms() >= deadline) {
+      errno = error;
+      perror("connect");
+      return -1;
+    }
+    if (may_spawn && !getenv("MUXGEIST_NO_SPAWN")) {
+      spawn_daemon();
+      may_spawn = 0;
+    }
+    // Sleep somewhere in [delay/2, delay) so restarting clients spread out
+    usleep((useconds_t)(delay_ms / 2 + rand() % (delay_ms / 2 + 1)) * 1000);
+    delay_ms = delay_ms * 2 > CONNECT_MAX_DELAY_MS ? CONNECT_MAX_DELAY_MS
+                                                   : delay_ms * 2;
+  }
+}
+
+// MUXGEIST_SOCKET selects another daemon, e.g. an aggregator. Without it
+// a per-user daemon is preferred, then a system one if that is running.
+const char *daemon_socket_path(int *may_spawn) {
+  const char *socket_path = getenv("MUXGEIST_SOCKET");
+  *may_spawn = 0;
+  if (socket_path && *socket_path) {
+    return socket_path;
+  }
+  if (access(MUXGEIST_SOCKET_PATH, F_OK) != 0 &&
+      access(MUXGEIST_SYSTEM_SOCKET_PATH, F_OK) == 0) {
+    return MUXGEIST_SYSTEM_SOCKET_PATH;
+  }
+  *may_spawn = 1;
+  return MUXGEIST_SOCKET_PATH;
+}
+
+client_error_t send_command(const char *command, char *response,
+                            size_t response_size) {
+  int sock;
+  int may_spawn;
+  const char *socket_path = daemon_socket_path(&may_spawn);
+
+  sock = connect_daemon(socket_path, may_spawn);
+  if (sock == -1) {
     return ERROR_SOCKET_CONNECT;
   }
 
@@ -44,24 +157,353 @@ client_error_t send_command(const char *command, char *response,
     return ERROR_SEND_FAILED;
   }
 
-  ssize_t bytes_received = recv(sock, response, response_size - 1, 0);
-  if (bytes_received == -1) {
-    perror("recv");
-    close(sock);
-    return ERROR_RECV_FAILED;
+  // The daemon closes the connection once the response is complete
+  size_t total_received = 0;
+  while (total_received < response_size - 1) {
+    ssize_t bytes_received = recv(sock, response + total_received,
+                                  response_size - total_received - 1, 0);
+    if (bytes_received == -1) {
+      perror("recv");
+      close(sock);
+      return ERROR_RECV_FAILED;
+    }
+    if (bytes_received == 0) {
+      break;
+    }
+    total_received += bytes_received;
   }
 
-  response[bytes_received] = '\0';
+  response[total_received] = '\0';
   close(sock);
   return ERROR_NONE;
 }
 
+int writev_all(int fd, struct iovec *iov, int iov_count) {
+  while (iov_count > 0) {
+    ssize_t written = writev(fd, iov, iov_count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iov_count--;
+    }
+    if (iov_count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+// Turn the complete protocol lines in data into output iovecs, pointing into
+// data itself. Returns the bytes consumed; a partial last line is left.
+// Sets *done to 1 when the session went away, -1 on a daemon error.
+size_t render_follow_lines(char *data, size_t len, struct iovec *iov,
+                           int *iov_count, unsigned long *last_seq,
+                           int *done) {
+  static const char *prefixes[] = {"L", "", "E", "!! ", "T", "== ",
+                                   "C", "-- ", NULL};
+  size_t used = 0;
+  while (used < len && *iov_count + 8 <= FOLLOW_IOV_MAX) {
+    char *line = data + used;
+    char *eol = memchr(line, '\n', len - used);
+    if (!eol) {
+      break;
+    }
+    used = eol - data + 1;
+    *eol = '\0';
+
+    if (strncmp(line, "ERROR", 5) == 0) {
+      fprintf(stderr, "%s\n", line);
+      *done = -1;
+      break;
+    }
+    if (strcmp(line, "GONE") == 0) {
+      *done = 1;
+      break;
+    }
+    if (line[0] == 'G') {
+      // "G from to pane": lines that scrolled away before they could be sent
+      char *to = strchr(line + 2, ' ');
+      char *gap_pane = to ? strchr(to + 1, ' ') : NULL;
+      if (!gap_pane) {
+        continue;
+      }
+      *to++ = '\0';
+      *gap_pane++ = '\0';
+      iov[(*iov_count)++] = (struct iovec){"[", 1};
+      iov[(*iov_count)++] = (struct iovec){gap_pane, strlen(gap_pane)};
+      iov[(*iov_count)++] = (struct iovec){"] ... missed lines ", 19};
+      iov[(*iov_count)++] = (struct iovec){line + 2, strlen(line + 2)};
+      iov[(*iov_count)++] = (struct iovec){"-", 1};
+      iov[(*iov_count)++] = (struct iovec){to, strlen(to)};
+      iov[(*iov_count)++] = (struct iovec){"\n", 1};
+      continue;
+    }
+    // "<kind> <seq> <pane> <text>"
+    char *cursor = line + 2;
+    unsigned long seq = strtoul(cursor, &cursor, 10);
+    char *pane = cursor + (*cursor == ' ');
+    char *text = strchr(pane, ' ');
+    if (line[0] == 'S') {
+      *last_seq = *last_seq ? *last_seq : seq;
+      continue;
+    }
+    if (!text || line[1] != ' ') {
+      continue;
+    }
+    *text++ = '\0';
+    pane[-1] = '[';
+    text[-1] = ']';
+    *last_seq = seq;
+    const char *prefix = "";
+    for (int i = 0; prefixes[i]; i += 2) {
+      if (line[0] == prefixes[i][0]) {
+        prefix = prefixes[i + 1];
+      }
+    }
+    iov[(*iov_count)++] = (struct iovec){pane - 1, text - pane + 1};
+    iov[(*iov_count)++] = (struct iovec){" ", 1};
+    iov[(*iov_count)++] = (struct iovec){(char *)prefix, strlen(prefix)};
+    eol[0] = '\n';
+    iov[(*iov_count)++] = (struct iovec){text, eol - text + 1};
+  }
+  return used;
+}
+
+// "follow <session> [--pane P] [--errors-only]": stream the session as it
+// is ingested. When the daemon restarts the stream resumes after the last
+// sequence number printed, so nothing that was still in its history is lost.
+int follow_session(int argc, char *argv[]) {
+  const char *session = argv[2];
+  const char *pane = "";
+  const char *flags = "";
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--pane") == 0 && i + 1 < argc) {
+      pane = argv[++i];
+    } else if (strcmp(argv[i], "--errors-only") == 0) {
+      flags = "errors";
+    } else {
+      fprintf(stderr, "Unknown follow option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  static char buffer[FOLLOW_BUFFER_SIZE];
+  struct iovec iov[FOLLOW_IOV_MAX];
+  unsigned long last_seq = 0;
+  int done = 0;
+  while (!done) {
+    int may_spawn;
+    const char *socket_path = daemon_socket_path(&may_spawn);
+    int sock = connect_daemon(socket_path, may_spawn);
+    if (sock == -1) {
+      return 1;
+    }
+    char request[512];
+    char since[32] = "";
+    if (last_seq) {
+      snprintf(since, sizeof(since), "%lu", last_seq);
+    }
+    snprintf(request, sizeof(request), "follow:%s:%s:%s:%s", session, since,
+             pane, flags);
+    if (send(sock, request, strlen(request), MSG_NOSIGNAL) == -1) {
+      perror("send");
+      close(sock);
+      return 1;
+    }
+
+    size_t buffered = 0;
+    while (!done) {
+      ssize_t received =
+          recv(sock, buffer + buffered, sizeof(buffer) - buffered, 0);
+      if (received <= 0) {
+        break; // Daemon went away: reconnect and resume
+      }
+      buffered += received;
+      size_t consumed = 0;
+      while (!done) {
+        int iov_count = 0;
+        size_t used =
+            render_follow_lines(buffer + consumed, buffered - consumed, iov,
+                                &iov_count, &last_seq, &done);
+        if (iov_count > 0 && writev_all(STDOUT_FILENO, iov, iov_count) != 0) {
+          close(sock);
+          return 1;
+        }
+        if (used == 0) {
+          break;
+        }
+        consumed += used;
+      }
+      memmove(buffer, buffer + consumed, buffered - consumed);
+      buffered -= consumed;
+      if (buffered == sizeof(buffer)) {
+        buffered = 0; // A line longer than the buffer: drop it
+      }
+    }
+    close(sock);
+  }
+  return done < 0 ? 1 : 0;
+}
+
+// Socket to stdout through a pipe of our own. Returns 0 at end of stream,
+// 1 when splicing is not possible (anything already in flight has been
+// written), -1 on error.
+int splice_through_pipe(int sock, int pipe_fds[2]) {
+  while (1) {
+    ssize_t moved = splice(sock, NULL, pipe_fds[1], NULL, SPLICE_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (moved <= 0) {
+      return moved == 0 ? 0 : 1;
+    }
+    while (moved > 0) {
+      ssize_t out = splice(pipe_fds[0], NULL, STDOUT_FILENO, NULL, moved,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (out > 0) {
+        moved -= out;
+        continue;
+      }
+      // stdout does not take splice (a terminal, say): drain the pipe
+      char chunk[4096];
+      while (moved > 0) {
+        ssize_t got = read(pipe_fds[0], chunk,
+                           moved < (ssize_t)sizeof(chunk) ? (size_t)moved
+                                                          : sizeof(chunk));
+        if (got <= 0 || write(STDOUT_FILENO, chunk, got) != got) {
+          return -1;
+        }
+        moved -= got;
+      }
+      return 1;
+    }
+  }
+}
+
+// Move everything the daemon sends to stdout. splice() keeps the bytes in
+// the kernel: straight from the socket when stdout is a pipe, else through
+// a pipe of our own. Where stdout cannot be spliced to, plain recv/write
+// takes over.
+int copy_to_stdout(int sock) {
+  struct stat st;
+  int rc = 1;
+  if (fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    ssize_t moved;
+    while ((moved = splice(sock, NULL, STDOUT_FILENO, NULL, SPLICE_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+    }
+    rc = moved == 0 ? 0 : 1;
+  } else {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == 0) {
+      fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+      rc = splice_through_pipe(sock, pipe_fds);
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+    }
+  }
+
+  char chunk[MAX_BUFFER_SIZE];
+  ssize_t got = 0;
+  while (rc == 1 && (got = recv(sock, chunk, sizeof(chunk), 0)) > 0) {
+    if (write(STDOUT_FILENO, chunk, got) != got) {
+      got = -1;
+      break;
+    }
+  }
+  if (rc < 0 || got < 0) {
+    perror("dump");
+    return -1;
+  }
+  return 0;
+}
+
+// Send a request whose answer may be any size and copy it all to stdout.
+// Errors come back as text instead of the stream and go to stderr.
+int stream_request(const char *request) {
+  int may_spawn;
+  const char *socket_path = daemon_socket_path(&may_spawn);
+  int sock = connect_daemon(socket_path, may_spawn);
+  if (sock == -1) {
+    return 1;
+  }
+  if (send(sock, request, strlen(request), MSG_NOSIGNAL) == -1) {
+    perror("send");
+    close(sock);
+    return 1;
+  }
+
+  char head[6];
+  ssize_t peeked = recv(sock, head, sizeof(head), MSG_PEEK | MSG_WAITALL);
+  if (peeked == (ssize_t)sizeof(head) && memcmp(head, "ERROR:", 6) == 0) {
+    char error[512];
+    ssize_t len = recv(sock, error, sizeof(error) - 1, MSG_WAITALL);
+    error[len > 0 ? len : 0] = '\0';
+    fprintf(stderr, "%s\n", error);
+    close(sock);
+    return 1;
+  }
+
+  int rc = copy_to_stdout(sock);
+  close(sock);
+  return rc == 0 ? 0 : 1;
+}
+
+// "dump <session> [--pane P] [--ndjson]": everything the daemon still holds
+// of a session's history, for postmortems.
+int dump_session(int argc, char *argv[]) {
+  const char *pane = "";
+  const char *format = "raw";
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--pane") == 0 && i + 1 < argc) {
+      pane = argv[++i];
+    } else if (strcmp(argv[i], "--ndjson") == 0) {
+      format = "ndjson";
+    } else {
+      fprintf(stderr, "Unknown dump option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  char request[512];
+  snprintf(request, sizeof(request), "dump:%s:%s:%s", argv[2], pane, format);
+  return stream_request(request);
+}
+
 void print_usage(const char *progname) {
   printf("Usage: %s <command>\n", progname);
   printf("Commands:\n");
   printf("  status              - Get daemon status\n");
   printf("  list                - List tracked sessions\n");
   printf("  context <session>   - Get context for specific session\n");
+  printf("  diagnostics <session> - Get distinct build/runtime diagnostics\n");
+  printf("  tests <session>     - Get latest test-suite results per pane\n");
+  printf("  templates <session> - Summarise pane output as log templates\n");
+  printf("  commands <session>  - Recent commands from shell history files\n");
+  printf("  retrieve:<session>:<k>:<bytes>:<question>\n");
+  printf("                      - Scrollback windows most relevant to a question\n");
+  printf("  summaries:<session>[:<seconds>[:<bytes>]]\n");
+  printf("                      - Summaries of older scrollback blocks\n");
+  printf("  diff:<session>:<seq> - Line diff of each pane since a context/diff Seq\n");
+  printf("  note:<session>:<text> - Add text to the session's @muxgeist_status\n");
+  printf("  search:<k>:<query>  - Best matching scrollback across all sessions\n");
+  printf("  grep:<session>:<seconds>:<text>\n");
+  printf("                      - History lines containing text (0 seconds: all)\n");
+  printf("  similar:<session>:<k>:<line>\n");
+  printf("                      - History lines most like the given one\n");
+  printf("  screen:<session>:<pane>:<seconds ago>[:<base seconds ago>]\n");
+  printf("                      - A full-screen pane as it was, or rows changed\n");
+  printf("  users               - Per-user usage of a --system daemon\n");
+  printf("  follow <session> [--pane P] [--errors-only]\n");
+  printf("                      - Stream new lines, errors and finished commands\n");
+  printf("  dump <session> [--pane P] [--ndjson]\n");
+  printf("                      - Everything still held of a session's history\n");
+  printf("  profile <seconds>   - Sample the daemon, print folded stacks\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -74,8 +516,29 @@ int main(int argc, char *argv[]) {
   char response[MAX_BUFFER_SIZE];
   client_error_t rc;
 
-  if (strcmp(argv[1], "context") == 0 && argc == 3) {
-    snprintf(command, sizeof(command), "context:%s", argv[2]);
+  if (strcmp(argv[1], "follow") == 0) {
+    if (argc < 3) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    return follow_session(argc, argv);
+  }
+  if (strcmp(argv[1], "dump") == 0) {
+    if (argc < 3) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    return dump_session(argc, argv);
+  }
+  if (strcmp(argv[1], "profile") == 0 && argc == 3) {
+    // Folded stacks can outgrow a response buffer, so they are streamed
+    snprintf(command, sizeof(command), "profile:%s", argv[2]);
+    return stream_request(command);
+  }
+
+  if (argc == 3) {
+    // "<command> <session>" maps to "command:session"
+    snprintf(command, sizeof(command), "%s:%s", argv[1], argv[2]);
   } else {
     strncpy(command, argv[1], sizeof(command) - 1);
     command[sizeof(command) - 1] = '\0';
@@ -1,23 +1,163 @@
+#define _GNU_SOURCE // memrchr, and Linux socket/pipe extensions
+
+#include <ctype.h>
 #include <dirent.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <limits.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <poll.h>
+#include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <ucontext.h>
 #include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MUXGEIST_SOCKET_PATH "/tmp/muxgeist.sock"
+#define MUXGEIST_SYSTEM_SOCKET_PATH "/run/muxgeist/muxgeist.sock"
+#define MUXGEIST_REPLAY_SOCKET_PATH "/tmp/muxgeist-replay.sock"
 #define MAX_SESSIONS 32
+#define SYSTEM_MAX_SESSIONS 512 // Shared by every user of a system daemon
+#define MAX_TMUX_SERVERS 128
+#define MAX_USERS 128
+#define USER_CPU_MS 250        // Default CPU time a user earns per second
+#define USER_CPU_BURST 4       // Seconds of earnings a user may bank
+#define USER_MEMORY_MB 64      // Default per-user memory quota
+#define SYSTEM_TICK_BUDGET_MS 500 // Polling time per loop before serving requests
+#define SD_LISTEN_FDS_START 3 // First fd passed by systemd socket activation
+#define SNAPSHOT_MAGIC 0x4d475331 // "MGS1"
+#define SNAPSHOT_INTERVAL 60 // Seconds between warm-start snapshots
+#define WARM_START_WAIT_MS 100 // How long a warm start waits for its caller
+#define MAX_FOLLOWERS 16
+#define FOLLOW_EVENTS 64  // Errors and completions kept per session
+#define FOLLOW_BACKLOG 10 // Lines a new follower starts with, like tail -f
+#define FOLLOW_IOV_LINES 256 // Lines per writev, three iovecs each
+#define FOLLOW_HEADER_SIZE 64
+#define DUMP_BATCH_LINES 256 // Lines per gather write of a dump, under IOV_MAX
+#define DUMP_HEADER_SIZE 128
+#define DUMP_ESCAPE_ARENA 65536
+#define PROFILE_HZ 997 // Prime, so sampling does not beat with periodic work
+#define PROFILE_MAX_SECONDS 60
+#define PROFILE_MAX_SAMPLES 16384 // Bounds a profile's memory, about 4MB
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SCAN_WORDS 4096 // Stack searched for a way out of libc
+#define TRACE_MAX_PAYLOAD (64 << 20) // Sanity limit when reading a trace
+#define REPLAY_REPORT_INTERVAL_MS 60000 // Trace time between replay reports
+#define REPLAY_TICK_MS 50 // Longest a paced replay waits in select
+#define REPLAY_TAIL_MS 2000 // Replayed past the last record
+#define SERVER_DISCOVERY_INTERVAL 10 // Seconds between socket directory scans
+#define SERVER_MIN_INTERVAL 1 // Poll interval of a server with activity
+#define SERVER_MAX_INTERVAL 8 // Idle servers back off to this
+#define SERVER_FULL_SCAN_INTERVAL 30 // Refresh idle sessions' topology and cwd
 #define MAX_BUFFER_SIZE 16384 // Increased for multi-pane content
+#define TMUX_MAX_ARGS 16 // argv slots for one tmux invocation
 #define MAX_COMMAND_SIZE 512
 #define CONTEXT_HISTORY_SIZE 100
+#define COMMAND_CWD_SIZE 256 // Longer directories keep their last part
+#define MAX_PANES_PER_SESSION 16
+#define PANE_HEADER_RESERVE 128 // Room for "=== PANE ... ===" headers
+#define RECENT_ACTIVITY_WINDOW 60 // Seconds a pane counts as recently active
+#define MAX_SCREEN_LINES 512
+#define TAIL_READ_BUDGET 262144 // Bytes read per tailed file per loop
+#define TAIL_LINE_SIZE 4096     // Longer lines from a tailed file are cut
+#define TAIL_CHECK_INTERVAL 2   // Seconds between looks for a tail's file
+#define MAX_SHELL_HISTORIES 64  // History files watched, kept for the run
+#define SHELL_HISTORY_RECHECK 30 // Seconds between looks for a shell's file
+#define SHELL_HISTORY_RESYNC 65536 // Tail of a rewritten file read again
+#define CAPTURE_HISTORY_LINES 200 // Scrollback rows captured above the screen
+#define MAX_DIAGNOSTICS 64
+#define DIAGNOSTIC_TTL 3600 // Forget diagnostics not seen for an hour
+#define MAX_TEST_FAILURES 8
+#define MAX_TEST_EXCERPT_LINES 8
+#define TEST_RUN_CONTINUATION 10 // Seconds between per-package result blocks
+#define MAX_LOG_TEMPLATES 128
+#define LOG_TEMPLATE_SIZE 256
+#define LOG_TEMPLATE_BUCKETS 64
+#define LOG_MAX_TOKENS 32
+#define LOG_TOKEN_SIZE 48
+#define LOG_SIMILARITY_THRESHOLD 0.5
+#define LOG_TEMPLATE_EXAMPLES 5 // Top templates rendered with an example
+#define LOG_TEMPLATE_WILDCARD "<*>"
+#define PANE_HISTORY_LINES 2000 // Recent lines retained per pane
+#define HISTORY_BLOCK_LINES 64   // Lines behind each history skip filter
+#define HISTORY_BLOCKS (PANE_HISTORY_LINES / HISTORY_BLOCK_LINES + 2)
+#define HISTORY_BLOOM_BYTES 1024 // Trigram Bloom filter; a power of two
+#define HISTORY_BLOOM_HASHES 3
+#define GREP_MAX_MATCHES 50
+#define SIMILAR_MAX_RESULTS 20
+#define SIMILAR_MIN_SCORE 0.5 // Trigram Dice coefficient of a similar line
+#define SIMILAR_MAX_TRIGRAMS 512
+#define HISTORY_HOT_BLOCKS 2      // Newest blocks of a pane never compressed
+#define HISTORY_THAW_SECONDS 30   // A block read back stays expanded this long
+#define HISTORY_FREEZE_INTERVAL 5 // Seconds between sweeps for cold blocks
+#define HISTORY_DEFLATE_LEVEL 6
+#define HISTORY_DICT_BYTES 16384  // zlib looks back at most 32K
+#define HISTORY_DICT_VERSIONS 8   // Retrained after 16, 32, 64... cold blocks
+#define HISTORY_TRAIN_BLOCKS 16
+#define DICT_SEGMENT_SLOTS 4096 // Recurring phrases counted while training
+#define DICT_SEGMENT_SIZE 48
+#define DICT_MIN_SEGMENT 6
+#define RETRIEVAL_WINDOW_LINES 8
+#define RETRIEVAL_WINDOW_TERMS 256
+#define MAX_RETRIEVAL_WINDOWS 4096 // Per session
+#define RETRIEVAL_INITIAL_TERMS 1024
+#define RETRIEVAL_MAX_TERMS 65536
+#define RETRIEVAL_REHASH_WINDOWS 64 // Sealed before retrying a full rebuild
+#define RETRIEVAL_TERM_SIZE 32
+#define RETRIEVAL_QUERY_TERMS 32
+#define BM25_K1 1.2
+#define BM25_B 0.75
+#define MAX_SEARCH_RESULTS 32
+#define SEARCH_RESULT_LINES 3 // Matching lines shown per search result
+#define SEARCH_LINE_SIZE 200
+#define SUMMARY_BLOCK_LINES 64 // Pane lines sealed into each level-0 block
+#define SUMMARY_FANOUT 4       // Blocks folded into one a level up
+#define SUMMARY_LEVELS 3
+#define SUMMARY_RING_BLOCKS 32 // Blocks kept per pane and level
+#define SUMMARY_KEEP_LINES 4   // Lines an extractive summary keeps
+#define SUMMARY_LINE_SIZE 120
+#define SUMMARY_TEXT_SIZE (SUMMARY_KEEP_LINES * (SUMMARY_LINE_SIZE + 1) + 1)
+#define SUMMARY_CACHE_SLOTS 256
+#define SUMMARY_DEFAULT_SPAN 7200 // Seconds of history a summaries query covers
+#define SUMMARY_DEFAULT_BUDGET 1200 // Summary bytes, roughly 300 tokens
+#define STATUS_TEST_AGE 600 // Seconds a finished test run stays in the status
+#define PANE_SNAPSHOTS 8    // Captures pinned per pane for diff queries
+#define SCREEN_KEYFRAME_FRAMES 32 // Full-screen frames per keyframe group
+#define SCREEN_GROUPS 64          // Groups kept per pane: 2048 redraws
+#define DIFF_MAX_EDITS 512 // Beyond this a pane diffs as a full replacement
+#define MAX_SUBSCRIBERS 8
+#define MAX_SHARDS 16
+#define MAX_REPLICAS SYSTEM_MAX_SESSIONS // Sessions one shard may announce
+#define SHARD_QUERY_TIMEOUT_MS 2000 // One deadline shared by a whole fan-out
+#define SHARD_MAX_BACKOFF 30 // Seconds between reconnects to a lost shard
+#define SYNC_LINE_SIZE (PATH_MAX + 512)
 
 typedef enum {
   ERROR_NONE = 0,
@@ -28,18 +168,388 @@ typedef enum {
   ERROR_TMUX_CMD,
   ERROR_FILE_IO,
   ERROR_INVALID_SESSION,
+  ERROR_INVALID_ARGS,
   ERROR_UNKNOWN = 255
 } muxgeist_error_t;
 
 typedef struct {
   char command[MAX_COMMAND_SIZE];
-  char cwd[PATH_MAX];
+  char cwd[COMMAND_CWD_SIZE];
+  char pane_index[16]; // "-" when no pane could be told
   time_t timestamp;
-  int exit_code;
+  int exit_code; // -1 when unknown, as for commands from history files
 } command_entry_t;
 
+// Capture priority tiers, most important first. The tier decides both how
+// often a pane is re-captured and how much of the scrollback budget it gets.
+typedef enum {
+  PRIORITY_ACTIVE = 0, // Active pane of an attached client
+  PRIORITY_VISIBLE,    // Other panes in the session's current window
+  PRIORITY_RECENT,     // Panes whose content changed recently
+  PRIORITY_BACKGROUND, // Everything else
+  PRIORITY_TIERS
+} pane_priority_t;
+
+// Capture every Nth scan tick, per tier
+static const int priority_capture_interval[PRIORITY_TIERS] = {1, 1, 3, 10};
+// Relative share of the scrollback buffer, per tier
+static const int priority_budget_weight[PRIORITY_TIERS] = {8, 4, 2, 1};
+
+typedef enum {
+  DIAG_ERROR = 0,
+  DIAG_WARNING,
+} diagnostic_severity_t;
+
+typedef struct {
+  char file[256];
+  int line;
+  int column;
+  diagnostic_severity_t severity;
+  char tool[8]; // cc, rustc, go, tsc, python
+  char message[256];
+  char snippet[256]; // Offending source line(s) with markers
+  char notes[256];   // note:/help: lines attached to the diagnostic
+  int count;
+  time_t first_seen;
+  time_t last_seen;
+} diagnostic_t;
+
+typedef enum {
+  DIAG_PARSE_NONE = 0,
+  DIAG_PARSE_CC_BODY,     // After a gcc/clang/go/tsc header
+  DIAG_PARSE_RUST_HEADER, // Saw "error[E..]: msg", waiting for "-->"
+  DIAG_PARSE_RUST_BODY,   // Inside a rustc snippet
+  DIAG_PARSE_TRACEBACK,   // Inside a Python traceback
+} diagnostic_parse_mode_t;
+
+// Streaming recogniser state, one per pane since output interleaves
+typedef struct {
+  diagnostic_parse_mode_t mode;
+  diagnostic_t pending;
+  int current; // Index of the record snippets/notes attach to, or -1
+} diagnostic_parser_t;
+
+typedef enum {
+  TEST_RUNNER_NONE = 0,
+  TEST_RUNNER_PYTEST,
+  TEST_RUNNER_CTEST,
+  TEST_RUNNER_GO,
+  TEST_RUNNER_CARGO,
+  TEST_RUNNER_COUNT,
+} test_runner_t;
+
+static const char *test_runner_names[] = {"none", "pytest", "ctest", "go",
+                                          "cargo"};
+
+typedef enum {
+  TEST_RUN_NONE = 0,
+  TEST_RUN_RUNNING,
+  TEST_RUN_FINISHED,
+} test_run_state_t;
+
+// Latest test-suite run seen in a pane, built incrementally from its output
+typedef struct {
+  test_runner_t runner;
+  test_run_state_t state;
+  int passed;
+  int failed;
+  int skipped;
+  int errors;
+  int packages_failed;
+  double duration; // Seconds, as reported by the runner when available
+  time_t started;
+  time_t finished;
+  char failures[MAX_TEST_FAILURES][128];
+  int failure_count;
+  int failures_dropped;
+  char excerpt[640]; // First failure's most telling lines
+  int excerpt_lines;
+  int in_failure_section;
+} test_run_t;
+
+// A cluster of log lines that differ only in their variable slots
+typedef struct {
+  char text[LOG_TEMPLATE_SIZE]; // Tokens joined by single spaces
+  int token_count;
+  unsigned long count;
+  time_t first_seen;
+  time_t last_seen;
+  char example[192]; // Most recent line that matched
+  unsigned int bucket;
+  int next; // Next template in the same bucket, or -1
+} log_template_t;
+
+// Drain-style online template miner, allocated on a pane's first line
+typedef struct {
+  log_template_t templates[MAX_LOG_TEMPLATES];
+  int template_count;
+  int buckets[LOG_TEMPLATE_BUCKETS]; // Head template index, or -1
+  unsigned long lines_seen;
+  unsigned long bytes_seen;
+  unsigned long evicted;
+} log_miner_t;
+
+typedef struct {
+  unsigned long seq; // Session-wide line sequence number
+  time_t timestamp;
+  char *text;
+  int width; // Display columns
+} history_line_t;
+
+// Every HISTORY_BLOCK_LINES consecutive lines of a pane share a filter of
+// the trigrams in them, so lookups can pass over blocks that cannot match.
+typedef struct {
+  unsigned long first_seq;
+  unsigned long last_seq;
+  time_t first_time;
+  time_t last_time;
+  size_t bytes;
+  unsigned char bloom[HISTORY_BLOOM_BYTES];
+  unsigned char *frozen; // Deflated copy of the lines once the block is cold
+  unsigned int frozen_len;
+  unsigned int raw_len;
+  int frozen_lines;           // The block's last lines, those retained then
+  unsigned char codec;        // history_class_t whose dictionary was used
+  unsigned char dict_version; // 0: none
+  unsigned char cold;         // Lines only in `frozen`, texts freed
+  unsigned char keep_hot;     // Did not compress; not tried again
+  time_t thawed;
+} history_block_t;
+
+// Kinds of terminal output, each compressed with its own dictionary
+typedef enum {
+  HISTORY_CLASS_SHELL = 0,
+  HISTORY_CLASS_BUILD,
+  HISTORY_CLASS_LOG,
+  HISTORY_CLASS_COUNT,
+} history_class_t;
+
+static const char *history_class_names[] = {"shell", "build", "log"};
+
+typedef struct {
+  unsigned long hash;
+  int count;
+  char text[DICT_SEGMENT_SIZE];
+} dict_segment_t;
+
+// Versioned dictionaries of one output class; blocks name the version
+// they were compressed with, so older ones stay loaded.
+typedef struct {
+  unsigned char *dicts[HISTORY_DICT_VERSIONS + 1];
+  size_t dict_sizes[HISTORY_DICT_VERSIONS + 1];
+  int version;
+  dict_segment_t *segments; // DICT_SEGMENT_SLOTS, allocated when training
+  int blocks_since_training;
+} history_codec_t;
+
+// Ring of the most recent lines ingested from a pane
+typedef struct {
+  history_line_t *lines; // PANE_HISTORY_LINES slots, allocated on first use
+  int start;
+  int count;
+  history_block_t *blocks; // HISTORY_BLOCKS slots, block n at n % slots
+  unsigned long appended;  // Lines ever appended, numbering the blocks
+} pane_history_t;
+
+// Lines of a pane accumulating into the next retrieval window
+typedef struct {
+  unsigned long first_seq;
+  unsigned long last_seq;
+  int lines;
+  int term_ids[RETRIEVAL_WINDOW_TERMS];
+  int term_count;
+} retrieval_builder_t;
+
+typedef struct {
+  unsigned long window;
+  unsigned short tf;
+} retrieval_posting_t;
+
+typedef struct {
+  char term[RETRIEVAL_TERM_SIZE]; // Empty for a free slot
+  int df; // Live windows containing the term
+  retrieval_posting_t *postings; // In window order
+  int posting_start; // Postings before this belong to evicted windows
+  int posting_count;
+  int posting_capacity;
+} retrieval_term_t;
+
+typedef struct {
+  char pane_id[16];
+  unsigned long first_seq;
+  unsigned long last_seq;
+  int length;    // Terms in the window, for BM25 length normalisation
+  int *term_ids; // Distinct terms, to keep df right on eviction
+  int term_count;
+} retrieval_window_t;
+
+// Per-session inverted index over fixed-size line windows of every pane.
+// Window ids grow monotonically; the live ones are the last window_count.
+typedef struct {
+  retrieval_term_t *terms; // Open-addressed, term_capacity slots
+  int term_capacity;
+  int term_count;
+  retrieval_window_t *windows; // Ring of MAX_RETRIEVAL_WINDOWS
+  unsigned long next_window;
+  int window_count;
+  unsigned long total_length;
+  unsigned long rehash_window; // No term table rebuild before this window
+} retrieval_index_t;
+
+// A pane capture as it was when a client was handed snapshot sequence
+// number seq; it stands for every later seq until the next snapshot.
+typedef struct {
+  unsigned long seq;
+  time_t taken;
+  unsigned long hash;
+  char *content;
+} pane_snapshot_t;
+
+// A keyframe of a full-screen pane and the redraws after it, each stored
+// as the rows that changed from the frame before ("K rows" then every row,
+// or "D changed rows" then "row text" lines). A group is deflated once the
+// next keyframe starts it.
+typedef struct {
+  unsigned long first_frame;
+  time_t times[SCREEN_KEYFRAME_FRAMES];
+  int frame_count;
+  char *data; // Encoded frames of the open group
+  size_t data_len;
+  size_t data_capacity;
+  unsigned char *frozen; // Deflated data of a finished group
+  unsigned int frozen_len;
+  unsigned int raw_len;
+} screen_group_t;
+
+typedef struct {
+  screen_group_t groups[SCREEN_GROUPS]; // Ring, oldest first
+  int group_start;
+  int group_count;
+  unsigned long frames; // Recorded so far; numbers them
+  char *last;           // Previous frame, the base of the next delta
+} screen_history_t;
+
+typedef struct {
+  int old_start;
+  int old_count;
+  int new_start;
+  int new_count;
+} diff_hunk_t;
+
+typedef struct {
+  unsigned long hash; // Of the lines covered, or of the child block hashes
+  unsigned long first_seq;
+  unsigned long last_seq;
+  time_t first_time;
+  time_t last_time;
+  char text[SUMMARY_TEXT_SIZE];
+} summary_block_t;
+
+// Sealed blocks of a pane's history at increasing granularity: every
+// SUMMARY_FANOUT blocks at one level are summarised again one level up.
+typedef struct {
+  summary_block_t blocks[SUMMARY_LEVELS][SUMMARY_RING_BLOCKS]; // Rings
+  int start[SUMMARY_LEVELS];
+  int count[SUMMARY_LEVELS];
+  int unfolded[SUMMARY_LEVELS]; // Newest blocks not yet folded a level up
+  int unsealed_lines;
+} summary_tree_t;
+
+// Summaries keyed by block hash, so repeated output is summarised once
+typedef struct {
+  unsigned long hash; // 0 for an empty slot
+  char text[SUMMARY_TEXT_SIZE];
+} summary_cache_entry_t;
+
+// The file a pane shows through tail -f or less +F, read directly instead
+// of through capture-pane so nothing that scrolls past between polls is lost
+typedef struct {
+  int fd;
+  int wd;    // inotify watch
+  pid_t pid; // The tail or less process
+  off_t offset;
+  int pending;       // May have data past offset
+  int file_gone;     // Renamed or deleted away
+  int watch_removed; // By the kernel, with the file
+  char path[PATH_MAX];
+  char partial[TAIL_LINE_SIZE]; // Line read without its newline yet
+  size_t partial_len;
+} pane_tail_t;
+
+typedef enum { SHELL_BASH, SHELL_ZSH, SHELL_FISH } shell_kind_t;
+
+// A shell history file, read as the shell appends to it. Its directory is
+// watched rather than the file, since zsh and fish replace the file by
+// renaming a new one over it.
+typedef struct {
+  shell_kind_t kind;
+  uid_t uid;
+  char path[PATH_MAX];
+  char name[256]; // Base name, matched against the directory's events
+  int wd;         // Watch on the directory, -1 once the kernel drops it
+  ino_t inode;
+  off_t offset;
+  int pending;
+  unsigned long last_hash; // Newest entry read; finds our place after a rewrite
+  time_t stamp;            // From a "#<epoch>" line, for the next bash entry
+  int in_entry;            // zsh continuation or fish "- cmd:" awaiting when:
+  char entry[MAX_COMMAND_SIZE];
+  size_t entry_len;
+  time_t entry_time;
+  char partial[TAIL_LINE_SIZE];
+  size_t partial_len;
+  char last_session[128]; // Where the last entry went, for shells gone since
+  unsigned long entries;
+} shell_history_t;
+
+typedef struct {
+  char pane_id[16];    // tmux "%N" id, stable while the pane lives
+  char pane_index[32]; // "window.pane" as shown in the scrollback header
+  char title[64];
+  char command[64];
+  char finished_command[64]; // Returned to the shell; told after a capture
+  pane_priority_t priority;
+  time_t last_change;   // Last time captured content differed
+  time_t window_activity;
+  unsigned long last_capture_tick;
+  unsigned long content_hash;
+  char *content; // Last capture, malloc'd
+  size_t content_len;
+  int alternate_screen; // Full-screen app; content is redrawn, not appended
+  int seen; // Mark for sweeping panes that have gone away
+  diagnostic_parser_t diag_parser;
+  test_run_t test_run;
+  log_miner_t *log_miner;
+  pane_history_t history;
+  retrieval_builder_t retrieval_builder;
+  summary_tree_t *summaries; // Allocated on the first ingested line
+  pane_snapshot_t snapshots[PANE_SNAPSHOTS]; // Ring, oldest first
+  int snapshot_start;
+  int snapshot_count;
+  screen_history_t *screens; // Redraws of a full-screen app, on first one
+  pane_tail_t *tail; // Set while the pane follows a file
+  time_t tail_checked;
+  pid_t shell_pid;
+  int shell_history; // Index into g_state.shell_histories, -1 if none
+  time_t shell_checked;
+} pane_state_t;
+
+// Something followers hear about besides plain lines: 'E' a diagnostic,
+// 'T' a finished test run, 'C' a command that returned to the shell.
+typedef struct {
+  unsigned long seq; // Line being ingested when it happened
+  char kind;
+  int alarm; // Shown to errors-only followers
+  char pane_id[16];
+  char pane_index[32];
+  char text[256];
+} follow_event_t;
+
 typedef struct {
-  char session_id[64];
+  char session_id[128]; // "server/session", how clients name it
+  char tmux_name[64];   // Session name within its server
+  int server;           // Index into g_state.servers
+  time_t window_activity; // Newest window activity seen by the last probe
   char current_cwd[PATH_MAX];
   char current_pane[16];
   time_t last_activity;
@@ -48,27 +558,348 @@ typedef struct {
   int history_index;
   char scrollback[MAX_BUFFER_SIZE];
   int scrollback_len;
+  pane_state_t panes[MAX_PANES_PER_SESSION];
+  int pane_count;
+  unsigned long capture_tick;
+  unsigned long line_seq; // Lines ingested so far, across all panes
+  diagnostic_t diagnostics[MAX_DIAGNOSTICS];
+  int diagnostic_count;
+  retrieval_index_t retrieval;
+  unsigned long snapshot_seq; // Last sequence number handed to a client
+  char status_note[64];  // Set by clients, e.g. "analysis ready"
+  char status_line[256]; // Last value pushed to @muxgeist_status
+  int status_published;
+  unsigned long sync_hash; // Of the line last sent to subscribers, 0 if none
+  unsigned long diagnostics_recorded; // Bumped per diagnostic seen, new or not
+  int last_diagnostic;
+  follow_event_t events[FOLLOW_EVENTS]; // Ring for followers
+  unsigned long next_event; // Id of the next event; the ring has the latest
+  int listed; // Reported by the server's last list-windows probe
+  int provisional; // Restored from a snapshot and not yet seen in a probe
 } session_context_t;
 
+// One tmux server, reached through its socket. Each is polled on its own
+// schedule: every SERVER_MIN_INTERVAL while it has activity, backing off to
+// SERVER_MAX_INTERVAL when idle, so idle servers cost one fork per interval.
+typedef struct {
+  char name[64]; // Socket file name, e.g. "default" or the -L label
+  char socket_path[PATH_MAX];
+  uid_t owner; // Of the socket; in system mode, whose namespace it is in
+  gid_t group; // Of the socket, which tmux runs with under a root daemon
+  int alive;
+  int interval;
+  time_t next_poll;
+  time_t last_full_scan;
+  int trace_state; // 1 + alive + 2 * is_default as last recorded, 0 if never
+  char client_panes[MAX_BUFFER_SIZE]; // "session\tpane_id" per attached client
+} tmux_server_t;
+
+// A downstream session as its daemon last announced it
+typedef struct {
+  char session_id[128]; // As the shard names it, "server/session"
+  char current_pane[16];
+  time_t last_activity;
+  int pane_count;
+  char current_cwd[PATH_MAX];
+  char status_line[256];
+} replica_t;
+
+// A downstream daemon, in aggregator mode. One connection stays subscribed
+// and keeps the replicas current; queries go over connections of their own.
+typedef struct {
+  char name[64];
+  char socket_path[PATH_MAX];
+  int fd;     // Subscription, -1 while disconnected
+  int synced; // Initial snapshot received
+  char partial[SYNC_LINE_SIZE]; // Unterminated tail of the last read
+  size_t partial_len;
+  replica_t *replicas; // MAX_REPLICAS slots
+  int replica_count;
+  int backoff;
+  time_t next_connect;
+  pid_t pid; // Process serving the shard, when started by --shards
+} shard_t;
+
+// Resource use of one user's sessions in system mode. CPU time, including
+// the tmux commands run on the user's behalf, is paid from a token bucket.
 typedef struct {
-  session_context_t sessions[MAX_SESSIONS];
+  uid_t uid;
+  char name[32];
+  double cpu_tokens_ms;
+  double cpu_used_ms;
+  size_t memory_bytes; // Retained by the user's sessions, as of last poll
   int session_count;
+  unsigned long throttled; // Polls deferred for lack of CPU tokens
+  unsigned long refused;   // Sessions not tracked for lack of memory
+} user_account_t;
+
+// One record of an activity trace (--record, --replay). On disk each is a
+// header line "ms kind key_len value_len alive owner default" followed by
+// the key and value bytes and a newline, after a "MGTRACE1 epoch_ms" line.
+typedef struct {
+  long ms;   // Since the recording started
+  char kind; // 'T' tmux command and its output, 'R' request, 'S' server
+  int alive; // 'S': the server's state, owner and whether it is the default
+  unsigned owner;
+  int is_default;
+  char *key; // Command, request or server name; NUL-terminated when read
+  size_t key_len;
+  char *value; // Command output or server socket path
+  size_t value_len;
+} trace_record_t;
+
+// Latest recorded output of one tmux command, which replay answers with
+typedef struct {
+  unsigned long hash; // 0 for an empty slot
+  char *command;
+  char *output;
+} replay_output_t;
+
+typedef struct {
+  FILE *fp;
+  trace_record_t next; // Read ahead, applied once the clock reaches it
+  int exhausted;
+  double speed; // Multiple of recorded speed, 0 for as fast as possible
+  long epoch_ms; // Wall clock when the trace was recorded
+  long now_ms;   // Replay clock, in trace time
+  long started_ms;
+  long last_ms; // Of the last record applied
+  replay_output_t *outputs;
+  size_t output_slots; // Power of two
+  size_t output_count;
+  trace_record_t servers[MAX_TMUX_SERVERS]; // Latest 'S' record per server
+  int server_count;
+  // Report: totals, and where the current report window began
+  unsigned long tmux_commands;
+  double *latencies; // Request latencies in ms, in order
+  size_t latency_count;
+  size_t latency_capacity;
+  long next_report_ms;
+  long window_real_ms;
+  unsigned long window_lines;
+  unsigned long window_commands;
+  size_t window_latencies;
+} replay_t;
+
+// A "follow" connection streaming one session's lines and events. Lines are
+// read straight out of the pane histories, so a follower that falls behind
+// costs nothing until it drains, and resumes by sequence number.
+typedef struct {
+  int fd;
+  session_context_t *session;
+  char pane[32]; // "window.pane" or "%id" to follow one pane, else empty
+  int errors_only;
+  unsigned long next_seq;   // First line not yet sent
+  unsigned long next_event; // First event not yet sent
+  char *pending; // Unsent tail of a batch the socket only partly took
+  size_t pending_len;
+  size_t pending_sent;
+  unsigned long gap_until; // Last sequence number already reported missing
+  int dump;                 // 1 raw, 2 ndjson: a dump, closed after dump_until
+  unsigned long dump_until; // Last line a dump sends
+  int closing;              // A reply, closed once pending has drained
+} follower_t;
+
+// A "profile:" in progress. The sample arrays exist only while one runs.
+typedef struct {
+  int active;
+  int client; // Answered when the profile ends
+  long end_ms;
+  int seconds;
+  const char *source; // "perf" or "itimer"
+  int perf_fd;
+  uintptr_t stack_top; // main's frame, where unwinding stops
+  uintptr_t *frames; // PROFILE_MAX_DEPTH per sample, leaf first
+  int *depths;
+  volatile int sample_count;
+  volatile unsigned long dropped;
+} profiler_t;
+
+typedef struct {
+  char socket_path[PATH_MAX];
+  int socket_activated; // Listening socket inherited, not ours to unlink
+  int lock_fd;          // Holds the single-instance lock for socket_path
+  char state_dir[PATH_MAX]; // Snapshot and dictionaries; empty keeps none
+  int warm_start;       // Sessions restored from a snapshot, not yet scanned
+  time_t last_snapshot;
+  int system_mode; // One daemon for every user, see handle_client_request
+  uid_t request_uid; // Peer of the request being served
+  user_account_t users[MAX_USERS];
+  int user_count;
+  double user_cpu_ms; // Per-user quotas
+  size_t user_memory_bytes;
+  long last_refill_ms;
+  session_context_t *sessions; // session_capacity slots
+  int session_capacity;
+  int session_count;
+  tmux_server_t servers[MAX_TMUX_SERVERS];
+  int server_count;
+  int default_server; // The one a bare "tmux" would talk to, or -1
+  time_t last_server_discovery;
+  summary_cache_entry_t summary_cache[SUMMARY_CACHE_SLOTS];
+  unsigned long summary_cache_hits;
+  unsigned long summary_cache_misses;
+  unsigned long history_blocks_tested; // By grep: and similar:
+  unsigned long history_blocks_skipped;
+  history_codec_t codecs[HISTORY_CLASS_COUNT];
+  time_t last_history_freeze;
+  size_t history_cold_raw; // Bytes of history held compressed, and in
+  size_t history_cold_bytes;
+  unsigned long history_thaw_failures; // Cold blocks that failed to expand
+  int subscribers[MAX_SUBSCRIBERS]; // Connections kept open by "subscribe"
+  uid_t subscriber_uids[MAX_SUBSCRIBERS];
+  follower_t followers[MAX_FOLLOWERS];
+  int follower_count;
+  int subscriber_count;
+  shard_t shards[MAX_SHARDS]; // Set only in aggregator mode
+  int shards_spawned; // --shards: how many, ids then leave out shard names
+  int shard_index;    // --shard k/N: owns the sessions hashing to k
+  int shard_total;
+  int shard_count;
+  FILE *trace; // --record
+  long trace_start_ms;
+  replay_t replay; // --replay, which stands in for tmux
+  int replaying;
+  unsigned long lines_ingested;
+  unsigned long tmux_truncated; // tmux outputs that lost their oldest lines
+  int inotify_fd; // Tailed files and history directories; -1 until used
+  shell_history_t *shell_histories[MAX_SHELL_HISTORIES];
+  int shell_history_count;
+  profiler_t profiler;
   int server_socket;
   volatile sig_atomic_t running;
 } muxgeist_state_t;
 
 static muxgeist_state_t g_state = {0};
 
+// Seconds on the daemon's clock: the wall clock, or under --replay the
+// recording's, so polling and ageing behave as they did when it was made.
+time_t daemon_time(void) {
+  if (g_state.replaying) {
+    return (g_state.replay.epoch_ms + g_state.replay.now_ms) / 1000;
+  }
+  return time(NULL);
+}
+
 void signal_handler(int sig) {
   printf("Received signal %d, shutting down...\n", sig);
   g_state.running = 0;
 }
 
+// A socket is live when something accepts connections on it; sockets of
+// processes that exited are left behind.
+int unix_socket_alive(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return 0;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return 0;
+  }
+  int alive = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  close(fd);
+  return alive;
+}
+
+// One daemon per socket: an flock on "<socket>.lock", which also holds the
+// daemon's pid. The kernel drops it when the daemon exits, however it exits.
+muxgeist_error_t acquire_instance_lock(void) {
+  char lock_path[PATH_MAX + 8];
+  snprintf(lock_path, sizeof(lock_path), "%s.lock", g_state.socket_path);
+  g_state.lock_fd =
+      open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (g_state.lock_fd == -1) {
+    perror("open lock");
+    return ERROR_FILE_IO;
+  }
+  if (flock(g_state.lock_fd, LOCK_EX | LOCK_NB) == -1) {
+    fprintf(stderr, "Another daemon is running for %s\n", g_state.socket_path);
+    close(g_state.lock_fd);
+    return ERROR_SOCKET_BIND;
+  }
+  char pid[32];
+  int len = snprintf(pid, sizeof(pid), "%ld\n", (long)getpid());
+  if (ftruncate(g_state.lock_fd, 0) == 0) {
+    ssize_t written = pwrite(g_state.lock_fd, pid, len, 0);
+    (void)written;
+  }
+  return ERROR_NONE;
+}
+
+// Under systemd socket activation (LISTEN_PID/LISTEN_FDS) the listening
+// socket arrives already bound as fd 3; its path names the instance.
+int inherit_listen_socket(void) {
+  const char *listen_pid = getenv("LISTEN_PID");
+  const char *listen_fds = getenv("LISTEN_FDS");
+  if (!listen_pid || !listen_fds || atol(listen_pid) != (long)getpid() ||
+      atoi(listen_fds) < 1) {
+    return 0;
+  }
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  struct sockaddr_un addr;
+  socklen_t addr_len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  if (getsockname(SD_LISTEN_FDS_START, (struct sockaddr *)&addr, &addr_len) ==
+          -1 ||
+      addr.sun_family != AF_UNIX) {
+    fprintf(stderr, "Inherited fd %d is not a Unix socket\n",
+            SD_LISTEN_FDS_START);
+    return 0;
+  }
+  fcntl(SD_LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+  if (addr.sun_path[0]) {
+    snprintf(g_state.socket_path, sizeof(g_state.socket_path), "%s",
+             addr.sun_path);
+  }
+  g_state.server_socket = SD_LISTEN_FDS_START;
+  g_state.socket_activated = 1;
+  return 1;
+}
+
 muxgeist_error_t setup_socket(void) {
   struct sockaddr_un addr;
 
-  // Remove existing socket
-  unlink(MUXGEIST_SOCKET_PATH);
+  if (inherit_listen_socket()) {
+    muxgeist_error_t rc = acquire_instance_lock();
+    if (rc == ERROR_NONE) {
+      printf("Muxgeist daemon listening on %s (socket activated)\n",
+             g_state.socket_path);
+    }
+    return rc;
+  }
+
+  if (g_state.system_mode) {
+    // Every user connects; requests are scoped by peer credentials
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", g_state.socket_path);
+    char *slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+      *slash = '\0';
+      mkdir(dir, 0755);
+    }
+  }
+
+  muxgeist_error_t rc = acquire_instance_lock();
+  if (rc != ERROR_NONE) {
+    return rc;
+  }
+
+  // Only a stale socket is removed; a live one belongs to another daemon,
+  // e.g. another user's on a shared host
+  if (unix_socket_alive(g_state.socket_path)) {
+    fprintf(stderr, "Another daemon is listening on %s\n",
+            g_state.socket_path);
+    return ERROR_SOCKET_BIND;
+  }
+  if (unlink(g_state.socket_path) == -1 && errno != ENOENT) {
+    perror("unlink");
+    return ERROR_SOCKET_BIND;
+  }
 
   g_state.server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
   if (g_state.server_socket == -1) {
@@ -78,7 +909,7 @@ muxgeist_error_t setup_socket(void) {
 
   memset(&addr, 0, sizeof(addr));
   addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, MUXGEIST_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  strncpy(addr.sun_path, g_state.socket_path, sizeof(addr.sun_path) - 1);
 
   if (bind(g_state.server_socket, (struct sockaddr *)&addr, sizeof(addr)) ==
       -1) {
@@ -87,290 +918,7993 @@ muxgeist_error_t setup_socket(void) {
     return ERROR_SOCKET_BIND;
   }
 
+  if (g_state.system_mode && chmod(g_state.socket_path, 0666) == -1) {
+    perror("chmod");
+    close(g_state.server_socket);
+    return ERROR_SOCKET_BIND;
+  }
+
   if (listen(g_state.server_socket, 5) == -1) {
     perror("listen");
     close(g_state.server_socket);
     return ERROR_SOCKET_LISTEN;
   }
 
-  printf("Muxgeist daemon listening on %s\n", MUXGEIST_SOCKET_PATH);
+  printf("Muxgeist daemon listening on %s\n", g_state.socket_path);
   return ERROR_NONE;
 }
 
-muxgeist_error_t execute_tmux_command(const char *cmd, char *output,
-                                      size_t output_size) {
-  FILE *fp = popen(cmd, "r");
-  if (!fp) {
-    return ERROR_TMUX_CMD;
-  }
+long monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
 
-  // Read all output, not just first line
-  size_t total_read = 0;
-  while (total_read < output_size - 1) {
-    size_t bytes_read =
-        fread(output + total_read, 1, output_size - total_read - 1, fp);
-    if (bytes_read == 0)
-      break;
-    total_read += bytes_read;
+unsigned long hash_bytes(const char *data, size_t len) {
+  // FNV-1a, enough to notice that a pane's content changed
+  unsigned long hash = 1469598103934665603UL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211UL;
   }
+  return hash;
+}
 
-  output[total_read] = '\0';
-
-  // Remove trailing newline if present
-  if (total_read > 0 && output[total_read - 1] == '\n') {
-    output[total_read - 1] = '\0';
-  }
+void trace_write_record(FILE *fp, const trace_record_t *record) {
+  fprintf(fp, "%ld %c %zu %zu %d %u %d\n", record->ms, record->kind,
+          record->key_len, record->value_len, record->alive, record->owner,
+          record->is_default);
+  fwrite(record->key, 1, record->key_len, fp);
+  fwrite(record->value, 1, record->value_len, fp);
+  fputc('\n', fp);
+}
 
-  pclose(fp);
-  return ERROR_NONE;
+void trace_free_record(trace_record_t *record) {
+  free(record->key);
+  free(record->value);
+  record->key = record->value = NULL;
 }
 
-session_context_t *find_session(const char *session_id) {
-  for (int i = 0; i < g_state.session_count; i++) {
-    if (strcmp(g_state.sessions[i].session_id, session_id) == 0) {
-      return &g_state.sessions[i];
-    }
+// Read the next record; key and value come back NUL-terminated, malloc'd.
+// Returns 0 at a clean end of the trace, -1 if it is damaged.
+int trace_read_record(FILE *fp, trace_record_t *record) {
+  memset(record, 0, sizeof(*record));
+  int fields = fscanf(fp, "%ld %c %zu %zu %d %u %d", &record->ms,
+                      &record->kind, &record->key_len, &record->value_len,
+                      &record->alive, &record->owner, &record->is_default);
+  if (fields == EOF) {
+    return 0;
   }
-  return NULL;
+  if (fields != 7 || fgetc(fp) != '\n' || record->key_len > TRACE_MAX_PAYLOAD ||
+      record->value_len > TRACE_MAX_PAYLOAD) {
+    return -1;
+  }
+  record->key = malloc(record->key_len + 1);
+  record->value = malloc(record->value_len + 1);
+  if (!record->key || !record->value ||
+      fread(record->key, 1, record->key_len, fp) != record->key_len ||
+      fread(record->value, 1, record->value_len, fp) != record->value_len ||
+      fgetc(fp) != '\n') {
+    trace_free_record(record);
+    return -1;
+  }
+  record->key[record->key_len] = '\0';
+  record->value[record->value_len] = '\0';
+  return 1;
 }
 
-session_context_t *create_session(const char *session_id) {
-  if (g_state.session_count >= MAX_SESSIONS) {
+// Open a trace for reading, returning the wall clock it was recorded at
+FILE *trace_open(const char *path, long *epoch_ms) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
     return NULL;
   }
-
-  session_context_t *session = &g_state.sessions[g_state.session_count];
-  memset(session, 0, sizeof(session_context_t));
-
-  strncpy(session->session_id, session_id, sizeof(session->session_id) - 1);
-  session->last_activity = time(NULL);
-
-  g_state.session_count++;
-  return session;
-}
-
-muxgeist_error_t capture_all_panes(session_context_t *session) {
-  char cmd[512];
-  char pane_list[2048];
-  char temp_content[MAX_BUFFER_SIZE];
-
-  // Clear existing scrollback
-  session->scrollback[0] = '\0';
-  session->scrollback_len = 0;
-
-  // Get list of all panes in the session
-  snprintf(
-      cmd, sizeof(cmd),
-      "tmux list-panes -t %s -F "
-      "'#{window_index}.#{pane_index}:#{pane_title}:#{pane_current_command}'",
-      session->session_id);
-
-  if (execute_tmux_command(cmd, pane_list, sizeof(pane_list)) != ERROR_NONE) {
-    return ERROR_TMUX_CMD;
+  if (fscanf(fp, "MGTRACE1 %ld", epoch_ms) != 1 || fgetc(fp) != '\n') {
+    fprintf(stderr, "%s: not a muxgeist trace\n", path);
+    fclose(fp);
+    return NULL;
   }
+  return fp;
+}
 
-  // If no panes found, try to get content anyway
-  if (strlen(pane_list) == 0) {
-    snprintf(cmd, sizeof(cmd), "tmux capture-pane -t %s -p",
-             session->session_id);
-    FILE *fp = popen(cmd, "r");
-    if (fp) {
-      session->scrollback_len =
-          fread(session->scrollback, 1, sizeof(session->scrollback) - 1, fp);
-      session->scrollback[session->scrollback_len] = '\0';
-      pclose(fp);
+// --record: start a trace. Pane contents are private, so only the daemon's
+// user may read it; "anonymise" it before sharing.
+muxgeist_error_t trace_start(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
+                0600);
+  g_state.trace = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!g_state.trace) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
     }
-    return ERROR_NONE;
+    return ERROR_INVALID_ARGS;
   }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  fprintf(g_state.trace, "MGTRACE1 %ld\n",
+          (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+  g_state.trace_start_ms = monotonic_ms();
+  return ERROR_NONE;
+}
 
-  // Process each pane
-  char *line = strtok(pane_list, "\n");
-  int pane_count = 0;
-
-  while (line != NULL &&
-         session->scrollback_len < sizeof(session->scrollback) - 500) {
-    char pane_id[32];
-    char pane_title[64] = "shell";
-    char pane_command[64] = "";
-
-    // Parse pane info: "window.pane:title:command"
-    char *colon1 = strchr(line, ':');
-    if (colon1) {
-      *colon1 = '\0';
-      strncpy(pane_id, line, sizeof(pane_id) - 1);
-      pane_id[sizeof(pane_id) - 1] = '\0';
-
-      char *colon2 = strchr(colon1 + 1, ':');
-      if (colon2) {
-        *colon2 = '\0';
-        strncpy(pane_title, colon1 + 1, sizeof(pane_title) - 1);
-        strncpy(pane_command, colon2 + 1, sizeof(pane_command) - 1);
-      } else {
-        strncpy(pane_title, colon1 + 1, sizeof(pane_title) - 1);
-      }
-    } else {
-      strncpy(pane_id, line, sizeof(pane_id) - 1);
-    }
+void trace_event(char kind, const char *key, const char *value) {
+  trace_record_t record = {
+      .ms = monotonic_ms() - g_state.trace_start_ms,
+      .kind = kind,
+      .key = (char *)key,
+      .key_len = strlen(key),
+      .value = (char *)value,
+      .value_len = strlen(value),
+  };
+  trace_write_record(g_state.trace, &record);
+}
 
-    // Skip the muxgeist pane itself
-    if (strstr(pane_title, "muxgeist") != NULL) {
-      line = strtok(NULL, "\n");
+// Record servers whose state changed since they were last recorded
+void trace_servers(void) {
+  for (int i = 0; g_state.trace && i < g_state.server_count; i++) {
+    tmux_server_t *server = &g_state.servers[i];
+    int is_default = i == g_state.default_server;
+    int state = 1 + server->alive + 2 * is_default;
+    if (server->trace_state == state) {
       continue;
     }
+    server->trace_state = state;
+    trace_record_t record = {
+        .ms = monotonic_ms() - g_state.trace_start_ms,
+        .kind = 'S',
+        .alive = server->alive,
+        .owner = (unsigned)server->owner,
+        .is_default = is_default,
+        .key = server->name,
+        .key_len = strlen(server->name),
+        .value = server->socket_path,
+        .value_len = strlen(server->socket_path),
+    };
+    trace_write_record(g_state.trace, &record);
+  }
+  if (g_state.trace) {
+    fflush(g_state.trace); // A trace cut short by a crash is still usable
+  }
+}
 
-    // Capture this pane's content
-    snprintf(cmd, sizeof(cmd), "tmux capture-pane -t %s:%s -p",
-             session->session_id, pane_id);
-
-    FILE *fp = popen(cmd, "r");
-    if (fp) {
-      size_t content_len = fread(temp_content, 1, sizeof(temp_content) - 1, fp);
-      temp_content[content_len] = '\0';
-      pclose(fp);
-
-      // Only include panes with meaningful content (skip empty/minimal panes)
-      if (content_len > 10) {
-        // Add pane header
-        int header_len =
-            snprintf(session->scrollback + session->scrollback_len,
-                     sizeof(session->scrollback) - session->scrollback_len,
-                     "\n=== PANE %s (%s) ===\n", pane_id, pane_title);
-
-        if (header_len > 0 && session->scrollback_len + header_len <
-                                  sizeof(session->scrollback)) {
-          session->scrollback_len += header_len;
-        }
-
-        // Add pane content (limit to avoid overflow)
-        size_t available_space =
-            sizeof(session->scrollback) - session->scrollback_len - 1;
-        size_t copy_len =
-            (content_len < available_space) ? content_len : available_space;
-
-        if (copy_len > 0) {
-          memcpy(session->scrollback + session->scrollback_len, temp_content,
-                 copy_len);
-          session->scrollback_len += copy_len;
-          session->scrollback[session->scrollback_len] = '\0';
-        }
+replay_output_t *replay_output_slot(const char *command) {
+  replay_t *replay = &g_state.replay;
+  unsigned long hash = hash_bytes(command, strlen(command)) | 1;
+  size_t slot = hash & (replay->output_slots - 1);
+  while (replay->outputs[slot].hash &&
+         (replay->outputs[slot].hash != hash ||
+          strcmp(replay->outputs[slot].command, command) != 0)) {
+    slot = (slot + 1) & (replay->output_slots - 1);
+  }
+  replay->outputs[slot].hash = hash;
+  return &replay->outputs[slot];
+}
 
-        pane_count++;
+// Remember a command's recorded output, taking ownership of the record's
+// buffers. The table doubles when half full.
+void replay_store_output(trace_record_t *record) {
+  replay_t *replay = &g_state.replay;
+  if ((replay->output_count + 1) * 2 > replay->output_slots) {
+    replay_output_t *old = replay->outputs;
+    size_t old_slots = replay->output_slots;
+    replay->output_slots = old_slots ? old_slots * 2 : 256;
+    replay->outputs = calloc(replay->output_slots, sizeof(replay_output_t));
+    if (!replay->outputs) {
+      fprintf(stderr, "Out of memory replaying\n");
+      exit(1);
+    }
+    for (size_t i = 0; i < old_slots; i++) {
+      if (old[i].hash) {
+        *replay_output_slot(old[i].command) = old[i];
       }
     }
-
-    line = strtok(NULL, "\n");
+    free(old);
+  }
+  replay_output_t *entry = replay_output_slot(record->key);
+  if (entry->command) {
+    free(record->key);
+    free(entry->output);
+  } else {
+    entry->command = record->key;
+    replay->output_count++;
   }
+  entry->output = record->value;
+  record->key = record->value = NULL;
+}
 
-  // If we didn't capture any panes (all were empty/muxgeist), capture the
-  // active pane
-  if (pane_count == 0) {
-    snprintf(cmd, sizeof(cmd), "tmux capture-pane -t %s -p",
-             session->session_id);
-    FILE *fp = popen(cmd, "r");
-    if (fp) {
-      session->scrollback_len =
-          fread(session->scrollback, 1, sizeof(session->scrollback) - 1, fp);
-      session->scrollback[session->scrollback_len] = '\0';
-      pclose(fp);
+// Under --replay tmux is not run: a command gets the output it last had in
+// the trace as of the replay clock, or nothing if it was never recorded.
+muxgeist_error_t replay_tmux_command(const char *cmd, char *output,
+                                     size_t output_size) {
+  replay_t *replay = &g_state.replay;
+  replay->tmux_commands++;
+  output[0] = '\0';
+  if (!replay->output_slots) {
+    return ERROR_NONE;
+  }
+  unsigned long hash = hash_bytes(cmd, strlen(cmd)) | 1;
+  for (size_t slot = hash & (replay->output_slots - 1);
+       replay->outputs[slot].hash;
+       slot = (slot + 1) & (replay->output_slots - 1)) {
+    if (replay->outputs[slot].hash == hash &&
+        strcmp(replay->outputs[slot].command, cmd) == 0) {
+      snprintf(output, output_size, "%s", replay->outputs[slot].output);
+      break;
     }
   }
-
   return ERROR_NONE;
 }
 
-muxgeist_error_t update_session_context(session_context_t *session) {
-  char cmd[256];
-  char output[MAX_BUFFER_SIZE];
-  muxgeist_error_t rc = ERROR_NONE;
-
-  // Get current pane
-  snprintf(cmd, sizeof(cmd), "tmux display-message -t %s -p '#{pane_id}'",
-           session->session_id);
-  rc = execute_tmux_command(cmd, output, sizeof(output));
-  if (rc == ERROR_NONE) {
-    strncpy(session->current_pane, output, sizeof(session->current_pane) - 1);
+// Whether a tmux server answers: its socket accepts connections, or under
+// --replay, the trace last had it alive
+int tmux_server_reachable(const char *socket_path) {
+  if (!g_state.replaying) {
+    return unix_socket_alive(socket_path);
   }
-
-  // Get current working directory from active pane
-  snprintf(cmd, sizeof(cmd),
-           "tmux display-message -t %s -p '#{pane_current_path}'",
-           session->session_id);
-  rc = execute_tmux_command(cmd, output, sizeof(output));
-  if (rc == ERROR_NONE) {
-    strncpy(session->current_cwd, output, sizeof(session->current_cwd) - 1);
+  for (int i = 0; i < g_state.replay.server_count; i++) {
+    if (strcmp(g_state.replay.servers[i].value, socket_path) == 0) {
+      return g_state.replay.servers[i].alive;
+    }
   }
+  return 0;
+}
 
-  // Capture content from all panes
-  rc = capture_all_panes(session);
+// Append text, counting what does not fit as snprintf does
+size_t append_text(char *dst, size_t dst_size, size_t used, const char *text) {
+  for (; *text; text++, used++) {
+    if (used + 1 < dst_size) {
+      dst[used] = *text;
+    }
+  }
+  dst[used < dst_size ? used : dst_size - 1] = '\0';
+  return used;
+}
 
-  session->last_activity = time(NULL);
-  return rc;
+// Append one word of a command line as a shell would read it. Values are
+// single-quoted; the subcommand, flags, pane ids and option names are not,
+// so a trace's commands read as typed and anonymising them leaves those be.
+size_t append_shell_word(char *dst, size_t dst_size, size_t used,
+                         const char *word, int bare) {
+  bare = bare || word[0] == '-' || word[0] == '@' ||
+         (word[0] == '%' && word[1] &&
+          strspn(word + 1, "0123456789") == strlen(word + 1));
+  used = append_text(dst, dst_size, used, bare ? " " : " '");
+  for (const char *c = word; *c; c++) {
+    char one[2] = {*c, '\0'};
+    used = append_text(dst, dst_size, used,
+                       *c == '\'' && !bare ? "'\\''" : one);
+  }
+  return bare ? used : append_text(dst, dst_size, used, "'");
 }
 
-muxgeist_error_t scan_tmux_sessions(void) {
-  char output[MAX_BUFFER_SIZE];
-  muxgeist_error_t rc = execute_tmux_command(
-      "tmux list-sessions -F '#{session_name}'", output, sizeof(output));
+// Run tmux against one server's socket and read what it prints, without a
+// shell in between: session names and socket paths come from users. A root
+// daemon runs it as the socket's owner, so a user's tmux is only ever
+// driven with that user's rights. -u because without a UTF-8 locale, as
+// under systemd, tmux prints the tabs our formats use as "_". Arguments
+// end with NULL; traces key the output by the command line as shell words.
+__attribute__((sentinel)) muxgeist_error_t
+tmux_command(const tmux_server_t *server, char *output, size_t output_size,
+             ...) {
+  const char *argv[TMUX_MAX_ARGS + 5] = {"tmux", "-u", "-S",
+                                         server->socket_path};
+  int argc = 4;
+  va_list args;
+  va_start(args, output_size);
+  for (const char *arg; (arg = va_arg(args, const char *)) != NULL;) {
+    if (argc < TMUX_MAX_ARGS + 4) {
+      argv[argc++] = arg;
+    }
+  }
+  va_end(args);
+  argv[argc] = NULL;
 
-  if (rc != ERROR_NONE) {
-    return rc;
+  char key[PATH_MAX + 1024] = "tmux -u -S";
+  size_t used = strlen(key);
+  used = append_shell_word(key, sizeof(key), used, server->socket_path, 0);
+  for (int i = 4; i < argc; i++) {
+    used = append_shell_word(key, sizeof(key), used, argv[i], i == 4);
+  }
+  if (used >= sizeof(key)) {
+    return ERROR_INVALID_ARGS;
+  }
+  output[0] = '\0';
+  if (g_state.replaying) {
+    return replay_tmux_command(key, output, output_size);
   }
 
-  // Parse session list
-  char *line = strtok(output, "\n");
-  while (line != NULL) {
-    session_context_t *session = find_session(line);
-    if (!session) {
-      session = create_session(line);
-      if (session) {
-        printf("Discovered new tmux session: %s\n", line);
-      }
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+    return ERROR_TMUX_CMD;
+  }
+  int drop = geteuid() == 0 && server->owner != 0;
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd < 0 || dup2(pipe_fds[1], STDOUT_FILENO) < 0 ||
+        dup2(null_fd, STDIN_FILENO) < 0 || dup2(null_fd, STDERR_FILENO) < 0) {
+      _exit(127);
     }
-
-    if (session) {
-      update_session_context(session);
+    if (drop && (setgroups(0, NULL) != 0 || setgid(server->group) != 0 ||
+                 setuid(server->owner) != 0)) {
+      _exit(127);
     }
+    execvp("tmux", (char *const *)argv);
+    _exit(127);
+  }
+  close(pipe_fds[1]);
+  if (pid < 0) {
+    close(pipe_fds[0]);
+    return ERROR_TMUX_CMD;
+  }
 
-    line = strtok(NULL, "\n");
+  // Read all output. What does not fit loses its oldest bytes, since the
+  // newest lines (the bottom of a capture) matter most, and then the line
+  // they cut in half.
+  size_t total_read = 0;
+  size_t room = output_size - 1;
+  int truncated = 0;
+  char chunk[4096];
+  ssize_t got;
+  while ((got = read(pipe_fds[0], chunk, sizeof(chunk))) != 0) {
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    size_t keep = (size_t)got < room ? (size_t)got : room;
+    if (total_read + keep > room) {
+      size_t shift = total_read + keep - room;
+      memmove(output, output + shift, total_read - shift);
+      total_read -= shift;
+      truncated = 1;
+    }
+    memcpy(output + total_read, chunk + got - keep, keep);
+    total_read += keep;
+    truncated |= keep < (size_t)got;
+  }
+  close(pipe_fds[0]);
+  while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
   }
 
+  output[total_read] = '\0';
+  if (truncated) {
+    g_state.tmux_truncated++;
+    char *newline = memchr(output, '\n', total_read);
+    size_t skip = newline ? (size_t)(newline + 1 - output) : 0;
+    memmove(output, output + skip, total_read - skip + 1);
+    total_read -= skip;
+  }
+  // Remove trailing newline if present
+  if (total_read > 0 && output[total_read - 1] == '\n') {
+    output[total_read - 1] = '\0';
+  }
+  if (g_state.trace) {
+    trace_event('T', key, output);
+  }
   return ERROR_NONE;
 }
 
-void handle_client_request(int client_socket) {
-  char buffer[MAX_BUFFER_SIZE];
-  ssize_t bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+// A tmux target naming exactly this session, "=name:"
+void session_target(const session_context_t *session, char *target,
+                    size_t target_size) {
+  snprintf(target, target_size, "=%s:", session->tmux_name);
+}
+
+// In system mode a user sees only sessions on their own tmux servers, so
+// server names like "default" are per-user namespaces; root sees them all.
+int session_visible(const session_context_t *session) {
+  return !g_state.system_mode || g_state.request_uid == 0 ||
+         g_state.servers[session->server].owner == g_state.request_uid;
+}
+
+// Look a session up by "server/session". A bare session name means the
+// session on the server a bare "tmux" command would use, or failing that on
+// the first server that has one.
+session_context_t *find_session(const char *session_id) {
+  session_context_t *fallback = NULL;
+  for (int i = 0; i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    if (!session_visible(session)) {
+      continue;
+    }
+    if (strcmp(session->session_id, session_id) == 0) {
+      return session;
+    }
+    if (!strchr(session_id, '/') &&
+        strcmp(session->tmux_name, session_id) == 0) {
+      int is_default =
+          g_state.system_mode
+              ? strcmp(g_state.servers[session->server].name, "default") == 0
+              : session->server == g_state.default_server;
+      if (is_default) {
+        return session;
+      }
+      if (!fallback) {
+        fallback = session;
+      }
+    }
+  }
+  return fallback;
+}
+
+session_context_t *find_server_session(int server, const char *tmux_name) {
+  for (int i = 0; i < g_state.session_count; i++) {
+    if (g_state.sessions[i].server == server &&
+        strcmp(g_state.sessions[i].tmux_name, tmux_name) == 0) {
+      return &g_state.sessions[i];
+    }
+  }
+  return NULL;
+}
+
+user_account_t *user_account(uid_t uid) {
+  for (int i = 0; i < g_state.user_count; i++) {
+    if (g_state.users[i].uid == uid) {
+      return &g_state.users[i];
+    }
+  }
+  if (g_state.user_count >= MAX_USERS) {
+    return NULL;
+  }
+  user_account_t *account = &g_state.users[g_state.user_count++];
+  memset(account, 0, sizeof(*account));
+  account->uid = uid;
+  account->cpu_tokens_ms = g_state.user_cpu_ms;
+  struct passwd *pw = getpwuid(uid);
+  if (pw) {
+    snprintf(account->name, sizeof(account->name), "%s", pw->pw_name);
+  } else {
+    snprintf(account->name, sizeof(account->name), "%u", (unsigned)uid);
+  }
+  return account;
+}
+
+session_context_t *create_session(int server, const char *tmux_name) {
+  if (g_state.session_count >= g_state.session_capacity) {
+    return NULL;
+  }
+  char qualified[sizeof(((session_context_t *)0)->session_id)];
+  snprintf(qualified, sizeof(qualified), "%s/%s", g_state.servers[server].name,
+           tmux_name);
+  if (g_state.shard_total > 0 &&
+      hash_bytes(qualified, strlen(qualified)) % g_state.shard_total !=
+          (unsigned long)g_state.shard_index) {
+    return NULL; // Another shard's
+  }
+  if (g_state.system_mode) {
+    user_account_t *account = user_account(g_state.servers[server].owner);
+    if (!account || account->memory_bytes >= g_state.user_memory_bytes) {
+      if (account) {
+        account->refused++;
+      }
+      return NULL;
+    }
+    account->session_count++;
+  }
+
+  session_context_t *session = &g_state.sessions[g_state.session_count];
+  memset(session, 0, sizeof(session_context_t));
+  strcpy(session->session_id, qualified);
+  strncpy(session->tmux_name, tmux_name, sizeof(session->tmux_name) - 1);
+  session->server = server;
+  session->last_activity = daemon_time();
+
+  g_state.session_count++;
+  return session;
+}
+
+pane_state_t *find_pane(session_context_t *session, const char *pane_id) {
+  for (int i = 0; i < session->pane_count; i++) {
+    if (strcmp(session->panes[i].pane_id, pane_id) == 0) {
+      return &session->panes[i];
+    }
+  }
+  return NULL;
+}
+
+pane_state_t *create_pane(session_context_t *session, const char *pane_id) {
+  if (session->pane_count >= MAX_PANES_PER_SESSION) {
+    return NULL;
+  }
+
+  pane_state_t *pane = &session->panes[session->pane_count++];
+  memset(pane, 0, sizeof(pane_state_t));
+  strncpy(pane->pane_id, pane_id, sizeof(pane->pane_id) - 1);
+  return pane;
+}
+
+// Length of the run of ASCII bytes at the start of s, sixteen bytes at a
+// time with SSE2 and eight at a time otherwise. Terminal text is mostly
+// ASCII, so this is where validation and width spend their time.
+size_t ascii_prefix(const unsigned char *s, size_t len) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= len; i += 16) {
+    int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (high) {
+      return i + __builtin_ctz(high);
+    }
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, sizeof(word));
+    if (word & 0x8080808080808080ULL) {
+      break;
+    }
+  }
+  while (i < len && s[i] < 0x80) {
+    i++;
+  }
+  return i;
+}
+
+// Decode the UTF-8 sequence at s. Returns its length, 0 if it is invalid
+// (stray continuation, overlong form, surrogate, beyond U+10FFFF), or -1
+// if it is a valid start cut short by the end of the buffer.
+int utf8_decode(const unsigned char *s, size_t len, unsigned int *codepoint) {
+  int need;
+  unsigned int cp, min;
+  if (s[0] < 0x80) {
+    *codepoint = s[0];
+    return 1;
+  } else if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+    need = 1, cp = s[0] & 0x1F, min = 0x80;
+  } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+    need = 2, cp = s[0] & 0x0F, min = 0x800;
+  } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+    need = 3, cp = s[0] & 0x07, min = 0x10000;
+  } else {
+    return 0;
+  }
+  for (int k = 1; k <= need; k++) {
+    if ((size_t)k >= len) {
+      return -1;
+    }
+    if ((s[k] & 0xC0) != 0x80) {
+      return 0;
+    }
+    cp = cp << 6 | (s[k] & 0x3F);
+  }
+  if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+    return 0;
+  }
+  *codepoint = cp;
+  return need + 1;
+}
+
+// Make text valid UTF-8 in place: each byte of an invalid sequence becomes
+// '?', and a sequence cut off by the end of a full capture buffer is
+// dropped. Returns the new length; the text stays NUL-terminated.
+size_t utf8_repair(char *text, size_t len) {
+  unsigned char *s = (unsigned char *)text;
+  size_t i = 0;
+  while (i < len) {
+    i += ascii_prefix(s + i, len - i);
+    if (i >= len) {
+      break;
+    }
+    unsigned int cp;
+    int n = utf8_decode(s + i, len - i, &cp);
+    if (n > 0) {
+      i += n;
+    } else if (n < 0) {
+      len = i;
+      text[len] = '\0';
+    } else {
+      s[i++] = '?';
+    }
+  }
+  return len;
+}
+
+// Code points a terminal draws two columns wide: East Asian wide and
+// fullwidth forms and emoji presentation, after wcwidth and UAX #11.
+static const unsigned int wide_ranges[][2] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x33FF},   {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF},   {0xA960, 0xA97F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4},
+    {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F251}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF},
+    {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+// Code points drawn in no column of their own: combining marks, zero-width
+// spaces and joiners, variation selectors.
+static const unsigned int zero_width_ranges[][2] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD},
+    {0x05BF, 0x05BF}, {0x05C1, 0x05C2}, {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F},
+    {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x0900, 0x0902}, {0x093C, 0x093C}, {0x0941, 0x0948},
+    {0x094D, 0x094D}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A},
+    {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+    {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF}, {0xE0001, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+int in_ranges(const unsigned int (*ranges)[2], int count, unsigned int cp) {
+  int low = 0, high = count - 1;
+  if (cp < ranges[0][0] || cp > ranges[high][1]) {
+    return 0;
+  }
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (cp > ranges[mid][1]) {
+      low = mid + 1;
+    } else if (cp < ranges[mid][0]) {
+      high = mid - 1;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int codepoint_width(unsigned int cp) {
+  if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0)) {
+    return 0;
+  }
+  if (in_ranges(zero_width_ranges,
+                sizeof(zero_width_ranges) / sizeof(zero_width_ranges[0]),
+                cp)) {
+    return 0;
+  }
+  return in_ranges(wide_ranges, sizeof(wide_ranges) / sizeof(wide_ranges[0]),
+                   cp)
+             ? 2
+             : 1;
+}
+
+// Columns validated UTF-8 takes on a terminal. ASCII runs count a column
+// a byte; only the rest is decoded and looked up.
+int utf8_width(const char *text, size_t len) {
+  const unsigned char *s = (const unsigned char *)text;
+  size_t i = 0;
+  int width = 0;
+  while (i < len) {
+    size_t run = ascii_prefix(s + i, len - i);
+    width += run;
+    i += run;
+    if (i >= len) {
+      break;
+    }
+    unsigned int cp;
+    int n = utf8_decode(s + i, len - i, &cp);
+    if (n <= 0) {
+      i++; // Unrepaired text: skip the byte
+      continue;
+    }
+    width += codepoint_width(cp);
+    i += n;
+  }
+  return width;
+}
+
+// Bytes of text to print so at most max_bytes go out without splitting a
+// character, for the "%.*s" cuts in responses.
+int utf8_prefix(const char *text, int max_bytes) {
+  int len = strnlen(text, max_bytes + 1);
+  if (len <= max_bytes) {
+    return len;
+  }
+  len = max_bytes;
+  while (len > 0 && ((unsigned char)text[len] & 0xC0) == 0x80) {
+    len--;
+  }
+  return len;
+}
+
+// Trigram identity for the history skip filters, ASCII folded to lower case
+// so the filters serve case-insensitive matching. Multiplying by an odd
+// constant keeps distinct trigrams distinct.
+unsigned long trigram_hash(const char *p) {
+  unsigned long trigram = (unsigned long)tolower((unsigned char)p[0]) << 16 |
+                          (unsigned long)tolower((unsigned char)p[1]) << 8 |
+                          (unsigned long)tolower((unsigned char)p[2]);
+  return (trigram + 1) * 0x9E3779B97F4A7C15UL;
+}
+
+void bloom_add(unsigned char *bloom, unsigned long hash) {
+  for (int k = 0; k < HISTORY_BLOOM_HASHES; k++) {
+    unsigned long bit = (hash >> (51 - 13 * k)) & (HISTORY_BLOOM_BYTES * 8 - 1);
+    bloom[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+int bloom_has(const unsigned char *bloom, unsigned long hash) {
+  for (int k = 0; k < HISTORY_BLOOM_HASHES; k++) {
+    unsigned long bit = (hash >> (51 - 13 * k)) & (HISTORY_BLOOM_BYTES * 8 - 1);
+    if (!(bloom[bit / 8] & (1 << (bit % 8)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Deflate one block of history text without a zlib header, primed with a
+// dictionary of recurring terminal phrases when there is one. Returns the
+// compressed length, or -1 if it does not fit in out_size.
+long history_deflate(const unsigned char *in, size_t in_len,
+                     const unsigned char *dict, size_t dict_len,
+                     unsigned char *out, size_t out_size) {
+#ifdef HAVE_ZLIB
+  z_stream stream = {0};
+  if (deflateInit2(&stream, HISTORY_DEFLATE_LEVEL, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return -1;
+  }
+  if (dict_len > 0) {
+    deflateSetDictionary(&stream, dict, dict_len);
+  }
+  stream.next_in = (unsigned char *)in;
+  stream.avail_in = in_len;
+  stream.next_out = out;
+  stream.avail_out = out_size;
+  long len = deflate(&stream, Z_FINISH) == Z_STREAM_END
+                 ? (long)stream.total_out
+                 : -1;
+  deflateEnd(&stream);
+  return len;
+#else
+  (void)in, (void)in_len, (void)dict, (void)dict_len, (void)out,
+      (void)out_size;
+  return -1; // Built without zlib: history stays uncompressed
+#endif
+}
+
+long history_inflate(const unsigned char *in, size_t in_len,
+                     const unsigned char *dict, size_t dict_len,
+                     unsigned char *out, size_t out_size) {
+#ifdef HAVE_ZLIB
+  z_stream stream = {0};
+  if (inflateInit2(&stream, -15) != Z_OK) {
+    return -1;
+  }
+  if (dict_len > 0) {
+    inflateSetDictionary(&stream, dict, dict_len);
+  }
+  stream.next_in = (unsigned char *)in;
+  stream.avail_in = in_len;
+  stream.next_out = out;
+  stream.avail_out = out_size;
+  long len = inflate(&stream, Z_FINISH) == Z_STREAM_END
+                 ? (long)stream.total_out
+                 : -1;
+  inflateEnd(&stream);
+  return len;
+#else
+  (void)in, (void)in_len, (void)dict, (void)dict_len, (void)out,
+      (void)out_size;
+  return -1;
+#endif
+}
+
+// A block whose slot is reused or whose pane goes away gives up its
+// compressed copy
+void history_block_release(history_block_t *block) {
+  if (block->frozen) {
+    g_state.history_cold_raw -= block->raw_len;
+    g_state.history_cold_bytes -= block->frozen_len;
+    free(block->frozen);
+  }
+}
+
+void history_append(pane_history_t *history, unsigned long seq,
+                    const char *line) {
+  if (!history->lines) {
+    history->lines = calloc(PANE_HISTORY_LINES, sizeof(history_line_t));
+    history->blocks = calloc(HISTORY_BLOCKS, sizeof(history_block_t));
+    if (!history->lines || !history->blocks) {
+      free(history->lines);
+      free(history->blocks);
+      history->lines = NULL;
+      history->blocks = NULL;
+      return;
+    }
+  }
+
+  int slot = (history->start + history->count) % PANE_HISTORY_LINES;
+  if (history->count == PANE_HISTORY_LINES) {
+    // Full: the oldest line makes room
+    free(history->lines[history->start].text);
+    history->start = (history->start + 1) % PANE_HISTORY_LINES;
+    history->count--;
+  }
+
+  history->lines[slot].seq = seq;
+  history->lines[slot].timestamp = daemon_time();
+  history->lines[slot].text = strdup(line);
+  history->lines[slot].width = utf8_width(line, strlen(line));
+  history->count++;
+
+  // The filter is filled as lines arrive and sealed with the block's last
+  history_block_t *block =
+      &history->blocks[history->appended / HISTORY_BLOCK_LINES % HISTORY_BLOCKS];
+  if (history->appended++ % HISTORY_BLOCK_LINES == 0) {
+    history_block_release(block);
+    memset(block, 0, sizeof(*block));
+    block->first_seq = seq;
+    block->first_time = history->lines[slot].timestamp;
+  }
+  block->last_seq = seq;
+  block->last_time = history->lines[slot].timestamp;
+  block->bytes += strlen(line) + 1;
+  for (const char *p = line; p[0] && p[1] && p[2]; p++) {
+    bloom_add(block->bloom, trigram_hash(p));
+  }
+}
+
+void history_free(pane_history_t *history) {
+  if (!history->lines) {
+    return;
+  }
+  for (int i = 0; i < history->count; i++) {
+    free(history->lines[(history->start + i) % PANE_HISTORY_LINES].text);
+  }
+  for (int b = 0; b < HISTORY_BLOCKS; b++) {
+    history_block_release(&history->blocks[b]);
+  }
+  free(history->lines);
+  free(history->blocks);
+  memset(history, 0, sizeof(*history));
+}
+
+// Position (0 = oldest) of the first retained line with seq >= the given
+// one, or history->count if there is none.
+int history_lower_bound(const pane_history_t *history, unsigned long seq) {
+  int lo = 0, hi = history->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (history->lines[(history->start + mid) % PANE_HISTORY_LINES].seq < seq) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Ring positions [*first, *end) of the lines of a block still retained;
+// the oldest block may have lost some of its lines to eviction.
+void history_block_span(const pane_history_t *history, unsigned long block,
+                        int *first, int *end) {
+  unsigned long oldest = history->appended - history->count;
+  unsigned long from = block * HISTORY_BLOCK_LINES;
+  unsigned long to = from + HISTORY_BLOCK_LINES;
+  *first = (int)((from > oldest ? from : oldest) - oldest);
+  *end = (int)((to < history->appended ? to : history->appended) - oldest);
+}
+
+// Bring a cold block's lines back for a lookup. They stay until a freeze
+// sweep finds them unread for HISTORY_THAW_SECONDS, so pointers handed out
+// while serving a request remain valid. A block that cannot be expanded
+// stays frozen, all its lines still without text.
+muxgeist_error_t history_thaw(pane_history_t *history, unsigned long b) {
+  history_block_t *block = &history->blocks[b % HISTORY_BLOCKS];
+  if (!block->cold) {
+    return ERROR_NONE;
+  }
+  const history_codec_t *codec = &g_state.codecs[block->codec];
+  unsigned char *raw = malloc(block->raw_len);
+  char **texts = calloc(block->frozen_lines, sizeof(char *));
+  long len = raw && texts
+                 ? history_inflate(block->frozen, block->frozen_len,
+                                   codec->dicts[block->dict_version],
+                                   codec->dict_sizes[block->dict_version],
+                                   raw, block->raw_len)
+                 : -1;
+  unsigned long oldest = history->appended - history->count;
+  unsigned long first = (b + 1) * HISTORY_BLOCK_LINES - block->frozen_lines;
+  const char *cursor = (const char *)raw;
+  const char *limit = cursor + (len > 0 ? len : 0);
+  int ok = len >= 0;
+  for (int k = 0; ok && k < block->frozen_lines; k++) {
+    const char *eol = cursor < limit ? memchr(cursor, '\n', limit - cursor)
+                                     : NULL;
+    if (first + k >= oldest) {
+      texts[k] = eol ? strndup(cursor, eol - cursor) : strdup("");
+      ok = texts[k] != NULL;
+    }
+    cursor = eol ? eol + 1 : limit;
+  }
+  free(raw);
+  if (!ok) {
+    for (int k = 0; texts && k < block->frozen_lines; k++) {
+      free(texts[k]);
+    }
+    free(texts);
+    g_state.history_thaw_failures++;
+    return ERROR_MEMORY_ALLOC;
+  }
+  for (int k = 0; k < block->frozen_lines; k++) {
+    if (first + k >= oldest) {
+      history->lines[(history->start + (first + k - oldest)) %
+                     PANE_HISTORY_LINES]
+          .text = texts[k];
+    }
+  }
+  free(texts);
+  block->cold = 0;
+  block->thawed = daemon_time();
+  return ERROR_NONE;
+}
+
+// The line at a position (0 = oldest) without bringing its text back: its
+// seq and timestamp stay in the ring while its block is cold.
+const history_line_t *history_slot(const pane_history_t *history,
+                                   int position) {
+  return &history->lines[(history->start + position) % PANE_HISTORY_LINES];
+}
+
+// The line at a position with its text, or NULL if its cold block could
+// not be expanded.
+const history_line_t *history_at(pane_history_t *history, int position) {
+  const history_line_t *line = history_slot(history, position);
+  if (!line->text &&
+      history_thaw(history, (history->appended - history->count + position) /
+                                HISTORY_BLOCK_LINES) != ERROR_NONE) {
+    return NULL;
+  }
+  return line;
+}
+
+void screen_group_release(screen_group_t *group) {
+  free(group->data);
+  free(group->frozen);
+  memset(group, 0, sizeof(*group));
+}
+
+void screen_history_free(screen_history_t *screens) {
+  if (!screens) {
+    return;
+  }
+  for (int g = 0; g < SCREEN_GROUPS; g++) {
+    screen_group_release(&screens->groups[g]);
+  }
+  free(screens->last);
+  free(screens);
+}
+
+size_t screen_history_bytes(const screen_history_t *screens) {
+  if (!screens) {
+    return 0;
+  }
+  size_t bytes = sizeof(*screens) + (screens->last ? strlen(screens->last) : 0);
+  for (int g = 0; g < SCREEN_GROUPS; g++) {
+    bytes += screens->groups[g].data_capacity + screens->groups[g].frozen_len;
+  }
+  return bytes;
+}
+
+// The foreground job on a pane's terminal: the process group leader its
+// shell has handed the tty to.
+pid_t foreground_job(pid_t shell_pid) {
+  char path[64], stat[512];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)shell_pid);
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+  size_t len = fread(stat, 1, sizeof(stat) - 1, fp);
+  fclose(fp);
+  stat[len] = '\0';
+  const char *after_comm = strrchr(stat, ')'); // The name may hold spaces
+  int tpgid;
+  if (!after_comm ||
+      sscanf(after_comm + 1, " %*c %*d %*d %*d %*d %d", &tpgid) != 1) {
+    return -1;
+  }
+  return tpgid;
+}
+
+// The one file a "tail -f"/"tail -F" or "less +F" process follows, resolved
+// against its working directory, and the /proc link of the descriptor the
+// process has it open on. The file is opened through that link, never by
+// name, so a path swapped for a symlink after the check cannot make the
+// daemon read what the pane's owner could not. journalctl -f and tails of
+// several files or of a pipe stay screen-scraped.
+int tail_target(pid_t pid, char *path, size_t path_size, char *fd_path,
+                size_t fd_path_size) {
+  char proc_path[64], args[4096];
+  snprintf(proc_path, sizeof(proc_path), "/proc/%d/cmdline", (int)pid);
+  int fd = open(proc_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t len = read(fd, args, sizeof(args) - 1);
+  close(fd);
+  if (len <= 0) {
+    return -1;
+  }
+  args[len] = '\0';
+
+  const char *program = strrchr(args, '/') ? strrchr(args, '/') + 1 : args;
+  int is_tail = strcmp(program, "tail") == 0;
+  int is_less = strcmp(program, "less") == 0;
+  int follows = 0, files = 0, skip_value = 0;
+  const char *file = NULL;
+  for (const char *arg = args + strlen(args) + 1; arg < args + len;
+       arg += strlen(arg) + 1) {
+    if (skip_value) {
+      skip_value = 0;
+    } else if (is_less && strcmp(arg, "+F") == 0) {
+      follows = 1;
+    } else if (is_tail && strncmp(arg, "--follow", 8) == 0) {
+      follows = 1;
+    } else if (is_tail && arg[0] == '-' && arg[1] != '-' && arg[1]) {
+      // Clustered short options; -n, -c and -s take a value
+      for (const char *c = arg + 1; *c; c++) {
+        follows |= *c == 'f' || *c == 'F';
+        if (*c == 'n' || *c == 'c' || *c == 's') {
+          skip_value = c[1] == '\0';
+          break;
+        }
+      }
+    } else if (arg[0] != '-' && arg[0] != '+') {
+      file = arg;
+      files++;
+    }
+  }
+  if ((!is_tail && !is_less) || !follows || files != 1) {
+    return -1;
+  }
+
+  char joined[PATH_MAX];
+  if (file[0] == '/') {
+    snprintf(joined, sizeof(joined), "%s", file);
+  } else {
+    char cwd[PATH_MAX];
+    snprintf(proc_path, sizeof(proc_path), "/proc/%d/cwd", (int)pid);
+    ssize_t cwd_len = readlink(proc_path, cwd, sizeof(cwd) - 1);
+    if (cwd_len <= 0) {
+      return -1;
+    }
+    cwd[cwd_len] = '\0';
+    if (snprintf(joined, sizeof(joined), "%s/%s", cwd, file) >=
+        (int)sizeof(joined)) {
+      return -1; // Cut short it could name another file
+    }
+  }
+  char resolved[PATH_MAX];
+  if (!realpath(joined, resolved)) {
+    return -1;
+  }
+
+  snprintf(proc_path, sizeof(proc_path), "/proc/%d/fd", (int)pid);
+  DIR *fds = opendir(proc_path);
+  int open_there = 0;
+  struct dirent *entry;
+  while (fds && !open_there && (entry = readdir(fds))) {
+    char link_path[PATH_MAX], target[PATH_MAX];
+    snprintf(link_path, sizeof(link_path), "%s/%s", proc_path, entry->d_name);
+    ssize_t target_len = readlink(link_path, target, sizeof(target) - 1);
+    if (target_len > 0) {
+      target[target_len] = '\0';
+      open_there = strcmp(target, resolved) == 0;
+    }
+    if (open_there) {
+      snprintf(fd_path, fd_path_size, "%s", link_path);
+    }
+  }
+  if (fds) {
+    closedir(fds);
+  }
+  if (!open_there) {
+    return -1;
+  }
+  snprintf(path, path_size, "%s", resolved);
+  return 0;
+}
+
+// The inotify descriptor tails and history watches share, opened on first
+// use
+int inotify_ready(void) {
+  if (g_state.inotify_fd < 0) {
+    g_state.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  }
+  return g_state.inotify_fd >= 0;
+}
+
+void tail_start(pane_state_t *pane, pid_t pid) {
+  char path[PATH_MAX], fd_path[PATH_MAX];
+  if (tail_target(pid, path, sizeof(path), fd_path, sizeof(fd_path)) != 0 ||
+      !inotify_ready()) {
+    return;
+  }
+  pane_tail_t *tail = calloc(1, sizeof(*tail));
+  int fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (!tail || fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    free(tail);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  // Watched through our descriptor too, so the watch is on the same file
+  char own_path[64];
+  snprintf(own_path, sizeof(own_path), "/proc/self/fd/%d", fd);
+  tail->wd = inotify_add_watch(g_state.inotify_fd, own_path,
+                               IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+  if (tail->wd < 0) {
+    free(tail);
+    close(fd);
+    return;
+  }
+  // What is on screen already came in through capture; the file takes over
+  // from its current end
+  tail->fd = fd;
+  tail->pid = pid;
+  tail->offset = st.st_size;
+  snprintf(tail->path, sizeof(tail->path), "%s", path);
+  pane->tail = tail;
+  printf("Tailing %s for pane %s\n", path, pane->pane_id);
+}
+
+void tail_stop(pane_state_t *pane) {
+  pane_tail_t *tail = pane->tail;
+  // Panes following the same file share its watch
+  int shared = 0;
+  for (int i = 0; i < g_state.session_count && !shared; i++) {
+    for (int p = 0; p < g_state.sessions[i].pane_count && !shared; p++) {
+      const pane_tail_t *other = g_state.sessions[i].panes[p].tail;
+      shared = other && other != tail && other->wd == tail->wd;
+    }
+  }
+  if (!shared && !tail->watch_removed) {
+    inotify_rm_watch(g_state.inotify_fd, tail->wd);
+  }
+  close(tail->fd);
+  free(tail);
+  pane->tail = NULL;
+}
+
+int process_alive(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d", (int)pid);
+  return access(path, F_OK) == 0;
+}
+
+// Follow the file directly while the pane's foreground job is a tail of
+// one, and go back to capture when that job ends.
+void tail_update(pane_state_t *pane, pid_t shell_pid) {
+  if (g_state.replaying || shell_pid <= 0) {
+    return;
+  }
+  int may_follow =
+      strcmp(pane->command, "tail") == 0 || strcmp(pane->command, "less") == 0;
+  pane_tail_t *tail = pane->tail;
+  if (tail && (!may_follow || (tail->file_gone && !tail->pending) ||
+               !process_alive(tail->pid))) {
+    tail_stop(pane);
+  }
+  time_t now = daemon_time();
+  if (!may_follow || pane->tail ||
+      now - pane->tail_checked < TAIL_CHECK_INTERVAL) {
+    return;
+  }
+  pane->tail_checked = now;
+  pid_t job = foreground_job(shell_pid);
+  if (job > 0) {
+    tail_start(pane, job);
+  }
+}
+
+// A variable from a process's environment, readable for the daemon's own
+// user's processes (or anyone's, as root)
+int process_env(pid_t pid, const char *name, char *value, size_t value_size) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/environ", (int)pid);
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    return -1;
+  }
+  size_t name_len = strlen(name);
+  char *entry = NULL;
+  size_t entry_size = 0;
+  int found = -1;
+  while (found < 0 && getdelim(&entry, &entry_size, '\0', fp) > 0) {
+    if (strncmp(entry, name, name_len) == 0 && entry[name_len] == '=' &&
+        entry[name_len + 1]) {
+      snprintf(value, value_size, "%s", entry + name_len + 1);
+      found = 0;
+    }
+  }
+  free(entry);
+  fclose(fp);
+  return found;
+}
+
+// The history file an interactive bash, zsh or fish appends to. HISTFILE is
+// seldom exported and zsh has no default, so without it the usual places
+// are tried and the most recently written one wins. The file must exist,
+// be no link, and belong to the shell's user.
+int shell_history_path(pid_t pid, shell_kind_t *kind, uid_t *uid, char *path,
+                       size_t path_size) {
+  char proc_path[64], comm[32] = "";
+  snprintf(proc_path, sizeof(proc_path), "/proc/%d/comm", (int)pid);
+  FILE *fp = fopen(proc_path, "r");
+  if (!fp) {
+    return -1;
+  }
+  if (!fgets(comm, sizeof(comm), fp)) {
+    comm[0] = '\0';
+  }
+  fclose(fp);
+  comm[strcspn(comm, "\n")] = '\0';
+  if (strcmp(comm, "bash") == 0) {
+    *kind = SHELL_BASH;
+  } else if (strcmp(comm, "zsh") == 0) {
+    *kind = SHELL_ZSH;
+  } else if (strcmp(comm, "fish") == 0) {
+    *kind = SHELL_FISH;
+  } else {
+    return -1;
+  }
+
+  struct stat st;
+  snprintf(proc_path, sizeof(proc_path), "/proc/%d", (int)pid);
+  if (stat(proc_path, &st) != 0) {
+    return -1;
+  }
+  *uid = st.st_uid;
+  char home[PATH_MAX];
+  if (process_env(pid, "HOME", home, sizeof(home)) != 0) {
+    struct passwd *pw = getpwuid(*uid);
+    if (!pw) {
+      return -1;
+    }
+    snprintf(home, sizeof(home), "%s", pw->pw_dir);
+  }
+
+  char candidates[3][PATH_MAX], value[PATH_MAX];
+  int count = 0;
+  if (*kind != SHELL_FISH &&
+      process_env(pid, "HISTFILE", value, sizeof(value)) == 0) {
+    if (value[0] != '/') {
+      return -1; // Relative to a directory we cannot know
+    }
+    snprintf(candidates[count++], PATH_MAX, "%s", value);
+  } else if (*kind != SHELL_FISH) {
+    static const char *bash_files[] = {".bash_history", NULL};
+    static const char *zsh_files[] = {".zsh_history", ".zhistory", ".histfile",
+                                      NULL};
+    for (const char **file = *kind == SHELL_BASH ? bash_files : zsh_files;
+         *file; file++) {
+      // A path too long to hold is skipped, not cut short into another one
+      int len = snprintf(candidates[count], PATH_MAX, "%s/%s", home, *file);
+      count += len < PATH_MAX;
+    }
+  } else {
+    char data_home[PATH_MAX], session_name[64] = "fish";
+    if (process_env(pid, "XDG_DATA_HOME", data_home, sizeof(data_home)) != 0 &&
+        snprintf(data_home, sizeof(data_home), "%s/.local/share", home) >=
+            (int)sizeof(data_home)) {
+      return -1;
+    }
+    process_env(pid, "fish_history", session_name, sizeof(session_name));
+    int len = snprintf(candidates[count], PATH_MAX, "%s/fish/%s_history",
+                       data_home, session_name);
+    count += len < PATH_MAX;
+  }
+
+  time_t newest = -1;
+  for (int c = 0; c < count; c++) {
+    if (lstat(candidates[c], &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_uid == *uid && st.st_mtime > newest) {
+      newest = st.st_mtime;
+      snprintf(path, path_size, "%s", candidates[c]);
+    }
+  }
+  return newest >= 0 ? 0 : -1;
+}
+
+void shell_history_reset(shell_history_t *history) {
+  history->stamp = 0;
+  history->in_entry = 0;
+  history->entry_len = 0;
+  history->partial_len = 0;
+}
+
+void shell_history_append(shell_history_t *history, const char *text,
+                          size_t len) {
+  for (size_t i = 0;
+       i < len && history->entry_len < sizeof(history->entry) - 1; i++) {
+    unsigned char c = text[i];
+    if (history->kind == SHELL_ZSH && c == 0x83 && i + 1 < len) {
+      c = text[++i] ^ 32; // zsh "metafies" bytes special to it
+    } else if (history->kind == SHELL_FISH && c == '\\' && i + 1 < len &&
+               text[i + 1] == '\\') {
+      i++; // fish escapes backslashes; "\n" stays as it is
+    }
+    history->entry[history->entry_len++] = c;
+  }
+  history->entry[history->entry_len] = '\0';
+}
+
+// One line of a history file. Returns 1 when it completes an entry, left in
+// history->entry with its time, or 0 for time the file did not give.
+//   bash: "#<epoch>" (written when HISTTIMEFORMAT is set), then the command
+//   zsh:  ": <start>:<elapsed>;<command>" with extended history, lines
+//         ending in a backslash continuing it
+//   fish: "- cmd: <command>", then "  when: <epoch>", then maybe paths
+int shell_history_line(shell_history_t *history, const char *line) {
+  size_t len = strlen(line);
+  switch (history->kind) {
+  case SHELL_BASH:
+    if (line[0] == '#' && len > 1 &&
+        strspn(line + 1, "0123456789") == len - 1) {
+      history->stamp = strtol(line + 1, NULL, 10);
+      return 0;
+    }
+    history->entry_len = 0;
+    shell_history_append(history, line, len);
+    history->entry_time = history->stamp;
+    history->stamp = 0;
+    return 1;
+  case SHELL_ZSH: {
+    const char *text = line;
+    if (history->in_entry) {
+      shell_history_append(history, "\\n", 2);
+    } else {
+      long start;
+      int skip = 0;
+      history->entry_len = 0;
+      history->entry_time = 0;
+      if (sscanf(line, ": %ld:%*d;%n", &start, &skip) == 1 && skip > 0) {
+        history->entry_time = start;
+        text = line + skip;
+      }
+    }
+    len = strlen(text);
+    history->in_entry = len > 0 && text[len - 1] == '\\';
+    shell_history_append(history, text, len - history->in_entry);
+    return !history->in_entry;
+  }
+  case SHELL_FISH:
+    if (strncmp(line, "- cmd: ", 7) == 0) {
+      history->entry_len = 0;
+      shell_history_append(history, line + 7, len - 7);
+      history->entry_time = 0;
+      history->in_entry = 1;
+    } else if (history->in_entry && strncmp(line, "  when: ", 8) == 0) {
+      history->entry_time = strtol(line + 8, NULL, 10);
+      history->in_entry = 0;
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+// Whether a pane's screen shows the command as typed: at the end of a line,
+// after a prompt or at its start
+int content_shows_command(const char *content, const char *command) {
+  size_t len = strlen(command);
+  for (const char *hit = content; (hit = strstr(hit, command)); hit++) {
+    if ((hit == content || hit[-1] == ' ' || hit[-1] == '\n') &&
+        (hit[len] == '\n' || hit[len] == '\0')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Store a completed entry in the command ring of the session whose pane
+// most likely ran it: of the panes whose shell uses this file, the one
+// showing the command, else the one with the newest output. Once those
+// shells are gone (bash writes its file as it exits) the entry goes to the
+// session the file's last entry went to.
+void shell_history_record(int index) {
+  shell_history_t *history = g_state.shell_histories[index];
+  session_context_t *target = NULL;
+  pane_state_t *best = NULL;
+  int best_shows = 0;
+  for (int i = 0; i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    for (int p = 0; p < session->pane_count; p++) {
+      pane_state_t *pane = &session->panes[p];
+      if (pane->shell_history != index) {
+        continue;
+      }
+      int shows = pane->content &&
+                  content_shows_command(pane->content, history->entry);
+      if (!best || shows > best_shows ||
+          (shows == best_shows && pane->last_change > best->last_change)) {
+        best = pane;
+        best_shows = shows;
+        target = session;
+      }
+    }
+  }
+  for (int i = 0; i < g_state.session_count && !target; i++) {
+    if (strcmp(g_state.sessions[i].session_id, history->last_session) == 0) {
+      target = &g_state.sessions[i];
+    }
+  }
+  if (!target) {
+    return;
+  }
+  snprintf(history->last_session, sizeof(history->last_session), "%s",
+           target->session_id);
+
+  command_entry_t *entry = &target->history[target->history_index];
+  memcpy(entry->command, history->entry, history->entry_len + 1);
+  entry->timestamp = history->entry_time ? history->entry_time : daemon_time();
+  entry->exit_code = -1;
+  if (snprintf(entry->pane_index, sizeof(entry->pane_index), "%s",
+               best ? best->pane_index : "-") >=
+      (int)sizeof(entry->pane_index)) {
+    strcpy(entry->pane_index, "-"); // Unknown rather than cut short
+  }
+  entry->cwd[0] = '\0';
+  char proc_path[64], cwd[PATH_MAX];
+  snprintf(proc_path, sizeof(proc_path), "/proc/%d/cwd",
+           best ? (int)best->shell_pid : 0);
+  ssize_t cwd_len = best ? readlink(proc_path, cwd, sizeof(cwd) - 1) : -1;
+  if (cwd_len > 0) {
+    cwd[cwd_len] = '\0';
+    // A long directory keeps its deepest part, where the command ran
+    size_t keep = sizeof(entry->cwd) - 4;
+    if ((size_t)cwd_len > keep) {
+      memcpy(entry->cwd, "...", 3);
+      memcpy(entry->cwd + 3, cwd + cwd_len - keep, keep + 1);
+    } else {
+      memcpy(entry->cwd, cwd, cwd_len + 1);
+    }
+  }
+  target->history_index = (target->history_index + 1) % CONTEXT_HISTORY_SIZE;
+  if (target->history_count < CONTEXT_HISTORY_SIZE) {
+    target->history_count++;
+  }
+}
+
+// Run a chunk of a history file through its parser; a line still being
+// written waits in partial. Entries completed are recorded when `record` is
+// set. Returns the offset just past the last entry hashing to `find`, or -1.
+long shell_history_feed(int index, const char *buffer, size_t len, int record,
+                        unsigned long find) {
+  shell_history_t *history = g_state.shell_histories[index];
+  long found = -1;
+  for (const char *cursor = buffer; cursor < buffer + len;) {
+    const char *eol = memchr(cursor, '\n', buffer + len - cursor);
+    size_t line_len = (eol ? eol : buffer + len) - cursor;
+    size_t room = sizeof(history->partial) - 1 - history->partial_len;
+    size_t kept = line_len < room ? line_len : room;
+    memcpy(history->partial + history->partial_len, cursor, kept);
+    history->partial_len += kept;
+    cursor += line_len + (eol != NULL);
+    if (!eol) {
+      break;
+    }
+    if (history->partial_len > 0 &&
+        history->partial[history->partial_len - 1] == '\r') {
+      history->partial_len--;
+    }
+    history->partial[history->partial_len] = '\0';
+    history->partial_len = 0;
+    if (!shell_history_line(history, history->partial)) {
+      continue;
+    }
+    history->entry_len = utf8_repair(history->entry, history->entry_len);
+    history->entry[history->entry_len] = '\0';
+    history->last_hash = hash_bytes(history->entry, history->entry_len) ^
+                         (unsigned long)history->entry_time *
+                             0x9E3779B97F4A7C15UL;
+    history->entries++;
+    if (find && history->last_hash == find) {
+      found = cursor - buffer;
+    }
+    if (record && history->entry_len > 0) {
+      shell_history_record(index);
+    }
+  }
+  return found;
+}
+
+// Open a watched history file as it is now. The path is the user's to
+// replace at any time, so a link or anything but a regular file of the
+// shell's own user is refused on every open, not just when it was chosen.
+int shell_history_open(const shell_history_t *history, struct stat *st) {
+  int fd =
+      open(history->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode) ||
+      st->st_uid != history->uid) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Find our place again in a file rewritten or replaced since the last read
+// (zsh and fish rewrite theirs, bash trims its to HISTFILESIZE): its tail is
+// searched for the newest entry already read, and only what follows that is
+// recorded. Without it there is no telling what is new, so nothing is,
+// unless nothing had been read of the file before.
+void shell_history_resync(int index, int record) {
+  static char buffer[SHELL_HISTORY_RESYNC];
+  shell_history_t *history = g_state.shell_histories[index];
+  struct stat st;
+  int fd = shell_history_open(history, &st);
+  if (fd < 0) {
+    return;
+  }
+  off_t start = st.st_size > SHELL_HISTORY_RESYNC
+                    ? st.st_size - SHELL_HISTORY_RESYNC
+                    : 0;
+  ssize_t got = pread(fd, buffer, sizeof(buffer), start);
+  close(fd);
+  if (got < 0) {
+    return;
+  }
+  size_t skip = 0;
+  if (start > 0) { // Begin at a whole line
+    const char *eol = memchr(buffer, '\n', got);
+    skip = eol ? (size_t)(eol - buffer + 1) : (size_t)got;
+  }
+
+  unsigned long find = history->last_hash;
+  int was_empty = history->offset == 0;
+  shell_history_reset(history);
+  long found = shell_history_feed(index, buffer + skip, got - skip, 0, find);
+  found = found < 0 && find == 0 && was_empty ? 0 : found;
+  if (record && found >= 0) {
+    shell_history_reset(history);
+    shell_history_feed(index, buffer + skip + found, got - skip - found, 1, 0);
+  }
+  history->inode = st.st_ino;
+  history->offset = start + got;
+}
+
+// The watcher for a history file, shared by every shell using it. It starts
+// at the file's end: what is there already cannot be told apart by pane.
+int shell_history_watch(shell_kind_t kind, uid_t uid, const char *path) {
+  for (int i = 0; i < g_state.shell_history_count; i++) {
+    if (strcmp(g_state.shell_histories[i]->path, path) == 0) {
+      return i;
+    }
+  }
+  if (g_state.shell_history_count >= MAX_SHELL_HISTORIES || !inotify_ready()) {
+    return -1;
+  }
+  shell_history_t *history = calloc(1, sizeof(*history));
+  if (!history) {
+    return -1;
+  }
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char *slash = strrchr(dir, '/');
+  *slash = '\0';
+  history->wd = inotify_add_watch(g_state.inotify_fd, dir[0] ? dir : "/",
+                                  IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO |
+                                      IN_CREATE);
+  if (history->wd < 0) {
+    free(history);
+    return -1;
+  }
+  history->kind = kind;
+  history->uid = uid;
+  snprintf(history->path, sizeof(history->path), "%s", path);
+  snprintf(history->name, sizeof(history->name), "%s", slash + 1);
+  int index = g_state.shell_history_count++;
+  g_state.shell_histories[index] = history;
+  shell_history_resync(index, 0);
+  printf("Watching shell history %s\n", path);
+  return index;
+}
+
+// Watch the history file of a pane's shell: looked up again when the pane's
+// shell changes, and retried now and then while there is none yet (bash
+// only creates its file when a shell first exits).
+void shell_history_update(pane_state_t *pane, pid_t shell_pid) {
+  if (g_state.replaying || shell_pid <= 0) {
+    return;
+  }
+  time_t now = daemon_time();
+  if (shell_pid == pane->shell_pid &&
+      (pane->shell_history >= 0 ||
+       now - pane->shell_checked < SHELL_HISTORY_RECHECK)) {
+    return;
+  }
+  pane->shell_pid = shell_pid;
+  pane->shell_checked = now;
+  shell_kind_t kind;
+  uid_t uid;
+  char path[PATH_MAX];
+  pane->shell_history =
+      shell_history_path(shell_pid, &kind, &uid, path, sizeof(path)) == 0
+          ? shell_history_watch(kind, uid, path)
+          : -1;
+}
+
+void sweep_panes(session_context_t *session) {
+  int kept = 0;
+  for (int i = 0; i < session->pane_count; i++) {
+    if (session->panes[i].seen) {
+      if (kept != i) {
+        session->panes[kept] = session->panes[i];
+      }
+      kept++;
+    } else {
+      free(session->panes[i].content);
+      free(session->panes[i].log_miner);
+      history_free(&session->panes[i].history);
+      free(session->panes[i].summaries);
+      screen_history_free(session->panes[i].screens);
+      if (session->panes[i].tail) {
+        tail_stop(&session->panes[i]);
+      }
+      for (int s = 0; s < session->panes[i].snapshot_count; s++) {
+        free(session->panes[i].snapshots[s].content);
+      }
+    }
+  }
+  session->pane_count = kept;
+}
+
+// Bytes a session holds, counting its heap allocations
+size_t session_memory_bytes(const session_context_t *session) {
+  size_t bytes = sizeof(*session);
+  const retrieval_index_t *index = &session->retrieval;
+  if (index->terms) {
+    bytes += index->term_capacity * sizeof(retrieval_term_t);
+    for (int t = 0; t < index->term_capacity; t++) {
+      bytes += index->terms[t].posting_capacity * sizeof(retrieval_posting_t);
+    }
+  }
+  if (index->windows) {
+    bytes += MAX_RETRIEVAL_WINDOWS * sizeof(retrieval_window_t);
+    for (int w = 0; w < index->window_count; w++) {
+      bytes += index->windows[(index->next_window - 1 - w) %
+                              MAX_RETRIEVAL_WINDOWS]
+                   .term_count *
+               sizeof(int);
+    }
+  }
+  for (int i = 0; i < session->pane_count; i++) {
+    const pane_state_t *pane = &session->panes[i];
+    bytes += pane->content ? pane->content_len + 1 : 0;
+    bytes += pane->log_miner ? sizeof(*pane->log_miner) : 0;
+    bytes += pane->summaries ? sizeof(*pane->summaries) : 0;
+    bytes += screen_history_bytes(pane->screens);
+    bytes += pane->tail ? sizeof(*pane->tail) : 0;
+    if (pane->history.lines) {
+      bytes += PANE_HISTORY_LINES * sizeof(history_line_t) +
+               HISTORY_BLOCKS * sizeof(history_block_t);
+      for (int l = 0; l < pane->history.count; l++) {
+        // Read directly: history_at would expand cold blocks
+        const char *text = pane->history.lines[(pane->history.start + l) %
+                                               PANE_HISTORY_LINES]
+                               .text;
+        bytes += text ? strlen(text) + 1 : 0;
+      }
+      for (int b = 0; b < HISTORY_BLOCKS; b++) {
+        bytes += pane->history.blocks[b].frozen_len;
+      }
+    }
+    for (int s = 0; s < pane->snapshot_count; s++) {
+      const pane_snapshot_t *snapshot =
+          &pane->snapshots[(pane->snapshot_start + s) % PANE_SNAPSHOTS];
+      bytes += snapshot->content ? strlen(snapshot->content) + 1 : 0;
+    }
+  }
+  return bytes;
+}
+
+int pane_is_client_active(const session_context_t *session,
+                          const char *pane_id) {
+  char match[96];
+  int match_len =
+      snprintf(match, sizeof(match), "%s\t%s", session->tmux_name, pane_id);
+
+  // Each line of client_panes is "session\tpane_id"
+  const char *line = g_state.servers[session->server].client_panes;
+  while (line && *line) {
+    const char *eol = strchr(line, '\n');
+    size_t line_len = eol ? (size_t)(eol - line) : strlen(line);
+    if (line_len == (size_t)match_len && strncmp(line, match, line_len) == 0) {
+      return 1;
+    }
+    line = eol ? eol + 1 : NULL;
+  }
+  return 0;
+}
+
+// Whether a pane's foreground process is an interactive shell, i.e. the
+// command it was running has returned to the prompt.
+int is_shell_command(const char *command) {
+  static const char *shells[] = {"bash", "zsh", "fish", "sh",  "dash",
+                                 "ksh",  "tcsh", "csh", "nu", NULL};
+  const char *name = command[0] == '-' ? command + 1 : command;
+  for (int i = 0; shells[i]; i++) {
+    if (strcmp(name, shells[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Queue an event for followers; the ring only keeps the latest ones, which
+// is all a follower that keeps up ever needs.
+void push_follow_event(session_context_t *session, const pane_state_t *pane,
+                       char kind, int alarm, const char *fmt, ...) {
+  follow_event_t *event = &session->events[session->next_event % FOLLOW_EVENTS];
+  event->seq = session->line_seq;
+  event->kind = kind;
+  event->alarm = alarm;
+  snprintf(event->pane_id, sizeof(event->pane_id), "%s", pane->pane_id);
+  snprintf(event->pane_index, sizeof(event->pane_index), "%s",
+           pane->pane_index);
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(event->text, sizeof(event->text), fmt, args);
+  va_end(args);
+  session->next_event++;
+}
+
+muxgeist_error_t refresh_pane_topology(session_context_t *session) {
+  char target[80];
+  char pane_list[MAX_BUFFER_SIZE];
+  unsigned long truncated = g_state.tmux_truncated;
+
+  // Tab separated so titles containing ':' survive; title/command go last
+  session_target(session, target, sizeof(target));
+  if (tmux_command(&g_state.servers[session->server], pane_list,
+                   sizeof(pane_list), "list-panes", "-s", "-t", target, "-F",
+                   "#{pane_id}\t#{window_index}.#{pane_index}\t"
+                   "#{window_active}\t#{pane_active}\t#{session_attached}\t"
+                   "#{window_activity}\t#{alternate_on}\t#{pane_title}\t"
+                   "#{pane_current_command}\t#{pane_pid}",
+                   NULL) != ERROR_NONE) {
+    return ERROR_TMUX_CMD;
+  }
+
+  for (int i = 0; i < session->pane_count; i++) {
+    session->panes[i].seen = 0;
+  }
+
+  time_t now = daemon_time();
+  char *saveptr = NULL;
+  for (char *line = strtok_r(pane_list, "\n", &saveptr); line != NULL;
+       line = strtok_r(NULL, "\n", &saveptr)) {
+    char *fields[10] = {0}; // pane_pid may be missing from older traces
+    char *cursor = line;
+    for (int f = 0; f < 10 && cursor; f++) {
+      fields[f] = strsep(&cursor, "\t");
+    }
+    if (!fields[0] || fields[0][0] != '%' || !fields[8]) {
+      continue;
+    }
+
+    pane_state_t *pane = find_pane(session, fields[0]);
+    if (!pane) {
+      pane = create_pane(session, fields[0]);
+      if (!pane) {
+        continue;
+      }
+      pane->diag_parser.current = -1;
+      pane->shell_history = -1;
+    }
+
+    pane->seen = 1;
+    strncpy(pane->pane_index, fields[1], sizeof(pane->pane_index) - 1);
+    strncpy(pane->title, fields[7][0] ? fields[7] : "shell",
+            sizeof(pane->title) - 1);
+    if (pane->command[0] && !is_shell_command(pane->command) &&
+        is_shell_command(fields[8])) {
+      memcpy(pane->finished_command, pane->command,
+             sizeof(pane->finished_command));
+    }
+    strncpy(pane->command, fields[8], sizeof(pane->command) - 1);
+    pane->window_activity = strtol(fields[5], NULL, 10);
+    pane->alternate_screen = strcmp(fields[6], "1") == 0;
+    tail_update(pane, fields[9] ? (pid_t)atoi(fields[9]) : 0);
+    shell_history_update(pane, fields[9] ? (pid_t)atoi(fields[9]) : 0);
+
+    int window_active = strcmp(fields[2], "1") == 0;
+    int pane_active = strcmp(fields[3], "1") == 0;
+    int attached = strcmp(fields[4], "0") != 0;
+
+    if (pane_is_client_active(session, pane->pane_id) ||
+        (!attached && window_active && pane_active)) {
+      pane->priority = PRIORITY_ACTIVE;
+    } else if (window_active) {
+      pane->priority = PRIORITY_VISIBLE;
+    } else if (now - pane->last_change < RECENT_ACTIVITY_WINDOW ||
+               now - pane->window_activity < RECENT_ACTIVITY_WINDOW) {
+      pane->priority = PRIORITY_RECENT;
+    } else {
+      pane->priority = PRIORITY_BACKGROUND;
+    }
+  }
+
+  // Panes missing from a list cut short may still be there
+  if (g_state.tmux_truncated == truncated) {
+    sweep_panes(session);
+  }
+  return ERROR_NONE;
+}
+
+int compare_pane_priority(const void *a, const void *b) {
+  const pane_state_t *pa = *(pane_state_t *const *)a;
+  const pane_state_t *pb = *(pane_state_t *const *)b;
+  if (pa->priority != pb->priority) {
+    return (int)pa->priority - (int)pb->priority;
+  }
+  // Within a tier, most recently changed first
+  if (pa->last_change != pb->last_change) {
+    return pa->last_change > pb->last_change ? -1 : 1;
+  }
+  return strcmp(pa->pane_index, pb->pane_index);
+}
+
+void copy_field(char *dst, size_t dst_size, const char *src, size_t len) {
+  if (len >= dst_size) {
+    len = dst_size - 1;
+  }
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
+
+void append_field_line(char *dst, size_t dst_size, const char *line) {
+  size_t used = strlen(dst);
+  if (used + 2 >= dst_size) {
+    return;
+  }
+  snprintf(dst + used, dst_size - used, "%s%s", used ? "\n" : "", line);
+}
+
+// Parse "file:line[:col]" at the start of text. Returns a pointer just past
+// the location (and the separator after it), or NULL if it isn't one.
+const char *parse_location(const char *text, char *file, size_t file_size,
+                           int *line, int *column) {
+  const char *p = text;
+  while (*p == ' ') {
+    p++;
+  }
+  const char *file_start = p;
+
+  // The file name ends at the first ":<digits>" followed by ':' or ' '
+  for (const char *c = file_start; *c && *c != ' '; c++) {
+    if (*c != ':' || c == file_start || !isdigit((unsigned char)c[1])) {
+      continue;
+    }
+    char *end = NULL;
+    long line_no = strtol(c + 1, &end, 10);
+    int col_no = 0;
+    if (*end == ':' && isdigit((unsigned char)end[1])) {
+      col_no = (int)strtol(end + 1, &end, 10);
+    }
+    if (*end != ':' && *end != ' ' && *end != '\0') {
+      continue;
+    }
+    copy_field(file, file_size, file_start, c - file_start);
+    *line = (int)line_no;
+    *column = col_no;
+    while (*end == ':' || *end == ' ') {
+      end++;
+    }
+    return end;
+  }
+  return NULL;
+}
+
+int diagnostic_matches(const diagnostic_t *a, const diagnostic_t *b) {
+  return a->line == b->line && strcmp(a->file, b->file) == 0 &&
+         strcmp(a->message, b->message) == 0;
+}
+
+// Insert or bump a diagnostic, deduplicated by (file, line, message).
+// Returns the index of the record, and whether it was new via *is_new.
+int record_diagnostic(session_context_t *session, const diagnostic_t *diag,
+                      int *is_new) {
+  time_t now = daemon_time();
+  *is_new = 0;
+
+  session->diagnostics_recorded++;
+  for (int i = 0; i < session->diagnostic_count; i++) {
+    if (diagnostic_matches(&session->diagnostics[i], diag)) {
+      session->diagnostics[i].count++;
+      session->diagnostics[i].last_seen = now;
+      session->last_diagnostic = i;
+      return i;
+    }
+  }
+
+  int slot = session->diagnostic_count;
+  if (slot >= MAX_DIAGNOSTICS) {
+    // Full: replace the record that was seen longest ago
+    slot = 0;
+    for (int i = 1; i < session->diagnostic_count; i++) {
+      if (session->diagnostics[i].last_seen <
+          session->diagnostics[slot].last_seen) {
+        slot = i;
+      }
+    }
+    // Parsers pointing at the evicted record must not append to its successor
+    for (int i = 0; i < session->pane_count; i++) {
+      if (session->panes[i].diag_parser.current == slot) {
+        session->panes[i].diag_parser.current = -1;
+      }
+    }
+  } else {
+    session->diagnostic_count++;
+  }
+
+  session->last_diagnostic = slot;
+  session->diagnostics[slot] = *diag;
+  session->diagnostics[slot].count = 1;
+  session->diagnostics[slot].first_seen = now;
+  session->diagnostics[slot].last_seen = now;
+  *is_new = 1;
+  return slot;
+}
+
+void commit_pending_diagnostic(session_context_t *session,
+                               diagnostic_parser_t *parser) {
+  int is_new = 0;
+  int index = record_diagnostic(session, &parser->pending, &is_new);
+  // Only a fresh record collects snippet/notes; repeats already have them
+  parser->current = is_new ? index : -1;
+  memset(&parser->pending, 0, sizeof(parser->pending));
+}
+
+// Recognise "<severity>: message" after a gcc/clang/go location.
+int parse_cc_severity(const char *rest, diagnostic_t *diag) {
+  static const struct {
+    const char *prefix;
+    diagnostic_severity_t severity;
+  } severities[] = {
+      {"fatal error: ", DIAG_ERROR},
+      {"error: ", DIAG_ERROR},
+      {"warning: ", DIAG_WARNING},
+  };
+
+  for (size_t i = 0; i < sizeof(severities) / sizeof(severities[0]); i++) {
+    size_t len = strlen(severities[i].prefix);
+    if (strncmp(rest, severities[i].prefix, len) == 0) {
+      diag->severity = severities[i].severity;
+      strncpy(diag->message, rest + len, sizeof(diag->message) - 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Try every single-line header format. Returns 1 and fills diag on a match.
+int parse_diagnostic_header(const char *line, diagnostic_t *diag) {
+  memset(diag, 0, sizeof(*diag));
+
+  // tsc (classic): src/app.ts(10,5): error TS2304: Cannot find name 'x'.
+  const char *paren = strstr(line, ".ts(");
+  if (!paren) {
+    paren = strstr(line, ".tsx(");
+  }
+  if (paren) {
+    const char *open = strchr(paren, '(');
+    int line_no = 0, col_no = 0, consumed = 0;
+    if (sscanf(open, "(%d,%d): %n", &line_no, &col_no, &consumed) == 2 &&
+        consumed > 0) {
+      const char *rest = open + consumed;
+      int is_error = strncmp(rest, "error ", 6) == 0;
+      if (is_error || strncmp(rest, "warning ", 8) == 0) {
+        copy_field(diag->file, sizeof(diag->file), line, open - line);
+        diag->line = line_no;
+        diag->column = col_no;
+        diag->severity = is_error ? DIAG_ERROR : DIAG_WARNING;
+        strncpy(diag->tool, "tsc", sizeof(diag->tool) - 1);
+        strncpy(diag->message, strchr(rest, ' ') + 1,
+                sizeof(diag->message) - 1);
+        return 1;
+      }
+    }
+  }
+
+  const char *rest = parse_location(line, diag->file, sizeof(diag->file),
+                                    &diag->line, &diag->column);
+  if (!rest) {
+    return 0;
+  }
+
+  // tsc (pretty): src/app.ts:10:5 - error TS2304: Cannot find name 'x'.
+  if (strncmp(rest, "- error ", 8) == 0 || strncmp(rest, "- warning ", 10) == 0) {
+    diag->severity = rest[2] == 'e' ? DIAG_ERROR : DIAG_WARNING;
+    strncpy(diag->tool, "tsc", sizeof(diag->tool) - 1);
+    strncpy(diag->message, strchr(rest + 2, ' ') + 1,
+            sizeof(diag->message) - 1);
+    return 1;
+  }
+
+  // gcc/clang: file.c:10:5: error: 'x' undeclared
+  if (parse_cc_severity(rest, diag)) {
+    strncpy(diag->tool, "cc", sizeof(diag->tool) - 1);
+    return 1;
+  }
+
+  // go build/vet: ./main.go:10:5: undefined: foo
+  size_t file_len = strlen(diag->file);
+  if (file_len > 3 && strcmp(diag->file + file_len - 3, ".go") == 0 &&
+      *rest) {
+    diag->severity = DIAG_ERROR;
+    strncpy(diag->tool, "go", sizeof(diag->tool) - 1);
+    strncpy(diag->message, rest, sizeof(diag->message) - 1);
+    return 1;
+  }
+
+  return 0;
+}
+
+void attach_diagnostic_text(session_context_t *session,
+                            diagnostic_parser_t *parser, int is_note,
+                            const char *text) {
+  if (parser->current < 0) {
+    return;
+  }
+  diagnostic_t *diag = &session->diagnostics[parser->current];
+  if (is_note) {
+    append_field_line(diag->notes, sizeof(diag->notes), text);
+  } else {
+    append_field_line(diag->snippet, sizeof(diag->snippet), text);
+  }
+}
+
+// The line Python prints between the tracebacks of chained exceptions
+int is_chained_exception_separator(const char *line) {
+  return strcmp(line, "During handling of the above exception, another "
+                      "exception occurred:") == 0 ||
+         strcmp(line, "The above exception was the direct cause of the "
+                      "following exception:") == 0;
+}
+
+// Feed one complete line of pane output through the diagnostic recogniser.
+void diagnostics_feed_line(session_context_t *session, pane_state_t *pane,
+                           const char *line) {
+  diagnostic_parser_t *parser = &pane->diag_parser;
+  diagnostic_t header;
+
+  if (parser->mode == DIAG_PARSE_TRACEBACK) {
+    if (strncmp(line, "  File \"", 8) == 0) {
+      const char *end = strchr(line + 8, '"');
+      if (end) {
+        copy_field(parser->pending.file, sizeof(parser->pending.file),
+                   line + 8, end - (line + 8));
+        sscanf(end, "\", line %d", &parser->pending.line);
+        parser->pending.snippet[0] = '\0';
+      }
+      return;
+    }
+    if (strncmp(line, "    ", 4) == 0) {
+      // Source line of the innermost frame seen so far; Python 3.11+ marks
+      // the failing expression on the next line with ~ and ^, kept out
+      const char *code = line;
+      while (*code == ' ') {
+        code++;
+      }
+      if (code[strspn(code, "~^ ")] != '\0') {
+        strncpy(parser->pending.snippet, code,
+                sizeof(parser->pending.snippet) - 1);
+      }
+      return;
+    }
+    if (strncmp(line, "Traceback ", 10) == 0 ||
+        is_chained_exception_separator(line)) {
+      // The traceback of a chained exception starts over
+      memset(&parser->pending, 0, sizeof(parser->pending));
+      parser->pending.severity = DIAG_ERROR;
+      strncpy(parser->pending.tool, "python",
+              sizeof(parser->pending.tool) - 1);
+      return;
+    }
+    if (line[0] != ' ' && line[0] != '\0') {
+      // "ValueError: message" closes the traceback
+      strncpy(parser->pending.message, line,
+              sizeof(parser->pending.message) - 1);
+      if (parser->pending.file[0]) {
+        char snippet[sizeof(parser->pending.snippet)];
+        memcpy(snippet, parser->pending.snippet, sizeof(snippet));
+        commit_pending_diagnostic(session, parser);
+        if (parser->current >= 0) {
+          strncpy(session->diagnostics[parser->current].snippet, snippet,
+                  sizeof(snippet) - 1);
+        }
+      }
+      parser->mode = DIAG_PARSE_NONE;
+      parser->current = -1;
+      return;
+    }
+    return;
+  }
+
+  if (parser->mode == DIAG_PARSE_RUST_HEADER) {
+    const char *arrow = strstr(line, "--> ");
+    if (arrow) {
+      parse_location(arrow + 4, parser->pending.file,
+                     sizeof(parser->pending.file), &parser->pending.line,
+                     &parser->pending.column);
+      commit_pending_diagnostic(session, parser);
+      parser->mode = DIAG_PARSE_RUST_BODY;
+      return;
+    }
+    // "error: aborting due to ..." and friends have no location
+    memset(&parser->pending, 0, sizeof(parser->pending));
+    parser->mode = DIAG_PARSE_NONE;
+  }
+
+  if (parser->mode == DIAG_PARSE_RUST_BODY) {
+    const char *p = line;
+    while (*p == ' ' || isdigit((unsigned char)*p)) {
+      p++;
+    }
+    if (*p == '|' && p != line) {
+      if (p[1] != '\0') {
+        attach_diagnostic_text(session, parser, 0, line);
+      }
+      return;
+    }
+    if (*p == '=' && p != line) {
+      attach_diagnostic_text(session, parser, 1, p + 2);
+      return;
+    }
+    if (strstr(line, "::: ") || strstr(line, "...")) {
+      return;
+    }
+    parser->mode = DIAG_PARSE_NONE;
+    parser->current = -1;
+  }
+
+  if (strncmp(line, "Traceback (most recent call last):", 34) == 0) {
+    memset(&parser->pending, 0, sizeof(parser->pending));
+    parser->pending.severity = DIAG_ERROR;
+    strncpy(parser->pending.tool, "python", sizeof(parser->pending.tool) - 1);
+    parser->mode = DIAG_PARSE_TRACEBACK;
+    parser->current = -1;
+    return;
+  }
+
+  // rustc: error[E0425]: cannot find value `x` in this scope
+  int rust_error = strncmp(line, "error", 5) == 0;
+  int rust_warning = strncmp(line, "warning", 7) == 0;
+  if (rust_error || rust_warning) {
+    const char *p = line + (rust_error ? 5 : 7);
+    if (*p == '[') {
+      p = strchr(p, ']');
+      p = p ? p + 1 : line;
+    }
+    if (p[0] == ':' && p[1] == ' ') {
+      memset(&parser->pending, 0, sizeof(parser->pending));
+      parser->pending.severity = rust_error ? DIAG_ERROR : DIAG_WARNING;
+      strncpy(parser->pending.tool, "rustc", sizeof(parser->pending.tool) - 1);
+      strncpy(parser->pending.message, p + 2,
+              sizeof(parser->pending.message) - 1);
+      parser->mode = DIAG_PARSE_RUST_HEADER;
+      parser->current = -1;
+      return;
+    }
+  }
+
+  if (parse_diagnostic_header(line, &header)) {
+    parser->pending = header;
+    commit_pending_diagnostic(session, parser);
+    parser->mode = DIAG_PARSE_CC_BODY;
+    return;
+  }
+
+  if (parser->mode == DIAG_PARSE_CC_BODY) {
+    diagnostic_t note;
+    const char *rest = parse_location(line, note.file, sizeof(note.file),
+                                      &note.line, &note.column);
+    if (rest && strncmp(rest, "note: ", 6) == 0) {
+      attach_diagnostic_text(session, parser, 1, rest + 6);
+      return;
+    }
+    // gcc/clang echo the source line and a caret marker underneath
+    if (line[0] == ' ' && line[1] != '\0') {
+      attach_diagnostic_text(session, parser, 0, line);
+      return;
+    }
+    if (strstr(line, ": In function") || strstr(line, "In file included")) {
+      return;
+    }
+    parser->mode = DIAG_PARSE_NONE;
+    parser->current = -1;
+  }
+}
+
+int compare_diagnostics(const void *a, const void *b) {
+  const diagnostic_t *da = a;
+  const diagnostic_t *db = b;
+  if (da->severity != db->severity) {
+    return (int)da->severity - (int)db->severity;
+  }
+  if (da->last_seen != db->last_seen) {
+    return da->last_seen > db->last_seen ? -1 : 1;
+  }
+  int cmp = strcmp(da->file, db->file);
+  return cmp ? cmp : da->line - db->line;
+}
+
+void prune_diagnostics(session_context_t *session) {
+  time_t now = daemon_time();
+  int kept = 0;
+  for (int i = 0; i < session->diagnostic_count; i++) {
+    if (now - session->diagnostics[i].last_seen <= DIAGNOSTIC_TTL) {
+      session->diagnostics[kept++] = session->diagnostics[i];
+    }
+  }
+  if (kept != session->diagnostic_count) {
+    for (int i = 0; i < session->pane_count; i++) {
+      session->panes[i].diag_parser.current = -1;
+    }
+  }
+  session->diagnostic_count = kept;
+}
+
+// One header line per distinct problem, followed by its snippet ("    | ")
+// and notes ("    = "), errors first and most recent first.
+void format_diagnostics(session_context_t *session, char *response,
+                        size_t response_size) {
+  static const char *severity_names[] = {"error", "warning"};
+  diagnostic_t sorted[MAX_DIAGNOSTICS];
+  size_t used = 0;
+
+  prune_diagnostics(session);
+  memcpy(sorted, session->diagnostics,
+         session->diagnostic_count * sizeof(diagnostic_t));
+  qsort(sorted, session->diagnostic_count, sizeof(diagnostic_t),
+        compare_diagnostics);
+
+  int errors = 0;
+  for (int i = 0; i < session->diagnostic_count; i++) {
+    errors += sorted[i].severity == DIAG_ERROR;
+  }
+  used += snprintf(response, response_size, "Diagnostics: %d (%d errors)\n",
+                   session->diagnostic_count, errors);
+
+  for (int i = 0; i < session->diagnostic_count && used < response_size; i++) {
+    diagnostic_t *diag = &sorted[i];
+    char entry[1536];
+    int len = snprintf(entry, sizeof(entry), "%s %s:%d:%d [%s] x%d: %s\n",
+                       severity_names[diag->severity], diag->file, diag->line,
+                       diag->column, diag->tool, diag->count, diag->message);
+
+    const char *fields[2] = {diag->snippet, diag->notes};
+    const char *prefixes[2] = {"    | ", "    = "};
+    for (int f = 0; f < 2; f++) {
+      const char *text = fields[f];
+      while (*text && len < (int)sizeof(entry)) {
+        const char *eol = strchr(text, '\n');
+        int text_len = eol ? (int)(eol - text) : (int)strlen(text);
+        len += snprintf(entry + len, sizeof(entry) - len, "%s%.*s\n",
+                        prefixes[f], text_len, text);
+        text = eol ? eol + 1 : text + text_len;
+      }
+    }
+
+    if (len >= (int)sizeof(entry)) {
+      len = sizeof(entry) - 1;
+    }
+    if (used + len >= response_size) {
+      break; // Keep whole records only
+    }
+    memcpy(response + used, entry, len);
+    used += len;
+    response[used] = '\0';
+  }
+}
+
+void test_run_reset(test_run_t *run, test_runner_t runner) {
+  memset(run, 0, sizeof(*run));
+  run->runner = runner;
+  run->state = TEST_RUN_RUNNING;
+  run->started = daemon_time();
+}
+
+void test_run_add_failure(test_run_t *run, const char *name, size_t len) {
+  while (len > 0 && name[len - 1] == ' ') {
+    len--;
+  }
+  for (int i = 0; i < run->failure_count; i++) {
+    if (strlen(run->failures[i]) == len &&
+        strncmp(run->failures[i], name, len) == 0) {
+      return;
+    }
+  }
+  if (run->failure_count < MAX_TEST_FAILURES) {
+    copy_field(run->failures[run->failure_count],
+               sizeof(run->failures[0]), name, len);
+    run->failure_count++;
+  } else {
+    run->failures_dropped++;
+  }
+}
+
+void test_run_add_excerpt(test_run_t *run, const char *line) {
+  if (run->excerpt_lines < MAX_TEST_EXCERPT_LINES) {
+    append_field_line(run->excerpt, sizeof(run->excerpt), line);
+    run->excerpt_lines++;
+  }
+}
+
+void test_run_finish(test_run_t *run) {
+  run->state = TEST_RUN_FINISHED;
+  run->finished = daemon_time();
+  if (run->duration <= 0) {
+    run->duration = difftime(run->finished, run->started);
+  }
+}
+
+// Count "<n> <word>" pairs in pytest's "1 failed, 2 passed in 0.12s" line
+void parse_pytest_summary(test_run_t *run, const char *text) {
+  const char *p = text;
+  while (*p) {
+    while (*p && !isdigit((unsigned char)*p)) {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+    char *end = NULL;
+    double value = strtod(p, &end);
+    int is_duration = p >= text + 3 && strncmp(p - 3, "in ", 3) == 0;
+    while (*end == ' ') {
+      end++;
+    }
+    if (is_duration) {
+      run->duration = value;
+    } else if (strncmp(end, "passed", 6) == 0) {
+      run->passed = (int)value;
+    } else if (strncmp(end, "failed", 6) == 0) {
+      run->failed = (int)value;
+    } else if (strncmp(end, "skipped", 7) == 0 ||
+               strncmp(end, "xfailed", 7) == 0 ||
+               strncmp(end, "deselected", 10) == 0) {
+      run->skipped += (int)value;
+    } else if (strncmp(end, "error", 5) == 0) {
+      run->errors = (int)value;
+    }
+    p = end > p ? end : p + 1;
+  }
+}
+
+void pytest_feed_line(test_run_t *run, const char *line) {
+  if (strncmp(line, "FAILED ", 7) == 0 || strncmp(line, "ERROR ", 6) == 0) {
+    const char *name = strchr(line, ' ') + 1;
+    const char *dash = strstr(name, " - ");
+    test_run_add_failure(run, name, dash ? (size_t)(dash - name) : strlen(name));
+    return;
+  }
+
+  if (line[0] == '_' && strstr(line, "__ ")) {
+    // "____ test_name ____" opens a failure section; keep the first one
+    run->in_failure_section = run->excerpt_lines == 0;
+    if (run->in_failure_section) {
+      test_run_add_excerpt(run, line);
+    }
+    return;
+  }
+
+  if (line[0] == '=' && strstr(line, " in ") &&
+      (strstr(line, "passed") || strstr(line, "failed") ||
+       strstr(line, "error") || strstr(line, "skipped"))) {
+    parse_pytest_summary(run, line);
+    test_run_finish(run);
+    return;
+  }
+
+  if (line[0] == '=') {
+    run->in_failure_section = 0;
+    return;
+  }
+
+  // Prefer the assertion lines ("E   ...") and their location
+  if (run->in_failure_section &&
+      (strncmp(line, "E ", 2) == 0 || strstr(line, ".py:"))) {
+    test_run_add_excerpt(run, line);
+  }
+}
+
+void ctest_feed_line(test_run_t *run, const char *line) {
+  int passed_pct = 0, failed = 0, total = 0;
+  double seconds = 0;
+
+  // "  2/3 Test #2: name .........***Failed    0.01 sec"
+  const char *test = strstr(line, " Test #");
+  if (test && (strstr(line, "Passed") || strstr(line, "Failed") ||
+               strstr(line, "Not Run") || strstr(line, "Exception") ||
+               strstr(line, "Timeout"))) {
+    const char *name = strchr(test, ':');
+    if (strstr(line, "Passed")) {
+      run->passed++;
+    } else if (strstr(line, "Not Run")) {
+      run->skipped++;
+    } else if (name) {
+      name++;
+      while (*name == ' ') {
+        name++;
+      }
+      const char *dots = strstr(name, " .");
+      run->failed++;
+      test_run_add_failure(run, name,
+                           dots ? (size_t)(dots - name) : strlen(name));
+    }
+    return;
+  }
+
+  if (sscanf(line, "%d%% tests passed, %d tests failed out of %d", &passed_pct,
+             &failed, &total) == 3) {
+    run->failed = failed;
+    run->passed = total - failed - run->skipped;
+    return;
+  }
+
+  if (sscanf(line, "Total Test time (real) = %lf sec", &seconds) == 1) {
+    run->duration = seconds;
+    test_run_finish(run);
+    return;
+  }
+
+  // Output of failing tests run with --output-on-failure
+  if (run->state == TEST_RUN_RUNNING && run->failed > 0 &&
+      run->excerpt_lines < MAX_TEST_EXCERPT_LINES && line[0] != '\0' &&
+      !strstr(line, "Start ") && !strstr(line, "tests passed")) {
+    test_run_add_excerpt(run, line);
+  }
+}
+
+int is_gotest_package_line(const char *line) {
+  char status[8], package[256];
+  if (sscanf(line, "%7s %255s", status, package) != 2) {
+    return 0;
+  }
+  return (strcmp(status, "ok") == 0 || strcmp(status, "FAIL") == 0) &&
+         (line[strlen(status)] == ' ' || line[strlen(status)] == '\t') &&
+         strchr(package, '/') != NULL;
+}
+
+void gotest_feed_line(test_run_t *run, const char *line) {
+  if (strncmp(line, "--- PASS: ", 10) == 0) {
+    run->passed++;
+    run->in_failure_section = 0;
+  } else if (strncmp(line, "--- SKIP: ", 10) == 0) {
+    run->skipped++;
+    run->in_failure_section = 0;
+  } else if (strncmp(line, "--- FAIL: ", 10) == 0) {
+    const char *name = line + 10;
+    const char *paren = strstr(name, " (");
+    run->failed++;
+    test_run_add_failure(run, name,
+                         paren ? (size_t)(paren - name) : strlen(name));
+    run->in_failure_section = run->excerpt_lines == 0;
+    if (run->in_failure_section) {
+      test_run_add_excerpt(run, line);
+    }
+  } else if (strncmp(line, "    ", 4) == 0 && run->in_failure_section) {
+    test_run_add_excerpt(run, line);
+  } else if (is_gotest_package_line(line)) {
+    // Per-package result: "ok  \tpkg\t0.012s" or "FAIL\tpkg\t0.012s"; the
+    // tabs arrive as spaces once rendered on screen
+    const char *last_space = strrchr(line, ' ');
+    if (last_space) {
+      run->duration += strtod(last_space + 1, NULL);
+    }
+    if (line[0] == 'F') {
+      run->packages_failed++;
+    }
+    test_run_finish(run);
+    run->in_failure_section = 0;
+  }
+}
+
+void cargo_feed_line(test_run_t *run, const char *line) {
+  int passed = 0, failed = 0, ignored = 0, consumed = 0;
+  double seconds = 0;
+
+  if (strncmp(line, "test ", 5) == 0 && strstr(line, " ... ")) {
+    const char *name = line + 5;
+    const char *dots = strstr(name, " ... ");
+    if (strstr(dots, "FAILED")) {
+      test_run_add_failure(run, name, dots - name);
+    }
+    return;
+  }
+
+  if (strncmp(line, "---- ", 5) == 0 && strstr(line, " stdout ----")) {
+    run->in_failure_section = run->excerpt_lines == 0;
+    if (run->in_failure_section) {
+      test_run_add_excerpt(run, line);
+    }
+    return;
+  }
+
+  // "test result: FAILED. 1 passed; 1 failed; 0 ignored; ... finished in 0.00s"
+  const char *result = strstr(line, "test result: ");
+  if (result) {
+    const char *counts = strchr(result + 13, ' ');
+    if (counts && sscanf(counts, " %d passed; %d failed; %d ignored;%n", &passed,
+                         &failed, &ignored, &consumed) == 3) {
+      run->passed += passed;
+      run->failed += failed;
+      run->skipped += ignored;
+    }
+    const char *finished = strstr(line, "finished in ");
+    if (finished && sscanf(finished, "finished in %lfs", &seconds) == 1) {
+      run->duration += seconds;
+    }
+    test_run_finish(run);
+    run->in_failure_section = 0;
+    return;
+  }
+
+  if (strcmp(line, "failures:") == 0) {
+    run->in_failure_section = 0; // Name list that repeats the results
+  } else if (run->in_failure_section && line[0] != '\0') {
+    test_run_add_excerpt(run, line);
+  }
+}
+
+// Recognise the start of a run for each runner. Cargo and go print one block
+// per crate/package, so a block that follows a recently finished run of the
+// same runner continues it instead of starting over.
+test_runner_t detect_test_run_start(const test_run_t *run, const char *line) {
+  int continues = run->state == TEST_RUN_RUNNING ||
+                  (run->state == TEST_RUN_FINISHED &&
+                   daemon_time() - run->finished <= TEST_RUN_CONTINUATION);
+
+  if (strstr(line, "=== test session starts ===") ||
+      (line[0] == '=' && strstr(line, " test session starts "))) {
+    return TEST_RUNNER_PYTEST;
+  }
+  if (strncmp(line, "Test project ", 13) == 0) {
+    return TEST_RUNNER_CTEST;
+  }
+  if (strncmp(line, "running ", 8) == 0 && strstr(line, " test")) {
+    return continues && run->runner == TEST_RUNNER_CARGO ? TEST_RUNNER_NONE
+                                                         : TEST_RUNNER_CARGO;
+  }
+  if (strncmp(line, "=== RUN ", 8) == 0 || strncmp(line, "--- FAIL: ", 10) == 0 ||
+      is_gotest_package_line(line)) {
+    return continues && run->runner == TEST_RUNNER_GO ? TEST_RUNNER_NONE
+                                                      : TEST_RUNNER_GO;
+  }
+  return TEST_RUNNER_NONE;
+}
+
+// Feed one line of pane output through the test-runner summarisers.
+void tests_feed_line(pane_state_t *pane, const char *line) {
+  test_run_t *run = &pane->test_run;
+
+  test_runner_t started = detect_test_run_start(run, line);
+  if (started != TEST_RUNNER_NONE) {
+    test_run_reset(run, started);
+    if (started == TEST_RUNNER_CTEST || started == TEST_RUNNER_PYTEST) {
+      return;
+    }
+  } else if (run->state == TEST_RUN_FINISHED &&
+             (run->runner == TEST_RUNNER_GO ||
+              run->runner == TEST_RUNNER_CARGO) &&
+             (strncmp(line, "=== RUN ", 8) == 0 ||
+              strncmp(line, "running ", 8) == 0)) {
+    run->state = TEST_RUN_RUNNING; // Next package/crate of the same run
+  }
+
+  switch (run->runner) {
+  case TEST_RUNNER_PYTEST:
+    pytest_feed_line(run, line);
+    break;
+  case TEST_RUNNER_CTEST:
+    ctest_feed_line(run, line);
+    break;
+  case TEST_RUNNER_GO:
+    gotest_feed_line(run, line);
+    break;
+  case TEST_RUNNER_CARGO:
+    cargo_feed_line(run, line);
+    break;
+  default:
+    break;
+  }
+}
+
+// One header line per pane with a recorded run, then failing test names
+// ("  FAIL ") and the first failure excerpt ("  | ").
+void format_test_runs(session_context_t *session, char *response,
+                      size_t response_size) {
+  static const char *state_names[] = {"none", "running", "finished"};
+  size_t used = 0;
+  int runs = 0;
+
+  for (int i = 0; i < session->pane_count; i++) {
+    runs += session->panes[i].test_run.runner != TEST_RUNNER_NONE;
+  }
+  used += snprintf(response, response_size, "Test runs: %d\n", runs);
+
+  time_t now = daemon_time();
+  for (int i = 0; i < session->pane_count && used < response_size; i++) {
+    pane_state_t *pane = &session->panes[i];
+    test_run_t *run = &pane->test_run;
+    if (run->runner == TEST_RUNNER_NONE) {
+      continue;
+    }
+
+    used += snprintf(response + used, response_size - used,
+                     "%s %s %s passed=%d failed=%d skipped=%d errors=%d "
+                     "duration=%.2fs age=%lds\n",
+                     pane->pane_index, test_runner_names[run->runner],
+                     state_names[run->state], run->passed, run->failed,
+                     run->skipped, run->errors, run->duration,
+                     (long)(now - (run->finished ? run->finished
+                                                 : run->started)));
+    for (int f = 0; f < run->failure_count && used < response_size; f++) {
+      used += snprintf(response + used, response_size - used, "  FAIL %s\n",
+                       run->failures[f]);
+    }
+    if (run->failures_dropped && used < response_size) {
+      used += snprintf(response + used, response_size - used,
+                       "  FAIL ... %d more\n", run->failures_dropped);
+    }
+    const char *text = run->excerpt;
+    while (*text && used < response_size) {
+      const char *eol = strchr(text, '\n');
+      int text_len = eol ? (int)(eol - text) : (int)strlen(text);
+      used += snprintf(response + used, response_size - used, "  | %.*s\n",
+                       text_len, text);
+      text = eol ? eol + 1 : text + text_len;
+    }
+  }
+}
+
+// The session's commands as read from its shells' history files, oldest
+// first: "[pane] epoch cwd $ command", newlines in a command shown as "\n"
+void format_commands(session_context_t *session, int limit, char *response,
+                     size_t response_size) {
+  int count = session->history_count;
+  if (limit > 0 && limit < count) {
+    count = limit;
+  }
+  size_t used = snprintf(response, response_size, "Commands: %d\n", count);
+  for (int i = count; i > 0 && used < response_size; i--) {
+    const command_entry_t *entry =
+        &session->history[(session->history_index + CONTEXT_HISTORY_SIZE - i) %
+                          CONTEXT_HISTORY_SIZE];
+    used += snprintf(response + used, response_size - used,
+                     "[%s] %ld %s $ %s\n", entry->pane_index,
+                     (long)entry->timestamp, entry->cwd[0] ? entry->cwd : "-",
+                     entry->command);
+  }
+}
+
+int log_value_is_variable(const char *value, size_t len) {
+  int digits = 0, letters = 0, hex_letters = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = value[i];
+    if (isdigit(c)) {
+      digits++;
+    } else if (isalpha(c)) {
+      letters++;
+      hex_letters += isxdigit(c) != 0;
+    }
+  }
+  // Numbers, timestamps, addresses, hex ids and mostly-numeric tokens
+  return digits > 0 && (digits >= letters || strncmp(value, "0x", 2) == 0 ||
+                        (len >= 8 && letters == hex_letters));
+}
+
+// Mask the variable part of a token (numbers, hex ids, addresses, times).
+// "key=value" and "key:value" keep their key so "status=200" and
+// "status=500" still cluster.
+void mask_log_token(const char *token, char *out, size_t out_size) {
+  const char *sep = strpbrk(token, "=:");
+  if (sep && sep > token && sep[1] &&
+      !log_value_is_variable(token, sep - token) &&
+      log_value_is_variable(sep + 1, strlen(sep + 1))) {
+    snprintf(out, out_size, "%.*s%s", (int)(sep + 1 - token), token,
+             LOG_TEMPLATE_WILDCARD);
+  } else if (log_value_is_variable(token, strlen(token))) {
+    snprintf(out, out_size, "%s", LOG_TEMPLATE_WILDCARD);
+  } else {
+    snprintf(out, out_size, "%s", token);
+  }
+}
+
+int tokenize_log_line(const char *line, char tokens[][LOG_TOKEN_SIZE],
+                      int max_tokens) {
+  int count = 0;
+  const char *p = line;
+  while (*p && count < max_tokens) {
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+    const char *start = p;
+    while (*p && *p != ' ' && *p != '\t') {
+      p++;
+    }
+    char raw[LOG_TOKEN_SIZE];
+    copy_field(raw, sizeof(raw), start, p - start);
+    mask_log_token(raw, tokens[count], LOG_TOKEN_SIZE);
+    count++;
+  }
+  return count;
+}
+
+int split_template_tokens(const char *text, char tokens[][LOG_TOKEN_SIZE]) {
+  int count = 0;
+  const char *p = text;
+  while (*p && count < LOG_MAX_TOKENS) {
+    const char *end = strchr(p, ' ');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    copy_field(tokens[count++], LOG_TOKEN_SIZE, p, len);
+    p += len + (end != NULL);
+  }
+  return count;
+}
+
+void join_template_tokens(char tokens[][LOG_TOKEN_SIZE], int count, char *text,
+                          size_t text_size) {
+  size_t used = 0;
+  text[0] = '\0';
+  for (int t = 0; t < count && used < text_size; t++) {
+    used += snprintf(text + used, text_size - used, "%s%s", t ? " " : "",
+                     tokens[t]);
+  }
+}
+
+// Drain's first levels: templates are grouped by token count and first token,
+// then compared by similarity within the group.
+unsigned int log_bucket(int token_count, const char *first_token) {
+  unsigned long hash = hash_bytes(first_token, strlen(first_token));
+  return (unsigned int)((hash ^ (unsigned long)token_count * 31UL) %
+                        LOG_TEMPLATE_BUCKETS);
+}
+
+void log_miner_unlink(log_miner_t *miner, int index) {
+  log_template_t *tpl = &miner->templates[index];
+  int *link = &miner->buckets[tpl->bucket];
+  while (*link >= 0 && *link != index) {
+    link = &miner->templates[*link].next;
+  }
+  if (*link == index) {
+    *link = tpl->next;
+  }
+}
+
+int log_miner_new_template(log_miner_t *miner, unsigned int bucket) {
+  int index = miner->template_count;
+  if (index >= MAX_LOG_TEMPLATES) {
+    // Recycle the rarest template, oldest first among equals
+    index = 0;
+    for (int i = 1; i < miner->template_count; i++) {
+      log_template_t *a = &miner->templates[i];
+      log_template_t *b = &miner->templates[index];
+      if (a->count < b->count ||
+          (a->count == b->count && a->last_seen < b->last_seen)) {
+        index = i;
+      }
+    }
+    log_miner_unlink(miner, index);
+    miner->evicted++;
+  } else {
+    miner->template_count++;
+  }
+
+  log_template_t *tpl = &miner->templates[index];
+  memset(tpl, 0, sizeof(*tpl));
+  tpl->bucket = bucket;
+  tpl->next = miner->buckets[bucket];
+  miner->buckets[bucket] = index;
+  tpl->first_seen = daemon_time();
+  return index;
+}
+
+// Feed one line to the pane's online template miner.
+void log_miner_feed_line(pane_state_t *pane, const char *line) {
+  char tokens[LOG_MAX_TOKENS][LOG_TOKEN_SIZE];
+  int token_count = tokenize_log_line(line, tokens, LOG_MAX_TOKENS);
+  if (token_count == 0) {
+    return;
+  }
+
+  if (!pane->log_miner) {
+    pane->log_miner = calloc(1, sizeof(log_miner_t));
+    if (!pane->log_miner) {
+      return;
+    }
+    for (int i = 0; i < LOG_TEMPLATE_BUCKETS; i++) {
+      pane->log_miner->buckets[i] = -1;
+    }
+  }
+  log_miner_t *miner = pane->log_miner;
+  miner->lines_seen++;
+  miner->bytes_seen += strlen(line) + 1;
+
+  unsigned int bucket = log_bucket(token_count, tokens[0]);
+
+  unsigned int wildcard_bucket = log_bucket(token_count, LOG_TEMPLATE_WILDCARD);
+  unsigned int search[2] = {bucket, wildcard_bucket};
+
+  char candidate[LOG_MAX_TOKENS][LOG_TOKEN_SIZE];
+  char best_tokens[LOG_MAX_TOKENS][LOG_TOKEN_SIZE];
+  int best = -1;
+  int best_equal = -1;
+  for (int b = 0; b < (bucket == wildcard_bucket ? 1 : 2); b++) {
+    for (int i = miner->buckets[search[b]]; i >= 0;
+         i = miner->templates[i].next) {
+      log_template_t *tpl = &miner->templates[i];
+      if (tpl->token_count != token_count ||
+          split_template_tokens(tpl->text, candidate) != token_count) {
+        continue;
+      }
+      int equal = 0;
+      for (int t = 0; t < token_count; t++) {
+        equal += strcmp(candidate[t], tokens[t]) == 0 ||
+                 strcmp(candidate[t], LOG_TEMPLATE_WILDCARD) == 0;
+      }
+      if (equal > best_equal) {
+        best = i;
+        best_equal = equal;
+        memcpy(best_tokens, candidate, sizeof(candidate[0]) * token_count);
+      }
+    }
+  }
+
+  if (best < 0 ||
+      (double)best_equal / token_count < LOG_SIMILARITY_THRESHOLD) {
+    best = log_miner_new_template(miner, bucket);
+    log_template_t *tpl = &miner->templates[best];
+    tpl->token_count = token_count;
+    join_template_tokens(tokens, token_count, tpl->text, sizeof(tpl->text));
+  } else {
+    // Positions that disagree become variable slots
+    log_template_t *tpl = &miner->templates[best];
+    for (int t = 0; t < token_count; t++) {
+      if (strcmp(best_tokens[t], tokens[t]) != 0) {
+        strcpy(best_tokens[t], LOG_TEMPLATE_WILDCARD);
+      }
+    }
+    join_template_tokens(best_tokens, token_count, tpl->text,
+                         sizeof(tpl->text));
+    // A first token that just became variable moves to the wildcard group
+    if (tpl->bucket != wildcard_bucket &&
+        strcmp(best_tokens[0], LOG_TEMPLATE_WILDCARD) == 0) {
+      log_miner_unlink(miner, best);
+      tpl->bucket = wildcard_bucket;
+      tpl->next = miner->buckets[wildcard_bucket];
+      miner->buckets[wildcard_bucket] = best;
+    }
+  }
+
+  log_template_t *tpl = &miner->templates[best];
+  tpl->count++;
+  tpl->last_seen = daemon_time();
+  strncpy(tpl->example, line, sizeof(tpl->example) - 1);
+  tpl->example[sizeof(tpl->example) - 1] = '\0';
+}
+
+int compare_template_count(const void *a, const void *b) {
+  const log_template_t *ta = *(log_template_t *const *)a;
+  const log_template_t *tb = *(log_template_t *const *)b;
+  if (ta->count != tb->count) {
+    return ta->count > tb->count ? -1 : 1;
+  }
+  return ta->last_seen > tb->last_seen ? -1 : (ta->last_seen < tb->last_seen);
+}
+
+// Render each pane's mined history as "count x template" lines, most
+// frequent first, with the last example of the top templates.
+void format_log_templates(session_context_t *session, const char *pane_filter,
+                          char *response, size_t response_size) {
+  size_t used = 0;
+  unsigned long total_lines = 0;
+  int total_templates = 0;
+
+  for (int i = 0; i < session->pane_count; i++) {
+    if (session->panes[i].log_miner) {
+      total_lines += session->panes[i].log_miner->lines_seen;
+      total_templates += session->panes[i].log_miner->template_count;
+    }
+  }
+  used += snprintf(response, response_size, "Templates: %d (%lu lines)\n",
+                   total_templates, total_lines);
+
+  for (int i = 0; i < session->pane_count && used < response_size; i++) {
+    pane_state_t *pane = &session->panes[i];
+    log_miner_t *miner = pane->log_miner;
+    if (!miner || (pane_filter && strcmp(pane_filter, pane->pane_index) != 0 &&
+                   strcmp(pane_filter, pane->pane_id) != 0)) {
+      continue;
+    }
+
+    log_template_t *sorted[MAX_LOG_TEMPLATES];
+    for (int t = 0; t < miner->template_count; t++) {
+      sorted[t] = &miner->templates[t];
+    }
+    qsort(sorted, miner->template_count, sizeof(sorted[0]),
+          compare_template_count);
+
+    used += snprintf(response + used, response_size - used,
+                     "=== PANE %s (%s) lines=%lu templates=%d ===\n",
+                     pane->pane_index, pane->title, miner->lines_seen,
+                     miner->template_count);
+
+    for (int t = 0; t < miner->template_count && used < response_size; t++) {
+      char entry[LOG_TEMPLATE_SIZE + 512];
+      int len = snprintf(entry, sizeof(entry), "%8lu x %s", sorted[t]->count,
+                         sorted[t]->text);
+      if (t < LOG_TEMPLATE_EXAMPLES && sorted[t]->count > 1) {
+        len += snprintf(entry + len, sizeof(entry) - len, "\n           e.g. %s",
+                        sorted[t]->example);
+      }
+      len += snprintf(entry + len, sizeof(entry) - len, "\n");
+      if (len >= (int)sizeof(entry) || used + len >= response_size) {
+        break;
+      }
+      memcpy(response + used, entry, len + 1);
+      used += len;
+    }
+  }
+}
+
+int is_retrieval_stopword(const char *term) {
+  static const char *stopwords[] = {
+      "the", "a",  "an",   "is",   "are",  "was", "be",   "to",  "of",
+      "in",  "on", "at",   "for",  "and",  "or",  "it",   "my",  "this",
+      "that", "what", "why", "how", "do",  "does", "did",  "with", "from",
+      "i",   "me", "can",  "there", "when", "which", "where", "who"};
+  for (size_t i = 0; i < sizeof(stopwords) / sizeof(stopwords[0]); i++) {
+    if (strcmp(term, stopwords[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Lower-case alphanumeric runs ("_" included) of useful length
+int next_retrieval_term(const char **cursor, char *term) {
+  const char *p = *cursor;
+  for (;;) {
+    while (*p && !isalnum((unsigned char)*p) && *p != '_') {
+      p++;
+    }
+    if (!*p) {
+      *cursor = p;
+      return 0;
+    }
+    size_t len = 0;
+    while (*p && (isalnum((unsigned char)*p) || *p == '_')) {
+      if (len < RETRIEVAL_TERM_SIZE - 1) {
+        term[len++] = tolower((unsigned char)*p);
+      }
+      p++;
+    }
+    term[len] = '\0';
+    if (len >= 2 && !is_retrieval_stopword(term)) {
+      *cursor = p;
+      return 1;
+    }
+  }
+}
+
+int retrieval_index_init(retrieval_index_t *index) {
+  index->terms = calloc(RETRIEVAL_INITIAL_TERMS, sizeof(retrieval_term_t));
+  index->windows = calloc(MAX_RETRIEVAL_WINDOWS, sizeof(retrieval_window_t));
+  if (!index->terms || !index->windows) {
+    free(index->terms);
+    free(index->windows);
+    index->terms = NULL;
+    index->windows = NULL;
+    return 0;
+  }
+  index->term_capacity = RETRIEVAL_INITIAL_TERMS;
+  return 1;
+}
+
+void retrieval_index_free(retrieval_index_t *index) {
+  for (int t = 0; index->terms && t < index->term_capacity; t++) {
+    free(index->terms[t].postings);
+  }
+  for (int w = 0; index->windows && w < MAX_RETRIEVAL_WINDOWS; w++) {
+    free(index->windows[w].term_ids);
+  }
+  free(index->terms);
+  free(index->windows);
+  memset(index, 0, sizeof(*index));
+}
+
+int retrieval_term_slot(const retrieval_term_t *terms, int capacity,
+                        const char *term) {
+  unsigned long hash = hash_bytes(term, strlen(term));
+  int slot = (int)(hash & (unsigned long)(capacity - 1));
+  while (terms[slot].term[0] && strcmp(terms[slot].term, term) != 0) {
+    slot = (slot + 1) & (capacity - 1);
+  }
+  return slot;
+}
+
+// Rebuild the term table at the given capacity, dropping terms no live
+// window or open window uses any more. Windows and the panes' open windows
+// hold slots, so those are remapped. Returns 0 if out of memory.
+int retrieval_rehash(session_context_t *session, int capacity) {
+  retrieval_index_t *index = &session->retrieval;
+  retrieval_term_t *terms = calloc(capacity, sizeof(retrieval_term_t));
+  int *remap = malloc(index->term_capacity * sizeof(int));
+  if (!terms || !remap) {
+    free(terms);
+    free(remap);
+    return 0;
+  }
+  for (int i = 0; i < index->term_capacity; i++) {
+    remap[i] = index->terms[i].df > 0 ? 0 : -1;
+  }
+  for (int p = 0; p < session->pane_count; p++) {
+    const retrieval_builder_t *builder = &session->panes[p].retrieval_builder;
+    for (int t = 0; t < builder->term_count; t++) {
+      remap[builder->term_ids[t]] = 0;
+    }
+  }
+  index->term_count = 0;
+  for (int i = 0; i < index->term_capacity; i++) {
+    if (!index->terms[i].term[0]) {
+      continue;
+    }
+    if (remap[i] < 0) {
+      free(index->terms[i].postings);
+      continue;
+    }
+    int moved = retrieval_term_slot(terms, capacity, index->terms[i].term);
+    terms[moved] = index->terms[i];
+    remap[i] = moved;
+    index->term_count++;
+  }
+  for (int w = 0; w < index->window_count; w++) {
+    retrieval_window_t *window =
+        &index->windows[(index->next_window - index->window_count + w) %
+                        MAX_RETRIEVAL_WINDOWS];
+    for (int t = 0; t < window->term_count; t++) {
+      window->term_ids[t] = remap[window->term_ids[t]];
+    }
+  }
+  for (int p = 0; p < session->pane_count; p++) {
+    retrieval_builder_t *builder = &session->panes[p].retrieval_builder;
+    for (int t = 0; t < builder->term_count; t++) {
+      builder->term_ids[t] = remap[builder->term_ids[t]];
+    }
+  }
+  free(remap);
+  free(index->terms);
+  index->terms = terms;
+  index->term_capacity = capacity;
+  return 1;
+}
+
+// Find or add a term; returns its slot, or -1 if the table is full. Terms
+// stay in place when their last window is evicted; once the table fills
+// they are dropped in a rebuild, which grows it only if half are live.
+// When even that leaves it full, no rebuild is tried again until more
+// windows have been sealed, and with them some evicted.
+int retrieval_intern_term(session_context_t *session, const char *term,
+                          int create) {
+  retrieval_index_t *index = &session->retrieval;
+  int slot = retrieval_term_slot(index->terms, index->term_capacity, term);
+  if (index->terms[slot].term[0] || !create) {
+    return index->terms[slot].term[0] ? slot : -1;
+  }
+
+  if ((index->term_count + 1) * 4 > index->term_capacity * 3) {
+    if (index->next_window < index->rehash_window ||
+        !retrieval_rehash(session, index->term_capacity)) {
+      return -1;
+    }
+    if (index->term_count * 2 > index->term_capacity &&
+        index->term_capacity < RETRIEVAL_MAX_TERMS &&
+        !retrieval_rehash(session, index->term_capacity * 2)) {
+      return -1;
+    }
+    if ((index->term_count + 1) * 4 > index->term_capacity * 3) {
+      index->rehash_window = index->next_window + RETRIEVAL_REHASH_WINDOWS;
+      return -1;
+    }
+    slot = retrieval_term_slot(index->terms, index->term_capacity, term);
+  }
+
+  strncpy(index->terms[slot].term, term, RETRIEVAL_TERM_SIZE - 1);
+  index->term_count++;
+  return slot;
+}
+
+void retrieval_evict_oldest(retrieval_index_t *index) {
+  unsigned long oldest = index->next_window - index->window_count;
+  retrieval_window_t *window = &index->windows[oldest % MAX_RETRIEVAL_WINDOWS];
+
+  for (int t = 0; t < window->term_count; t++) {
+    retrieval_term_t *term = &index->terms[window->term_ids[t]];
+    term->df--;
+    // Postings are in window order, so dead ones form a prefix
+    while (term->posting_start < term->posting_count &&
+           term->postings[term->posting_start].window <= oldest) {
+      term->posting_start++;
+    }
+    if (term->posting_start > term->posting_count / 2) {
+      memmove(term->postings, term->postings + term->posting_start,
+              (term->posting_count - term->posting_start) *
+                  sizeof(retrieval_posting_t));
+      term->posting_count -= term->posting_start;
+      term->posting_start = 0;
+    }
+  }
+
+  index->total_length -= window->length;
+  free(window->term_ids);
+  memset(window, 0, sizeof(*window));
+  index->window_count--;
+}
+
+int compare_ints(const void *a, const void *b) {
+  int ia = *(const int *)a, ib = *(const int *)b;
+  return (ia > ib) - (ia < ib);
+}
+
+// Close a pane's open window and add it to the session's inverted index
+void retrieval_seal_window(session_context_t *session, pane_state_t *pane) {
+  retrieval_index_t *index = &session->retrieval;
+  retrieval_builder_t *builder = &pane->retrieval_builder;
+  if (builder->lines == 0 || !index->windows) {
+    builder->lines = 0;
+    builder->term_count = 0;
+    return;
+  }
+
+  if (index->window_count == MAX_RETRIEVAL_WINDOWS) {
+    retrieval_evict_oldest(index);
+  }
+
+  unsigned long id = index->next_window++;
+  retrieval_window_t *window = &index->windows[id % MAX_RETRIEVAL_WINDOWS];
+  memset(window, 0, sizeof(*window));
+  strncpy(window->pane_id, pane->pane_id, sizeof(window->pane_id) - 1);
+  window->first_seq = builder->first_seq;
+  window->last_seq = builder->last_seq;
+  window->length = builder->term_count;
+  index->window_count++;
+  index->total_length += window->length;
+
+  qsort(builder->term_ids, builder->term_count, sizeof(int), compare_ints);
+  window->term_ids = malloc(builder->term_count * sizeof(int) + 1);
+  for (int t = 0; t < builder->term_count && window->term_ids;) {
+    int term_id = builder->term_ids[t];
+    int tf = 0;
+    while (t < builder->term_count && builder->term_ids[t] == term_id) {
+      tf++;
+      t++;
+    }
+
+    retrieval_term_t *term = &index->terms[term_id];
+    if (term->posting_count == term->posting_capacity) {
+      int capacity = term->posting_capacity ? term->posting_capacity * 2 : 4;
+      retrieval_posting_t *postings =
+          realloc(term->postings, capacity * sizeof(retrieval_posting_t));
+      if (!postings) {
+        continue;
+      }
+      term->postings = postings;
+      term->posting_capacity = capacity;
+    }
+    term->postings[term->posting_count].window = id;
+    term->postings[term->posting_count].tf = tf;
+    term->posting_count++;
+    term->df++;
+    window->term_ids[window->term_count++] = term_id;
+  }
+
+  builder->lines = 0;
+  builder->term_count = 0;
+}
+
+void retrieval_feed_line(session_context_t *session, pane_state_t *pane,
+                         const char *line) {
+  retrieval_index_t *index = &session->retrieval;
+  retrieval_builder_t *builder = &pane->retrieval_builder;
+  if (!index->windows && !retrieval_index_init(index)) {
+    return;
+  }
+
+  if (builder->lines == 0) {
+    builder->first_seq = session->line_seq;
+  }
+  builder->last_seq = session->line_seq;
+  builder->lines++;
+
+  char term[RETRIEVAL_TERM_SIZE];
+  const char *cursor = line;
+  while (builder->term_count < RETRIEVAL_WINDOW_TERMS &&
+         next_retrieval_term(&cursor, term)) {
+    int slot = retrieval_intern_term(session, term, 1);
+    if (slot >= 0) {
+      builder->term_ids[builder->term_count++] = slot;
+    }
+  }
+
+  if (builder->lines == RETRIEVAL_WINDOW_LINES) {
+    retrieval_seal_window(session, pane);
+  }
+}
+
+int line_has_any_term(const char *line, char terms[][RETRIEVAL_TERM_SIZE],
+                      int term_count) {
+  char term[RETRIEVAL_TERM_SIZE];
+  const char *cursor = line;
+  while (next_retrieval_term(&cursor, term)) {
+    for (int i = 0; i < term_count; i++) {
+      if (strcmp(term, terms[i]) == 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// A ranked window. Panes' open windows count too, numbered after the
+// sealed ones.
+typedef struct {
+  unsigned long window;
+  const char *pane_id;
+  unsigned long first_seq;
+  unsigned long last_seq;
+  double score;
+} retrieval_hit_t;
+
+int compare_retrieval_hits(const void *a, const void *b) {
+  const retrieval_hit_t *ha = a, *hb = b;
+  if (ha->score != hb->score) {
+    return ha->score > hb->score ? -1 : 1;
+  }
+  return ha->window > hb->window ? -1 : (ha->window < hb->window);
+}
+
+// Rank the session's live windows against the question with BM25. Fills
+// hits best first and terms with the distinct query terms; returns the
+// number of windows that matched at all. Each pane's open window is scored
+// as it stands, so queries find the freshest lines without cutting the
+// windows they are in short.
+int retrieval_rank(session_context_t *session, const char *question,
+                   retrieval_hit_t *hits,
+                   char seen_terms[][RETRIEVAL_TERM_SIZE], int *term_count) {
+  static double scores[MAX_RETRIEVAL_WINDOWS];
+  double open_scores[MAX_PANES_PER_SESSION] = {0};
+  retrieval_index_t *index = &session->retrieval;
+  *term_count = 0;
+  if (!index->windows) {
+    return 0;
+  }
+
+  int open_count = 0;
+  unsigned long total_length = index->total_length;
+  for (int p = 0; p < session->pane_count; p++) {
+    const retrieval_builder_t *builder = &session->panes[p].retrieval_builder;
+    open_count += builder->lines > 0;
+    total_length += builder->lines > 0 ? builder->term_count : 0;
+  }
+  int window_count = index->window_count + open_count;
+  if (window_count == 0) {
+    return 0;
+  }
+
+  unsigned long oldest = index->next_window - index->window_count;
+  double avg_length = total_length ? (double)total_length / window_count : 1.0;
+  memset(scores, 0, sizeof(scores));
+
+  char term[RETRIEVAL_TERM_SIZE];
+  int seen_count = 0;
+  const char *cursor = question;
+  while (seen_count < RETRIEVAL_QUERY_TERMS &&
+         next_retrieval_term(&cursor, term)) {
+    int duplicate = 0;
+    for (int i = 0; i < seen_count && !duplicate; i++) {
+      duplicate = strcmp(seen_terms[i], term) == 0;
+    }
+    if (duplicate) {
+      continue;
+    }
+    strcpy(seen_terms[seen_count++], term);
+
+    int slot = retrieval_intern_term(session, term, 0);
+    if (slot < 0) {
+      continue;
+    }
+    retrieval_term_t *entry = &index->terms[slot];
+    int open_tf[MAX_PANES_PER_SESSION];
+    int df = entry->df;
+    for (int p = 0; p < session->pane_count; p++) {
+      const retrieval_builder_t *builder =
+          &session->panes[p].retrieval_builder;
+      open_tf[p] = 0;
+      for (int t = 0; t < builder->term_count; t++) {
+        open_tf[p] += builder->term_ids[t] == slot;
+      }
+      df += open_tf[p] > 0;
+    }
+    if (df <= 0) {
+      continue;
+    }
+    double idf = log(1.0 + (window_count - df + 0.5) / (df + 0.5));
+    for (int p = entry->posting_start; p < entry->posting_count; p++) {
+      retrieval_posting_t *posting = &entry->postings[p];
+      if (posting->window < oldest) {
+        continue;
+      }
+      retrieval_window_t *window =
+          &index->windows[posting->window % MAX_RETRIEVAL_WINDOWS];
+      double tf = posting->tf;
+      double norm = BM25_K1 * (1.0 - BM25_B + BM25_B * window->length /
+                                                 avg_length);
+      scores[posting->window % MAX_RETRIEVAL_WINDOWS] +=
+          idf * tf * (BM25_K1 + 1.0) / (tf + norm);
+    }
+    for (int p = 0; p < session->pane_count; p++) {
+      if (open_tf[p] > 0) {
+        double tf = open_tf[p];
+        double norm =
+            BM25_K1 * (1.0 - BM25_B +
+                       BM25_B * session->panes[p].retrieval_builder.term_count /
+                           avg_length);
+        open_scores[p] += idf * tf * (BM25_K1 + 1.0) / (tf + norm);
+      }
+    }
+  }
+  *term_count = seen_count;
+
+  int hit_count = 0;
+  for (int w = 0; w < index->window_count; w++) {
+    unsigned long id = oldest + w;
+    const retrieval_window_t *window =
+        &index->windows[id % MAX_RETRIEVAL_WINDOWS];
+    double score = scores[id % MAX_RETRIEVAL_WINDOWS];
+    if (score > 0) {
+      hits[hit_count++] = (retrieval_hit_t){id, window->pane_id,
+                                            window->first_seq,
+                                            window->last_seq, score};
+    }
+  }
+  for (int p = 0; p < session->pane_count; p++) {
+    const pane_state_t *pane = &session->panes[p];
+    if (open_scores[p] > 0) {
+      hits[hit_count++] = (retrieval_hit_t){
+          index->next_window + p, pane->pane_id,
+          pane->retrieval_builder.first_seq, pane->retrieval_builder.last_seq,
+          open_scores[p]};
+    }
+  }
+  qsort(hits, hit_count, sizeof(hits[0]), compare_retrieval_hits);
+  return hit_count;
+}
+
+// Rank live windows against the question with BM25 and write the top k that
+// fit in budget bytes, best first.
+void format_retrieval(session_context_t *session, int top_k, size_t budget,
+                      const char *question, char *response,
+                      size_t response_size) {
+  static retrieval_hit_t hits[MAX_RETRIEVAL_WINDOWS + MAX_PANES_PER_SESSION];
+  char seen_terms[RETRIEVAL_QUERY_TERMS][RETRIEVAL_TERM_SIZE];
+  int seen_count;
+
+  int hit_count =
+      retrieval_rank(session, question, hits, seen_terms, &seen_count);
+  if (hit_count == 0) {
+    snprintf(response, response_size, "Windows: 0\n");
+    return;
+  }
+
+  static char body[MAX_BUFFER_SIZE];
+  size_t body_used = 0;
+  int emitted = 0;
+  body[0] = '\0';
+  if (budget > sizeof(body) - 1) {
+    budget = sizeof(body) - 1;
+  }
+  for (int h = 0; h < hit_count && emitted < top_k; h++) {
+    const retrieval_hit_t *window = &hits[h];
+    pane_state_t *pane = find_pane(session, window->pane_id);
+    if (!pane || !pane->history.lines) {
+      continue;
+    }
+
+    char entry[MAX_BUFFER_SIZE];
+    int header_len = snprintf(entry, sizeof(entry),
+                              "=== WINDOW %s (%s) seq=%lu-%lu score=%.3f ===\n",
+                              pane->pane_index, pane->title, window->first_seq,
+                              window->last_seq, window->score);
+    int len = header_len;
+    for (int pos = history_lower_bound(&pane->history, window->first_seq);
+         pos < pane->history.count && len < (int)sizeof(entry); pos++) {
+      const history_line_t *line = history_at(&pane->history, pos);
+      if (!line) {
+        continue; // In a cold block that could not be expanded
+      }
+      if (line->seq > window->last_seq) {
+        break;
+      }
+      len += snprintf(entry + len, sizeof(entry) - len, "%s\n", line->text);
+    }
+    if (len >= (int)sizeof(entry)) {
+      len = sizeof(entry) - 1;
+    }
+
+    // Too big for what is left of the budget: keep only the lines that
+    // match the question, then trim to whole lines
+    size_t left = budget - body_used;
+    if ((size_t)len > left) {
+      len = header_len;
+      for (int pos = history_lower_bound(&pane->history, window->first_seq);
+           pos < pane->history.count && len < (int)sizeof(entry); pos++) {
+        const history_line_t *line = history_at(&pane->history, pos);
+        if (!line) {
+          continue;
+        }
+        if (line->seq > window->last_seq) {
+          break;
+        }
+        if (line_has_any_term(line->text, seen_terms, seen_count)) {
+          len += snprintf(entry + len, sizeof(entry) - len, "%s\n",
+                          line->text);
+        }
+      }
+      if (len >= (int)sizeof(entry)) {
+        len = sizeof(entry) - 1;
+      }
+    }
+    if ((size_t)len > left) {
+      char *cut = left > (size_t)header_len
+                      ? memrchr(entry + header_len, '\n', left - header_len)
+                      : NULL;
+      if (!cut) {
+        continue; // Smaller windows further down may still fit
+      }
+      len = cut - entry + 1;
+    }
+    memcpy(body + body_used, entry, len);
+    body_used += len;
+    body[body_used] = '\0';
+    emitted++;
+  }
+
+  snprintf(response, response_size, "Windows: %d\n%s", emitted, body);
+}
+
+typedef struct {
+  session_context_t *session;
+  retrieval_hit_t hit;
+} search_result_t;
+
+// BM25 search over every session, best top_k windows first. Each result shows
+// only the window lines that contain query terms, so many fit in a response.
+// Scores come from each session's own index, so they compare only roughly.
+void format_search(int top_k, const char *query, char *response,
+                   size_t response_size) {
+  static retrieval_hit_t hits[MAX_RETRIEVAL_WINDOWS + MAX_PANES_PER_SESSION];
+  search_result_t results[MAX_SEARCH_RESULTS];
+  char terms[RETRIEVAL_QUERY_TERMS][RETRIEVAL_TERM_SIZE];
+  int term_count = 0;
+  int result_count = 0;
+
+  if (top_k > MAX_SEARCH_RESULTS) {
+    top_k = MAX_SEARCH_RESULTS;
+  }
+  for (int i = 0; i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    if (!g_state.servers[session->server].alive || !session_visible(session)) {
+      continue;
+    }
+    int hit_count = retrieval_rank(session, query, hits, terms, &term_count);
+    for (int h = 0; h < hit_count && h < top_k; h++) {
+      int pos = result_count;
+      while (pos > 0 && results[pos - 1].hit.score < hits[h].score) {
+        pos--;
+      }
+      if (pos >= top_k) {
+        break; // Later hits of this session score lower still
+      }
+      int last = result_count < top_k ? result_count : top_k - 1;
+      memmove(&results[pos + 1], &results[pos],
+              (last - pos) * sizeof(results[0]));
+      results[pos] = (search_result_t){session, hits[h]};
+      if (result_count < top_k) {
+        result_count++;
+      }
+    }
+  }
+
+  size_t used = snprintf(response, response_size, "Results: %d\n",
+                         result_count);
+  for (int r = 0; r < result_count && used < response_size; r++) {
+    session_context_t *session = results[r].session;
+    const retrieval_hit_t *window = &results[r].hit;
+    pane_state_t *pane = find_pane(session, window->pane_id);
+    if (!pane || !pane->history.lines) {
+      continue;
+    }
+    used += snprintf(response + used, response_size - used,
+                     "=== RESULT %s %s (%s) seq=%lu-%lu score=%.3f ===\n",
+                     session->session_id, pane->pane_index, pane->title,
+                     window->first_seq, window->last_seq, window->score);
+    int shown = 0;
+    for (int pos = history_lower_bound(&pane->history, window->first_seq);
+         pos < pane->history.count && shown < SEARCH_RESULT_LINES &&
+         used < response_size;
+         pos++) {
+      const history_line_t *line = history_at(&pane->history, pos);
+      if (!line) {
+        continue;
+      }
+      if (line->seq > window->last_seq) {
+        break;
+      }
+      if (line_has_any_term(line->text, terms, term_count)) {
+        used += snprintf(response + used, response_size - used, "%.*s\n",
+                         utf8_prefix(line->text, SEARCH_LINE_SIZE),
+                         line->text);
+        shown++;
+      }
+    }
+  }
+}
+
+typedef struct {
+  const pane_state_t *pane;
+  const history_line_t *line;
+  double score;
+} history_match_t;
+
+// Blocks and bytes one grep:/similar: read or passed over
+typedef struct {
+  int tested;
+  int skipped;
+  size_t bytes_read;
+  size_t bytes_skipped;
+} history_scan_t;
+
+// Keep matches best first: higher score, then newer. Returns 0 when the
+// match did not make the cut.
+int history_match_insert(history_match_t *matches, int *count, int max,
+                         history_match_t match) {
+  int pos = *count;
+  while (pos > 0 && (matches[pos - 1].score < match.score ||
+                     (matches[pos - 1].score == match.score &&
+                      matches[pos - 1].line->seq < match.line->seq))) {
+    pos--;
+  }
+  if (pos >= max) {
+    return 0;
+  }
+  int last = *count < max ? *count : max - 1;
+  memmove(&matches[pos + 1], &matches[pos], (last - pos) * sizeof(*matches));
+  matches[pos] = match;
+  if (*count < max) {
+    (*count)++;
+  }
+  return 1;
+}
+
+void history_scan_note(history_scan_t *scan, const history_block_t *block,
+                       int skipped) {
+  scan->tested++;
+  g_state.history_blocks_tested++;
+  if (skipped) {
+    scan->skipped++;
+    scan->bytes_skipped += block->bytes;
+    g_state.history_blocks_skipped++;
+  } else {
+    scan->bytes_read += block->bytes;
+  }
+}
+
+int format_history_scan(char *out, size_t out_size,
+                        const history_scan_t *scan) {
+  return snprintf(
+      out, out_size,
+      "Filter: skipped %d/%d blocks, read %zu of %zu bytes (%.1f%% of "
+      "blocks skipped overall)\n",
+      scan->skipped, scan->tested, scan->bytes_read,
+      scan->bytes_read + scan->bytes_skipped,
+      g_state.history_blocks_tested
+          ? 100.0 * g_state.history_blocks_skipped /
+                g_state.history_blocks_tested
+          : 0.0);
+}
+
+int compare_ulongs(const void *a, const void *b) {
+  unsigned long ua = *(const unsigned long *)a, ub = *(const unsigned long *)b;
+  return (ua > ub) - (ua < ub);
+}
+
+// Distinct trigram hashes of a line, sorted, at most max of them
+int line_trigrams(const char *text, unsigned long *out, int max) {
+  int count = 0;
+  for (const char *p = text; p[0] && p[1] && p[2] && count < max; p++) {
+    out[count++] = trigram_hash(p);
+  }
+  qsort(out, count, sizeof(*out), compare_ulongs);
+  int distinct = 0;
+  for (int i = 0; i < count; i++) {
+    if (distinct == 0 || out[distinct - 1] != out[i]) {
+      out[distinct++] = out[i];
+    }
+  }
+  return distinct;
+}
+
+// Case-insensitive substring search of a session's retained history, or
+// only its last `seconds` of it, newest matches kept. Blocks whose time
+// range or trigram filter rules them out are never read.
+void format_grep(session_context_t *session, long seconds, const char *pattern,
+                 char *response, size_t response_size) {
+  history_match_t matches[GREP_MAX_MATCHES];
+  unsigned long wanted[SEARCH_LINE_SIZE];
+  int match_count = 0;
+  history_scan_t scan = {0};
+  time_t cutoff = seconds > 0 ? daemon_time() - seconds : 0;
+
+  int wanted_count = 0;
+  for (const char *p = pattern;
+       p[0] && p[1] && p[2] && wanted_count < SEARCH_LINE_SIZE; p++) {
+    wanted[wanted_count++] = trigram_hash(p);
+  }
+
+  for (int i = 0; i < session->pane_count; i++) {
+    pane_state_t *pane = &session->panes[i];
+    pane_history_t *history = &pane->history;
+    if (!history->lines || history->count == 0) {
+      continue;
+    }
+    unsigned long oldest = (history->appended - history->count) /
+                           HISTORY_BLOCK_LINES;
+    for (unsigned long b = (history->appended - 1) / HISTORY_BLOCK_LINES + 1;
+         b-- > oldest;) {
+      const history_block_t *block = &history->blocks[b % HISTORY_BLOCKS];
+      if (match_count == GREP_MAX_MATCHES &&
+          block->last_seq < matches[match_count - 1].line->seq) {
+        break; // Only older lines left in this pane
+      }
+      int skip = block->last_time < cutoff;
+      for (int w = 0; w < wanted_count && !skip; w++) {
+        skip = !bloom_has(block->bloom, wanted[w]);
+      }
+      history_scan_note(&scan, block, skip);
+      if (skip) {
+        continue;
+      }
+      int first, end;
+      history_block_span(history, b, &first, &end);
+      for (int pos = end - 1; pos >= first; pos--) {
+        const history_line_t *line = history_at(history, pos);
+        if (line && line->timestamp >= cutoff &&
+            strcasestr(line->text, pattern)) {
+          history_match_insert(matches, &match_count, GREP_MAX_MATCHES,
+                               (history_match_t){pane, line, 0});
+        }
+      }
+    }
+  }
+
+  size_t used = snprintf(response, response_size, "Matches: %d\n",
+                         match_count);
+  used += format_history_scan(response + used, response_size - used, &scan);
+  for (int m = match_count - 1; m >= 0 && used < response_size; m--) {
+    used += snprintf(response + used, response_size - used, "[%s] %lu %.*s\n",
+                     matches[m].pane->pane_index, matches[m].line->seq,
+                     utf8_prefix(matches[m].line->text, SEARCH_LINE_SIZE),
+                     matches[m].line->text);
+  }
+}
+
+// Lines of a session's history most like the given one, by the Dice
+// coefficient of their trigram sets. A line scoring SIMILAR_MIN_SCORE shares
+// at least s/(2-s) of the query's trigrams, so blocks holding fewer of them
+// cannot contain one and are passed over.
+void format_similar(session_context_t *session, int top_k, const char *text,
+                    char *response, size_t response_size) {
+  static unsigned long query[SIMILAR_MAX_TRIGRAMS];
+  static unsigned long candidate[SIMILAR_MAX_TRIGRAMS * 4];
+  history_match_t matches[SIMILAR_MAX_RESULTS];
+  int match_count = 0;
+  history_scan_t scan = {0};
+
+  if (top_k > SIMILAR_MAX_RESULTS) {
+    top_k = SIMILAR_MAX_RESULTS;
+  }
+  int query_count = line_trigrams(text, query, SIMILAR_MAX_TRIGRAMS);
+  if (query_count == 0) {
+    snprintf(response, response_size, "ERROR: Line too short to compare");
+    return;
+  }
+  int needed = (int)ceil(SIMILAR_MIN_SCORE * query_count /
+                         (2 - SIMILAR_MIN_SCORE));
+
+  for (int i = 0; i < session->pane_count; i++) {
+    pane_state_t *pane = &session->panes[i];
+    pane_history_t *history = &pane->history;
+    if (!history->lines || history->count == 0) {
+      continue;
+    }
+    unsigned long oldest = (history->appended - history->count) /
+                           HISTORY_BLOCK_LINES;
+    for (unsigned long b = (history->appended - 1) / HISTORY_BLOCK_LINES + 1;
+         b-- > oldest;) {
+      const history_block_t *block = &history->blocks[b % HISTORY_BLOCKS];
+      int present = 0;
+      for (int q = 0; q < query_count && present < needed; q++) {
+        present += bloom_has(block->bloom, query[q]);
+      }
+      history_scan_note(&scan, block, present < needed);
+      if (present < needed) {
+        continue;
+      }
+      int first, end;
+      history_block_span(history, b, &first, &end);
+      for (int pos = end - 1; pos >= first; pos--) {
+        const history_line_t *line = history_at(history, pos);
+        if (!line) {
+          continue;
+        }
+        int count = line_trigrams(line->text, candidate,
+                                  SIMILAR_MAX_TRIGRAMS * 4);
+        int shared = 0;
+        for (int q = 0, c = 0; q < query_count && c < count;) {
+          if (query[q] == candidate[c]) {
+            shared++;
+            q++;
+            c++;
+          } else if (query[q] < candidate[c]) {
+            q++;
+          } else {
+            c++;
+          }
+        }
+        double score = 2.0 * shared / (query_count + count);
+        if (score >= SIMILAR_MIN_SCORE) {
+          history_match_insert(matches, &match_count, top_k,
+                               (history_match_t){pane, line, score});
+        }
+      }
+    }
+  }
+
+  size_t used = snprintf(response, response_size, "Similar: %d\n",
+                         match_count);
+  used += format_history_scan(response + used, response_size - used, &scan);
+  for (int m = 0; m < match_count && used < response_size; m++) {
+    used += snprintf(response + used, response_size - used,
+                     "[%s] %lu %.2f %.*s\n", matches[m].pane->pane_index,
+                     matches[m].line->seq, matches[m].score,
+                     utf8_prefix(matches[m].line->text, SEARCH_LINE_SIZE),
+                     matches[m].line->text);
+  }
+}
+
+// Whether a line mentions trouble: errors, failures, crashes, timeouts.
+int line_has_alarm(const char *line) {
+  static const char *alarms[] = {"error",   "fail",      "fatal",
+                                 "panic",   "exception", "traceback",
+                                 "denied",  "refused",   "timed out",
+                                 "timeout", "warning",   "killed",
+                                 "segmentation", NULL};
+  for (int i = 0; alarms[i]; i++) {
+    if (strcasestr(line, alarms[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Rough salience of a line for extractive summaries: problems first, then
+// commands that were run and outcomes, then lines carrying more words.
+int summary_line_score(const char *line) {
+  static const char *outcomes[] = {"passed",   "success",   "succeeded",
+                                   "done",     "finished",  "complete",
+                                   "listening", "started",  NULL};
+
+  while (*line == ' ' || *line == '\t') {
+    line++;
+  }
+  if (*line == '\0') {
+    return -1;
+  }
+
+  int score = line_has_alarm(line) ? 8 : 0;
+  for (int i = 0; outcomes[i]; i++) {
+    if (strcasestr(line, outcomes[i])) {
+      score += 3;
+      break;
+    }
+  }
+
+  // A shell prompt followed by a command
+  const char *prompt = strstr(line, "$ ");
+  if (!prompt) {
+    prompt = strstr(line, "# ");
+  }
+  if (prompt && prompt - line < 64 && prompt[2] != '\0') {
+    score += 4;
+  }
+
+  int words = 0;
+  const char *p = line;
+  while (*p && words < 12) {
+    while (*p && !isalnum((unsigned char)*p)) {
+      p++;
+    }
+    const char *start = p;
+    while (isalnum((unsigned char)*p)) {
+      p++;
+    }
+    if (p - start >= 3) {
+      words++;
+    }
+  }
+  return score + words / 2;
+}
+
+// Hash of a line with digits skipped, so lines differing only in counters,
+// timestamps or addresses count as repeats.
+unsigned long summary_line_shape(const char *line) {
+  unsigned long hash = 14695981039346656037UL;
+  for (const char *p = line; *p; p++) {
+    if (!isdigit((unsigned char)*p)) {
+      hash = (hash ^ (unsigned char)*p) * 1099511628211UL;
+    }
+  }
+  return hash;
+}
+
+// Keep the SUMMARY_KEEP_LINES most salient distinct lines, in their
+// original order, each trimmed to SUMMARY_LINE_SIZE.
+void summarise_lines(const char **lines, int count, char *out,
+                     size_t out_size) {
+  unsigned long shapes[SUMMARY_BLOCK_LINES];
+  int chosen[SUMMARY_KEEP_LINES];
+  int chosen_scores[SUMMARY_KEEP_LINES];
+  int chosen_count = 0;
+
+  if (count > SUMMARY_BLOCK_LINES) {
+    count = SUMMARY_BLOCK_LINES;
+  }
+  for (int i = 0; i < count; i++) {
+    shapes[i] = summary_line_shape(lines[i]);
+    int repeat = 0;
+    for (int j = 0; j < i && !repeat; j++) {
+      repeat = shapes[j] == shapes[i];
+    }
+    int score = repeat ? -1 : summary_line_score(lines[i]);
+    if (score < 0) {
+      continue;
+    }
+
+    // Insertion into the best-first list; earlier lines win ties
+    int pos = chosen_count;
+    while (pos > 0 && chosen_scores[pos - 1] < score) {
+      pos--;
+    }
+    if (pos >= SUMMARY_KEEP_LINES) {
+      continue;
+    }
+    int last = chosen_count < SUMMARY_KEEP_LINES ? chosen_count
+                                                 : SUMMARY_KEEP_LINES - 1;
+    memmove(&chosen[pos + 1], &chosen[pos], (last - pos) * sizeof(int));
+    memmove(&chosen_scores[pos + 1], &chosen_scores[pos],
+            (last - pos) * sizeof(int));
+    chosen[pos] = i;
+    chosen_scores[pos] = score;
+    if (chosen_count < SUMMARY_KEEP_LINES) {
+      chosen_count++;
+    }
+  }
+  qsort(chosen, chosen_count, sizeof(int), compare_ints);
+
+  size_t used = 0;
+  out[0] = '\0';
+  for (int c = 0; c < chosen_count && used + 1 < out_size; c++) {
+    const char *line = lines[chosen[c]];
+    while (*line == ' ' || *line == '\t') {
+      line++;
+    }
+    int written = snprintf(out + used, out_size - used, "%.*s\n",
+                           utf8_prefix(line, SUMMARY_LINE_SIZE), line);
+    if (written < 0 || (size_t)written >= out_size - used) {
+      break;
+    }
+    used += written;
+  }
+  if (used > 0) {
+    out[used - 1] = '\0'; // No trailing newline
+  }
+}
+
+// Look the block up in the summary cache, summarising and caching on a miss
+void summarise_block(summary_block_t *block, const char **lines, int count) {
+  summary_cache_entry_t *entry =
+      &g_state.summary_cache[block->hash % SUMMARY_CACHE_SLOTS];
+  if (entry->hash == block->hash) {
+    g_state.summary_cache_hits++;
+  } else {
+    g_state.summary_cache_misses++;
+    summarise_lines(lines, count, entry->text, sizeof(entry->text));
+    entry->hash = block->hash;
+  }
+  memcpy(block->text, entry->text, sizeof(block->text));
+}
+
+unsigned long summary_hash_combine(unsigned long hash, unsigned long value) {
+  return hash ^ (value + 0x9e3779b97f4a7c15UL + (hash << 6) + (hash >> 2));
+}
+
+summary_block_t *summary_block_at(summary_tree_t *tree, int level,
+                                  int position) {
+  return &tree->blocks[level]
+                      [(tree->start[level] + position) % SUMMARY_RING_BLOCKS];
+}
+
+summary_block_t *summary_push_block(summary_tree_t *tree, int level) {
+  if (tree->count[level] == SUMMARY_RING_BLOCKS) {
+    tree->start[level] = (tree->start[level] + 1) % SUMMARY_RING_BLOCKS;
+    tree->count[level]--;
+  }
+  summary_block_t *block = summary_block_at(tree, level, tree->count[level]);
+  tree->count[level]++;
+  tree->unfolded[level]++;
+  return block;
+}
+
+// Summarise the newest SUMMARY_FANOUT blocks of a level one level up, and
+// carry on upwards while levels fill.
+void summary_fold(summary_tree_t *tree, int level) {
+  while (level + 1 < SUMMARY_LEVELS &&
+         tree->unfolded[level] >= SUMMARY_FANOUT) {
+    char texts[SUMMARY_FANOUT][SUMMARY_TEXT_SIZE];
+    const char *lines[SUMMARY_FANOUT * SUMMARY_KEEP_LINES];
+    int line_count = 0;
+    int first = tree->count[level] - SUMMARY_FANOUT;
+
+    summary_block_t parent = {0};
+    for (int i = 0; i < SUMMARY_FANOUT; i++) {
+      summary_block_t *child = summary_block_at(tree, level, first + i);
+      if (i == 0) {
+        parent.first_seq = child->first_seq;
+        parent.first_time = child->first_time;
+      }
+      parent.last_seq = child->last_seq;
+      parent.last_time = child->last_time;
+      parent.hash = summary_hash_combine(parent.hash, child->hash);
+
+      memcpy(texts[i], child->text, sizeof(texts[i]));
+      char *cursor = texts[i];
+      char *line;
+      while ((line = strsep(&cursor, "\n")) &&
+             line_count < SUMMARY_FANOUT * SUMMARY_KEEP_LINES) {
+        lines[line_count++] = line;
+      }
+    }
+    summarise_block(&parent, lines, line_count);
+    tree->unfolded[level] = 0;
+
+    *summary_push_block(tree, level + 1) = parent;
+    level++;
+  }
+}
+
+// Count a freshly appended history line, sealing the pane's newest
+// SUMMARY_BLOCK_LINES lines into a level-0 block once enough have arrived.
+// Summaries are built here, as output arrives, so queries only read them.
+void summary_feed_line(pane_state_t *pane) {
+  if (!pane->summaries) {
+    pane->summaries = calloc(1, sizeof(summary_tree_t));
+    if (!pane->summaries) {
+      return;
+    }
+  }
+  summary_tree_t *tree = pane->summaries;
+  if (++tree->unsealed_lines < SUMMARY_BLOCK_LINES ||
+      pane->history.count < SUMMARY_BLOCK_LINES) {
+    return;
+  }
+  tree->unsealed_lines = 0;
+
+  const char *lines[SUMMARY_BLOCK_LINES];
+  summary_block_t block = {0};
+  int first = pane->history.count - SUMMARY_BLOCK_LINES;
+  for (int i = 0; i < SUMMARY_BLOCK_LINES; i++) {
+    const history_line_t *line = history_at(&pane->history, first + i);
+    if (!line) {
+      return;
+    }
+    lines[i] = line->text;
+    block.hash = summary_hash_combine(
+        block.hash, hash_bytes(line->text, strlen(line->text)));
+  }
+  block.first_seq = history_slot(&pane->history, first)->seq;
+  block.first_time = history_slot(&pane->history, first)->timestamp;
+  block.last_seq = history_slot(&pane->history, pane->history.count - 1)->seq;
+  block.last_time =
+      history_slot(&pane->history, pane->history.count - 1)->timestamp;
+  summarise_block(&block, lines, SUMMARY_BLOCK_LINES);
+
+  *summary_push_block(tree, 0) = block;
+  summary_fold(tree, 0);
+}
+
+// Bytes of summary text needed to cover blocks ending after since at the
+// given level, plus the newer blocks of finer levels not yet folded into it.
+size_t summary_cover_cost(summary_tree_t *tree, int level, time_t since) {
+  size_t cost = 0;
+  for (int i = 0; i < tree->count[level]; i++) {
+    summary_block_t *block = summary_block_at(tree, level, i);
+    if (block->last_time >= since) {
+      cost += strlen(block->text) + 1;
+    }
+  }
+  for (int l = level - 1; l >= 0; l--) {
+    for (int i = tree->count[l] - tree->unfolded[l]; i < tree->count[l]; i++) {
+      cost += strlen(summary_block_at(tree, l, i)->text) + 1;
+    }
+  }
+  return cost;
+}
+
+// True when the level still holds blocks reaching back to since, so finer
+// levels are not missing anything a coarser one would show.
+int summary_level_covers(summary_tree_t *tree, int level, time_t since) {
+  return tree->count[level] < SUMMARY_RING_BLOCKS ||
+         summary_block_at(tree, level, 0)->first_time <= since;
+}
+
+int append_summary_block(char *body, size_t body_size, size_t *used,
+                         const pane_state_t *pane, int level,
+                         const summary_block_t *block) {
+  int written = snprintf(
+      body + *used, body_size - *used,
+      "=== BLOCK %s (%s) level=%d seq=%lu-%lu time=%ld-%ld hash=%016lx ===\n"
+      "%s\n",
+      pane->pane_index, pane->title, level, block->first_seq, block->last_seq,
+      (long)block->first_time, (long)block->last_time, block->hash,
+      block->text);
+  if (written < 0 || (size_t)written >= body_size - *used) {
+    return 0;
+  }
+  *used += written;
+  return 1;
+}
+
+// Describe the last span seconds of every pane within budget bytes of summary
+// text: each pane gets an equal share and uses the finest level that fits,
+// followed by the finer blocks that have not been folded into it yet.
+void format_summaries(session_context_t *session, long span, size_t budget,
+                      char *response, size_t response_size) {
+  static char body[MAX_BUFFER_SIZE];
+  time_t since = daemon_time() - span;
+  size_t used = 0;
+  int emitted = 0;
+  int panes_with_blocks = 0;
+
+  for (int i = 0; i < session->pane_count; i++) {
+    if (session->panes[i].summaries && session->panes[i].summaries->count[0]) {
+      panes_with_blocks++;
+    }
+  }
+  size_t share = panes_with_blocks ? budget / panes_with_blocks : budget;
+  body[0] = '\0';
+
+  for (int i = 0; i < session->pane_count; i++) {
+    pane_state_t *pane = &session->panes[i];
+    summary_tree_t *tree = pane->summaries;
+    if (!tree || tree->count[0] == 0) {
+      continue;
+    }
+
+    int level = SUMMARY_LEVELS - 1;
+    for (int l = 0; l < SUMMARY_LEVELS; l++) {
+      if (tree->count[l] == 0 && l > 0) {
+        level = l - 1;
+        break;
+      }
+      if (summary_level_covers(tree, l, since) &&
+          summary_cover_cost(tree, l, since) <= share) {
+        level = l;
+        break;
+      }
+    }
+    while (level > 0 && tree->count[level] == 0) {
+      level--;
+    }
+
+    // Finer tails are the most recent, so they claim the share first and
+    // the chosen level fills what is left from its newest block backwards
+    size_t left = share;
+    int tail_start[SUMMARY_LEVELS] = {0};
+    for (int l = level - 1; l >= 0; l--) {
+      tail_start[l] = tree->count[l];
+      for (int b = tree->count[l] - 1; b >= tree->count[l] - tree->unfolded[l];
+           b--) {
+        size_t cost = strlen(summary_block_at(tree, l, b)->text) + 1;
+        if (cost > left) {
+          break;
+        }
+        left -= cost;
+        tail_start[l] = b;
+      }
+    }
+    int first = tree->count[level];
+    for (int b = tree->count[level] - 1; b >= 0; b--) {
+      summary_block_t *block = summary_block_at(tree, level, b);
+      size_t cost = strlen(block->text) + 1;
+      if (block->last_time < since || cost > left) {
+        break;
+      }
+      left -= cost;
+      first = b;
+    }
+
+    for (int b = first; b < tree->count[level]; b++) {
+      emitted += append_summary_block(body, sizeof(body), &used, pane, level,
+                                      summary_block_at(tree, level, b));
+    }
+    for (int l = level - 1; l >= 0; l--) {
+      for (int b = tail_start[l]; b < tree->count[l]; b++) {
+        emitted += append_summary_block(body, sizeof(body), &used, pane, l,
+                                        summary_block_at(tree, l, b));
+      }
+    }
+  }
+
+  snprintf(response, response_size,
+           "Blocks: %d\nCache: %lu hits, %lu misses\n%s", emitted,
+           g_state.summary_cache_hits, g_state.summary_cache_misses, body);
+}
+
+// Split a capture into lines, dropping the blank rows tmux pads the screen
+// with. Returns the number of lines; the buffer is modified in place.
+int split_screen_lines(char *content, char **lines, int max_lines) {
+  int count = 0;
+  // strtok_r would merge blank lines, so split by hand
+  char *cursor = content;
+  while (cursor && count < max_lines) {
+    lines[count++] = strsep(&cursor, "\n");
+  }
+  for (int i = 0; i < count; i++) {
+    size_t len = strlen(lines[i]);
+    while (len > 0 && (lines[i][len - 1] == ' ' || lines[i][len - 1] == '\r')) {
+      lines[i][--len] = '\0';
+    }
+  }
+  while (count > 0 && lines[count - 1][0] == '\0') {
+    count--;
+  }
+  return count;
+}
+
+void ingest_line(session_context_t *session, pane_state_t *pane,
+                 const char *line) {
+  session->line_seq++;
+  g_state.lines_ingested++;
+  unsigned long recorded = session->diagnostics_recorded;
+  diagnostics_feed_line(session, pane, line);
+  if (session->diagnostics_recorded != recorded) {
+    const diagnostic_t *diag = &session->diagnostics[session->last_diagnostic];
+    push_follow_event(session, pane, 'E', 1, "%s %s:%d:%d [%s]: %s",
+                      diag->severity == DIAG_ERROR ? "error" : "warning",
+                      diag->file, diag->line, diag->column, diag->tool,
+                      diag->message);
+  }
+  test_run_state_t test_state = pane->test_run.state;
+  tests_feed_line(pane, line);
+  const test_run_t *run = &pane->test_run;
+  if (run->state == TEST_RUN_FINISHED && test_state != TEST_RUN_FINISHED) {
+    int failed = run->failed || run->errors;
+    push_follow_event(session, pane, 'T', failed,
+                      "%s %s: passed=%d failed=%d skipped=%d errors=%d "
+                      "duration=%.2fs",
+                      test_runner_names[run->runner],
+                      failed ? "failed" : "passed",
+                      run->passed, run->failed, run->skipped, run->errors,
+                      run->duration);
+  }
+  log_miner_feed_line(pane, line);
+  history_append(&pane->history, session->line_seq, line);
+  retrieval_feed_line(session, pane, line);
+  summary_feed_line(pane);
+}
+
+// Work out which lines of a fresh capture are new since the previous one and
+// feed them to the line consumers. The last non-blank row is the cursor line
+// (usually a prompt being typed into), so it is only ingested once a later
+// line follows it.
+void ingest_pane_update(session_context_t *session, pane_state_t *pane,
+                        const char *old_content, const char *new_content) {
+  static char *old_lines[MAX_SCREEN_LINES];
+  static char *new_lines[MAX_SCREEN_LINES];
+
+  if (pane->alternate_screen) {
+    return;
+  }
+
+  char *old_copy = strdup(old_content ? old_content : "");
+  char *new_copy = strdup(new_content);
+  if (!old_copy || !new_copy) {
+    free(old_copy);
+    free(new_copy);
+    return;
+  }
+
+  int old_count = split_screen_lines(old_copy, old_lines, MAX_SCREEN_LINES) - 1;
+  int new_count = split_screen_lines(new_copy, new_lines, MAX_SCREEN_LINES) - 1;
+  if (new_count <= 0) {
+    free(old_copy);
+    free(new_copy);
+    return;
+  }
+  if (old_count < 0) {
+    old_count = 0;
+  }
+
+  static unsigned long old_hashes[MAX_SCREEN_LINES];
+  static unsigned long new_hashes[MAX_SCREEN_LINES];
+  for (int i = 0; i < old_count; i++) {
+    old_hashes[i] = hash_bytes(old_lines[i], strlen(old_lines[i]));
+  }
+  for (int i = 0; i < new_count; i++) {
+    new_hashes[i] = hash_bytes(new_lines[i], strlen(new_lines[i]));
+  }
+
+  // Largest overlap where the old screen's tail is the new screen's head,
+  // i.e. the screen scrolled by (old_count - overlap) lines
+  int overlap = 0;
+  for (int k = old_count < new_count ? old_count : new_count; k > 0; k--) {
+    int match = 1;
+    for (int i = 0; i < k && match; i++) {
+      match = old_hashes[old_count - k + i] == new_hashes[i] &&
+              strcmp(old_lines[old_count - k + i], new_lines[i]) == 0;
+    }
+    if (match) {
+      overlap = k;
+      break;
+    }
+  }
+
+  for (int i = overlap; i < new_count; i++) {
+    ingest_line(session, pane, new_lines[i]);
+  }
+
+  free(old_copy);
+  free(new_copy);
+}
+
+int screen_group_append(screen_group_t *group, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (group->data_len + len + 1 > group->data_capacity) {
+    size_t capacity = (group->data_len + len + 1) * 2;
+    char *data = realloc(group->data, capacity);
+    if (!data) {
+      return -1;
+    }
+    group->data = data;
+    group->data_capacity = capacity;
+  }
+  va_start(args, fmt);
+  vsnprintf(group->data + group->data_len, len + 1, fmt, args);
+  va_end(args);
+  group->data_len += len;
+  return 0;
+}
+
+// A finished group is only read for time travel, so it is kept deflated
+void screen_group_freeze(screen_group_t *group) {
+  unsigned char *out = group->data_len ? malloc(group->data_len) : NULL;
+  long len = out ? history_deflate((unsigned char *)group->data,
+                                   group->data_len, NULL, 0, out,
+                                   group->data_len)
+                 : -1;
+  if (len <= 0) {
+    free(out);
+    return; // Kept as it is
+  }
+  unsigned char *shrunk = realloc(out, len);
+  group->frozen = shrunk ? shrunk : out;
+  group->frozen_len = len;
+  group->raw_len = group->data_len;
+  free(group->data);
+  group->data = NULL;
+  group->data_len = group->data_capacity = 0;
+}
+
+// Record a redraw of a full-screen pane: every SCREEN_KEYFRAME_FRAMES
+// frames the whole screen, otherwise only the rows that differ from the
+// frame before. A `watch` pane then stores a changed clock and a few rows
+// per refresh instead of the whole screen.
+void screen_record(pane_state_t *pane, const char *content) {
+  static char *rows[MAX_SCREEN_LINES];
+  static char *last_rows[MAX_SCREEN_LINES];
+
+  if (!pane->screens) {
+    pane->screens = calloc(1, sizeof(screen_history_t));
+    if (!pane->screens) {
+      return;
+    }
+  }
+  screen_history_t *screens = pane->screens;
+  char *copy = strdup(content);
+  char *last_copy = strdup(screens->last ? screens->last : "");
+  if (!copy || !last_copy) {
+    free(copy);
+    free(last_copy);
+    return;
+  }
+  int row_count = split_screen_lines(copy, rows, MAX_SCREEN_LINES);
+  int last_count = split_screen_lines(last_copy, last_rows, MAX_SCREEN_LINES);
+  int changed = 0;
+  for (int r = 0; r < row_count; r++) {
+    changed += r >= last_count || strcmp(rows[r], last_rows[r]) != 0;
+  }
+  if (screens->frames > 0 && changed == 0 && row_count == last_count) {
+    free(copy);
+    free(last_copy);
+    return; // Differs only in trailing blanks
+  }
+
+  int keyframe = screens->frames % SCREEN_KEYFRAME_FRAMES == 0;
+  if (keyframe) {
+    if (screens->group_count > 0) {
+      screen_group_freeze(&screens->groups[(screens->group_start +
+                                            screens->group_count - 1) %
+                                           SCREEN_GROUPS]);
+    }
+    if (screens->group_count == SCREEN_GROUPS) {
+      screen_group_release(&screens->groups[screens->group_start]);
+      screens->group_start = (screens->group_start + 1) % SCREEN_GROUPS;
+      screens->group_count--;
+    }
+    screen_group_t *fresh =
+        &screens->groups[(screens->group_start + screens->group_count++) %
+                         SCREEN_GROUPS];
+    fresh->first_frame = screens->frames;
+  }
+  screen_group_t *group =
+      &screens->groups[(screens->group_start + screens->group_count - 1) %
+                       SCREEN_GROUPS];
+
+  int failed = screen_group_append(group, "%c %d %d\n", keyframe ? 'K' : 'D',
+                                   keyframe ? row_count : changed, row_count);
+  for (int r = 0; r < row_count && !failed; r++) {
+    if (keyframe) {
+      failed = screen_group_append(group, "%s\n", rows[r]);
+    } else if (r >= last_count || strcmp(rows[r], last_rows[r]) != 0) {
+      failed = screen_group_append(group, "%d %s\n", r, rows[r]);
+    }
+  }
+  free(copy);
+  free(last_copy);
+  if (failed) {
+    return;
+  }
+  group->times[group->frame_count++] = daemon_time();
+  screens->frames++;
+  free(screens->last);
+  screens->last = strdup(content);
+}
+
+// Rebuild frame n of a pane into rows[], pointing into *buffer, which the
+// caller frees. Returns the row count, or -1 when the frame is gone.
+int screen_frame(const screen_history_t *screens, unsigned long n,
+                 char **rows, char **buffer) {
+  const screen_group_t *group = NULL;
+  *buffer = NULL;
+  for (int g = 0; g < screens->group_count && !group; g++) {
+    const screen_group_t *candidate =
+        &screens->groups[(screens->group_start + g) % SCREEN_GROUPS];
+    if (n >= candidate->first_frame &&
+        n < candidate->first_frame + candidate->frame_count) {
+      group = candidate;
+    }
+  }
+  if (!group) {
+    return -1;
+  }
+  size_t len = group->frozen ? group->raw_len : group->data_len;
+  *buffer = malloc(len + 1);
+  if (!*buffer) {
+    return -1;
+  }
+  if (group->frozen) {
+    if (history_inflate(group->frozen, group->frozen_len, NULL, 0,
+                        (unsigned char *)*buffer, len) != (long)len) {
+      return -1;
+    }
+  } else {
+    memcpy(*buffer, group->data, len);
+  }
+  (*buffer)[len] = '\0';
+
+  // Replay the keyframe and the deltas after it up to frame n
+  char *cursor = *buffer;
+  int row_count = 0;
+  for (unsigned long f = group->first_frame; f <= n && cursor; f++) {
+    char kind = 0;
+    int entries = 0, rows_now = 0;
+    char *header = strsep(&cursor, "\n");
+    if (!header || sscanf(header, "%c %d %d", &kind, &entries, &rows_now) != 3) {
+      return -1;
+    }
+    for (int r = row_count; r < rows_now && r < MAX_SCREEN_LINES; r++) {
+      rows[r] = "";
+    }
+    row_count = rows_now < MAX_SCREEN_LINES ? rows_now : MAX_SCREEN_LINES;
+    for (int e = 0; e < entries && cursor; e++) {
+      char *line = strsep(&cursor, "\n");
+      int row = e;
+      if (kind == 'D') {
+        row = atoi(line);
+        line = strchr(line, ' ');
+        line = line ? line + 1 : "";
+      }
+      if (row >= 0 && row < row_count) {
+        rows[row] = line;
+      }
+    }
+  }
+  return row_count;
+}
+
+// Newest frame recorded at or before `when`, or the oldest kept
+unsigned long screen_frame_at(const screen_history_t *screens, time_t when,
+                              time_t *taken) {
+  unsigned long found = 0;
+  *taken = 0;
+  for (int g = 0; g < screens->group_count; g++) {
+    const screen_group_t *group =
+        &screens->groups[(screens->group_start + g) % SCREEN_GROUPS];
+    for (int f = 0; f < group->frame_count; f++) {
+      if (group->times[f] <= when || *taken == 0) {
+        found = group->first_frame + f;
+        *taken = group->times[f];
+      }
+    }
+  }
+  return found;
+}
+
+// A full-screen pane as it was `ago` seconds back, or, given a base time,
+// only the rows that differ from the base frame to that one.
+void format_screen(session_context_t *session, const char *pane_spec,
+                   long ago, long base_ago, char *response,
+                   size_t response_size) {
+  static char *rows[MAX_SCREEN_LINES];
+  static char *base_rows[MAX_SCREEN_LINES];
+  const pane_state_t *pane = NULL;
+  for (int p = 0; p < session->pane_count && !pane; p++) {
+    if (strcmp(session->panes[p].pane_id, pane_spec) == 0 ||
+        strcmp(session->panes[p].pane_index, pane_spec) == 0) {
+      pane = &session->panes[p];
+    }
+  }
+  if (!pane || !pane->screens || pane->screens->frames == 0) {
+    snprintf(response, response_size, "ERROR: %s",
+             pane ? "No full-screen frames recorded for this pane"
+                  : "Pane not found");
+    return;
+  }
+
+  time_t now = daemon_time();
+  time_t taken, base_taken = 0;
+  unsigned long frame = screen_frame_at(pane->screens, now - ago, &taken);
+  char *buffer = NULL, *base_buffer = NULL;
+  int row_count = screen_frame(pane->screens, frame, rows, &buffer);
+  int base_count = 0;
+  unsigned long base_frame = 0;
+  if (base_ago >= 0) {
+    base_frame = screen_frame_at(pane->screens, now - base_ago, &base_taken);
+    base_count = screen_frame(pane->screens, base_frame, base_rows,
+                              &base_buffer);
+  }
+  if (row_count < 0 || base_count < 0) {
+    snprintf(response, response_size, "ERROR: Frame could not be rebuilt");
+  } else {
+    size_t used = snprintf(
+        response, response_size,
+        "Frame: %lu of %lu, %lds ago\nStored: %zu bytes\n", frame,
+        pane->screens->frames, (long)(now - taken),
+        screen_history_bytes(pane->screens));
+    if (base_ago >= 0) {
+      used += snprintf(response + used, response_size - used,
+                       "Base: frame %lu, %lds ago\n", base_frame,
+                       (long)(now - base_taken));
+    }
+    int rows_max = row_count > base_count ? row_count : base_count;
+    for (int r = 0; r < rows_max && used < response_size; r++) {
+      const char *row = r < row_count ? rows[r] : "";
+      if (base_ago < 0) {
+        used += snprintf(response + used, response_size - used, "%s\n", row);
+      } else if (strcmp(row, r < base_count ? base_rows[r] : "") != 0) {
+        used += snprintf(response + used, response_size - used, "%d: %s\n", r,
+                         row);
+      }
+    }
+  }
+  free(buffer);
+  free(base_buffer);
+}
+
+void capture_pane(session_context_t *session, pane_state_t *pane) {
+  char start[16];
+  char temp_content[MAX_BUFFER_SIZE];
+
+  // Include some history so output that scrolled past between polls is still
+  // seen, and join wrapped rows so long lines parse as one. Rows that do not
+  // fit the buffer are lost from the top, never the newest at the bottom.
+  snprintf(start, sizeof(start), "-%d", CAPTURE_HISTORY_LINES);
+  if (tmux_command(&g_state.servers[session->server], temp_content,
+                   sizeof(temp_content), "capture-pane", "-t", pane->pane_id,
+                   "-p", "-J", "-S", start, NULL) != ERROR_NONE) {
+    return;
+  }
+
+  // Everything downstream (history, indexes, responses) sees valid UTF-8
+  size_t content_len = utf8_repair(temp_content, strlen(temp_content));
+  unsigned long hash = hash_bytes(temp_content, content_len);
+  pane->last_capture_tick = session->capture_tick;
+  if (pane->content && hash == pane->content_hash &&
+      content_len == pane->content_len) {
+    return;
+  }
+
+  if (!pane->tail) { // A followed file's lines come from the file itself
+    ingest_pane_update(session, pane, pane->content, temp_content);
+  }
+
+  char *content = realloc(pane->content, content_len + 1);
+  if (!content) {
+    return;
+  }
+  memcpy(content, temp_content, content_len + 1);
+  pane->content = content;
+  pane->content_len = content_len;
+  pane->content_hash = hash;
+  pane->last_change = daemon_time();
+  if (pane->alternate_screen) {
+    screen_record(pane, content);
+  }
+}
+
+// Feed what a tailed file gained since the last read into the pane's
+// history, whole lines only; a line still being written waits in partial.
+// At most TAIL_READ_BUDGET bytes go per call, so one busy log cannot
+// stall the loop; the rest stays pending for the next.
+void tail_pump(session_context_t *session, pane_state_t *pane) {
+  pane_tail_t *tail = pane->tail;
+  struct stat st;
+  if (fstat(tail->fd, &st) == 0 && st.st_size < tail->offset) {
+    tail->offset = 0; // Truncated in place, as copytruncate rotation does
+    tail->partial_len = 0;
+  }
+
+  char buffer[65536];
+  size_t budget = TAIL_READ_BUDGET;
+  tail->pending = 0;
+  while (budget > 0) {
+    ssize_t got = pread(tail->fd, buffer,
+                        budget < sizeof(buffer) ? budget : sizeof(buffer),
+                        tail->offset);
+    if (got <= 0) {
+      return;
+    }
+    tail->offset += got;
+    budget -= got;
+    pane->last_change = daemon_time();
+
+    for (char *cursor = buffer; cursor < buffer + got;) {
+      char *eol = memchr(cursor, '\n', buffer + got - cursor);
+      size_t len = (eol ? eol : buffer + got) - cursor;
+      size_t room = sizeof(tail->partial) - 1 - tail->partial_len;
+      size_t kept = len < room ? len : room; // Overlong lines are cut
+      memcpy(tail->partial + tail->partial_len, cursor, kept);
+      tail->partial_len += kept;
+      cursor += len + (eol != NULL);
+      if (!eol) {
+        break;
+      }
+      if (tail->partial_len > 0 &&
+          tail->partial[tail->partial_len - 1] == '\r') {
+        tail->partial_len--;
+      }
+      tail->partial[tail->partial_len] = '\0';
+      utf8_repair(tail->partial, tail->partial_len);
+      ingest_line(session, pane, tail->partial);
+      tail->partial_len = 0;
+    }
+  }
+  tail->pending = 1;
+}
+
+// Read inotify events and mark the tails and history files they concern. A
+// tailed file renamed or deleted away (log rotation) is read to its end,
+// then let go; the next topology refresh picks up whatever tail -F reopens.
+// History files are watched through their directory, so events name them.
+void read_watch_events(void) {
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while ((len = read(g_state.inotify_fd, events, sizeof(events))) > 0) {
+    for (char *p = events; p < events + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+      for (int i = 0; i < g_state.session_count; i++) {
+        for (int k = 0; k < g_state.sessions[i].pane_count; k++) {
+          pane_tail_t *tail = g_state.sessions[i].panes[k].tail;
+          if (tail && tail->wd == event->wd) {
+            tail->pending = 1;
+            tail->file_gone |=
+                (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) != 0;
+            tail->watch_removed |= (event->mask & IN_IGNORED) != 0;
+          }
+        }
+      }
+      for (int h = 0; h < g_state.shell_history_count; h++) {
+        shell_history_t *history = g_state.shell_histories[h];
+        if (history->wd == event->wd &&
+            ((event->mask & IN_IGNORED) ||
+             (event->len > 0 && strcmp(event->name, history->name) == 0))) {
+          history->pending = 1;
+          history->wd = event->mask & IN_IGNORED ? -1 : history->wd;
+        }
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+// Read what history files gained since their last read. At most
+// TAIL_READ_BUDGET bytes go per file and call, like a tail.
+void shell_history_pump(int index) {
+  shell_history_t *history = g_state.shell_histories[index];
+  history->pending = 0;
+  struct stat st;
+  int fd = shell_history_open(history, &st);
+  if (fd < 0) {
+    return; // Between a rewrite's unlink and rename; its event follows
+  }
+  if (st.st_ino != history->inode || st.st_size < history->offset) {
+    close(fd);
+    shell_history_resync(index, 1);
+    return;
+  }
+
+  char buffer[65536];
+  size_t budget = TAIL_READ_BUDGET;
+  while (budget > 0) {
+    ssize_t got = pread(fd, buffer,
+                        budget < sizeof(buffer) ? budget : sizeof(buffer),
+                        history->offset);
+    if (got <= 0) {
+      break;
+    }
+    history->offset += got;
+    budget -= got;
+    shell_history_feed(index, buffer, got, 1, 0);
+  }
+  close(fd);
+  history->pending = budget == 0;
+}
+
+// Returns whether any tail or history file still has data waiting, so the
+// loop need not sleep.
+int pump_tails(void) {
+  int waiting = 0;
+  for (int h = 0; h < g_state.shell_history_count; h++) {
+    if (g_state.shell_histories[h]->pending) {
+      shell_history_pump(h);
+      waiting |= g_state.shell_histories[h]->pending;
+    }
+  }
+  for (int i = 0; i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    for (int p = 0; p < session->pane_count; p++) {
+      pane_state_t *pane = &session->panes[p];
+      if (pane->tail && pane->tail->pending) {
+        tail_pump(session, pane);
+        waiting |= pane->tail->pending;
+      }
+    }
+  }
+  return waiting;
+}
+
+// Split the scrollback budget between panes in proportion to their tier
+// weight. Panes that need less than their share hand the rest back to the
+// others, so a short active pane does not waste space.
+void assign_pane_budgets(pane_state_t **panes, size_t *budgets, int count,
+                         size_t total) {
+  int settled[MAX_PANES_PER_SESSION] = {0};
+  size_t remaining = total;
+
+  for (int i = 0; i < count; i++) {
+    budgets[i] = 0;
+  }
+
+  for (int pass = 0; pass < count && remaining > 0; pass++) {
+    int weight_sum = 0;
+    for (int i = 0; i < count; i++) {
+      if (!settled[i]) {
+        weight_sum += priority_budget_weight[panes[i]->priority];
+      }
+    }
+    if (weight_sum == 0) {
+      break;
+    }
+
+    int progress = 0;
+    for (int i = 0; i < count; i++) {
+      if (settled[i]) {
+        continue;
+      }
+      size_t share =
+          remaining * priority_budget_weight[panes[i]->priority] / weight_sum;
+      if (panes[i]->content_len <= share) {
+        budgets[i] = panes[i]->content_len;
+        settled[i] = 1;
+        progress = 1;
+      }
+    }
+
+    remaining = total;
+    for (int i = 0; i < count; i++) {
+      if (settled[i]) {
+        remaining -= budgets[i];
+      }
+    }
+
+    if (!progress) {
+      // Nobody fits: everyone left gets exactly their proportional share
+      for (int i = 0; i < count; i++) {
+        if (!settled[i]) {
+          budgets[i] =
+              remaining * priority_budget_weight[panes[i]->priority] /
+              weight_sum;
+        }
+      }
+      break;
+    }
+  }
+}
+
+void append_pane_scrollback(session_context_t *session, pane_state_t *pane,
+                            size_t budget) {
+  size_t space = sizeof(session->scrollback) - session->scrollback_len - 1;
+  int header_len = snprintf(session->scrollback + session->scrollback_len,
+                            space + 1, "\n=== PANE %s (%s) ===\n",
+                            pane->pane_index, pane->title);
+  if (header_len < 0 || (size_t)header_len >= space) {
+    session->scrollback[session->scrollback_len] = '\0';
+    return;
+  }
+  session->scrollback_len += header_len;
+  space -= header_len;
+
+  // Keep the tail of the pane, starting on a line boundary
+  const char *start = pane->content;
+  size_t len = pane->content_len;
+  if (budget > space) {
+    budget = space;
+  }
+  if (len > budget) {
+    start = pane->content + (len - budget);
+    const char *nl = memchr(start, '\n', budget);
+    if (nl && (size_t)(nl - start) < budget / 2) {
+      start = nl + 1;
+    }
+    len = pane->content + pane->content_len - start;
+  }
+
+  memcpy(session->scrollback + session->scrollback_len, start, len);
+  session->scrollback_len += len;
+  session->scrollback[session->scrollback_len] = '\0';
+}
+
+muxgeist_error_t capture_all_panes(session_context_t *session) {
+  session->capture_tick++;
+
+  if (refresh_pane_topology(session) != ERROR_NONE) {
+    return ERROR_TMUX_CMD;
+  }
+
+  // Order panes by priority so the one the user is looking at comes first
+  pane_state_t *ordered[MAX_PANES_PER_SESSION];
+  int ordered_count = 0;
+  for (int i = 0; i < session->pane_count; i++) {
+    pane_state_t *pane = &session->panes[i];
+
+    // Skip the muxgeist pane itself
+    if (strstr(pane->title, "muxgeist") != NULL) {
+      pane->finished_command[0] = '\0';
+      continue;
+    }
+
+    // A finished command's last output is captured before it is announced
+    unsigned long interval = priority_capture_interval[pane->priority];
+    if (!pane->content || pane->finished_command[0] ||
+        session->capture_tick - pane->last_capture_tick >= interval) {
+      capture_pane(session, pane);
+    }
+    if (pane->finished_command[0]) {
+      push_follow_event(session, pane, 'C', 0, "%s finished",
+                        pane->finished_command);
+      pane->finished_command[0] = '\0';
+    }
+
+    // Only include panes with meaningful content (skip empty/minimal panes)
+    if (pane->content && pane->content_len > 10) {
+      ordered[ordered_count++] = pane;
+    }
+  }
+  qsort(ordered, ordered_count, sizeof(ordered[0]), compare_pane_priority);
+
+  size_t budgets[MAX_PANES_PER_SESSION];
+  size_t reserve = (size_t)ordered_count * PANE_HEADER_RESERVE;
+  size_t total = sizeof(session->scrollback) - 1;
+  assign_pane_budgets(ordered, budgets, ordered_count,
+                      total > reserve ? total - reserve : 0);
+
+  session->scrollback[0] = '\0';
+  session->scrollback_len = 0;
+  for (int i = 0; i < ordered_count; i++) {
+    append_pane_scrollback(session, ordered[i], budgets[i]);
+  }
+
+  // If we didn't capture any panes (all were empty/muxgeist), capture the
+  // active pane
+  if (ordered_count == 0) {
+    char target[80];
+    session_target(session, target, sizeof(target));
+    if (tmux_command(&g_state.servers[session->server], session->scrollback,
+                     sizeof(session->scrollback), "capture-pane", "-t", target,
+                     "-p", NULL) == ERROR_NONE) {
+      session->scrollback_len = strlen(session->scrollback);
+    }
+  }
+
+  return ERROR_NONE;
+}
+
+// Pin the current capture of every pane under a new snapshot sequence number,
+// storing copies only for panes that changed since their last snapshot.
+unsigned long session_mark_snapshot(session_context_t *session) {
+  session->snapshot_seq++;
+  for (int i = 0; i < session->pane_count; i++) {
+    pane_state_t *pane = &session->panes[i];
+    if (!pane->content) {
+      continue;
+    }
+    if (pane->snapshot_count > 0) {
+      pane_snapshot_t *newest =
+          &pane->snapshots[(pane->snapshot_start + pane->snapshot_count - 1) %
+                           PANE_SNAPSHOTS];
+      if (newest->hash == pane->content_hash) {
+        continue;
+      }
+    }
+
+    char *copy = strdup(pane->content);
+    if (!copy) {
+      continue;
+    }
+    if (pane->snapshot_count == PANE_SNAPSHOTS) {
+      free(pane->snapshots[pane->snapshot_start].content);
+      pane->snapshot_start = (pane->snapshot_start + 1) % PANE_SNAPSHOTS;
+      pane->snapshot_count--;
+    }
+    pane_snapshot_t *snapshot =
+        &pane->snapshots[(pane->snapshot_start + pane->snapshot_count) %
+                         PANE_SNAPSHOTS];
+    snapshot->seq = session->snapshot_seq;
+    snapshot->taken = daemon_time();
+    snapshot->hash = pane->content_hash;
+    snapshot->content = copy;
+    pane->snapshot_count++;
+  }
+  return session->snapshot_seq;
+}
+
+// The newest snapshot at or before seq. Falls back to the oldest one kept
+// (setting *exact to 0) when seq has been evicted, and returns NULL when the
+// pane has no snapshot from before seq at all.
+const pane_snapshot_t *pane_snapshot_at(const pane_state_t *pane,
+                                        unsigned long seq, int *exact) {
+  *exact = 1;
+  for (int i = pane->snapshot_count - 1; i >= 0; i--) {
+    const pane_snapshot_t *snapshot =
+        &pane->snapshots[(pane->snapshot_start + i) % PANE_SNAPSHOTS];
+    if (snapshot->seq <= seq) {
+      return snapshot;
+    }
+  }
+  if (pane->snapshot_count == PANE_SNAPSHOTS) {
+    *exact = 0;
+    return &pane->snapshots[pane->snapshot_start];
+  }
+  return NULL;
+}
+
+int append_hunk(diff_hunk_t *hunks, int hunk_count, int max_hunks, int old_pos,
+                int new_pos, int deleted) {
+  diff_hunk_t *last = hunk_count ? &hunks[hunk_count - 1] : NULL;
+  if (!last || last->old_start + last->old_count != old_pos ||
+      last->new_start + last->new_count != new_pos) {
+    if (hunk_count == max_hunks) {
+      return -1;
+    }
+    last = &hunks[hunk_count++];
+    last->old_start = old_pos;
+    last->new_start = new_pos;
+    last->old_count = 0;
+    last->new_count = 0;
+  }
+  if (deleted) {
+    last->old_count++;
+  } else {
+    last->new_count++;
+  }
+  return hunk_count;
+}
+
+// Myers' O(ND) line diff over line hashes. The common prefix and suffix are
+// skipped first, which is all the work for the usual append-only pane.
+// Returns the number of hunks, or -1 when the edit distance exceeds
+// DIFF_MAX_EDITS or the hunks do not fit.
+int diff_lines(const unsigned long *a, int n, const unsigned long *b, int m,
+               diff_hunk_t *hunks, int max_hunks) {
+  int prefix = 0;
+  while (prefix < n && prefix < m && a[prefix] == b[prefix]) {
+    prefix++;
+  }
+  int suffix = 0;
+  while (suffix < n - prefix && suffix < m - prefix &&
+         a[n - 1 - suffix] == b[m - 1 - suffix]) {
+    suffix++;
+  }
+  a += prefix;
+  b += prefix;
+  n -= prefix + suffix;
+  m -= prefix + suffix;
+  if (n == 0 && m == 0) {
+    return 0;
+  }
+  if (n == 0 || m == 0) {
+    hunks[0] = (diff_hunk_t){prefix, n, prefix, m};
+    return 1;
+  }
+
+  int max = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+  int width = 2 * max + 2;
+  int *trace = malloc((size_t)(max + 1) * width * sizeof(int));
+  if (!trace) {
+    return -1;
+  }
+  int *v = calloc(width, sizeof(int));
+  if (!v) {
+    free(trace);
+    return -1;
+  }
+#define V(k) v[(k) + max]
+  int distance = -1;
+  for (int d = 0; d <= max && distance < 0; d++) {
+    memcpy(trace + (size_t)d * width, v, width * sizeof(int));
+    for (int k = -d; k <= d; k += 2) {
+      int x = (k == -d || (k != d && V(k - 1) < V(k + 1))) ? V(k + 1)
+                                                         : V(k - 1) + 1;
+      int y = x - k;
+      while (x < n && y < m && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      V(k) = x;
+      if (x >= n && y >= m) {
+        distance = d;
+        break;
+      }
+    }
+  }
+#undef V
+  free(v);
+  if (distance < 0) {
+    free(trace);
+    return -1;
+  }
+
+  // Walk the trace back from (n, m), collecting the edits in reverse
+  int *edit_old = malloc(distance * sizeof(int) + 1);
+  int *edit_new = malloc(distance * sizeof(int) + 1);
+  char *edit_deleted = malloc(distance + 1);
+  int x = n, y = m;
+  if (edit_old && edit_new && edit_deleted) {
+    for (int d = distance; d > 0; d--) {
+      const int *prev = trace + (size_t)d * width + max;
+      int k = x - y;
+      int prev_k = (k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+                       ? k + 1
+                       : k - 1;
+      int prev_x = prev[prev_k];
+      int prev_y = prev_x - prev_k;
+      x = prev_x;
+      y = prev_y;
+      edit_old[d - 1] = prev_x;
+      edit_new[d - 1] = prev_y;
+      edit_deleted[d - 1] = prev_k == k - 1;
+    }
+  }
+  free(trace);
+
+  int hunk_count = 0;
+  if (edit_old && edit_new && edit_deleted) {
+    for (int e = 0; e < distance && hunk_count >= 0; e++) {
+      hunk_count = append_hunk(hunks, hunk_count, max_hunks,
+                               prefix + edit_old[e], prefix + edit_new[e],
+                               edit_deleted[e]);
+    }
+  } else {
+    hunk_count = -1;
+  }
+  free(edit_old);
+  free(edit_new);
+  free(edit_deleted);
+  return hunk_count;
+}
+
+// Append a pane's edit script from its snapshot at since to its current
+// capture. Deletions at the very top of a scrolling pane are output that
+// scrolled out of the captured history, so they are only counted.
+int format_pane_diff(pane_state_t *pane, unsigned long since, char *out,
+                     size_t out_size) {
+  static diff_hunk_t hunks[MAX_SCREEN_LINES];
+  char *old_lines[MAX_SCREEN_LINES];
+  char *new_lines[MAX_SCREEN_LINES];
+  unsigned long old_hashes[MAX_SCREEN_LINES];
+  unsigned long new_hashes[MAX_SCREEN_LINES];
+
+  int exact;
+  const pane_snapshot_t *base = pane_snapshot_at(pane, since, &exact);
+  if (!pane->content || (base && base->hash == pane->content_hash)) {
+    return 0;
+  }
+
+  char *old_copy = strdup(base ? base->content : "");
+  char *new_copy = strdup(pane->content);
+  if (!old_copy || !new_copy) {
+    free(old_copy);
+    free(new_copy);
+    return 0;
+  }
+  int n = split_screen_lines(old_copy, old_lines, MAX_SCREEN_LINES);
+  int m = split_screen_lines(new_copy, new_lines, MAX_SCREEN_LINES);
+  for (int i = 0; i < n; i++) {
+    old_hashes[i] = hash_bytes(old_lines[i], strlen(old_lines[i]));
+  }
+  for (int i = 0; i < m; i++) {
+    new_hashes[i] = hash_bytes(new_lines[i], strlen(new_lines[i]));
+  }
+
+  int hunk_count =
+      diff_lines(old_hashes, n, new_hashes, m, hunks, MAX_SCREEN_LINES);
+  int replaced = hunk_count < 0;
+  if (replaced) {
+    hunks[0] = (diff_hunk_t){0, n, 0, m};
+    hunk_count = 1;
+  }
+  if (hunk_count == 0) {
+    free(old_copy);
+    free(new_copy);
+    return 0;
+  }
+
+  int added = 0, removed = 0;
+  for (int h = 0; h < hunk_count; h++) {
+    added += hunks[h].new_count;
+    removed += hunks[h].old_count;
+  }
+
+  size_t used = 0;
+#define APPEND(...)                                                            \
+  do {                                                                         \
+    int written_ = snprintf(out + used, out_size - used, __VA_ARGS__);         \
+    if (written_ < 0 || (size_t)written_ >= out_size - used) {                 \
+      goto truncated;                                                          \
+    }                                                                          \
+    used += written_;                                                          \
+  } while (0)
+
+  APPEND("=== PANE %s (%s) base=%lu%s age=%lds +%d -%d%s ===\n",
+         pane->pane_index, pane->title, base ? base->seq : 0,
+         exact ? "" : "~", base ? (long)(daemon_time() - base->taken) : 0L, added,
+         removed, replaced ? " replaced" : "");
+  for (int h = 0; h < hunk_count; h++) {
+    diff_hunk_t *hunk = &hunks[h];
+    int scrolled = h == 0 && hunk->old_start == 0 && hunk->old_count > 0 &&
+                   !pane->alternate_screen;
+    if (scrolled) {
+      APPEND("~ %d lines scrolled out of view\n", hunk->old_count);
+      if (hunk->new_count == 0) {
+        continue;
+      }
+    }
+    APPEND("@@ -%d,%d +%d,%d @@\n", hunk->old_start + 1,
+           scrolled ? 0 : hunk->old_count, hunk->new_start + 1,
+           hunk->new_count);
+    for (int i = 0; i < (scrolled ? 0 : hunk->old_count); i++) {
+      APPEND("-%s\n", old_lines[hunk->old_start + i]);
+    }
+    for (int i = 0; i < hunk->new_count; i++) {
+      APPEND("+%s\n", new_lines[hunk->new_start + i]);
+    }
+  }
+#undef APPEND
+  free(old_copy);
+  free(new_copy);
+  return used;
+
+truncated:
+  free(old_copy);
+  free(new_copy);
+  // Keep whole lines and say so
+  char *cut = used ? memrchr(out, '\n', used) : NULL;
+  used = cut ? (size_t)(cut - out + 1) : 0;
+  if (out_size - used > 16) {
+    used += snprintf(out + used, out_size - used, "... truncated\n");
+  }
+  return used;
+}
+
+// Line diff of every pane since the client's snapshot sequence number. The
+// response starts with a fresh sequence number to diff against next time.
+void format_diff(session_context_t *session, unsigned long since,
+                 char *response, size_t response_size) {
+  static char body[MAX_BUFFER_SIZE];
+  size_t used = 0;
+  int changed = 0;
+
+  body[0] = '\0';
+  for (int i = 0; i < session->pane_count && used + 1 < sizeof(body); i++) {
+    int len = format_pane_diff(&session->panes[i], since, body + used,
+                               sizeof(body) - used);
+    if (len > 0) {
+      used += len;
+      changed++;
+    }
+  }
+
+  unsigned long seq = session_mark_snapshot(session);
+  snprintf(response, response_size, "Seq: %lu\nSince: %lu\nChanged: %d of %d panes\n%s",
+           seq, since, changed, session->pane_count, body);
+}
+
+// Keep only characters that are safe inside a single-quoted shell word and
+// are not tmux format syntax.
+void sanitize_status_text(char *dst, size_t dst_size, const char *src) {
+  size_t len = 0;
+  for (; *src && len + 1 < dst_size; src++) {
+    unsigned char c = *src;
+    if (c >= 0x20 && c != 0x7f && !strchr("'\"#`$\\", c)) {
+      dst[len++] = c;
+    }
+  }
+  dst[len] = '\0';
+}
+
+// Compose the session's status string and store it in the session's
+// @muxgeist_status user option when it changes, so status lines show it
+// with #{@muxgeist_status} instead of forking a command per refresh.
+void publish_session_status(session_context_t *session) {
+  char status[sizeof(session->status_line)];
+  size_t used = 0;
+  int errors = 0, warnings = 0;
+
+  prune_diagnostics(session);
+  for (int i = 0; i < session->diagnostic_count; i++) {
+    if (session->diagnostics[i].severity == DIAG_ERROR) {
+      errors++;
+    } else {
+      warnings++;
+    }
+  }
+  status[0] = '\0';
+  if (errors) {
+    used += snprintf(status + used, sizeof(status) - used, "✖%d ", errors);
+  }
+  if (warnings) {
+    used += snprintf(status + used, sizeof(status) - used, "⚠%d ", warnings);
+  }
+
+  // One entry per runner, not per pane
+  unsigned int running = 0, failing = 0, passing = 0;
+  int failed_tests = 0;
+  time_t now = daemon_time();
+  for (int i = 0; i < session->pane_count; i++) {
+    test_run_t *run = &session->panes[i].test_run;
+    unsigned int bit = 1u << run->runner;
+    if (run->state == TEST_RUN_RUNNING) {
+      running |= bit;
+    } else if (run->state == TEST_RUN_FINISHED &&
+               now - run->finished <= STATUS_TEST_AGE) {
+      if (run->failed || run->errors) {
+        failing |= bit;
+        failed_tests += run->failed + run->errors;
+      } else {
+        passing |= bit;
+      }
+    }
+  }
+  const char *marks[3] = {"▶", "✘", "✔"};
+  unsigned int sets[3] = {running, failing, passing & ~failing};
+  for (int m = 0; m < 3 && used < sizeof(status); m++) {
+    if (!sets[m]) {
+      continue;
+    }
+    used += snprintf(status + used, sizeof(status) - used, "%s", marks[m]);
+    if (m == 1 && used < sizeof(status)) {
+      used += snprintf(status + used, sizeof(status) - used, "%d ",
+                       failed_tests);
+    }
+    const char *separator = "";
+    for (int r = TEST_RUNNER_NONE + 1; r < TEST_RUNNER_COUNT; r++) {
+      if ((sets[m] & (1u << r)) && used < sizeof(status)) {
+        used += snprintf(status + used, sizeof(status) - used, "%s%s",
+                         separator, test_runner_names[r]);
+        separator = ",";
+      }
+    }
+    if (used < sizeof(status)) {
+      used += snprintf(status + used, sizeof(status) - used, " ");
+    }
+  }
+  if (session->status_note[0] && used < sizeof(status)) {
+    used += snprintf(status + used, sizeof(status) - used, "%s ",
+                     session->status_note);
+  }
+  if (used >= sizeof(status)) {
+    used = strlen(status);
+  }
+  if (used > 0 && status[used - 1] == ' ') {
+    status[used - 1] = '\0';
+  }
+
+  if (session->status_published && strcmp(status, session->status_line) == 0) {
+    return;
+  }
+
+  char target[80];
+  char output[256];
+  session_target(session, target, sizeof(target));
+  if (tmux_command(&g_state.servers[session->server], output, sizeof(output),
+                   "set-option", "-q", "-t", target, "@muxgeist_status", status,
+                   NULL) == ERROR_NONE) {
+    strcpy(session->status_line, status);
+    session->status_published = 1;
+  }
+}
+
+muxgeist_error_t update_session_context(session_context_t *session) {
+  char target[80];
+  char output[MAX_BUFFER_SIZE];
+  muxgeist_error_t rc = ERROR_NONE;
+  const tmux_server_t *server = &g_state.servers[session->server];
+
+  // Get current pane and the working directory of the active pane
+  session_target(session, target, sizeof(target));
+  rc = tmux_command(server, output, sizeof(output), "display-message", "-t",
+                    target, "-p", "#{pane_id}\t#{pane_current_path}", NULL);
+  char *path = strchr(output, '\t');
+  if (rc == ERROR_NONE && path) {
+    *path++ = '\0';
+    strncpy(session->current_pane, output, sizeof(session->current_pane) - 1);
+    strncpy(session->current_cwd, path, sizeof(session->current_cwd) - 1);
+  }
+
+  // Capture content from all panes
+  rc = capture_all_panes(session);
+  publish_session_status(session);
+
+  session->last_activity = daemon_time();
+  return rc;
+}
+
+void update_user_memory(user_account_t *account) {
+  account->memory_bytes = 0;
+  account->session_count = 0;
+  for (int i = 0; i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    if (g_state.servers[session->server].owner == account->uid) {
+      account->memory_bytes += session_memory_bytes(session);
+      account->session_count++;
+    }
+  }
+}
+
+void drop_subscriber(int index) {
+  close(g_state.subscribers[index]);
+  g_state.subscriber_count--;
+  g_state.subscribers[index] = g_state.subscribers[g_state.subscriber_count];
+  g_state.subscriber_uids[index] =
+      g_state.subscriber_uids[g_state.subscriber_count];
+}
+
+// Subscribers never block the daemon: one whose socket buffer is full is
+// dropped, and resynchronises from a fresh snapshot when it reconnects.
+int send_to_subscriber(int index, const char *data, size_t len) {
+  ssize_t sent = send(g_state.subscribers[index], data, len,
+                      MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (sent != (ssize_t)len) {
+    drop_subscriber(index);
+    return -1;
+  }
+  return 0;
+}
+
+// Send to every subscriber allowed to see the session
+void broadcast_sync(const session_context_t *session, const char *line,
+                    size_t len) {
+  uid_t owner = g_state.servers[session->server].owner;
+  for (int i = g_state.subscriber_count - 1; i >= 0; i--) {
+    if (!g_state.system_mode || g_state.subscriber_uids[i] == 0 ||
+        g_state.subscriber_uids[i] == owner) {
+      send_to_subscriber(i, line, len);
+    }
+  }
+}
+
+// Forget a session that tmux no longer has. The last session moves into its
+// slot; followers of the removed one are told it is gone on their next flush,
+// and subscribers that were sent it get "GONE id" now.
+void remove_session(int index) {
+  session_context_t *session = &g_state.sessions[index];
+  session_context_t *last = &g_state.sessions[g_state.session_count - 1];
+  printf("tmux session gone: %s\n", session->session_id);
+  if (session->sync_hash) {
+    char line[SYNC_LINE_SIZE];
+    int len = snprintf(line, sizeof(line), "GONE %s\n", session->session_id);
+    broadcast_sync(session, line, len);
+  }
+  for (int p = 0; p < session->pane_count; p++) {
+    session->panes[p].seen = 0;
+  }
+  sweep_panes(session);
+  retrieval_index_free(&session->retrieval);
+  for (int f = 0; f < g_state.follower_count; f++) {
+    follower_t *follower = &g_state.followers[f];
+    if (follower->session == session) {
+      follower->session = NULL;
+    } else if (follower->session == last) {
+      follower->session = session;
+    }
+  }
+  uid_t owner = g_state.servers[session->server].owner;
+  if (session != last) {
+    memcpy(session, last, sizeof(*session));
+  }
+  g_state.session_count--;
+  user_account_t *account = g_state.system_mode ? user_account(owner) : NULL;
+  if (account) {
+    update_user_memory(account);
+  }
+}
+
+// Remove a server's sessions that the last probe did not list, or all of
+// them once the server is gone
+void remove_unlisted_sessions(int server) {
+  for (int i = g_state.session_count - 1; i >= 0; i--) {
+    if (g_state.sessions[i].server == server &&
+        (!g_state.servers[server].alive || !g_state.sessions[i].listed)) {
+      remove_session(i);
+    }
+  }
+}
+
+int find_server(const char *socket_path) {
+  for (int i = 0; i < g_state.server_count; i++) {
+    if (strcmp(g_state.servers[i].socket_path, socket_path) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void track_server(const char *name, const char *socket_path) {
+  int index = find_server(socket_path);
+  if (index < 0) {
+    if (g_state.server_count >= MAX_TMUX_SERVERS) {
+      return;
+    }
+    index = g_state.server_count++;
+    tmux_server_t *server = &g_state.servers[index];
+    memset(server, 0, sizeof(*server));
+    strncpy(server->name, name, sizeof(server->name) - 1);
+    strncpy(server->socket_path, socket_path, sizeof(server->socket_path) - 1);
+  }
+
+  tmux_server_t *server = &g_state.servers[index];
+  struct stat st;
+  if (lstat(socket_path, &st) == 0) {
+    server->owner = st.st_uid;
+    server->group = st.st_gid;
+  }
+  int alive = tmux_server_reachable(socket_path);
+  if (alive && !server->alive) {
+    printf("Tracking tmux server: %s (%s, uid %u)\n", server->name,
+           socket_path, (unsigned)server->owner);
+    server->interval = SERVER_MIN_INTERVAL;
+    server->next_poll = 0;
+    server->last_full_scan = 0;
+  } else if (!alive && server->alive) {
+    printf("tmux server gone: %s\n", server->name);
+  }
+  server->alive = alive;
+  if (!alive) {
+    remove_unlisted_sessions(index);
+  }
+}
+
+// Sockets are taken only if they are not symlinks and belong to the
+// directory's owner, so nobody can point the daemon at another user's server
+void discover_socket_dir(const char *dir_path) {
+  struct stat dir_st;
+  DIR *dir = lstat(dir_path, &dir_st) == 0 && S_ISDIR(dir_st.st_mode)
+                 ? opendir(dir_path)
+                 : NULL;
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char socket_path[PATH_MAX];
+    struct stat st;
+    snprintf(socket_path, sizeof(socket_path), "%s/%s", dir_path,
+             entry->d_name);
+    if (entry->d_name[0] != '.' && lstat(socket_path, &st) == 0 &&
+        S_ISSOCK(st.st_mode) && st.st_uid == dir_st.st_uid) {
+      track_server(entry->d_name, socket_path);
+    }
+  }
+  closedir(dir);
+}
+
+// Find tmux servers: every socket in the per-user socket directory (one per
+// -L label), plus any listed in MUXGEIST_TMUX_SOCKETS (colon separated),
+// e.g. servers started with -S elsewhere. A system daemon looks in every
+// user's directory.
+void discover_tmux_servers(void) {
+  char dir_path[PATH_MAX];
+  char default_path[PATH_MAX];
+  const char *tmpdir = getenv("TMUX_TMPDIR");
+  const char *base = tmpdir && *tmpdir ? tmpdir : "/tmp";
+  snprintf(dir_path, sizeof(dir_path), "%s/tmux-%u", base,
+           (unsigned)getuid());
+
+  // Inside tmux, $TMUX is "socket,pid,session" and names the default server
+  const char *inside = getenv("TMUX");
+  if (inside && *inside) {
+    snprintf(default_path, sizeof(default_path), "%.*s",
+             (int)strcspn(inside, ","), inside);
+  } else {
+    snprintf(default_path, sizeof(default_path), "%s/default", dir_path);
+  }
+
+  if (g_state.system_mode) {
+    DIR *dir = opendir(base);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+      if (strncmp(entry->d_name, "tmux-", 5) == 0 &&
+          isdigit((unsigned char)entry->d_name[5])) {
+        char user_dir[PATH_MAX];
+        snprintf(user_dir, sizeof(user_dir), "%s/%s", base, entry->d_name);
+        discover_socket_dir(user_dir);
+      }
+    }
+    if (dir) {
+      closedir(dir);
+    }
+  } else {
+    discover_socket_dir(dir_path);
+  }
+
+  const char *extra = getenv("MUXGEIST_TMUX_SOCKETS");
+  if (extra && *extra) {
+    char paths[4096];
+    strncpy(paths, extra, sizeof(paths) - 1);
+    paths[sizeof(paths) - 1] = '\0';
+    char *cursor = paths;
+    char *path;
+    while ((path = strsep(&cursor, ":")) != NULL) {
+      if (*path) {
+        const char *base = strrchr(path, '/');
+        track_server(base ? base + 1 : path, path);
+      }
+    }
+  }
+  g_state.default_server = -1;
+  for (int i = 0; i < g_state.server_count; i++) {
+    if (strcmp(g_state.servers[i].socket_path, default_path) == 0) {
+      g_state.default_server = i;
+    }
+  }
+  g_state.last_server_discovery = daemon_time();
+}
+
+// Poll one server if it is due. A single list-windows probe tells which
+// sessions had output since they were last updated; only those are captured,
+// plus every session on a slower full-scan cycle for topology and cwd.
+void poll_tmux_server(int index) {
+  tmux_server_t *server = &g_state.servers[index];
+  time_t now = daemon_time();
+  if (!server->alive || now < server->next_poll) {
+    return;
+  }
+
+  char output[MAX_BUFFER_SIZE];
+  unsigned long truncated = g_state.tmux_truncated;
+  if (tmux_command(server, output, sizeof(output), "list-windows", "-a", "-F",
+                   "#{session_name}\t#{window_activity}",
+                   NULL) != ERROR_NONE ||
+      output[0] == '\0') {
+    server->alive = tmux_server_reachable(server->socket_path);
+    if (!server->alive) {
+      printf("tmux server gone: %s\n", server->name);
+      remove_unlisted_sessions(index);
+    }
+    server->next_poll = now + SERVER_MAX_INTERVAL;
+    return;
+  }
+  // A list cut short by the buffer may be missing sessions; none go then,
+  // except restored ones, which stay only once a probe has shown them
+  int complete = g_state.tmux_truncated == truncated;
+  for (int i = 0; i < g_state.session_count; i++) {
+    if (g_state.sessions[i].server == index) {
+      g_state.sessions[i].listed = !complete && !g_state.sessions[i].provisional;
+    }
+  }
+
+  // Newest window activity per session (the list is grouped by session)
+  static session_context_t *due[SYSTEM_MAX_SESSIONS];
+  int due_count = 0;
+  int full_scan = now - server->last_full_scan >= SERVER_FULL_SCAN_INTERVAL;
+  char *saveptr = NULL;
+  char *line = strtok_r(output, "\n", &saveptr);
+  session_context_t *session = NULL;
+  time_t activity = 0;
+  while (1) {
+    char *tab = line ? strchr(line, '\t') : NULL;
+    if (tab) {
+      *tab = '\0';
+    }
+    if (session && (!line || strcmp(line, session->tmux_name) != 0)) {
+      // Activity in the same second as the last update may have come after
+      // it, so that counts as new too
+      if (full_scan || activity != session->window_activity ||
+          activity >= session->last_activity - 1) {
+        if (due_count < SYSTEM_MAX_SESSIONS) {
+          due[due_count++] = session;
+        }
+      }
+      session->window_activity = activity;
+      session = NULL;
+    }
+    if (!line) {
+      break;
+    }
+    if (!session) {
+      session = find_server_session(index, line);
+      if (!session) {
+        session = create_session(index, line);
+        if (session) {
+          printf("Discovered new tmux session: %s\n", session->session_id);
+          session->window_activity = -1;
+        }
+      }
+      if (session) {
+        session->listed = 1;
+        session->provisional = 0;
+      }
+      activity = 0;
+    }
+    time_t window_activity = tab ? (time_t)atol(tab + 1) : 0;
+    if (window_activity > activity) {
+      activity = window_activity;
+    }
+    line = strtok_r(NULL, "\n", &saveptr);
+  }
+
+  if (due_count > 0) {
+    // One fork for all clients; capture uses it to find the panes being
+    // looked at right now
+    if (tmux_command(server, server->client_panes,
+                     sizeof(server->client_panes), "list-clients", "-F",
+                     "#{client_session}\t#{pane_id}", NULL) != ERROR_NONE) {
+      server->client_panes[0] = '\0';
+    }
+    for (int i = 0; i < due_count; i++) {
+      update_session_context(due[i]);
+    }
+  }
+  if (full_scan) {
+    server->last_full_scan = now;
+  }
+  remove_unlisted_sessions(index);
+
+  if (due_count > 0 && !full_scan) {
+    server->interval = SERVER_MIN_INTERVAL;
+  } else if (server->interval < SERVER_MAX_INTERVAL) {
+    server->interval = server->interval ? server->interval * 2
+                                        : SERVER_MIN_INTERVAL;
+    if (server->interval > SERVER_MAX_INTERVAL) {
+      server->interval = SERVER_MAX_INTERVAL;
+    }
+  }
+  server->next_poll = now + server->interval;
+}
+
+// CPU time of the daemon's reaped children, the tmux commands. A poll's
+// share is the difference across it, charged to the server's owner.
+double child_cpu_time_ms(void) {
+  struct rusage children;
+  getrusage(RUSAGE_CHILDREN, &children);
+  return (children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1000.0 +
+         (children.ru_utime.tv_usec + children.ru_stime.tv_usec) / 1000.0;
+}
+
+// A server due for a poll, with its owner's account looked up beforehand
+typedef struct {
+  int server;
+  user_account_t *account;
+  double tokens_ms; // The account's at sort time
+} due_server_t;
+
+int compare_server_tokens(const void *a, const void *b) {
+  double ta = ((const due_server_t *)a)->tokens_ms;
+  double tb = ((const due_server_t *)b)->tokens_ms;
+  return (ta < tb) - (ta > tb);
+}
+
+// System mode: users share the capture loop fairly. Each earns user_cpu_ms
+// of tmux CPU time per second, and due servers are polled
+// for the user with the most left first. A user who ran out waits, and a
+// tick stops after SYSTEM_TICK_BUDGET_MS so requests are still served.
+void schedule_user_polls(void) {
+  long now_ms = monotonic_ms();
+  long elapsed = g_state.last_refill_ms ? now_ms - g_state.last_refill_ms : 0;
+  g_state.last_refill_ms = now_ms;
+  for (int i = 0; i < g_state.user_count; i++) {
+    user_account_t *account = &g_state.users[i];
+    account->cpu_tokens_ms += g_state.user_cpu_ms * elapsed / 1000.0;
+    if (account->cpu_tokens_ms > g_state.user_cpu_ms * USER_CPU_BURST) {
+      account->cpu_tokens_ms = g_state.user_cpu_ms * USER_CPU_BURST;
+    }
+  }
+
+  due_server_t due[MAX_TMUX_SERVERS];
+  int due_count = 0;
+  time_t now = daemon_time();
+  for (int i = 0; i < g_state.server_count; i++) {
+    if (g_state.servers[i].alive && now >= g_state.servers[i].next_poll) {
+      user_account_t *account = user_account(g_state.servers[i].owner);
+      if (account) {
+        due[due_count++] =
+            (due_server_t){i, account, account->cpu_tokens_ms};
+      }
+    }
+  }
+  qsort(due, due_count, sizeof(due[0]), compare_server_tokens);
+
+  for (int d = 0; d < due_count; d++) {
+    user_account_t *account = due[d].account;
+    if (account->cpu_tokens_ms <= 0) {
+      account->throttled++;
+      continue;
+    }
+    double before = child_cpu_time_ms();
+    poll_tmux_server(due[d].server);
+    double cost = child_cpu_time_ms() - before;
+    account->cpu_tokens_ms -= cost;
+    account->cpu_used_ms += cost;
+    update_user_memory(account);
+    if (monotonic_ms() - now_ms >= SYSTEM_TICK_BUDGET_MS) {
+      break;
+    }
+  }
+}
+
+muxgeist_error_t scan_tmux_sessions(void) {
+  // A replay learns of servers from the trace instead
+  if (!g_state.replaying && daemon_time() - g_state.last_server_discovery >=
+                                SERVER_DISCOVERY_INTERVAL) {
+    discover_tmux_servers();
+  }
+  if (g_state.system_mode) {
+    schedule_user_polls();
+  } else {
+    for (int i = 0; i < g_state.server_count; i++) {
+      poll_tmux_server(i);
+    }
+  }
+  trace_servers();
+  return ERROR_NONE;
+}
+
+// What a warm start restores of a session: enough to answer list, context
+// and diagnostics right away. Panes are recaptured by the first scan.
+typedef struct {
+  char server_name[64];
+  char socket_path[PATH_MAX];
+  char tmux_name[64];
+  char current_cwd[PATH_MAX];
+  char current_pane[16];
+  time_t last_activity;
+  char status_note[64];
+  unsigned long line_seq; // Numbering carries on, so followers can resume
+  int scrollback_len;   // Bytes of scrollback following the record
+  int diagnostic_count; // diagnostic_t entries following the scrollback
+} session_snapshot_t;
+
+typedef struct {
+  unsigned int magic;
+  unsigned int record_size; // Guards against reading another build's layout
+  unsigned int diagnostic_size;
+  int session_count;
+  time_t saved;
+} snapshot_header_t;
+
+// The snapshot and dictionaries are made of scrollback, so they are kept
+// where no other user can plant or replace a file: $XDG_RUNTIME_DIR/muxgeist,
+// or /tmp/muxgeist-<uid> without one. A system daemon keeps them in its
+// socket's directory, which it created. If the directory turns out not to be
+// ours alone, nothing is saved or loaded.
+void setup_state_dir(void) {
+  char dir[PATH_MAX];
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  int len;
+  if (g_state.system_mode) {
+    len = snprintf(dir, sizeof(dir), "%s", g_state.socket_path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) {
+      len = snprintf(dir, sizeof(dir), ".");
+    } else if (slash == dir) {
+      dir[1] = '\0'; // A socket in "/"
+    } else {
+      *slash = '\0';
+    }
+  } else if (runtime && runtime[0] == '/') {
+    len = snprintf(dir, sizeof(dir), "%s/muxgeist", runtime);
+  } else {
+    len = snprintf(dir, sizeof(dir), "/tmp/muxgeist-%u", (unsigned)geteuid());
+  }
+  if (len >= (int)sizeof(dir)) {
+    return;
+  }
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    perror(dir);
+    return;
+  }
+  struct stat st;
+  if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != geteuid() || (st.st_mode & 022)) {
+    fprintf(stderr, "%s is not private to this user; no snapshot is kept\n",
+            dir);
+    return;
+  }
+  snprintf(g_state.state_dir, sizeof(g_state.state_dir), "%s", dir);
+}
+
+// A state file of this daemon: its socket path, slashes turned to '_', plus
+// the suffix. Returns -1 if there is no state directory or it does not fit.
+int state_path(char *path, size_t path_size, const char *suffix) {
+  if (!g_state.state_dir[0]) {
+    return -1;
+  }
+  int len = snprintf(path, path_size, "%s/", g_state.state_dir);
+  for (const char *p = g_state.socket_path + (g_state.socket_path[0] == '/');
+       *p && len + 1 < (int)path_size; p++) {
+    path[len++] = *p == '/' ? '_' : *p;
+  }
+  path[len] = '\0';
+  return snprintf(path + len, path_size - len, "%s", suffix) <
+                 (int)(path_size - len)
+             ? 0
+             : -1;
+}
+
+// Open a state file for reading. Its contents reach the AI, so only a
+// regular file of the daemon's user that no one else may read or write is
+// trusted.
+int open_state_file(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+  struct stat st;
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_uid != geteuid() || (st.st_mode & 077)) {
+    fprintf(stderr, "Ignoring %s: not private to this user\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Create the temporary file a state file is written to before it is renamed
+// into place. Whatever is left there is removed first, and O_EXCL refuses
+// anything put in its place meanwhile.
+int create_state_file(const char *tmp_path) {
+  unlink(tmp_path);
+  return open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW,
+              0600);
+}
+
+// Write the snapshot to a temporary file and rename it into place, so a
+// crash mid-write leaves the previous one intact. Scrollback is private, so
+// the file is readable by the daemon's user only.
+void save_snapshot(void) {
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  if (state_path(path, sizeof(path), ".snapshot") != 0 ||
+      state_path(tmp_path, sizeof(tmp_path), ".snapshot.tmp") != 0) {
+    return;
+  }
+  int fd = create_state_file(tmp_path);
+  FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!fp) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+
+  snapshot_header_t header = {SNAPSHOT_MAGIC, sizeof(session_snapshot_t),
+                              sizeof(diagnostic_t), 0, time(NULL)};
+  for (int i = 0; i < g_state.session_count; i++) {
+    header.session_count +=
+        g_state.servers[g_state.sessions[i].server].alive != 0;
+  }
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  for (int i = 0; ok && i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    tmux_server_t *server = &g_state.servers[session->server];
+    if (!server->alive) {
+      continue;
+    }
+    session_snapshot_t record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.server_name, server->name, sizeof(record.server_name));
+    memcpy(record.socket_path, server->socket_path,
+           sizeof(record.socket_path));
+    memcpy(record.tmux_name, session->tmux_name, sizeof(record.tmux_name));
+    memcpy(record.current_cwd, session->current_cwd,
+           sizeof(record.current_cwd));
+    memcpy(record.current_pane, session->current_pane,
+           sizeof(record.current_pane));
+    memcpy(record.status_note, session->status_note,
+           sizeof(record.status_note));
+    record.last_activity = session->last_activity;
+    record.line_seq = session->line_seq;
+    record.scrollback_len = session->scrollback_len;
+    record.diagnostic_count = session->diagnostic_count;
+    ok = fwrite(&record, sizeof(record), 1, fp) == 1 &&
+         fwrite(session->scrollback, 1, record.scrollback_len, fp) ==
+             (size_t)record.scrollback_len &&
+         fwrite(session->diagnostics, sizeof(diagnostic_t),
+                record.diagnostic_count,
+                fp) == (size_t)record.diagnostic_count;
+  }
+  if (fclose(fp) != 0 || !ok || rename(tmp_path, path) == -1) {
+    unlink(tmp_path);
+    return;
+  }
+  g_state.last_snapshot = header.saved;
+}
+
+// Which dictionary suits a pane's output: its prompt and commands, a build
+// or test run, or whatever else a program prints (logs, mostly).
+history_class_t history_class(const pane_state_t *pane) {
+  static const char *builders[] = {"make",  "cmake", "ninja", "cargo", "go",
+                                   "gcc",   "g++",   "cc",    "clang", "rustc",
+                                   "tsc",   "npm",   "yarn",  "pnpm",  "pytest",
+                                   "ctest", "mvn",   "gradle", "bazel", NULL};
+  if (is_shell_command(pane->command)) {
+    return HISTORY_CLASS_SHELL;
+  }
+  for (int i = 0; builders[i]; i++) {
+    if (strcmp(pane->command, builders[i]) == 0) {
+      return HISTORY_CLASS_BUILD;
+    }
+  }
+  return pane->test_run.state == TEST_RUN_NONE ? HISTORY_CLASS_LOG
+                                               : HISTORY_CLASS_BUILD;
+}
+
+// Count the phrases of some cold text: runs between digits (which are
+// counters, times and addresses, different every time) and line ends.
+// Slots are direct-mapped; a newcomer wears down the incumbent's count
+// before replacing it, so phrases that keep recurring survive.
+void dict_observe(history_codec_t *codec, const char *text, size_t len) {
+  if (!codec->segments) {
+    codec->segments = calloc(DICT_SEGMENT_SLOTS, sizeof(dict_segment_t));
+    if (!codec->segments) {
+      return;
+    }
+  }
+  const char *end = text + len;
+  while (text < end) {
+    while (text < end && (isdigit((unsigned char)*text) || *text == '\n')) {
+      text++;
+    }
+    const char *start = text;
+    while (text < end && !isdigit((unsigned char)*text) && *text != '\n') {
+      text++;
+    }
+    size_t piece = text - start < DICT_SEGMENT_SIZE - 1 ? text - start
+                                                        : DICT_SEGMENT_SIZE - 1;
+    if (piece < DICT_MIN_SEGMENT) {
+      continue;
+    }
+    unsigned long hash = hash_bytes(start, piece);
+    dict_segment_t *slot = &codec->segments[hash % DICT_SEGMENT_SLOTS];
+    if (slot->hash == hash) {
+      slot->count++;
+    } else if (--slot->count <= 0) {
+      slot->hash = hash;
+      slot->count = 1;
+      memcpy(slot->text, start, piece);
+      slot->text[piece] = '\0';
+    }
+  }
+}
+
+int compare_segment_scores(const void *a, const void *b) {
+  const dict_segment_t *sa = *(dict_segment_t *const *)a;
+  const dict_segment_t *sb = *(dict_segment_t *const *)b;
+  long score_a = (long)sa->count * strlen(sa->text);
+  long score_b = (long)sb->count * strlen(sb->text);
+  return (score_a < score_b) - (score_a > score_b);
+}
+
+int dict_path(char *path, size_t path_size, int class, int version,
+              const char *tmp) {
+  char suffix[64];
+  snprintf(suffix, sizeof(suffix), ".dict-%s.%d%s",
+           history_class_names[class], version, tmp);
+  return state_path(path, path_size, suffix);
+}
+
+// Dictionaries are kept with the snapshot and checked the same way: they
+// are made of scrollback.
+void save_dictionary(int class, int version) {
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  const history_codec_t *codec = &g_state.codecs[class];
+  if (g_state.replaying ||
+      dict_path(path, sizeof(path), class, version, "") != 0 ||
+      dict_path(tmp_path, sizeof(tmp_path), class, version, ".tmp") != 0) {
+    return;
+  }
+  int fd = create_state_file(tmp_path);
+  if (fd < 0) {
+    return;
+  }
+  ssize_t written = write(fd, codec->dicts[version], codec->dict_sizes[version]);
+  close(fd);
+  if (written != (ssize_t)codec->dict_sizes[version] ||
+      rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+  }
+}
+
+// Pick up the dictionaries an earlier run trained, so compression is good
+// from the first cold block
+void load_dictionaries(void) {
+  for (int class = 0; class < HISTORY_CLASS_COUNT; class++) {
+    history_codec_t *codec = &g_state.codecs[class];
+    for (int version = 1; version <= HISTORY_DICT_VERSIONS; version++) {
+      char path[PATH_MAX];
+      int fd = dict_path(path, sizeof(path), class, version, "") == 0
+                   ? open_state_file(path)
+                   : -1;
+      FILE *fp = fd >= 0 ? fdopen(fd, "rb") : NULL;
+      if (!fp) {
+        if (fd >= 0) {
+          close(fd);
+        }
+        break;
+      }
+      unsigned char *dict = malloc(HISTORY_DICT_BYTES);
+      size_t size = dict ? fread(dict, 1, HISTORY_DICT_BYTES, fp) : 0;
+      fclose(fp);
+      if (size == 0) {
+        free(dict);
+        break;
+      }
+      codec->dicts[version] = dict;
+      codec->dict_sizes[version] = size;
+      codec->version = version;
+    }
+  }
+}
+
+// Lay the highest scoring phrases (count x length) out as a new dictionary
+// version, best last: deflate reaches the end of a dictionary most cheaply.
+void dict_train(int class) {
+  static dict_segment_t *ranked[DICT_SEGMENT_SLOTS];
+  history_codec_t *codec = &g_state.codecs[class];
+  int count = 0;
+  for (int i = 0; codec->segments && i < DICT_SEGMENT_SLOTS; i++) {
+    if (codec->segments[i].count >= 2) {
+      ranked[count++] = &codec->segments[i];
+    }
+  }
+  qsort(ranked, count, sizeof(ranked[0]), compare_segment_scores);
+  size_t total = 0;
+  int used = 0;
+  while (used < count &&
+         total + strlen(ranked[used]->text) <= HISTORY_DICT_BYTES) {
+    total += strlen(ranked[used++]->text);
+  }
+  codec->blocks_since_training = 0;
+  unsigned char *dict = total >= DICT_SEGMENT_SIZE ? malloc(total) : NULL;
+  if (!dict) {
+    return; // Too little recurs yet to be worth a dictionary
+  }
+  size_t offset = 0;
+  for (int i = used - 1; i >= 0; i--) {
+    size_t len = strlen(ranked[i]->text);
+    memcpy(dict + offset, ranked[i]->text, len);
+    offset += len;
+  }
+  int version = ++codec->version;
+  codec->dicts[version] = dict;
+  codec->dict_sizes[version] = total;
+  for (int i = 0; i < DICT_SEGMENT_SLOTS; i++) {
+    codec->segments[i].count /= 2; // Let newer phrases catch up
+  }
+  save_dictionary(class, version);
+  printf("Trained %s dictionary v%d: %zu bytes\n", history_class_names[class],
+         version, total);
+}
+
+// Compress a block's lines and free them. A block read back since still
+// has its compressed copy, and only drops the lines again.
+void history_freeze(pane_history_t *history, unsigned long b, int class) {
+  history_block_t *block = &history->blocks[b % HISTORY_BLOCKS];
+  int first, end;
+  history_block_span(history, b, &first, &end);
+  if (block->cold || block->keep_hot || first >= end) {
+    return;
+  }
+  if (!block->frozen) {
+    size_t raw_len = 0;
+    for (int pos = first; pos < end; pos++) {
+      const char *text = history_slot(history, pos)->text;
+      raw_len += (text ? strlen(text) : 0) + 1;
+    }
+    char *raw = malloc(raw_len);
+    unsigned char *out = malloc(raw_len);
+    if (!raw || !out) {
+      free(raw);
+      free(out);
+      return;
+    }
+    size_t offset = 0;
+    for (int pos = first; pos < end; pos++) {
+      const char *text = history_slot(history, pos)->text;
+      size_t len = text ? strlen(text) : 0;
+      memcpy(raw + offset, text ? text : "", len);
+      raw[offset + len] = '\n';
+      offset += len + 1;
+    }
+    history_codec_t *codec = &g_state.codecs[class];
+    long len = history_deflate((unsigned char *)raw, raw_len,
+                               codec->dicts[codec->version],
+                               codec->dict_sizes[codec->version], out,
+                               raw_len);
+    dict_observe(codec, raw, raw_len);
+    free(raw);
+    if (len <= 0) {
+      free(out);
+      block->keep_hot = 1;
+      return;
+    }
+    unsigned char *shrunk = realloc(out, len);
+    block->frozen = shrunk ? shrunk : out;
+    block->frozen_len = len;
+    block->raw_len = raw_len;
+    block->frozen_lines = end - first;
+    block->codec = class;
+    block->dict_version = codec->version;
+    g_state.history_cold_raw += raw_len;
+    g_state.history_cold_bytes += len;
+    if (++codec->blocks_since_training >=
+            HISTORY_TRAIN_BLOCKS << codec->version &&
+        codec->version < HISTORY_DICT_VERSIONS) {
+      dict_train(class);
+    }
+  }
+  for (int pos = first; pos < end; pos++) {
+    history_line_t *line =
+        &history->lines[(history->start + pos) % PANE_HISTORY_LINES];
+    free(line->text);
+    line->text = NULL;
+  }
+  block->cold = 1;
+}
+
+// Every few seconds, compress the history blocks nobody has read lately:
+// all but the newest HISTORY_HOT_BLOCKS of each pane.
+void freeze_cold_history(void) {
+  time_t now = daemon_time();
+  if (now - g_state.last_history_freeze < HISTORY_FREEZE_INTERVAL) {
+    return;
+  }
+  g_state.last_history_freeze = now;
+  for (int i = 0; i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    for (int p = 0; p < session->pane_count; p++) {
+      pane_history_t *history = &session->panes[p].history;
+      if (!history->lines || history->count == 0) {
+        continue;
+      }
+      int class = history_class(&session->panes[p]);
+      unsigned long newest = (history->appended - 1) / HISTORY_BLOCK_LINES;
+      for (unsigned long b = (history->appended - history->count) /
+                             HISTORY_BLOCK_LINES;
+           b + HISTORY_HOT_BLOCKS <= newest; b++) {
+        if (history->blocks[b % HISTORY_BLOCKS].thawed + HISTORY_THAW_SECONDS <=
+            now) {
+          history_freeze(history, b, class);
+        }
+      }
+    }
+  }
+}
+
+void save_snapshot_if_due(void) {
+  if (time(NULL) - g_state.last_snapshot < SNAPSHOT_INTERVAL) {
+    return;
+  }
+  for (int i = 0; i < g_state.session_count; i++) {
+    if (g_state.sessions[i].last_activity > g_state.last_snapshot) {
+      save_snapshot();
+      return;
+    }
+  }
+}
+
+// Restore sessions whose tmux server is still running, so the request that
+// started the daemon is answered before the first (slower) scan.
+void load_snapshot(void) {
+  char path[PATH_MAX];
+  if (state_path(path, sizeof(path), ".snapshot") != 0) {
+    return;
+  }
+  int fd = open_state_file(path);
+  FILE *fp = fd >= 0 ? fdopen(fd, "rb") : NULL;
+  if (!fp) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+
+  snapshot_header_t header;
+  int restored = 0;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != SNAPSHOT_MAGIC ||
+      header.record_size != sizeof(session_snapshot_t) ||
+      header.diagnostic_size != sizeof(diagnostic_t)) {
+    fclose(fp);
+    return;
+  }
+  for (int i = 0; i < header.session_count; i++) {
+    session_snapshot_t record;
+    if (fread(&record, sizeof(record), 1, fp) != 1 ||
+        record.scrollback_len < 0 || record.scrollback_len >= MAX_BUFFER_SIZE ||
+        record.diagnostic_count < 0 ||
+        record.diagnostic_count > MAX_DIAGNOSTICS) {
+      break;
+    }
+    record.server_name[sizeof(record.server_name) - 1] = '\0';
+    record.socket_path[sizeof(record.socket_path) - 1] = '\0';
+    record.tmux_name[sizeof(record.tmux_name) - 1] = '\0';
+
+    track_server(record.server_name, record.socket_path);
+    int server = find_server(record.socket_path);
+    session_context_t *session = NULL;
+    if (server >= 0 && g_state.servers[server].alive &&
+        !find_server_session(server, record.tmux_name)) {
+      session = create_session(server, record.tmux_name);
+    }
+    if (!session) {
+      // Skip the record's payload
+      if (fseek(fp,
+                record.scrollback_len +
+                    (long)record.diagnostic_count * sizeof(diagnostic_t),
+                SEEK_CUR) != 0) {
+        break;
+      }
+      continue;
+    }
+    memcpy(session->current_cwd, record.current_cwd,
+           sizeof(session->current_cwd));
+    session->current_cwd[sizeof(session->current_cwd) - 1] = '\0';
+    memcpy(session->current_pane, record.current_pane,
+           sizeof(session->current_pane));
+    session->current_pane[sizeof(session->current_pane) - 1] = '\0';
+    memcpy(session->status_note, record.status_note,
+           sizeof(session->status_note));
+    session->status_note[sizeof(session->status_note) - 1] = '\0';
+    session->last_activity = record.last_activity;
+    session->line_seq = record.line_seq;
+    session->window_activity = -1;
+    session->provisional = 1;
+    if (fread(session->scrollback, 1, record.scrollback_len, fp) !=
+            (size_t)record.scrollback_len ||
+        fread(session->diagnostics, sizeof(diagnostic_t),
+              record.diagnostic_count,
+              fp) != (size_t)record.diagnostic_count) {
+      break;
+    }
+    session->scrollback[record.scrollback_len] = '\0';
+    session->scrollback_len = record.scrollback_len;
+    session->diagnostic_count = record.diagnostic_count;
+    restored++;
+  }
+  fclose(fp);
+  if (restored > 0) {
+    printf("Warm start: %d sessions from %s\n", restored, path);
+    g_state.warm_start = 1;
+    g_state.last_snapshot = header.saved;
+  }
+}
+
+// Connect to a daemon's socket, optionally without blocking on a full
+// backlog. Returns the fd, or -1.
+int connect_unix(const char *path, int nonblocking) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// "SESSION id\tpane\tlast_activity\tpane_count\tcwd\tstatus\n"
+size_t format_session_sync(const session_context_t *session, char *line,
+                           size_t line_size) {
+  char cwd[PATH_MAX];
+  size_t len = 0;
+  for (const char *p = session->current_cwd; *p && len + 1 < sizeof(cwd);
+       p++) {
+    cwd[len++] = (*p == '\t' || *p == '\n') ? ' ' : *p;
+  }
+  cwd[len] = '\0';
+  int written = snprintf(line, line_size, "SESSION %s\t%s\t%ld\t%d\t%s\t%s\n",
+                         session->session_id, session->current_pane,
+                         (long)session->last_activity, session->pane_count,
+                         cwd, session->status_line);
+  return written < (int)line_size ? (size_t)written : line_size - 1;
+}
+
+// "subscribe" keeps the connection open: the subscriber gets every live
+// session, then "SYNCED", then only sessions whose line changed after each
+// scan, and "GONE id" for sessions that tmux no longer has.
+void add_subscriber(int client_socket) {
+  if (g_state.subscriber_count >= MAX_SUBSCRIBERS) {
+    const char *error = "ERROR: Too many subscribers\n";
+    send(client_socket, error, strlen(error), MSG_NOSIGNAL);
+    close(client_socket);
+    return;
+  }
+  int index = g_state.subscriber_count++;
+  g_state.subscribers[index] = client_socket;
+  g_state.subscriber_uids[index] = g_state.request_uid;
+
+  char line[SYNC_LINE_SIZE];
+  for (int i = 0; i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    if (!g_state.servers[session->server].alive || !session_visible(session)) {
+      continue;
+    }
+    size_t len = format_session_sync(session, line, sizeof(line));
+    if (send_to_subscriber(index, line, len) != 0) {
+      return;
+    }
+  }
+  send_to_subscriber(index, "SYNCED\n", 7);
+}
+
+void publish_sync(void) {
+  char line[SYNC_LINE_SIZE];
+  for (int i = 0; i < g_state.session_count; i++) {
+    session_context_t *session = &g_state.sessions[i];
+    if (!g_state.servers[session->server].alive) {
+      continue;
+    }
+    size_t len = format_session_sync(session, line, sizeof(line));
+    unsigned long hash = hash_bytes(line, len);
+    if (hash != session->sync_hash) {
+      session->sync_hash = hash;
+      broadcast_sync(session, line, len);
+    }
+  }
+}
+
+void drop_follower(int index) {
+  follower_t *follower = &g_state.followers[index];
+  close(follower->fd);
+  free(follower->pending);
+  g_state.follower_count--;
+  *follower = g_state.followers[g_state.follower_count];
+}
+
+int follower_wants_pane(const follower_t *follower, const char *pane_id,
+                        const char *pane_index) {
+  return !follower->pane[0] || strcmp(follower->pane, pane_id) == 0 ||
+         strcmp(follower->pane, pane_index) == 0;
+}
+
+// Sequence number to start from so a new follower sees the last few lines
+// of the panes it follows, walking their histories back in merged order.
+unsigned long follow_backlog_seq(const follower_t *follower) {
+  session_context_t *session = follower->session;
+  int positions[MAX_PANES_PER_SESSION];
+  for (int p = 0; p < session->pane_count; p++) {
+    const pane_state_t *pane = &session->panes[p];
+    positions[p] = follower_wants_pane(follower, pane->pane_id,
+                                       pane->pane_index)
+                       ? pane->history.count - 1
+                       : -1;
+  }
+  unsigned long seq = session->line_seq + 1;
+  for (int n = 0; n < FOLLOW_BACKLOG; n++) {
+    int best = -1;
+    for (int p = 0; p < session->pane_count; p++) {
+      if (positions[p] >= 0 &&
+          (best < 0 ||
+           history_slot(&session->panes[p].history, positions[p])->seq >
+               history_slot(&session->panes[best].history, positions[best])
+                   ->seq)) {
+        best = p;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    seq = history_slot(&session->panes[best].history, positions[best])->seq;
+    positions[best]--;
+  }
+  return seq;
+}
+
+int json_needs_escape(const char *text) {
+  for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+    if (*p == '"' || *p == '\\' || *p < 0x20) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Write text as a JSON string body into out, truncating to fit. Returns the
+// bytes written.
+size_t json_escape(const char *text, char *out, size_t out_size) {
+  size_t used = 0;
+  for (const unsigned char *p = (const unsigned char *)text;
+       *p && used + 7 <= out_size; p++) {
+    if (*p == '"' || *p == '\\') {
+      out[used++] = '\\';
+      out[used++] = *p;
+    } else if (*p < 0x20) {
+      used += snprintf(out + used, 7, "\\u%04x", *p);
+    } else {
+      out[used++] = *p;
+    }
+  }
+  return used;
+}
+
+// Send what is left of a partly written batch. Returns 1 once nothing is
+// pending, 0 if the socket is still full, -1 if the follower went away.
+int follower_drain(follower_t *follower) {
+  while (follower->pending_sent < follower->pending_len) {
+    ssize_t sent = send(follower->fd, follower->pending + follower->pending_sent,
+                        follower->pending_len - follower->pending_sent,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    follower->pending_sent += sent;
+  }
+  free(follower->pending);
+  follower->pending = NULL;
+  follower->pending_len = follower->pending_sent = 0;
+  return 1;
+}
+
+// Gather-write a batch of lines in one syscall. Whatever the socket does not
+// take is copied to the follower's pending buffer, which must drain before
+// the next batch is built. Returns 1 if it all went, 0 if some is pending.
+int follower_send(follower_t *follower, struct iovec *iov, int iov_count) {
+  // The kernel takes at most IOV_MAX entries; the rest goes to pending
+  struct msghdr message = {.msg_iov = iov,
+                           .msg_iovlen = iov_count < IOV_MAX ? iov_count
+                                                             : IOV_MAX};
+  ssize_t sent = sendmsg(follower->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (sent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+    sent = 0;
+  }
+  size_t rest = 0;
+  for (int i = 0; i < iov_count; i++) {
+    rest += iov[i].iov_len;
+  }
+  rest -= sent;
+  if (rest == 0) {
+    return 1;
+  }
+  follower->pending = malloc(rest);
+  if (!follower->pending) {
+    return -1;
+  }
+  follower->pending_len = rest;
+  follower->pending_sent = 0;
+  size_t copied = 0;
+  for (int i = 0; i < iov_count; i++) {
+    size_t skip = (size_t)sent > iov[i].iov_len ? iov[i].iov_len : (size_t)sent;
+    sent -= skip;
+    memcpy(follower->pending + copied, (char *)iov[i].iov_base + skip,
+           iov[i].iov_len - skip);
+    copied += iov[i].iov_len - skip;
+  }
+  return 0;
+}
+
+// Send a dump's next batches until the socket is full or the dump is
+// through, which returns -1 so it is closed. Lines are looked up by
+// sequence number each time, so a dump resumes where the socket left it;
+// lines that scrolled out of the histories while it waited are skipped.
+// Lines go out in gather writes straight from the history ring, copied
+// only for the escaping ndjson needs or when the socket is full.
+int flush_dump(follower_t *follower) {
+  static struct iovec iov[DUMP_BATCH_LINES * 3];
+  static char headers[DUMP_BATCH_LINES][DUMP_HEADER_SIZE];
+  static char arena[DUMP_ESCAPE_ARENA];
+  session_context_t *session = follower->session;
+  if (!session) {
+    return -1;
+  }
+
+  while (1) {
+    int positions[MAX_PANES_PER_SESSION];
+    for (int p = 0; p < session->pane_count; p++) {
+      pane_state_t *pane = &session->panes[p];
+      positions[p] =
+          follower_wants_pane(follower, pane->pane_id, pane->pane_index)
+              ? history_lower_bound(&pane->history, follower->next_seq)
+              : -1;
+    }
+    int iov_count = 0;
+    size_t arena_used = 0;
+    int lines = 0;
+    while (lines < DUMP_BATCH_LINES) {
+      int best = -1;
+      for (int p = 0; p < session->pane_count; p++) {
+        if (positions[p] >= 0 &&
+            positions[p] < session->panes[p].history.count &&
+            history_slot(&session->panes[p].history, positions[p])->seq <=
+                follower->dump_until &&
+            (best < 0 ||
+             history_slot(&session->panes[p].history, positions[p])->seq <
+                 history_slot(&session->panes[best].history, positions[best])
+                     ->seq)) {
+          best = p;
+        }
+      }
+      if (best < 0) {
+        break;
+      }
+      pane_state_t *source = &session->panes[best];
+      const history_line_t *line = history_at(&source->history,
+                                              positions[best]);
+      if (!line) {
+        positions[best]++; // In a cold block that could not be expanded
+        follower->next_seq =
+            history_slot(&source->history, positions[best] - 1)->seq + 1;
+        continue;
+      }
+      if (follower->dump == 1) {
+        iov[iov_count++] = (struct iovec){line->text, strlen(line->text)};
+        iov[iov_count++] = (struct iovec){"\n", 1};
+      } else {
+        const char *text = line->text;
+        size_t len = strlen(text);
+        if (json_needs_escape(text)) {
+          size_t room = sizeof(arena) - arena_used;
+          if (len * 6 + 1 > room && lines > 0) {
+            break; // Send this batch first to free the arena
+          }
+          len = json_escape(text, arena + arena_used, room);
+          text = arena + arena_used;
+          arena_used += len;
+        }
+        int header_len = snprintf(
+            headers[lines], DUMP_HEADER_SIZE,
+            "{\"seq\":%lu,\"time\":%ld,\"pane\":\"%s\",\"width\":%d,"
+            "\"text\":\"",
+            line->seq, (long)line->timestamp, source->pane_index, line->width);
+        iov[iov_count++] = (struct iovec){headers[lines], header_len};
+        iov[iov_count++] = (struct iovec){(char *)text, len};
+        iov[iov_count++] = (struct iovec){"\"}\n", 3};
+      }
+      positions[best]++;
+      follower->next_seq = line->seq + 1;
+      lines++;
+    }
+    if (lines == 0) {
+      return -1; // Through
+    }
+    int rc = follower_send(follower, iov, iov_count);
+    if (rc != 1) {
+      return rc;
+    }
+  }
+}
+
+// Stream everything the follower has not seen yet: pane lines merged by
+// sequence number with the session's events, in batches of up to
+// FOLLOW_IOV_LINES lines per write. Lines that scrolled out of a pane's
+// history before they could be sent are reported as a gap.
+int flush_follower(follower_t *follower) {
+  static struct iovec iov[FOLLOW_IOV_LINES * 3];
+  static char headers[FOLLOW_IOV_LINES][FOLLOW_HEADER_SIZE];
+  session_context_t *session = follower->session;
+
+  if (follower->pending && follower_drain(follower) != 1) {
+    return follower->pending ? 0 : -1;
+  }
+  if (follower->closing) {
+    return -1; // All of a reply is out
+  }
+  if (follower->dump) {
+    return flush_dump(follower);
+  }
+  if (!session || !g_state.servers[session->server].alive) {
+    send(follower->fd, "GONE\n", 5, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return -1;
+  }
+  if (session->next_event - follower->next_event > FOLLOW_EVENTS) {
+    follower->next_event = session->next_event - FOLLOW_EVENTS;
+  }
+
+  int positions[MAX_PANES_PER_SESSION];
+  int iov_count = 0;
+  int lines = 0;
+  for (int p = 0; p < session->pane_count; p++) {
+    pane_state_t *pane = &session->panes[p];
+    positions[p] = -1;
+    if (!follower_wants_pane(follower, pane->pane_id, pane->pane_index)) {
+      continue;
+    }
+    positions[p] = history_lower_bound(&pane->history, follower->next_seq);
+    unsigned long oldest = pane->history.count
+                               ? history_slot(&pane->history, 0)->seq
+                               : follower->next_seq;
+    if (pane->history.count == PANE_HISTORY_LINES &&
+        oldest > follower->next_seq && oldest - 1 > follower->gap_until) {
+      unsigned long from = follower->next_seq > follower->gap_until
+                               ? follower->next_seq
+                               : follower->gap_until + 1;
+      int len = snprintf(headers[lines], FOLLOW_HEADER_SIZE, "G %lu %lu %s\n",
+                         from, oldest - 1, pane->pane_index);
+      iov[iov_count++] = (struct iovec){headers[lines++], len};
+      follower->gap_until = oldest - 1;
+    }
+  }
+
+  while (lines < FOLLOW_IOV_LINES) {
+    int best = -1;
+    for (int p = 0; p < session->pane_count; p++) {
+      if (positions[p] >= 0 &&
+          positions[p] < session->panes[p].history.count &&
+          (best < 0 ||
+           history_slot(&session->panes[p].history, positions[p])->seq <
+               history_slot(&session->panes[best].history, positions[best])
+                   ->seq)) {
+        best = p;
+      }
+    }
+    const history_line_t *line =
+        best >= 0 ? history_slot(&session->panes[best].history, positions[best])
+                  : NULL;
+
+    // An event follows the line that caused it
+    if (follower->next_event < session->next_event) {
+      const follow_event_t *event =
+          &session->events[follower->next_event % FOLLOW_EVENTS];
+      if (!line || event->seq < line->seq) {
+        follower->next_event++;
+        if (follower_wants_pane(follower, event->pane_id, event->pane_index) &&
+            (!follower->errors_only || event->alarm)) {
+          int len = snprintf(headers[lines], FOLLOW_HEADER_SIZE, "%c %lu %s ",
+                             event->kind, event->seq, event->pane_index);
+          iov[iov_count++] = (struct iovec){headers[lines++], len};
+          iov[iov_count++] =
+              (struct iovec){(void *)event->text, strlen(event->text)};
+          iov[iov_count++] = (struct iovec){"\n", 1};
+        }
+        continue;
+      }
+    }
+    if (!line) {
+      break;
+    }
+    positions[best]++;
+    follower->next_seq = line->seq + 1;
+    line = history_at(&session->panes[best].history, positions[best] - 1);
+    if (!line || (follower->errors_only && !line_has_alarm(line->text))) {
+      continue;
+    }
+    int len = snprintf(headers[lines], FOLLOW_HEADER_SIZE, "L %lu %s ",
+                       line->seq, session->panes[best].pane_index);
+    iov[iov_count++] = (struct iovec){headers[lines++], len};
+    iov[iov_count++] = (struct iovec){line->text, strlen(line->text)};
+    iov[iov_count++] = (struct iovec){"\n", 1};
+  }
+  if (follower->next_seq <= session->line_seq && lines < FOLLOW_IOV_LINES) {
+    follower->next_seq = session->line_seq + 1; // Only filtered lines left
+  }
+
+  if (iov_count == 0) {
+    return 1;
+  }
+  int rc = follower_send(follower, iov, iov_count);
+  if (rc == 1 && lines == FOLLOW_IOV_LINES) {
+    return flush_follower(follower); // More where that came from
+  }
+  return rc;
+}
+
+void flush_followers(void) {
+  for (int i = g_state.follower_count - 1; i >= 0; i--) {
+    if (flush_follower(&g_state.followers[i]) < 0) {
+      drop_follower(i);
+    }
+  }
+}
+
+// Hand a finished reply to the follower table, which sends it as the
+// socket takes it and then closes the connection. With no slot free the
+// client gets what one send takes without waiting.
+void send_reply_later(int fd, const char *reply, size_t len) {
+  if (g_state.follower_count >= MAX_FOLLOWERS) {
+    send(fd, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+    return;
+  }
+  follower_t *follower = &g_state.followers[g_state.follower_count++];
+  memset(follower, 0, sizeof(*follower));
+  follower->fd = fd;
+  follower->closing = 1;
+  struct iovec iov = {(void *)reply, len};
+  if (follower_send(follower, &iov, 1) != 0) {
+    drop_follower(g_state.follower_count - 1); // Sent, or the client left
+  }
+}
+
+// "follow:session:since:pane:flags" keeps the connection open and streams
+// the session's lines ("L seq pane text"), diagnostics ("E"), finished test
+// runs ("T") and finished commands ("C") as they are ingested, starting
+// after sequence number `since`, or with the last few lines when it is
+// empty. An optional pane narrows it to one pane; flags "errors" sends only
+// alarming lines, diagnostics and failed test runs.
+void add_follower(int client_socket, char *request) {
+  char *cursor = request;
+  char *session_id = strsep(&cursor, ":");
+  char *since = cursor ? strsep(&cursor, ":") : "";
+  char *pane = cursor ? strsep(&cursor, ":") : "";
+  char *flags = cursor ? cursor : "";
+  session_context_t *session = find_session(session_id);
+  const char *error = NULL;
+  if (!session) {
+    error = "ERROR: Session not found\n";
+  } else if (g_state.follower_count >= MAX_FOLLOWERS) {
+    error = "ERROR: Too many followers\n";
+  } else if (strlen(pane) >= sizeof(g_state.followers[0].pane)) {
+    error = "ERROR: Pane not found\n";
+  }
+  if (!error && pane[0]) {
+    error = "ERROR: Pane not found\n";
+    for (int p = 0; p < session->pane_count; p++) {
+      if (strcmp(session->panes[p].pane_id, pane) == 0 ||
+          strcmp(session->panes[p].pane_index, pane) == 0) {
+        error = NULL;
+      }
+    }
+  }
+  if (error) {
+    send(client_socket, error, strlen(error), MSG_NOSIGNAL);
+    close(client_socket);
+    return;
+  }
+
+  follower_t *follower = &g_state.followers[g_state.follower_count++];
+  memset(follower, 0, sizeof(*follower));
+  follower->fd = client_socket;
+  follower->session = session;
+  snprintf(follower->pane, sizeof(follower->pane), "%s", pane);
+  follower->errors_only = strstr(flags, "errors") != NULL;
+  // A position past the end is from a daemon whose numbering was lost
+  unsigned long resume = strtoul(since, NULL, 10);
+  follower->next_seq = since[0] && resume <= session->line_seq
+                           ? resume + 1
+                           : follow_backlog_seq(follower);
+  follower->gap_until = follower->next_seq - 1;
+
+  // Replay the events from the starting point that are still in the ring
+  follower->next_event = session->next_event > FOLLOW_EVENTS
+                             ? session->next_event - FOLLOW_EVENTS
+                             : 0;
+  while (follower->next_event < session->next_event &&
+         session->events[follower->next_event % FOLLOW_EVENTS].seq <
+             follower->next_seq) {
+    follower->next_event++;
+  }
+
+  char header[FOLLOW_HEADER_SIZE];
+  int len = snprintf(header, sizeof(header), "S %lu\n", session->line_seq);
+  send(client_socket, header, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (flush_follower(follower) < 0) {
+    drop_follower(g_state.follower_count - 1);
+  }
+}
+
+// "dump:session[:pane[:format]]" streams everything still held in the pane
+// histories, oldest first, merged by sequence number across panes, then
+// closes the connection. Format "raw" (the default) is the lines as
+// captured; "ndjson" is one {"seq","time","pane","width","text"} record
+// per line, width being the line's display columns. The dump is a follower
+// that stops at the last line held when it was asked for, so a slow reader
+// is fed as its socket drains instead of stalling the daemon.
+void dump_history(int client_socket, char *request) {
+  char *cursor = request;
+  char *session_id = strsep(&cursor, ":");
+  char *pane = cursor ? strsep(&cursor, ":") : "";
+  const char *format = cursor && *cursor ? cursor : "raw";
+  session_context_t *session = find_session(session_id);
+  int ndjson = strcmp(format, "ndjson") == 0;
 
+  const char *error = NULL;
+  if (!session) {
+    error = "ERROR: Session not found";
+  } else if (!ndjson && strcmp(format, "raw") != 0) {
+    error = "ERROR: Unknown format, use raw or ndjson";
+  } else if (g_state.follower_count >= MAX_FOLLOWERS) {
+    error = "ERROR: Too many followers";
+  } else if (strlen(pane) >= sizeof(g_state.followers[0].pane)) {
+    error = "ERROR: Pane not found";
+  }
+  int matched = 0;
+  for (int p = 0; !error && p < session->pane_count; p++) {
+    matched += !pane[0] ||
+               strcmp(session->panes[p].pane_id, pane) == 0 ||
+               strcmp(session->panes[p].pane_index, pane) == 0;
+  }
+  if (!error && !matched) {
+    error = "ERROR: Pane not found";
+  }
+  if (error) {
+    send(client_socket, error, strlen(error), MSG_NOSIGNAL);
+    close(client_socket);
+    return;
+  }
+
+  follower_t *follower = &g_state.followers[g_state.follower_count++];
+  memset(follower, 0, sizeof(*follower));
+  follower->fd = client_socket;
+  follower->session = session;
+  snprintf(follower->pane, sizeof(follower->pane), "%s", pane);
+  follower->dump = ndjson ? 2 : 1;
+  follower->dump_until = session->line_seq;
+  if (flush_follower(follower) < 0) {
+    drop_follower(g_state.follower_count - 1);
+  }
+}
+
+void shard_disconnect(shard_t *shard) {
+  printf("Lost shard: %s\n", shard->name);
+  close(shard->fd);
+  shard->fd = -1;
+  shard->synced = 0;
+  shard->replica_count = 0;
+  shard->backoff = 1;
+  shard->next_connect = time(NULL) + shard->backoff;
+}
+
+// (Re)subscribe to a shard when due, backing off while it is unreachable
+void shard_connect(shard_t *shard) {
+  time_t now = time(NULL);
+  if (shard->fd >= 0 || now < shard->next_connect) {
+    return;
+  }
+  int fd = connect_unix(shard->socket_path, 0);
+  if (fd >= 0 && send(fd, "subscribe", 9, MSG_NOSIGNAL) == 9) {
+    printf("Subscribed to shard: %s (%s)\n", shard->name, shard->socket_path);
+    shard->fd = fd;
+    shard->synced = 0;
+    shard->partial_len = 0;
+    shard->replica_count = 0;
+    shard->backoff = 0;
+    return;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  shard->backoff = shard->backoff ? shard->backoff * 2 : 1;
+  if (shard->backoff > SHARD_MAX_BACKOFF) {
+    shard->backoff = SHARD_MAX_BACKOFF;
+  }
+  shard->next_connect = now + shard->backoff;
+}
+
+int find_replica(const shard_t *shard, const char *session_id) {
+  for (int i = 0; i < shard->replica_count; i++) {
+    if (strcmp(shard->replicas[i].session_id, session_id) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void shard_apply_line(shard_t *shard, char *line) {
+  if (strncmp(line, "SESSION ", 8) == 0) {
+    char *fields[6] = {0};
+    char *cursor = line + 8;
+    for (int f = 0; f < 6 && cursor; f++) {
+      fields[f] = strsep(&cursor, "\t");
+    }
+    if (!fields[5]) {
+      return;
+    }
+    int index = find_replica(shard, fields[0]);
+    if (index < 0) {
+      if (shard->replica_count >= MAX_REPLICAS) {
+        return;
+      }
+      index = shard->replica_count++;
+    }
+    replica_t *replica = &shard->replicas[index];
+    snprintf(replica->session_id, sizeof(replica->session_id), "%s",
+             fields[0]);
+    snprintf(replica->current_pane, sizeof(replica->current_pane), "%s",
+             fields[1]);
+    replica->last_activity = (time_t)atol(fields[2]);
+    replica->pane_count = atoi(fields[3]);
+    snprintf(replica->current_cwd, sizeof(replica->current_cwd), "%s",
+             fields[4]);
+    snprintf(replica->status_line, sizeof(replica->status_line), "%s",
+             fields[5]);
+  } else if (strncmp(line, "GONE ", 5) == 0) {
+    int index = find_replica(shard, line + 5);
+    if (index >= 0) {
+      shard->replicas[index] = shard->replicas[--shard->replica_count];
+    }
+  } else if (strcmp(line, "SYNCED") == 0) {
+    shard->synced = 1;
+    printf("Shard %s synced: %d sessions\n", shard->name,
+           shard->replica_count);
+  } else if (strncmp(line, "ERROR", 5) == 0) {
+    printf("Shard %s: %s\n", shard->name, line);
+  }
+}
+
+void shard_read(shard_t *shard) {
+  ssize_t bytes_read = recv(shard->fd, shard->partial + shard->partial_len,
+                            sizeof(shard->partial) - shard->partial_len - 1, 0);
+  if (bytes_read <= 0) {
+    shard_disconnect(shard);
+    return;
+  }
+  shard->partial_len += bytes_read;
+  shard->partial[shard->partial_len] = '\0';
+
+  char *line = shard->partial;
+  char *newline;
+  while ((newline = strchr(line, '\n')) != NULL) {
+    *newline = '\0';
+    shard_apply_line(shard, line);
+    line = newline + 1;
+  }
+  shard->partial_len -= line - shard->partial;
+  if (shard->partial_len + 1 >= sizeof(shard->partial)) {
+    shard->partial_len = 0; // Longer than any line a daemon sends
+  }
+  memmove(shard->partial, line, shard->partial_len);
+}
+
+// Send each request to its shard over a fresh connection and collect the
+// responses concurrently under one deadline, so a query costs as much as its
+// slowest shard. Returns how many answered; the others' responses are empty.
+int shard_fanout(shard_t **targets, const char **requests, int count,
+                 char responses[][MAX_BUFFER_SIZE]) {
+  struct pollfd fds[MAX_SHARDS];
+  size_t lengths[MAX_SHARDS] = {0};
+  int pending = 0;
+  int answered = 0;
+
+  for (int i = 0; i < count; i++) {
+    responses[i][0] = '\0';
+    fds[i].fd = connect_unix(targets[i]->socket_path, 1);
+    fds[i].events = POLLIN;
+    size_t len = strlen(requests[i]);
+    if (fds[i].fd >= 0 &&
+        send(fds[i].fd, requests[i], len, MSG_NOSIGNAL) != (ssize_t)len) {
+      close(fds[i].fd);
+      fds[i].fd = -1;
+    }
+    pending += fds[i].fd >= 0;
+  }
+
+  long deadline = monotonic_ms() + SHARD_QUERY_TIMEOUT_MS;
+  while (pending > 0) {
+    long remaining = deadline - monotonic_ms();
+    if (remaining <= 0 || poll(fds, count, (int)remaining) <= 0) {
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      if (fds[i].fd < 0 || !fds[i].revents) {
+        continue;
+      }
+      ssize_t bytes_read = recv(fds[i].fd, responses[i] + lengths[i],
+                                MAX_BUFFER_SIZE - lengths[i] - 1, 0);
+      if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+        continue;
+      }
+      if (bytes_read > 0) {
+        lengths[i] += bytes_read;
+        if (lengths[i] < MAX_BUFFER_SIZE - 1) {
+          continue;
+        }
+      }
+      // End of response (the daemon closes after it), full buffer or error
+      if (bytes_read < 0) {
+        lengths[i] = 0;
+      } else {
+        answered++;
+      }
+      responses[i][lengths[i]] = '\0';
+      close(fds[i].fd);
+      fds[i].fd = -1;
+      pending--;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (fds[i].fd >= 0) {
+      printf("Shard %s timed out\n", targets[i]->name);
+      close(fds[i].fd);
+      responses[i][0] = '\0';
+    }
+  }
+  return answered;
+}
+
+// Find the shard holding a session. Ids are "shard/server/session" as the
+// aggregator lists them; anything else is looked up in the replicas, by
+// the shard's own "server/session" id or the bare session name.
+shard_t *resolve_shard_session(const char *id, const char **downstream_id) {
+  const char *slash = strchr(id, '/');
+  for (int i = 0; slash && i < g_state.shard_count; i++) {
+    shard_t *shard = &g_state.shards[i];
+    if (strlen(shard->name) == (size_t)(slash - id) &&
+        strncmp(shard->name, id, slash - id) == 0) {
+      *downstream_id = slash + 1;
+      return shard;
+    }
+  }
+  for (int i = 0; i < g_state.shard_count; i++) {
+    shard_t *shard = &g_state.shards[i];
+    for (int r = 0; r < shard->replica_count; r++) {
+      const char *replica_id = shard->replicas[r].session_id;
+      const char *name = strchr(replica_id, '/');
+      if (strcmp(replica_id, id) == 0 || (name && strcmp(name + 1, id) == 0)) {
+        *downstream_id = replica_id;
+        return shard;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Forward "cmd:session[:args]" to the session's shard, rewriting the id to
+// the shard's own, and relay the response.
+void route_session_request(const char *buffer, char *response,
+                           size_t response_size) {
+  static char shard_response[1][MAX_BUFFER_SIZE];
+  char session_id[256];
+  const char *id_start = strchr(buffer, ':') + 1;
+  size_t id_len = strcspn(id_start, ":");
+  snprintf(session_id, sizeof(session_id), "%.*s", (int)id_len, id_start);
+
+  const char *downstream_id = NULL;
+  shard_t *shard = resolve_shard_session(session_id, &downstream_id);
+  if (!shard) {
+    snprintf(response, response_size, "ERROR: Session not found");
+    return;
+  }
+
+  char request[MAX_BUFFER_SIZE];
+  snprintf(request, sizeof(request), "%.*s%s%s", (int)(id_start - buffer),
+           buffer, downstream_id, id_start + id_len);
+  const char *requests[1] = {request};
+  if (shard_fanout(&shard, requests, 1, shard_response) == 0) {
+    snprintf(response, response_size, "ERROR: Shard %s did not answer",
+             shard->name);
+    return;
+  }
+  snprintf(response, response_size, "%s", shard_response[0]);
+}
+
+typedef struct {
+  const shard_t *shard;
+  const char *text; // Block after "=== RESULT "
+  size_t len;
+  double score;
+} shard_result_t;
+
+int compare_shard_results(const void *a, const void *b) {
+  const shard_result_t *ra = a;
+  const shard_result_t *rb = b;
+  return (ra->score < rb->score) - (ra->score > rb->score);
+}
+
+// Fan "search:k:query" out to every shard and merge the top k by score,
+// prefixing session ids with the shard name.
+void aggregate_search(const char *buffer, char *response,
+                      size_t response_size) {
+  static char shard_responses[MAX_SHARDS][MAX_BUFFER_SIZE];
+  static shard_result_t results[MAX_SHARDS * MAX_SEARCH_RESULTS];
+  shard_t *targets[MAX_SHARDS];
+  const char *requests[MAX_SHARDS];
+  static const char marker[] = "=== RESULT ";
+
+  for (int i = 0; i < g_state.shard_count; i++) {
+    targets[i] = &g_state.shards[i];
+    requests[i] = buffer;
+  }
+  int answered = shard_fanout(targets, requests, g_state.shard_count,
+                              shard_responses);
+
+  int result_count = 0;
+  for (int i = 0; i < g_state.shard_count; i++) {
+    char *block = strstr(shard_responses[i], marker);
+    while (block && result_count < MAX_SHARDS * MAX_SEARCH_RESULTS) {
+      char *next = strstr(block + 1, marker);
+      const char *score = strstr(block, " score=");
+      shard_result_t *result = &results[result_count++];
+      result->shard = targets[i];
+      result->text = block + strlen(marker);
+      result->len = (next ? (size_t)(next - block) : strlen(block)) -
+                    strlen(marker);
+      result->score = score ? atof(score + 7) : 0;
+      block = next;
+    }
+  }
+  qsort(results, result_count, sizeof(results[0]), compare_shard_results);
+
+  int top_k = atoi(buffer + 7);
+  if (top_k <= 0 || top_k > MAX_SEARCH_RESULTS) {
+    top_k = MAX_SEARCH_RESULTS;
+  }
+  if (result_count > top_k) {
+    result_count = top_k;
+  }
+  size_t used = snprintf(response, response_size,
+                         "Results: %d\nShards: %d/%d\n", result_count,
+                         answered, g_state.shard_count);
+  for (int r = 0; r < result_count && used < response_size; r++) {
+    used += snprintf(response + used, response_size - used, "%s%s%s%.*s",
+                     marker,
+                     g_state.shards_spawned ? "" : results[r].shard->name,
+                     g_state.shards_spawned ? "" : "/", (int)results[r].len,
+                     results[r].text);
+  }
+}
+
+// Aggregator mode: list and status come from the replicas, search fans out
+// to every shard, and per-session commands go to the shard owning it.
+void handle_aggregate_request(const char *buffer, char *response,
+                              size_t response_size) {
+  static const char *routed[] = {"context:",   "diagnostics:", "tests:",
+                                 "templates:", "retrieve:",    "summaries:",
+                                 "diff:",      "note:",        "grep:",
+                                 "similar:",   "screen:",      "commands:"};
+
+  if (strcmp(buffer, "status") == 0) {
+    int sessions = 0;
+    int connected = 0;
+    for (int i = 0; i < g_state.shard_count; i++) {
+      sessions += g_state.shards[i].replica_count;
+      connected += g_state.shards[i].synced;
+    }
+    snprintf(response, response_size,
+             "OK: %d sessions tracked across %d/%d shards", sessions,
+             connected, g_state.shard_count);
+    return;
+  }
+  if (strcmp(buffer, "list") == 0) {
+    size_t used = 0;
+    response[0] = '\0';
+    for (int i = 0; i < g_state.shard_count; i++) {
+      shard_t *shard = &g_state.shards[i];
+      for (int r = 0; r < shard->replica_count && used < response_size; r++) {
+        used += snprintf(response + used, response_size - used,
+                         "%s%s%s (%s)\n",
+                         g_state.shards_spawned ? "" : shard->name,
+                         g_state.shards_spawned ? "" : "/",
+                         shard->replicas[r].session_id,
+                         shard->replicas[r].current_cwd);
+      }
+    }
+    return;
+  }
+  if (strncmp(buffer, "search:", 7) == 0) {
+    aggregate_search(buffer, response, response_size);
+    return;
+  }
+  for (size_t i = 0; i < sizeof(routed) / sizeof(routed[0]); i++) {
+    if (strncmp(buffer, routed[i], strlen(routed[i])) == 0) {
+      route_session_request(buffer, response, response_size);
+      return;
+    }
+  }
+  snprintf(response, response_size, "ERROR: Unknown command");
+}
+
+// "users": per-user accounting of a system daemon. Users see their own
+// line, root sees everyone's.
+void format_users(char *response, size_t response_size) {
+  if (!g_state.system_mode) {
+    snprintf(response, response_size, "ERROR: Not a system daemon");
+    return;
+  }
+  int visible = 0;
+  for (int i = 0; i < g_state.user_count; i++) {
+    visible += g_state.request_uid == 0 ||
+               g_state.users[i].uid == g_state.request_uid;
+  }
+  size_t used = snprintf(response, response_size, "Users: %d\n", visible);
+  for (int i = 0; i < g_state.user_count && used < response_size; i++) {
+    user_account_t *account = &g_state.users[i];
+    if (g_state.request_uid != 0 && account->uid != g_state.request_uid) {
+      continue;
+    }
+    used += snprintf(
+        response + used, response_size - used,
+        "%s uid=%u sessions=%d cpu=%.0fms tokens=%.0fms memory=%zuK/%zuK "
+        "throttled=%lu refused=%lu\n",
+        account->name, (unsigned)account->uid, account->session_count,
+        account->cpu_used_ms, account->cpu_tokens_ms,
+        account->memory_bytes / 1024, g_state.user_memory_bytes / 1024,
+        account->throttled, account->refused);
+  }
+}
+
+shard_t *add_shard(const char *socket_path) {
+  if (g_state.shard_count >= MAX_SHARDS) {
+    fprintf(stderr, "Too many shards, at most %d\n", MAX_SHARDS);
+    return NULL;
+  }
+  shard_t *shard = &g_state.shards[g_state.shard_count];
+  shard->replicas = calloc(MAX_REPLICAS, sizeof(replica_t));
+  if (!shard->replicas) {
+    fprintf(stderr, "Failed to allocate shard replicas\n");
+    return NULL;
+  }
+  snprintf(shard->socket_path, sizeof(shard->socket_path), "%s", socket_path);
+  shard->fd = -1;
+  g_state.shard_count++;
+  return shard;
+}
+
+// "--aggregate name=socket,..."; without "name=" a shard is named after its
+// socket file, minus any .sock suffix.
+muxgeist_error_t parse_shards(const char *spec) {
+  char list[4096];
+  snprintf(list, sizeof(list), "%s", spec);
+  char *cursor = list;
+  char *entry;
+  while ((entry = strsep(&cursor, ",")) != NULL) {
+    if (!*entry) {
+      continue;
+    }
+    char *equals = strchr(entry, '=');
+    const char *path = equals ? equals + 1 : entry;
+    shard_t *shard = add_shard(path);
+    if (!shard) {
+      return ERROR_INVALID_ARGS;
+    }
+    if (equals) {
+      snprintf(shard->name, sizeof(shard->name), "%.*s",
+               (int)(equals - entry), entry);
+    } else {
+      const char *base = strrchr(path, '/');
+      base = base ? base + 1 : path;
+      size_t len = strlen(base);
+      if (len > 5 && strcmp(base + len - 5, ".sock") == 0) {
+        len -= 5;
+      }
+      snprintf(shard->name, sizeof(shard->name), "%.*s", (int)len, base);
+    }
+    if (!shard->name[0] || strchr(shard->name, '/') || !*path) {
+      fprintf(stderr, "Invalid shard: %s\n", entry);
+      return ERROR_INVALID_ARGS;
+    }
+  }
+  return ERROR_NONE;
+}
+
+// Start, or restart, the daemon process owning shard `index` of --shards.
+// It is this binary again, on a socket of its own, and goes down with us.
+void spawn_shard(shard_t *shard, int index) {
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return;
+  }
+  if (pid > 0) {
+    shard->pid = pid;
+    return;
+  }
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != parent) {
+    _exit(1);
+  }
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  for (int fd = 3; fd < (max_fd > 0 && max_fd < 65536 ? max_fd : 65536);
+       fd++) {
+    close(fd); // Our listening socket and lock stay ours
+  }
+  char spec[32];
+  snprintf(spec, sizeof(spec), "%d/%d", index, g_state.shards_spawned);
+  // By its real path, so the shard shows up (and is pkill'ed) by name
+  char self[PATH_MAX] = "/proc/self/exe";
+  ssize_t self_len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (self_len > 0) {
+    self[self_len] = '\0';
+  }
+  execl(self, "muxgeist-daemon", "--socket", shard->socket_path, "--shard",
+        spec, (char *)NULL);
+  perror("exec");
+  _exit(1);
+}
+
+// --shards N: N daemons, each owning the sessions that hash to it, behind
+// this one as their aggregator. Nothing is shared between them, so capture
+// work spreads over as many cores as there are shards.
+muxgeist_error_t spawn_shards(void) {
+  for (int i = 0; i < g_state.shards_spawned; i++) {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s.shard%d", g_state.socket_path, i);
+    shard_t *shard = add_shard(path);
+    if (!shard) {
+      return ERROR_INVALID_ARGS;
+    }
+    snprintf(shard->name, sizeof(shard->name), "shard%d", i);
+    spawn_shard(shard, i);
+  }
+  return ERROR_NONE;
+}
+
+// Restart shard processes that died; their sessions are back once the new
+// process has scanned (or warm started from its snapshot).
+void reap_shards(void) {
+  pid_t pid;
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    for (int i = 0; i < g_state.shard_count; i++) {
+      if (g_state.shards[i].pid == pid) {
+        printf("Shard %s exited, restarting\n", g_state.shards[i].name);
+        spawn_shard(&g_state.shards[i], i);
+      }
+    }
+  }
+}
+
+void stop_shards(void) {
+  for (int i = 0; i < g_state.shard_count; i++) {
+    if (g_state.shards[i].pid > 0) {
+      kill(g_state.shards[i].pid, SIGTERM);
+      waitpid(g_state.shards[i].pid, NULL, 0);
+    }
+  }
+}
+
+// Pass a "follow:" or "dump:" connection to the shard owning the session,
+// with the request rewritten to the shard's session id. The shard serves
+// the client directly from then on; nothing is relayed through here.
+void handoff_to_shard(int client_socket, const char *buffer) {
+  char session_id[256];
+  const char *id_start = strchr(buffer, ':') + 1;
+  size_t id_len = strcspn(id_start, ":");
+  snprintf(session_id, sizeof(session_id), "%.*s", (int)id_len, id_start);
+
+  const char *downstream_id = NULL;
+  shard_t *shard = resolve_shard_session(session_id, &downstream_id);
+  int fd = shard ? connect_unix(shard->socket_path, 0) : -1;
+  if (fd < 0) {
+    const char *error = shard ? "ERROR: Shard did not answer\n"
+                              : "ERROR: Session not found\n";
+    send(client_socket, error, strlen(error), MSG_NOSIGNAL);
+    close(client_socket);
+    return;
+  }
+
+  char request[MAX_BUFFER_SIZE];
+  int len = snprintf(request, sizeof(request), "adopt:%.*s%s%s",
+                     (int)(id_start - buffer), buffer, downstream_id,
+                     id_start + id_len);
+  char control[CMSG_SPACE(sizeof(int))] = {0};
+  struct iovec iov = {request, len < (int)sizeof(request) ? (size_t)len
+                                                          : sizeof(request)};
+  struct msghdr message = {.msg_iov = &iov,
+                           .msg_iovlen = 1,
+                           .msg_control = control,
+                           .msg_controllen = sizeof(control)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client_socket, sizeof(int));
+  if (sendmsg(fd, &message, MSG_NOSIGNAL) < 0) {
+    const char *error = "ERROR: Shard did not answer\n";
+    send(client_socket, error, strlen(error), MSG_NOSIGNAL);
+  }
+  close(fd);
+  close(client_socket);
+}
+
+
+// Bounds of the daemon's own code, from the linker
+extern char __executable_start[], etext[];
+
+int profile_in_text(uintptr_t pc) {
+  return pc >= (uintptr_t)__executable_start && pc < (uintptr_t)etext;
+}
+
+// Whether fp starts a frame-pointer chain that climbs to main's frame,
+// every frame returning into our code; stale words on the stack seldom do
+int profile_chain_ok(uintptr_t fp, uintptr_t low, uintptr_t top) {
+  for (int depth = 0; depth < PROFILE_MAX_DEPTH; depth++) {
+    if (fp == top) {
+      return 1;
+    }
+    if (fp <= low || fp > top || fp % sizeof(uintptr_t) != 0 ||
+        !profile_in_text(((const uintptr_t *)fp)[1])) {
+      return 0;
+    }
+    low = fp;
+    fp = ((const uintptr_t *)fp)[0];
+  }
+  return 0;
+}
+
+// Runs on SIGPROF, from either sample source: record the interrupted pc and
+// the return addresses up the frame-pointer chain. Only frames between
+// here and main's are followed, so a bad frame pointer ends the walk
+// instead of faulting. libc is built without frame pointers, so when the
+// pc is in library code the stack is searched instead. The chain resumes
+// from the frame pointer register if it still leads to main, else from the
+// first word up the stack that does, and the call into the library is the
+// return address just below that frame.
+void profile_signal(int sig, siginfo_t *info, void *context) {
+  (void)sig;
+  (void)info;
+  profiler_t *profiler = &g_state.profiler;
+  if (!profiler->frames) {
+    return;
+  }
+  if (profiler->perf_fd >= 0) {
+    ioctl(profiler->perf_fd, PERF_EVENT_IOC_REFRESH, 1); // Re-arm
+  }
+  if (profiler->sample_count >= PROFILE_MAX_SAMPLES) {
+    profiler->dropped++;
+    return;
+  }
+
+  uintptr_t *frames =
+      profiler->frames + (size_t)profiler->sample_count * PROFILE_MAX_DEPTH;
+  const ucontext_t *uc = context;
+  uintptr_t pc = 0, fp = 0, sp = 0;
+#if defined(__x86_64__)
+  pc = uc->uc_mcontext.gregs[REG_RIP];
+  fp = uc->uc_mcontext.gregs[REG_RBP];
+  sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  pc = uc->uc_mcontext.pc;
+  fp = uc->uc_mcontext.regs[29];
+  sp = uc->uc_mcontext.sp;
+#else
+  (void)uc;
+#endif
+  int depth = 0;
+  frames[depth++] = pc;
+  uintptr_t low = (uintptr_t)__builtin_frame_address(0);
+  if (!profile_in_text(pc) && sp > low && sp % sizeof(uintptr_t) == 0) {
+    uintptr_t top = profiler->stack_top;
+    const uintptr_t *first = (const uintptr_t *)sp;
+    if (!profile_chain_ok(fp, sp, top)) {
+      fp = 0;
+      for (const uintptr_t *word = first;
+           word < first + PROFILE_SCAN_WORDS && (uintptr_t)word <= top;
+           word++) {
+        if (profile_chain_ok((uintptr_t)word, sp - 1, top)) {
+          fp = (uintptr_t)word;
+          break;
+        }
+      }
+    }
+    // Below that frame, the nearest return address into our code is the
+    // call into the library; lower ones are left over from earlier calls
+    for (const uintptr_t *word = (const uintptr_t *)fp - 1;
+         fp && word >= first; word--) {
+      if (profile_in_text(*word)) {
+        frames[depth++] = *word - 1;
+        break;
+      }
+    }
+  }
+  while (depth < PROFILE_MAX_DEPTH && fp > low && fp < profiler->stack_top &&
+         fp % sizeof(uintptr_t) == 0) {
+    const uintptr_t *frame = (const uintptr_t *)fp;
+    frames[depth++] = frame[1] - 1; // Inside the call, not after it
+    low = fp;
+    fp = frame[0];
+  }
+  profiler->depths[profiler->sample_count++] = depth;
+}
+
+// Sample the daemon's own CPU time: a task-clock perf event that signals
+// on overflow where perf_event_open is allowed, else ITIMER_PROF.
+int profile_arm(profiler_t *profiler) {
+  struct sigaction action = {.sa_sigaction = profile_signal,
+                             .sa_flags = SA_SIGINFO | SA_RESTART};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+
+  struct perf_event_attr attr = {
+      .size = sizeof(attr),
+      .type = PERF_TYPE_SOFTWARE,
+      .config = PERF_COUNT_SW_TASK_CLOCK,
+      .sample_period = 1000000000 / PROFILE_HZ, // Nanoseconds on the CPU
+      .disabled = 1,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+  };
+  profiler->perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                              PERF_FLAG_FD_CLOEXEC);
+  if (profiler->perf_fd >= 0) {
+    struct f_owner_ex owner = {F_OWNER_TID, (pid_t)syscall(SYS_gettid)};
+    if (fcntl(profiler->perf_fd, F_SETFL, O_ASYNC) == 0 &&
+        fcntl(profiler->perf_fd, F_SETSIG, SIGPROF) == 0 &&
+        fcntl(profiler->perf_fd, F_SETOWN_EX, &owner) == 0 &&
+        ioctl(profiler->perf_fd, PERF_EVENT_IOC_REFRESH, 1) == 0) {
+      profiler->source = "perf";
+      return 0;
+    }
+    close(profiler->perf_fd);
+    profiler->perf_fd = -1;
+  }
+
+  struct itimerval timer = {{0, 1000000 / PROFILE_HZ},
+                            {0, 1000000 / PROFILE_HZ}};
+  if (setitimer(ITIMER_PROF, &timer, NULL) == 0) {
+    profiler->source = "itimer";
+    return 0;
+  }
+  signal(SIGPROF, SIG_IGN);
+  return -1;
+}
+
+void profile_disarm(profiler_t *profiler) {
+  if (profiler->perf_fd >= 0) {
+    ioctl(profiler->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    close(profiler->perf_fd);
+    profiler->perf_fd = -1;
+  } else {
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+  }
+  // A signal still in flight must not take the default action and kill us
+  signal(SIGPROF, SIG_IGN);
+}
+
+// "profile:seconds" samples the daemon for that long, carrying on with its
+// work meanwhile, then answers with folded stacks ("main;f;g 42" lines, as
+// flamegraph.pl takes them). Nothing is installed between profiles.
+void profile_start(int client_socket, const char *request) {
+  profiler_t *profiler = &g_state.profiler;
+  const char *error = NULL;
+  int seconds = atoi(request);
+  if (g_state.system_mode && g_state.request_uid != getuid() &&
+      g_state.request_uid != 0) {
+    error = "ERROR: Only the daemon's owner may profile it";
+  } else if (profiler->active) {
+    error = "ERROR: A profile is already running";
+  } else if (seconds < 1 || seconds > PROFILE_MAX_SECONDS) {
+    error = "ERROR: Profile length must be 1 to 60 seconds";
+  } else {
+    profiler->frames = malloc(sizeof(uintptr_t) * PROFILE_MAX_SAMPLES *
+                              PROFILE_MAX_DEPTH);
+    profiler->depths = malloc(sizeof(int) * PROFILE_MAX_SAMPLES);
+    profiler->sample_count = 0;
+    profiler->dropped = 0;
+    profiler->perf_fd = -1;
+    if (!profiler->frames || !profiler->depths) {
+      error = "ERROR: Out of memory";
+    } else if (profile_arm(profiler) != 0) {
+      error = "ERROR: No sampling source available";
+    }
+    if (error) {
+      free(profiler->frames);
+      free(profiler->depths);
+      profiler->frames = NULL;
+      profiler->depths = NULL;
+    }
+  }
+  if (error) {
+    send(client_socket, error, strlen(error), MSG_NOSIGNAL);
+    close(client_socket);
+    return;
+  }
+  profiler->active = 1;
+  profiler->client = client_socket;
+  profiler->end_ms = monotonic_ms() + seconds * 1000L;
+  profiler->seconds = seconds;
+}
+
+typedef struct {
+  char *stack;
+  unsigned long count;
+} folded_stack_t;
+
+int compare_folded(const void *a, const void *b) {
+  return strcmp(((const folded_stack_t *)a)->stack,
+                ((const folded_stack_t *)b)->stack);
+}
+
+// Name a code address for a folded stack: its symbol where -rdynamic
+// exported one, else module+offset.
+void profile_symbol(uintptr_t pc, char *out, size_t out_size) {
+  Dl_info info = {0};
+  if (dladdr((void *)pc, &info) && info.dli_sname) {
+    snprintf(out, out_size, "%s", info.dli_sname);
+  } else if (info.dli_fname && info.dli_fbase) {
+    const char *base = strrchr(info.dli_fname, '/');
+    snprintf(out, out_size, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+             (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+  } else {
+    snprintf(out, out_size, "0x%lx", (unsigned long)pc);
+  }
+}
+
+// Stop sampling once the profile's time is up (or the daemon is shutting
+// down) and send the stacks, root first, identical ones counted together.
+void profile_finish(int force) {
+  profiler_t *profiler = &g_state.profiler;
+  if (!profiler->active || (!force && monotonic_ms() < profiler->end_ms)) {
+    return;
+  }
+  profile_disarm(profiler);
+
+  int count = profiler->sample_count;
+  folded_stack_t *stacks = calloc(count ? count : 1, sizeof(*stacks));
+  int stack_count = 0;
+  for (int s = 0; stacks && s < count; s++) {
+    const uintptr_t *frames = profiler->frames + (size_t)s * PROFILE_MAX_DEPTH;
+    char folded[PROFILE_MAX_DEPTH * 64];
+    size_t used = 0;
+    for (int d = profiler->depths[s] - 1; d >= 0 && used < sizeof(folded);
+         d--) {
+      char name[256];
+      profile_symbol(frames[d], name, sizeof(name));
+      used += snprintf(folded + used, sizeof(folded) - used, "%s%s",
+                       used ? ";" : "", name);
+    }
+    stacks[stack_count].stack = strdup(folded);
+    if (stacks[stack_count].stack) {
+      stacks[stack_count++].count = 1;
+    }
+  }
+  if (stacks) {
+    qsort(stacks, stack_count, sizeof(*stacks), compare_folded);
+  }
+
+  size_t reply_size = 1, reply_used = 0;
+  for (int s = 0; s < stack_count; s++) {
+    reply_size += strlen(stacks[s].stack) + 24;
+  }
+  char *reply = malloc(reply_size);
+  for (int s = 0; reply && s < stack_count; s++) {
+    unsigned long samples = 1;
+    while (s + 1 < stack_count &&
+           strcmp(stacks[s].stack, stacks[s + 1].stack) == 0) {
+      s++;
+      samples++;
+    }
+    reply_used += snprintf(reply + reply_used, reply_size - reply_used,
+                           "%s %lu\n", stacks[s].stack, samples);
+  }
+  for (int s = 0; stacks && s < stack_count; s++) {
+    free(stacks[s].stack);
+  }
+  free(stacks);
+  printf("Profile: %d samples over %ds from %s, %lu dropped\n", count,
+         profiler->seconds, profiler->source, profiler->dropped);
+
+  if (!reply) {
+    const char *error = "ERROR: Out of memory";
+    send_reply_later(profiler->client, error, strlen(error));
+  } else if (count == 0) {
+    const char *error = "ERROR: No samples; the daemon was idle";
+    send_reply_later(profiler->client, error, strlen(error));
+  } else {
+    send_reply_later(profiler->client, reply, reply_used);
+  }
+  free(reply);
+  profiler->active = 0;
+  free(profiler->frames);
+  free(profiler->depths);
+  profiler->frames = NULL;
+  profiler->depths = NULL;
+}
+
+void handle_client_request(int client_socket) {
+  char buffer[MAX_BUFFER_SIZE];
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {buffer, sizeof(buffer) - 1};
+  struct msghdr message = {.msg_iov = &iov,
+                           .msg_iovlen = 1,
+                           .msg_control = control,
+                           .msg_controllen = sizeof(control)};
+  ssize_t bytes_read = recvmsg(client_socket, &message, MSG_CMSG_CLOEXEC);
+
+  int passed_fd = -1;
+  struct cmsghdr *cmsg = bytes_read > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+    memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+  }
   if (bytes_read <= 0) {
     close(client_socket);
     return;
   }
 
-  buffer[bytes_read] = '\0';
-  printf("Received request: %s\n", buffer);
-
-  // Simple protocol: "status", "context:session_id", "list"
+  buffer[bytes_read] = '\0';
+  printf("Received request: %s\n", buffer);
+
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  // "adopt:" hands us the client of a --shards parent, which only our own
+  // user (or root) may do; the request is then answered on that connection
+  if (passed_fd >= 0) {
+    if (strncmp(buffer, "adopt:", 6) == 0 &&
+        getsockopt(client_socket, SOL_SOCKET, SO_PEERCRED, &cred,
+                   &cred_len) == 0 &&
+        (cred.uid == getuid() || cred.uid == 0)) {
+      close(client_socket);
+      client_socket = passed_fd;
+      memmove(buffer, buffer + 6, strlen(buffer + 6) + 1);
+    } else {
+      close(passed_fd);
+    }
+  }
+
+  // Requests act for the connecting user; a system daemon serves only the
+  // sessions on that user's own tmux servers
+  cred_len = sizeof(cred);
+  if (getsockopt(client_socket, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) ==
+      0) {
+    g_state.request_uid = cred.uid;
+  } else if (g_state.system_mode) {
+    const char *error = "ERROR: Unknown peer";
+    send(client_socket, error, strlen(error), MSG_NOSIGNAL);
+    close(client_socket);
+    return;
+  } else {
+    g_state.request_uid = getuid();
+  }
+
+  if (strcmp(buffer, "subscribe") == 0 && g_state.shard_count == 0) {
+    add_subscriber(client_socket); // Stays open
+    return;
+  }
+  if (strncmp(buffer, "follow:", 7) == 0 && g_state.shard_count == 0) {
+    add_follower(client_socket, buffer + 7); // Stays open
+    return;
+  }
+  if (strncmp(buffer, "dump:", 5) == 0 && g_state.shard_count == 0) {
+    dump_history(client_socket, buffer + 5); // Streams, then closes
+    return;
+  }
+  if ((strncmp(buffer, "follow:", 7) == 0 ||
+       strncmp(buffer, "dump:", 5) == 0) &&
+      g_state.shard_count > 0) {
+    handoff_to_shard(client_socket, buffer);
+    return;
+  }
+  if (strncmp(buffer, "profile:", 8) == 0) {
+    profile_start(client_socket, buffer + 8); // Answered when done
+    return;
+  }
+  if (g_state.trace) {
+    trace_event('R', buffer, "");
+  }
+
+  // Simple protocol: "status", "context:session_id", "list",
+  // "diagnostics:session_id", "tests:session_id", "templates:session_id[:pane]",
+  // "retrieve:session_id:k:budget:question",
+  // "summaries:session_id[:seconds[:budget]]", "diff:session_id:seq",
+  // "note:session_id:text", "search:k:query", "subscribe", "users",
+  // "follow:session_id:since:pane:flags", "dump:session_id[:pane[:format]]",
+  // "grep:session_id:seconds:text", "similar:session_id:k:line",
+  // "screen:session_id:pane:seconds_ago[:base_seconds_ago]",
+  // "profile:seconds", "commands:session_id[:count]"
   char response[MAX_BUFFER_SIZE];
 
-  if (strcmp(buffer, "status") == 0) {
-    snprintf(response, sizeof(response), "OK: %d sessions tracked",
-             g_state.session_count);
+  if (g_state.shard_count > 0) {
+    handle_aggregate_request(buffer, response, sizeof(response));
+  } else if (strcmp(buffer, "status") == 0) {
+    int visible = 0;
+    for (int i = 0; i < g_state.session_count; i++) {
+      visible += session_visible(&g_state.sessions[i]);
+    }
+    int used = snprintf(response, sizeof(response), "OK: %d sessions tracked",
+                        visible);
+    if (g_state.history_cold_bytes > 0) {
+      used += snprintf(response + used, sizeof(response) - used,
+                       "; cold history %zuK held in %zuK",
+                       g_state.history_cold_raw / 1024,
+                       g_state.history_cold_bytes / 1024);
+    }
+    if (g_state.history_thaw_failures > 0) {
+      used += snprintf(response + used, sizeof(response) - used,
+                       "; %lu cold history reads failed",
+                       g_state.history_thaw_failures);
+    }
+    int tails = 0;
+    for (int i = 0; i < g_state.session_count; i++) {
+      for (int p = 0; p < g_state.sessions[i].pane_count; p++) {
+        tails += g_state.sessions[i].panes[p].tail != NULL;
+      }
+    }
+    if (tails > 0) {
+      used += snprintf(response + used, sizeof(response) - used,
+                       "; following %d file%s", tails, tails == 1 ? "" : "s");
+    }
+    if (g_state.shell_history_count > 0) {
+      snprintf(response + used, sizeof(response) - used,
+               "; watching %d shell histor%s", g_state.shell_history_count,
+               g_state.shell_history_count == 1 ? "y" : "ies");
+    }
+  } else if (strcmp(buffer, "users") == 0) {
+    format_users(response, sizeof(response));
   } else if (strncmp(buffer, "context:", 8) == 0) {
     char *session_id = buffer + 8;
     session_context_t *session = find_session(session_id);
     if (session) {
+      unsigned long seq = session_mark_snapshot(session);
       snprintf(response, sizeof(response),
-               "Session: %s\nCWD: %s\nPane: %s\nLast Activity: %ld\nScrollback "
-               "Length: %d\nScrollback:\n%s\n",
+               "Session: %s\nCWD: %s\nPane: %s\nLast Activity: %ld\nSeq: "
+               "%lu\nScrollback Length: %d\nScrollback:\n%s\n",
                session->session_id, session->current_cwd, session->current_pane,
-               session->last_activity, session->scrollback_len,
+               session->last_activity, seq, session->scrollback_len,
                session->scrollback);
     } else {
       snprintf(response, sizeof(response), "ERROR: Session not found");
     }
+  } else if (strncmp(buffer, "diagnostics:", 12) == 0) {
+    session_context_t *session = find_session(buffer + 12);
+    if (session) {
+      format_diagnostics(session, response, sizeof(response));
+    } else {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    }
+  } else if (strncmp(buffer, "tests:", 6) == 0) {
+    session_context_t *session = find_session(buffer + 6);
+    if (session) {
+      format_test_runs(session, response, sizeof(response));
+    } else {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    }
+  } else if (strncmp(buffer, "commands:", 9) == 0) {
+    // "commands:session" or "commands:session:count"
+    char *session_id = buffer + 9;
+    char *limit = strchr(session_id, ':');
+    if (limit) {
+      *limit++ = '\0';
+    }
+    session_context_t *session = find_session(session_id);
+    if (session) {
+      format_commands(session, limit ? atoi(limit) : 0, response,
+                      sizeof(response));
+    } else {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    }
+  } else if (strncmp(buffer, "templates:", 10) == 0) {
+    // "templates:session" or "templates:session:pane"
+    char *session_id = buffer + 10;
+    char *pane_filter = strchr(session_id, ':');
+    if (pane_filter) {
+      *pane_filter++ = '\0';
+    }
+    session_context_t *session = find_session(session_id);
+    if (session) {
+      format_log_templates(session, pane_filter, response, sizeof(response));
+    } else {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    }
+  } else if (strncmp(buffer, "retrieve:", 9) == 0) {
+    // "retrieve:session:k:budget:question"
+    char *fields[5] = {0};
+    char *cursor = buffer + 9;
+    for (int f = 0; f < 3 && cursor; f++) {
+      fields[f] = strsep(&cursor, ":");
+    }
+    fields[3] = cursor;
+    session_context_t *session = fields[0] ? find_session(fields[0]) : NULL;
+    if (!fields[3]) {
+      snprintf(response, sizeof(response),
+               "ERROR: Usage: retrieve:session:k:budget:question");
+    } else if (session) {
+      int top_k = atoi(fields[1]);
+      long budget = atol(fields[2]);
+      format_retrieval(session, top_k > 0 ? top_k : 5,
+                       budget > 0 ? (size_t)budget : sizeof(response),
+                       fields[3], response, sizeof(response));
+    } else {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    }
+  } else if (strncmp(buffer, "diff:", 5) == 0) {
+    // "diff:session:seq", seq as returned by context: or a previous diff:
+    char *cursor = buffer + 5;
+    char *session_id = strsep(&cursor, ":");
+    session_context_t *session = find_session(session_id);
+    if (!cursor) {
+      snprintf(response, sizeof(response), "ERROR: Usage: diff:session:seq");
+    } else if (session) {
+      format_diff(session, strtoul(cursor, NULL, 10), response,
+                  sizeof(response));
+    } else {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    }
+  } else if (strncmp(buffer, "note:", 5) == 0) {
+    // "note:session:text" adds text to the session's status; empty clears it
+    char *cursor = buffer + 5;
+    char *session_id = strsep(&cursor, ":");
+    session_context_t *session = find_session(session_id);
+    if (!cursor) {
+      snprintf(response, sizeof(response), "ERROR: Usage: note:session:text");
+    } else if (session) {
+      sanitize_status_text(session->status_note, sizeof(session->status_note),
+                           cursor);
+      publish_session_status(session);
+      snprintf(response, sizeof(response), "OK: %s", session->status_line);
+    } else {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    }
+  } else if (strncmp(buffer, "summaries:", 10) == 0) {
+    // "summaries:session", optionally followed by ":seconds[:budget]"
+    char *cursor = buffer + 10;
+    char *session_id = strsep(&cursor, ":");
+    char *span = cursor ? strsep(&cursor, ":") : NULL;
+    long seconds = span ? atol(span) : 0;
+    long budget = cursor ? atol(cursor) : 0;
+    session_context_t *session = find_session(session_id);
+    if (session) {
+      format_summaries(session,
+                       seconds > 0 ? seconds : SUMMARY_DEFAULT_SPAN,
+                       budget > 0 ? (size_t)budget : SUMMARY_DEFAULT_BUDGET,
+                       response, sizeof(response));
+    } else {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    }
+  } else if (strncmp(buffer, "screen:", 7) == 0) {
+    // "screen:session:pane:seconds_ago[:base_seconds_ago]"
+    char *cursor = buffer + 7;
+    char *session_id = strsep(&cursor, ":");
+    char *pane = cursor ? strsep(&cursor, ":") : NULL;
+    char *ago = cursor ? strsep(&cursor, ":") : NULL;
+    session_context_t *session = find_session(session_id);
+    if (!pane || !*pane) {
+      snprintf(response, sizeof(response),
+               "ERROR: Usage: screen:session:pane:seconds_ago[:base]");
+    } else if (!session) {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    } else {
+      format_screen(session, pane, ago ? atol(ago) : 0,
+                    cursor && *cursor ? atol(cursor) : -1, response,
+                    sizeof(response));
+    }
+  } else if (strncmp(buffer, "grep:", 5) == 0 ||
+             strncmp(buffer, "similar:", 8) == 0) {
+    // "grep:session:seconds:text" (0 seconds for all history) and
+    // "similar:session:k:line"
+    int grep = buffer[0] == 'g';
+    char *cursor = buffer + (grep ? 5 : 8);
+    char *session_id = strsep(&cursor, ":");
+    char *number = cursor ? strsep(&cursor, ":") : NULL;
+    session_context_t *session = find_session(session_id);
+    if (!cursor || !*cursor) {
+      snprintf(response, sizeof(response), "ERROR: Usage: %s",
+               grep ? "grep:session:seconds:text" : "similar:session:k:line");
+    } else if (!session) {
+      snprintf(response, sizeof(response), "ERROR: Session not found");
+    } else if (grep) {
+      format_grep(session, atol(number), cursor, response, sizeof(response));
+    } else {
+      int top_k = atoi(number);
+      format_similar(session, top_k > 0 ? top_k : 5, cursor, response,
+                     sizeof(response));
+    }
+  } else if (strncmp(buffer, "search:", 7) == 0) {
+    // "search:k:query" ranks windows of every session
+    char *cursor = buffer + 7;
+    char *count = strsep(&cursor, ":");
+    if (!cursor) {
+      snprintf(response, sizeof(response), "ERROR: Usage: search:k:query");
+    } else {
+      int top_k = atoi(count);
+      format_search(top_k > 0 ? top_k : 10, cursor, response,
+                    sizeof(response));
+    }
   } else if (strcmp(buffer, "list") == 0) {
     response[0] = '\0';
     for (int i = 0; i < g_state.session_count; i++) {
+      if (!g_state.servers[g_state.sessions[i].server].alive ||
+          !session_visible(&g_state.sessions[i])) {
+        continue;
+      }
       char session_info[256];
       snprintf(session_info, sizeof(session_info), "%s (%s)\n",
                g_state.sessions[i].session_id, g_state.sessions[i].current_cwd);
@@ -384,6 +8918,588 @@ void handle_client_request(int client_socket) {
   close(client_socket);
 }
 
+// Resident set size right now, in KiB
+long resident_kb(void) {
+  long pages = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    if (fscanf(fp, "%*s %ld", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(fp);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+// p50, p99 and max of a slice of the request latencies
+void latency_percentiles(const double *latencies, size_t count,
+                         double *p50, double *p99, double *max) {
+  *p50 = *p99 = *max = 0;
+  if (count == 0) {
+    return;
+  }
+  double *sorted = malloc(count * sizeof(double));
+  if (!sorted) {
+    return;
+  }
+  memcpy(sorted, latencies, count * sizeof(double));
+  qsort(sorted, count, sizeof(double), compare_doubles);
+  *p50 = sorted[count / 2];
+  *p99 = sorted[count * 99 / 100];
+  *max = sorted[count - 1];
+  free(sorted);
+}
+
+// Serve a recorded request as if a client had sent it, timing the handler
+void replay_request(const trace_record_t *record) {
+  replay_t *replay = &g_state.replay;
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    return;
+  }
+  send(fds[0], record->key, record->key_len, MSG_NOSIGNAL);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  handle_client_request(fds[1]); // Closes its end when done
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  char discard[4096];
+  while (recv(fds[0], discard, sizeof(discard), 0) > 0) {
+  }
+  close(fds[0]);
+
+  if (replay->latency_count == replay->latency_capacity) {
+    size_t capacity = replay->latency_capacity ? replay->latency_capacity * 2
+                                               : 1024;
+    double *grown = realloc(replay->latencies, capacity * sizeof(double));
+    if (!grown) {
+      return;
+    }
+    replay->latencies = grown;
+    replay->latency_capacity = capacity;
+  }
+  replay->latencies[replay->latency_count++] =
+      (end.tv_sec - start.tv_sec) * 1000.0 +
+      (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+void replay_apply(trace_record_t *record) {
+  replay_t *replay = &g_state.replay;
+  replay->last_ms = record->ms;
+  if (record->kind == 'T') {
+    replay_store_output(record);
+  } else if (record->kind == 'R') {
+    replay_request(record);
+  } else if (record->kind == 'S') {
+    int slot = 0;
+    while (slot < replay->server_count &&
+           strcmp(replay->servers[slot].value, record->value) != 0) {
+      slot++;
+    }
+    if (slot == MAX_TMUX_SERVERS) {
+      return;
+    }
+    if (slot == replay->server_count) {
+      replay->server_count++;
+    } else {
+      trace_free_record(&replay->servers[slot]);
+    }
+    replay->servers[slot] = *record;
+    record->key = record->value = NULL;
+    track_server(replay->servers[slot].key, replay->servers[slot].value);
+    int index = find_server(replay->servers[slot].value);
+    if (index >= 0) {
+      g_state.servers[index].owner = replay->servers[slot].owner;
+      if (replay->servers[slot].is_default) {
+        g_state.default_server = index;
+      }
+    }
+  }
+  trace_free_record(record);
+}
+
+// One line of the replay report: what the last window of trace time cost
+void replay_report(const char *label, long trace_ms, long real_ms,
+                   unsigned long lines, unsigned long commands,
+                   const double *latencies, size_t latency_count) {
+  double p50, p99, max;
+  latency_percentiles(latencies, latency_count, &p50, &p99, &max);
+  printf("%s t=%lds real=%ldms lines=%lu (%.0f/s) tmux=%lu requests=%zu "
+         "p50=%.3fms p99=%.3fms max=%.3fms rss=%ldK\n",
+         label, trace_ms / 1000, real_ms, lines,
+         real_ms > 0 ? lines * 1000.0 / real_ms : 0.0, commands,
+         latency_count, p50, p99, max, resident_kb());
+  fflush(stdout);
+}
+
+// Move the replay clock and apply every record it has reached. Paced
+// replays follow the wall clock times the speed; an unpaced one jumps
+// straight to the next record or server poll, whichever comes first.
+void replay_advance(void) {
+  replay_t *replay = &g_state.replay;
+  if (replay->speed > 0) {
+    replay->now_ms = (long)((monotonic_ms() - replay->started_ms) *
+                            replay->speed);
+  } else {
+    long next = replay->exhausted ? LONG_MAX : replay->next.ms;
+    for (int i = 0; i < g_state.server_count; i++) {
+      if (g_state.servers[i].alive) {
+        long due = g_state.servers[i].next_poll * 1000 - replay->epoch_ms;
+        next = due < next ? due : next;
+      }
+    }
+    if (next == LONG_MAX || next <= replay->now_ms) {
+      next = replay->now_ms + SERVER_MIN_INTERVAL * 1000;
+    }
+    replay->now_ms = next;
+  }
+
+  while (!replay->exhausted && replay->next.ms <= replay->now_ms) {
+    replay_apply(&replay->next);
+    int rc = trace_read_record(replay->fp, &replay->next);
+    if (rc <= 0) {
+      if (rc < 0) {
+        fprintf(stderr, "Trace damaged after %lds, replaying what was read\n",
+                replay->last_ms / 1000);
+      }
+      replay->exhausted = 1;
+    }
+  }
+
+  // Done once the last recorded outputs have had a poll to be picked up
+  long real_ms = monotonic_ms() - replay->started_ms;
+  int finished = replay->exhausted &&
+                 replay->now_ms >= replay->last_ms + REPLAY_TAIL_MS;
+  if (replay->now_ms >= replay->next_report_ms && !finished) {
+    replay_report("replay", replay->now_ms, real_ms - replay->window_real_ms,
+                  g_state.lines_ingested - replay->window_lines,
+                  replay->tmux_commands - replay->window_commands,
+                  replay->latencies + replay->window_latencies,
+                  replay->latency_count - replay->window_latencies);
+    replay->next_report_ms += REPLAY_REPORT_INTERVAL_MS;
+    replay->window_real_ms = real_ms;
+    replay->window_lines = g_state.lines_ingested;
+    replay->window_commands = replay->tmux_commands;
+    replay->window_latencies = replay->latency_count;
+  }
+  if (finished) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    replay_report("replay done", replay->now_ms, real_ms,
+                  g_state.lines_ingested, replay->tmux_commands,
+                  replay->latencies, replay->latency_count);
+    printf("replay speedup=%.1fx peak_rss=%ldK\n",
+           real_ms > 0 ? (double)replay->now_ms / real_ms : 0.0,
+           usage.ru_maxrss);
+    g_state.running = 0;
+  }
+}
+
+// --replay: run against a trace instead of tmux. speed is a multiple of the
+// recorded pace, 0 for as fast as possible.
+muxgeist_error_t replay_start(const char *path, double speed) {
+  replay_t *replay = &g_state.replay;
+  replay->fp = trace_open(path, &replay->epoch_ms);
+  if (!replay->fp) {
+    return ERROR_INVALID_ARGS;
+  }
+  if (trace_read_record(replay->fp, &replay->next) <= 0) {
+    fprintf(stderr, "%s: empty trace\n", path);
+    return ERROR_INVALID_ARGS;
+  }
+  replay->speed = speed;
+  replay->started_ms = monotonic_ms();
+  replay->next_report_ms = REPLAY_REPORT_INTERVAL_MS;
+  g_state.replaying = 1;
+  return ERROR_NONE;
+}
+
+// Words an anonymised trace keeps, because the daemon's parsers look for
+// them: without them a replay would find no diagnostics or test runs.
+int anonymise_keeps(const char *word, size_t len) {
+  static const char *keep[] = {
+      "error",   "errors",    "warning",  "warnings", "fatal",    "note",
+      "help",    "aborting",  "panic",    "traceback", "most",    "recent",
+      "call",    "last",      "file",     "line",     "exception", "fail",
+      "failed",  "failure",   "failures", "pass",     "passed",   "skip",
+      "skipped", "xfailed",   "deselected", "ignored", "test",    "tests",
+      "session", "starts",    "result",   "project",  "total",    "time",
+      "real",    "sec",       "run",      "running",  "finished", "not",
+      "start",   "timeout",   "denied",   "refused",  "killed",   "pytest",
+      "ctest",   "cargo",     "rustc",    "tsc",      "gcc",      "clang",
+      "python",  "python3",   "bash",     "zsh",      "fish",     "dash",
+      "ksh",     "tcsh",      "csh",      "muxgeist", "tmux",     "out",
+      "in",      "of",        "ok",       NULL};
+  for (int i = 0; keep[i]; i++) {
+    if (strlen(keep[i]) == len && strncasecmp(word, keep[i], len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Source file extensions, kept after a '.' so file:line:col still parses
+int anonymise_keeps_extension(const char *word, size_t len) {
+  static const char *extensions[] = {"c",  "h",  "cc", "cpp", "hpp", "go",
+                                     "rs", "py", "js", "ts",  "tsx", NULL};
+  for (int i = 0; extensions[i]; i++) {
+    if (strlen(extensions[i]) == len &&
+        strncmp(word, extensions[i], len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A keyed permutation of the len-digit numbers, by cycle-walking a small
+// Feistel network: distinct numbers (pane ids, pids) stay distinct while
+// their values are hidden.
+unsigned long anonymise_number(unsigned long value, size_t len,
+                               unsigned long salt) {
+  unsigned long limit = 1;
+  for (size_t i = 0; i < len; i++) {
+    limit *= 10;
+  }
+  int half = 1;
+  while ((1UL << (2 * half)) < limit) {
+    half++;
+  }
+  unsigned long mask = (1UL << half) - 1;
+  do {
+    unsigned long left = value >> half;
+    unsigned long right = value & mask;
+    for (unsigned long round = 0; round < 4; round++) {
+      unsigned long mix[2] = {right, round};
+      unsigned long f = hash_bytes((const char *)mix, sizeof(mix)) ^ salt;
+      f = (f * 6364136223846793005UL + 1442695040888963407UL) >> 33;
+      unsigned long next = left ^ (f & mask);
+      left = right;
+      right = next;
+    }
+    value = (left << half) | right;
+  } while (value >= limit);
+  return value;
+}
+
+int anonymise_word_char(unsigned char c) {
+  return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// Replace each word by characters derived from a salted hash of it, same
+// length and case, digits by digits. Runs of digits count as words of their
+// own. The same word always maps the same way within a trace, so a session
+// name still matches between list output and the commands that target it,
+// and columns still line up. Numbers are kept only where a parser reads
+// them as a position: the line and column after a file name, the line after
+// Python's "line".
+void anonymise_text(char *text, size_t len, unsigned long salt) {
+  int position = 0; // The next number is a file line or column
+  size_t i = 0;
+  while (i < len) {
+    if (!anonymise_word_char(text[i])) {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    int number = isdigit((unsigned char)text[i]) != 0;
+    while (i < len && anonymise_word_char(text[i]) &&
+           !!isdigit((unsigned char)text[i]) == number) {
+      i++;
+    }
+    const char *word = text + start;
+    size_t word_len = i - start;
+    char before = start > 0 ? text[start - 1] : '\n';
+    int keep;
+    if (number) {
+      keep = (position && strchr(":(,", before)) ||
+             (start >= 5 && strncmp(word - 5, "line ", 5) == 0);
+    } else {
+      keep = anonymise_keeps(word, word_len) ||
+             (before == '.' && anonymise_keeps_extension(word, word_len)) ||
+             // pytest's "E   assert ..." and durations such as "0.12s"
+             (word_len == 1 && *word == 'E' && before == '\n') ||
+             (word_len == 1 && *word == 's' && isdigit((unsigned char)before));
+    }
+    position = keep && i < len && strchr(":(,", text[i]) &&
+               (number || before == '.');
+    if (keep) {
+      continue;
+    }
+    if (number && word_len <= 18) {
+      unsigned long value = strtoul(word, NULL, 10);
+      value = anonymise_number(value, word_len, salt);
+      for (size_t j = i; j > start; j--, value /= 10) {
+        text[j - 1] = '0' + value % 10;
+      }
+      continue;
+    }
+    unsigned long hash = hash_bytes(word, word_len) ^ salt;
+    for (size_t j = start; j < i; j++) {
+      hash = hash * 6364136223846793005UL + 1442695040888963407UL;
+      if (number) {
+        text[j] = '0' + (hash >> 33) % 10;
+      } else {
+        char letter = 'a' + (hash >> 33) % 26;
+        text[j] = isupper((unsigned char)text[j]) ? toupper(letter) : letter;
+      }
+    }
+  }
+}
+
+// A tmux command keeps its syntax and formats; only its quoted arguments
+// (socket paths, targets, option values) and the numbers of bare pane ids
+// are anonymised, the same way as in the output they came from.
+void anonymise_command(char *command, size_t len, unsigned long salt) {
+  char *end = command + len;
+  for (char *p = command; p < end; p++) {
+    if (*p == '\\') {
+      p++; // The \' of a quote inside a quoted word
+    } else if (*p == '\'') {
+      char *close = memchr(p + 1, '\'', end - p - 1);
+      if (!close) {
+        break;
+      }
+      if (!memmem(p, close - p, "#{", 2)) {
+        anonymise_text(p + 1, close - p - 1, salt);
+      }
+      p = close;
+    } else if (*p == '%' && p > command && p[-1] == ' ') {
+      char *digits = p + 1;
+      while (p + 1 < end && isdigit((unsigned char)p[1])) {
+        p++;
+      }
+      anonymise_text(digits, p + 1 - digits, salt);
+    }
+  }
+}
+
+// Compress blocks[first..last) one by one, each in its own stream as cold
+// history is, and time decoding them all back. Returns the compressed size.
+size_t bench_blocks(char **blocks, size_t *lens, int first, int last,
+                    const unsigned char *dict, size_t dict_len,
+                    double *decode_mb_s) {
+  unsigned char **packed = calloc(last - first, sizeof(*packed));
+  long *packed_lens = calloc(last - first, sizeof(*packed_lens));
+  size_t total = 0, raw = 0, largest = 0;
+  for (int b = first; packed && packed_lens && b < last; b++) {
+    packed[b - first] = malloc(lens[b]);
+    packed_lens[b - first] =
+        packed[b - first]
+            ? history_deflate((unsigned char *)blocks[b], lens[b], dict,
+                              dict_len, packed[b - first], lens[b])
+            : -1;
+    total += packed_lens[b - first] > 0 ? (size_t)packed_lens[b - first]
+                                        : lens[b];
+    raw += lens[b];
+    largest = lens[b] > largest ? lens[b] : largest;
+  }
+  unsigned char *scratch = malloc(largest + 1);
+  long started = monotonic_ms(), elapsed = 0;
+  size_t decoded = 0;
+  while (scratch && raw > 0 && elapsed < 300) {
+    for (int b = first; b < last; b++) {
+      if (packed_lens[b - first] > 0) {
+        history_inflate(packed[b - first], packed_lens[b - first], dict,
+                        dict_len, scratch, largest);
+      }
+    }
+    decoded += raw;
+    elapsed = monotonic_ms() - started;
+  }
+  *decode_mb_s = elapsed > 0 ? decoded / 1048576.0 / (elapsed / 1000.0) : 0;
+  for (int b = first; packed && b < last; b++) {
+    free(packed[b - first]);
+  }
+  free(packed);
+  free(packed_lens);
+  free(scratch);
+  return total;
+}
+
+// Time the UTF-8 ingest pass over text as capture runs it: repair, then
+// the width of every line. Speeds are in MB of input per second.
+void bench_utf8(char *text, size_t size, double *repair_mb_s,
+                double *width_mb_s) {
+  long started = monotonic_ms(), elapsed = 0;
+  size_t done = 0;
+  while (size > 0 && elapsed < 300) {
+    utf8_repair(text, size);
+    done += size;
+    elapsed = monotonic_ms() - started;
+  }
+  *repair_mb_s = elapsed > 0 ? done / 1048576.0 / (elapsed / 1000.0) : 0;
+
+  started = monotonic_ms(), elapsed = 0, done = 0;
+  volatile int columns = 0; // Kept so the loop is not optimised away
+  while (size > 0 && elapsed < 300) {
+    for (char *line = text; line < text + size;) {
+      char *eol = memchr(line, '\n', text + size - line);
+      size_t len = eol ? (size_t)(eol - line) : (size_t)(text + size - line);
+      columns += utf8_width(line, len);
+      line += len + 1;
+    }
+    done += size;
+    elapsed = monotonic_ms() - started;
+  }
+  *width_mb_s = elapsed > 0 ? done / 1048576.0 / (elapsed / 1000.0) : 0;
+}
+
+// --bench-history FILE: cut a text file (a dump, say) into history blocks,
+// train a dictionary on the first half, and compress the second half block
+// by block without and with it. One stream over the whole second half
+// shows the ratio that large blocks would reach. The UTF-8 pass every
+// capture goes through is timed on the same text first.
+muxgeist_error_t bench_history(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return ERROR_INVALID_ARGS;
+  }
+  size_t size = 0, capacity = 1 << 20;
+  char *text = malloc(capacity);
+  size_t got;
+  while (text && (got = fread(text + size, 1, capacity - size, fp)) > 0) {
+    size += got;
+    if (size == capacity) {
+      char *grown = realloc(text, capacity *= 2);
+      if (!grown) {
+        free(text);
+      }
+      text = grown;
+    }
+  }
+  fclose(fp);
+  if (!text) {
+    fprintf(stderr, "Out of memory\n");
+    return ERROR_INVALID_ARGS;
+  }
+  text[size] = '\0';
+  size = utf8_repair(text, size);
+  double repair_speed, width_speed;
+  bench_utf8(text, size, &repair_speed, &width_speed);
+  printf("bench utf8 repair=%.0fMB/s width=%.0fMB/s\n", repair_speed,
+         width_speed);
+
+  int block_count = 0;
+  for (size_t i = 0; i < size; i++) {
+    block_count += text[i] == '\n';
+  }
+  block_count = block_count / HISTORY_BLOCK_LINES + 1;
+  char **blocks = calloc(block_count, sizeof(*blocks));
+  size_t *lens = calloc(block_count, sizeof(*lens));
+  int blocks_found = 0;
+  for (char *cursor = text; blocks && lens && cursor < text + size;) {
+    char *end = cursor;
+    for (int l = 0; l < HISTORY_BLOCK_LINES && end < text + size; l++) {
+      char *eol = memchr(end, '\n', text + size - end);
+      end = eol ? eol + 1 : text + size;
+    }
+    blocks[blocks_found] = cursor;
+    lens[blocks_found++] = end - cursor;
+    cursor = end;
+  }
+  if (blocks_found < 2) {
+    fprintf(stderr, "Need at least %d lines\n", 2 * HISTORY_BLOCK_LINES);
+    return ERROR_INVALID_ARGS;
+  }
+
+  int half = blocks_found / 2;
+  history_codec_t *codec = &g_state.codecs[HISTORY_CLASS_LOG];
+  for (int b = 0; b < half; b++) {
+    dict_observe(codec, blocks[b], lens[b]);
+  }
+  g_state.socket_path[0] = '\0'; // Nothing to save the dictionary next to
+  dict_train(HISTORY_CLASS_LOG);
+
+  size_t raw = blocks[blocks_found - 1] + lens[blocks_found - 1] - blocks[half];
+  double plain_speed, dict_speed;
+  size_t plain = bench_blocks(blocks, lens, half, blocks_found, NULL, 0,
+                              &plain_speed);
+  size_t with_dict =
+      bench_blocks(blocks, lens, half, blocks_found,
+                   codec->dicts[codec->version],
+                   codec->dict_sizes[codec->version], &dict_speed);
+  unsigned char *whole = malloc(raw);
+  long stream = whole ? history_deflate((unsigned char *)blocks[half], raw,
+                                        NULL, 0, whole, raw)
+                      : -1;
+  free(whole);
+  free(blocks);
+  free(lens);
+  free(text);
+  if (stream < 0) {
+    fprintf(stderr, "Compression unavailable (built without zlib?)\n");
+    return ERROR_INVALID_ARGS;
+  }
+  printf("bench blocks=%d lines/block=%d raw=%zuK dictionary=%zu bytes\n",
+         blocks_found - half, HISTORY_BLOCK_LINES, raw / 1024,
+         codec->dict_sizes[codec->version]);
+  printf("bench no-dictionary ratio=%.2fx decode=%.0fMB/s\n",
+         (double)raw / plain, plain_speed);
+  printf("bench dictionary ratio=%.2fx decode=%.0fMB/s\n",
+         (double)raw / with_dict, dict_speed);
+  printf("bench one-stream ratio=%.2fx\n", (double)raw / stream);
+  return ERROR_NONE;
+}
+
+// --anonymise: copy a trace with its contents scrambled for sharing. Pane
+// output, names and paths become nonsense words; structure, timing, sizes
+// and the keywords the parsers need survive, so it replays alike.
+muxgeist_error_t anonymise_trace(const char *in_path, const char *out_path) {
+  long epoch_ms;
+  FILE *in = trace_open(in_path, &epoch_ms);
+  if (!in) {
+    return ERROR_INVALID_ARGS;
+  }
+  FILE *out = fopen(out_path, "wb");
+  if (!out) {
+    perror(out_path);
+    fclose(in);
+    return ERROR_INVALID_ARGS;
+  }
+  unsigned long salt = 0;
+  int random = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  if (random < 0 || read(random, &salt, sizeof(salt)) != sizeof(salt)) {
+    salt = (unsigned long)monotonic_ms() ^ ((unsigned long)getpid() << 32);
+  }
+  if (random >= 0) {
+    close(random);
+  }
+
+  fprintf(out, "MGTRACE1 %ld\n", epoch_ms);
+  trace_record_t record;
+  int rc;
+  while ((rc = trace_read_record(in, &record)) > 0) {
+    if (record.kind == 'T') {
+      anonymise_command(record.key, record.key_len, salt);
+      anonymise_text(record.value, record.value_len, salt);
+    } else if (record.kind == 'R') {
+      // Keep the command word of "command:arguments"
+      char *colon = memchr(record.key, ':', record.key_len);
+      if (colon) {
+        anonymise_text(colon + 1, record.key + record.key_len - colon - 1,
+                       salt);
+      }
+    } else {
+      anonymise_text(record.key, record.key_len, salt);
+      anonymise_text(record.value, record.value_len, salt);
+    }
+    trace_write_record(out, &record);
+    trace_free_record(&record);
+  }
+  fclose(in);
+  if (fclose(out) != 0 || rc < 0) {
+    fprintf(stderr, "%s\n", rc < 0 ? "Trace damaged" : "Write failed");
+    return ERROR_INVALID_ARGS;
+  }
+  return ERROR_NONE;
+}
+
 int main(int argc, char *argv[]) {
   muxgeist_error_t rc = ERROR_NONE;
 
@@ -395,6 +9511,121 @@ int main(int argc, char *argv[]) {
 
   // Initialize state
   g_state.running = 1;
+  g_state.default_server = -1;
+  g_state.inotify_fd = -1;
+  g_state.profiler.stack_top = (uintptr_t)__builtin_frame_address(0);
+  g_state.user_cpu_ms = USER_CPU_MS;
+  g_state.user_memory_bytes = (size_t)USER_MEMORY_MB << 20;
+  g_state.session_capacity = MAX_SESSIONS;
+  const char *record_path = NULL;
+  const char *replay_path = NULL;
+  double replay_speed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      snprintf(g_state.socket_path, sizeof(g_state.socket_path), "%s",
+               argv[++i]);
+    } else if (strcmp(argv[i], "--system") == 0) {
+      g_state.system_mode = 1;
+      g_state.session_capacity = SYSTEM_MAX_SESSIONS;
+    } else if (strcmp(argv[i], "--user-cpu-ms") == 0 && i + 1 < argc) {
+      g_state.user_cpu_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--user-memory-mb") == 0 && i + 1 < argc) {
+      g_state.user_memory_bytes = (size_t)atol(argv[++i]) << 20;
+    } else if (strcmp(argv[i], "--aggregate") == 0 && i + 1 < argc) {
+      if (parse_shards(argv[++i]) != ERROR_NONE) {
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+      i++;
+      long cores = sysconf(_SC_NPROCESSORS_ONLN);
+      int count = strcmp(argv[i], "auto") == 0 ? (int)cores : atoi(argv[i]);
+      if (count < 1) {
+        fprintf(stderr, "--shards takes a count, or auto\n");
+        return 1;
+      }
+      g_state.shards_spawned = count < MAX_SHARDS ? count : MAX_SHARDS;
+    } else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%d/%d", &g_state.shard_index,
+                 &g_state.shard_total) != 2 ||
+          g_state.shard_total < 1 || g_state.shard_index < 0 ||
+          g_state.shard_index >= g_state.shard_total) {
+        fprintf(stderr, "--shard takes k/N\n");
+        return 1;
+      }
+      g_state.session_capacity = SYSTEM_MAX_SESSIONS;
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+      i++;
+      replay_speed = strcmp(argv[i], "max") == 0 ? 0 : atof(argv[i]);
+      if (strcmp(argv[i], "max") != 0 && replay_speed <= 0) {
+        fprintf(stderr, "--speed takes a multiple like 1 or 10, or max\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--bench-history") == 0 && i + 1 < argc) {
+      return bench_history(argv[i + 1]) == ERROR_NONE ? 0 : 1;
+    } else if (strcmp(argv[i], "--anonymise") == 0 && i + 2 < argc) {
+      return anonymise_trace(argv[i + 1], argv[i + 2]) == ERROR_NONE ? 0 : 1;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--socket PATH] [--aggregate [name=]socket,...]\n"
+              "       %s --system [--socket PATH] [--user-cpu-ms MS] "
+              "[--user-memory-mb MB]\n"
+              "       %s --shards N|auto [--socket PATH]\n"
+              "       %s [--record TRACE] | --replay TRACE [--speed N|max]\n"
+              "       %s --anonymise TRACE OUT | --bench-history FILE\n",
+              argv[0], argv[0], argv[0], argv[0], argv[0]);
+      return 1;
+    }
+  }
+  if (g_state.shards_spawned &&
+      (g_state.shard_count > 0 || g_state.system_mode || record_path ||
+       replay_path)) {
+    fprintf(stderr, "--shards runs on its own, without --aggregate, "
+                    "--system, --record or --replay\n");
+    return 1;
+  }
+  if ((record_path || replay_path) && g_state.shard_count > 0) {
+    fprintf(stderr, "An aggregator has nothing to record or replay\n");
+    return 1;
+  }
+  if (record_path && replay_path) {
+    fprintf(stderr, "--record and --replay do not combine\n");
+    return 1;
+  }
+  if (replay_path && !g_state.socket_path[0]) {
+    // Stay out of the way of a live daemon
+    snprintf(g_state.socket_path, sizeof(g_state.socket_path), "%s",
+             MUXGEIST_REPLAY_SOCKET_PATH);
+  }
+  if (!g_state.socket_path[0]) {
+    snprintf(g_state.socket_path, sizeof(g_state.socket_path), "%s",
+             g_state.system_mode ? MUXGEIST_SYSTEM_SOCKET_PATH
+                                 : MUXGEIST_SOCKET_PATH);
+  }
+  if (g_state.system_mode && geteuid() != 0) {
+    fprintf(stderr, "--system needs root to reach every user's tmux\n");
+    return 1;
+  }
+  if (g_state.system_mode && g_state.shard_count > 0) {
+    fprintf(stderr, "--system and --aggregate do not combine\n");
+    return 1;
+  }
+  g_state.sessions = calloc(g_state.session_capacity, sizeof(session_context_t));
+  if (!g_state.sessions) {
+    fprintf(stderr, "Failed to allocate sessions\n");
+    return 1;
+  }
+  for (int i = 0; i < g_state.shard_count; i++) {
+    if (strcmp(g_state.shards[i].socket_path, g_state.socket_path) == 0) {
+      fprintf(stderr, "Shard %s is this daemon's own socket\n",
+              g_state.shards[i].name);
+      return 1;
+    }
+  }
 
   // Setup socket
   rc = setup_socket();
@@ -402,24 +9633,125 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Failed to setup socket: %d\n", rc);
     return 1;
   }
+  if (g_state.shards_spawned && spawn_shards() != ERROR_NONE) {
+    return 1;
+  }
+  if ((record_path && trace_start(record_path) != ERROR_NONE) ||
+      (replay_path && replay_start(replay_path, replay_speed) != ERROR_NONE)) {
+    return 1;
+  }
 
   // Main loop
   fd_set readfds;
+  fd_set writefds;
   struct timeval timeout;
 
+  if (g_state.shard_count == 0 && !g_state.replaying) {
+    setup_state_dir();
+    load_dictionaries();
+    load_snapshot();
+  }
+
   while (g_state.running) {
-    // Scan for tmux sessions every iteration
-    scan_tmux_sessions();
+    if (g_state.replaying) {
+      replay_advance();
+    }
+    profile_finish(0);
+    // A warm start first serves whoever started the daemon, then scans
+    int warm = g_state.warm_start;
+    g_state.warm_start = 0;
+    int tails_waiting = 0;
+    if (g_state.shard_count > 0) {
+      if (g_state.shards_spawned) {
+        reap_shards();
+      }
+      for (int i = 0; i < g_state.shard_count; i++) {
+        shard_connect(&g_state.shards[i]);
+      }
+    } else if (!warm) {
+      // Scan for tmux sessions every iteration
+      scan_tmux_sessions();
+      tails_waiting = pump_tails();
+      publish_sync();
+      flush_followers();
+      freeze_cold_history();
+      save_snapshot_if_due();
+    }
 
     // Setup select for socket
     FD_ZERO(&readfds);
     FD_SET(g_state.server_socket, &readfds);
+    int max_fd = g_state.server_socket;
+    for (int i = 0; i < g_state.subscriber_count; i++) {
+      FD_SET(g_state.subscribers[i], &readfds);
+      max_fd = g_state.subscribers[i] > max_fd ? g_state.subscribers[i] : max_fd;
+    }
+    // Followers are watched for EOF, and for room when output is pending
+    FD_ZERO(&writefds);
+    for (int i = 0; i < g_state.follower_count; i++) {
+      follower_t *follower = &g_state.followers[i];
+      FD_SET(follower->fd, &readfds);
+      if (follower->pending) {
+        FD_SET(follower->fd, &writefds);
+      }
+      max_fd = follower->fd > max_fd ? follower->fd : max_fd;
+    }
+    for (int i = 0; i < g_state.shard_count; i++) {
+      if (g_state.shards[i].fd >= 0) {
+        FD_SET(g_state.shards[i].fd, &readfds);
+        max_fd = g_state.shards[i].fd > max_fd ? g_state.shards[i].fd : max_fd;
+      }
+    }
+    if (g_state.inotify_fd >= 0) {
+      FD_SET(g_state.inotify_fd, &readfds);
+      max_fd = g_state.inotify_fd > max_fd ? g_state.inotify_fd : max_fd;
+    }
+
+    // Servers poll on their own schedule
+    timeout.tv_sec = warm ? 0 : SERVER_MIN_INTERVAL;
+    timeout.tv_usec = warm ? WARM_START_WAIT_MS * 1000 : 0;
+    if (g_state.replaying) {
+      timeout.tv_sec = 0;
+      timeout.tv_usec = g_state.replay.speed > 0 ? REPLAY_TICK_MS * 1000 : 0;
+    }
+    if (tails_waiting) {
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 0;
+    }
 
-    timeout.tv_sec = 2; // 2 second timeout
-    timeout.tv_usec = 0;
+    int activity = select(max_fd + 1, &readfds, &writefds, NULL, &timeout);
 
-    int activity =
-        select(g_state.server_socket + 1, &readfds, NULL, NULL, &timeout);
+    if (activity > 0) {
+      // Subscribers only ever send EOF
+      for (int i = g_state.subscriber_count - 1; i >= 0; i--) {
+        char discard[256];
+        if (FD_ISSET(g_state.subscribers[i], &readfds) &&
+            recv(g_state.subscribers[i], discard, sizeof(discard),
+                 MSG_DONTWAIT) <= 0) {
+          drop_subscriber(i);
+        }
+      }
+      for (int i = g_state.follower_count - 1; i >= 0; i--) {
+        follower_t *follower = &g_state.followers[i];
+        char discard[256];
+        if (FD_ISSET(follower->fd, &readfds) &&
+            recv(follower->fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0) {
+          drop_follower(i);
+        } else if (FD_ISSET(follower->fd, &writefds) &&
+                   flush_follower(follower) < 0) {
+          drop_follower(i);
+        }
+      }
+      for (int i = 0; i < g_state.shard_count; i++) {
+        if (g_state.shards[i].fd >= 0 &&
+            FD_ISSET(g_state.shards[i].fd, &readfds)) {
+          shard_read(&g_state.shards[i]);
+        }
+      }
+      if (g_state.inotify_fd >= 0 && FD_ISSET(g_state.inotify_fd, &readfds)) {
+        read_watch_events();
+      }
+    }
 
     if (activity > 0 && FD_ISSET(g_state.server_socket, &readfds)) {
       int client_socket = accept(g_state.server_socket, NULL, NULL);
@@ -430,8 +9762,19 @@ int main(int argc, char *argv[]) {
   }
 
   // Cleanup
+  profile_finish(1);
+  stop_shards();
+  if (g_state.shard_count == 0 && !g_state.replaying) {
+    save_snapshot();
+  }
+  if (g_state.trace) {
+    fclose(g_state.trace);
+  }
   close(g_state.server_socket);
-  unlink(MUXGEIST_SOCKET_PATH);
+  if (!g_state.socket_activated) {
+    unlink(g_state.socket_path); // systemd owns an inherited socket
+  }
+  free(g_state.sessions);
   printf("Muxgeist daemon stopped.\n");
 
   return 0;
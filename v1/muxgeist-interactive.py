@@ -76,7 +76,13 @@ class MuxgeistInteractive:
                 text=True,
             )
             if result.returncode == 0:
+                # The daemon tracks every tmux server, naming sessions
+                # "server/session" after the server's socket
                 self.session_name = result.stdout.strip()
+                socket_path = os.environ.get("TMUX", "").split(",")[0]
+                if socket_path:
+                    server = os.path.basename(socket_path)
+                    self.session_name = f"{server}/{self.session_name}"
                 logger.info(f"Detected tmux session: {self.session_name}")
             else:
                 self.session_name = "unknown"
@@ -191,12 +197,51 @@ class MuxgeistInteractive:
                 f"🤖 Provider: {self.ai_service.ai_client.provider} ({self.ai_service.ai_client.model})"
             )
 
+    def _show_changes(self):
+        """Show what changed in the session since the last analysis"""
+        if not self.ai_service:
+            print("AI service not available")
+            return
+        if not self.last_analysis:
+            self._show_analysis()
+            return
+
+        since = self.last_analysis.session_context.snapshot_seq
+        try:
+            changes, commentary = self.ai_service.analyze_changes(
+                self.session_name, since
+            )
+        except Exception as e:
+            logger.error(f"Change analysis failed: {e}")
+            logger.error(f"Exception details: {traceback.format_exc()}")
+            print(f"Change analysis failed: {e}")
+            return
+
+        if changes is None:
+            print("Could not get changes - is the daemon running?")
+            return
+
+        age_mins = (datetime.now() - self.analysis_time).seconds // 60
+        print(f"🔄 Changes since the last analysis ({age_mins}m ago):")
+        print("─" * 50)
+        if not changes["panes"]:
+            print("Nothing changed.")
+        for pane in changes["panes"]:
+            print(
+                f"  pane {pane['pane']} ({pane['title']}): "
+                f"+{pane['added']} -{pane['removed']} lines"
+            )
+        if commentary:
+            print()
+            print(commentary)
+
     def _show_help(self):
         """Show help information"""
         print("🔧 Muxgeist Commands:")
         print("─" * 30)
         print("  a, analyze  - Analyze current session")
         print("  r, refresh  - Force refresh analysis")
+        print("  c, changes  - What changed since the last analysis")
         print("  s, status   - Show daemon status")
         print("  l, list     - List all sessions")
         print("  h, help     - Show this help")
@@ -225,6 +270,10 @@ class MuxgeistInteractive:
         # AI service status
         if self.ai_service:
             print(f"✅ AI: {self.ai_service.ai_client.provider} ready")
+            saved = self.ai_service.ai_client.singleflight.saved_calls()
+            print(
+                f"♻️  Shared analyses: {sum(saved.values())} provider calls saved"
+            )
         else:
             print("❌ AI: Not available")
 
@@ -250,6 +299,9 @@ class MuxgeistInteractive:
         if self.ai_service:
             print(f"AI Provider: {self.ai_service.ai_client.provider}")
             print(f"AI Model: {self.ai_service.ai_client.model}")
+            routes = self.ai_service.ai_client.router.routes
+            fast_model = routes.get("fast", {}).get("model", "none (strong only)")
+            print(f"AI Fast Model: {fast_model}")
 
         # Test daemon connection
         try:
@@ -280,16 +332,31 @@ class MuxgeistInteractive:
             print("AI service not available for questions")
             return
 
-        # For now, just re-analyze with the question as context
-        # In a more advanced version, we'd pass the question to the AI
         print(f"💬 Processing question: {question}")
-        print("🔍 Let me analyze your current context...")
+        print("🔍 Searching your scrollback for relevant output...")
 
-        analysis = self._analyze_current_session()
-        if isinstance(analysis, str):
-            print(analysis)
-        else:
-            self._show_analysis()
+        try:
+            answer = self.ai_service.answer_question(
+                self.session_name, question.lstrip("?").strip()
+            )
+        except Exception as e:
+            logger.error(f"Question failed: {e}")
+            logger.error(f"Exception details: {traceback.format_exc()}")
+            answer = f"Could not answer: {e}"
+
+        print("─" * 50)
+        print(answer or "Could not answer - no context available")
+
+    def _summary_worker(self):
+        """Keep LLM summaries of older scrollback warm between questions"""
+        while self.running:
+            try:
+                count = self.ai_service.refresh_summaries(self.session_name)
+                if count:
+                    logger.info(f"Summarised {count} scrollback blocks")
+            except Exception as e:
+                logger.error(f"Summary refresh failed: {e}")
+            time.sleep(60)
 
     def _get_user_input(self):
         """Get user input with prompt"""
@@ -309,6 +376,8 @@ class MuxgeistInteractive:
         elif cmd in ("r", "refresh"):
             self.last_analysis = None
             self._show_analysis()
+        elif cmd in ("c", "changes"):
+            self._show_changes()
         elif cmd in ("s", "status"):
             self._show_status()
         elif cmd in ("l", "list"):
@@ -339,6 +408,9 @@ class MuxgeistInteractive:
             # Initial analysis
             self._show_analysis()
 
+            if self.ai_service:
+                threading.Thread(target=self._summary_worker, daemon=True).start()
+
             # Interactive loop
             while self.running:
                 try:
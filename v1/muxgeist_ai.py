@@ -2,13 +2,20 @@
 
 import socket
 import json
+import fcntl
+import hashlib
+import threading
 import re
 import os
+import random
+import shutil
+import subprocess
 import sys
 import time
 import logging
 import yaml
 from datetime import datetime
+from contextlib import contextmanager
 from typing import Dict, List, Optional, Tuple
 from dataclasses import dataclass, asdict
 from pathlib import Path
@@ -23,6 +30,10 @@ logging.basicConfig(
 )
 logger = logging.getLogger(__name__)
 
+SYSTEM_SOCKET_PATH = "/run/muxgeist/muxgeist.sock"
+CONNECT_RETRY_SECONDS = 3.0  # Keep retrying this long while a daemon starts
+CONNECT_MAX_DELAY = 0.2
+
 
 @dataclass
 class SessionContext:
@@ -32,6 +43,7 @@ class SessionContext:
     last_activity: int
     scrollback: str
     scrollback_length: int
+    snapshot_seq: int = 0  # Pass to DaemonClient.get_changes for later diffs
 
 
 @dataclass
@@ -74,12 +86,14 @@ class ConfigManager:
         default_config = {
             "ai": {
                 "provider": None,  # Will be auto-detected
+                "routing": {"enabled": True, "fast_max_prompt_tokens": 3000},
                 "anthropic": {"api_key": None, "model": "claude-3-5-sonnet-20241022"},
                 "openai": {"api_key": None, "model": "gpt-4o"},
                 "openrouter": {"api_key": None, "model": "anthropic/claude-3.5-sonnet"},
             },
-            "daemon": {"socket_path": "/tmp/muxgeist.sock"},
+            "daemon": {"socket_path": "/tmp/muxgeist.sock", "auto_spawn": True},
             "ui": {"pane_size": "40", "pane_title": "muxgeist"},
+            "summaries": {"window_seconds": 7200, "budget": 1200, "use_llm": False},
             "logging": {"level": "INFO"},
         }
 
@@ -155,17 +169,72 @@ class DaemonClient:
     def __init__(self, config_manager: ConfigManager = None):
         self.config = config_manager or ConfigManager()
         self.socket_path = self.config.get("daemon.socket_path", "/tmp/muxgeist.sock")
+        auto_spawn = self.config.get("daemon.auto_spawn", True)
+        self.auto_spawn = str(auto_spawn).lower() in ("1", "true", "yes")
+        if not os.path.exists(self.socket_path) and os.path.exists(
+            SYSTEM_SOCKET_PATH
+        ):
+            # Shared hosts may run one --system daemon instead of per-user ones
+            self.socket_path = SYSTEM_SOCKET_PATH
+            self.auto_spawn = False
+
+    def _spawn_daemon(self):
+        """Start a daemon for our socket in the background, detached"""
+        daemon = self.config.get("daemon.binary") or shutil.which("muxgeist-daemon")
+        if not daemon:
+            beside = Path(__file__).resolve().parent / "muxgeist-daemon"
+            daemon = str(beside) if os.access(beside, os.X_OK) else None
+        if not daemon:
+            logger.warning("muxgeist-daemon not found, cannot start it")
+            return
+        try:
+            # Racing clients may each start one; the instance lock keeps one
+            subprocess.Popen(
+                [daemon, "--socket", self.socket_path],
+                stdin=subprocess.DEVNULL,
+                stdout=subprocess.DEVNULL,
+                stderr=subprocess.DEVNULL,
+                start_new_session=True,
+            )
+            logger.info(f"Started {daemon} for {self.socket_path}")
+        except OSError as e:
+            logger.warning(f"Failed to start daemon: {e}")
+
+    def _connect(self) -> socket.socket:
+        """Connect, retrying with jittered backoff while the daemon (re)starts"""
+        deadline = time.monotonic() + CONNECT_RETRY_SECONDS
+        delay = 0.005
+        may_spawn = self.auto_spawn
+        while True:
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            try:
+                sock.connect(self.socket_path)
+                return sock
+            except (FileNotFoundError, ConnectionRefusedError):
+                sock.close()
+                if time.monotonic() >= deadline:
+                    raise
+            if may_spawn:
+                self._spawn_daemon()
+                may_spawn = False
+            time.sleep(random.uniform(delay / 2, delay))
+            delay = min(delay * 2, CONNECT_MAX_DELAY)
 
     def _send_command(self, command: str) -> str:
         """Send command to daemon and return response"""
         try:
-            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
-            sock.connect(self.socket_path)
+            sock = self._connect()
             sock.send(command.encode())
 
-            response = sock.recv(8192).decode()
+            # The daemon closes the connection after a complete response
+            chunks = []
+            while True:
+                chunk = sock.recv(8192)
+                if not chunk:
+                    break
+                chunks.append(chunk)
             sock.close()
-            return response
+            return b"".join(chunks).decode(errors="replace")
         except Exception as e:
             logger.error(f"Failed to communicate with daemon: {e}")
             return ""
@@ -213,6 +282,8 @@ class DaemonClient:
                     context_data["pane"] = value
                 elif key == "last activity":
                     context_data["last_activity"] = int(value)
+                elif key == "seq":
+                    context_data["snapshot_seq"] = int(value)
                 elif key == "scrollback length":
                     context_data["scrollback_length"] = int(value)
                 elif key == "scrollback":
@@ -230,8 +301,11 @@ class DaemonClient:
             try:
                 import subprocess
 
+                # Sessions are "server/session"; the server is the -L label
+                server, _, session = context_data["session_id"].rpartition("/")
+                server_args = ["-L", server] if server else []
                 result = subprocess.run(
-                    ["tmux", "capture-pane", "-t", context_data["session_id"], "-p"],
+                    ["tmux", *server_args, "capture-pane", "-t", session, "-p"],
                     capture_output=True,
                     text=True,
                     timeout=5,
@@ -248,6 +322,712 @@ class DaemonClient:
 
         return SessionContext(**context_data)
 
+    def get_diagnostics(self, session_id: str) -> List[Dict]:
+        """Get deduplicated compiler/runtime diagnostics for a session"""
+        response = self._send_command(f"diagnostics:{session_id}")
+        if not response or response.startswith("ERROR"):
+            return []
+
+        header = re.compile(
+            r"^(error|warning) (.*):(\d+):(\d+) \[(\w*)\] x(\d+): (.*)$"
+        )
+        diagnostics = []
+        for line in response.split("\n"):
+            match = header.match(line)
+            if match:
+                severity, file, line_no, col, tool, count, message = match.groups()
+                diagnostics.append(
+                    {
+                        "severity": severity,
+                        "file": file,
+                        "line": int(line_no),
+                        "column": int(col),
+                        "tool": tool,
+                        "count": int(count),
+                        "message": message,
+                        "snippet": [],
+                        "notes": [],
+                    }
+                )
+            elif diagnostics and line.startswith("    | "):
+                diagnostics[-1]["snippet"].append(line[6:])
+            elif diagnostics and line.startswith("    = "):
+                diagnostics[-1]["notes"].append(line[6:])
+        return diagnostics
+
+    def get_test_runs(self, session_id: str) -> List[Dict]:
+        """Get the latest test-suite run recorded in each pane"""
+        response = self._send_command(f"tests:{session_id}")
+        if not response or response.startswith("ERROR"):
+            return []
+
+        runs = []
+        for line in response.split("\n"):
+            if line.startswith("  FAIL ") and runs:
+                runs[-1]["failures"].append(line[7:])
+            elif line.startswith("  | ") and runs:
+                runs[-1]["excerpt"].append(line[4:])
+            elif line and not line.startswith(("Test runs:", " ")):
+                parts = line.split()
+                if len(parts) < 4:
+                    continue
+                run = {
+                    "pane": parts[0],
+                    "runner": parts[1],
+                    "state": parts[2],
+                    "failures": [],
+                    "excerpt": [],
+                }
+                for field in parts[3:]:
+                    key, _, value = field.partition("=")
+                    if key == "duration":
+                        run[key] = float(value.rstrip("s"))
+                    elif key in ("passed", "failed", "skipped", "errors", "age"):
+                        run[key] = int(value.rstrip("s"))
+                runs.append(run)
+        return runs
+
+    def get_recent_commands(self, session_id: str, count: int = 20) -> List[Dict]:
+        """Get the session's latest commands as read from its shell history files"""
+        response = self._send_command(f"commands:{session_id}:{count}")
+        if not response or response.startswith("ERROR"):
+            return []
+
+        entry = re.compile(r"^\[(.*?)\] (\d+) (.*?) \$ (.*)$")
+        commands = []
+        for line in response.split("\n"):
+            match = entry.match(line)
+            if match:
+                pane, timestamp, cwd, command = match.groups()
+                commands.append(
+                    {
+                        "pane": pane,
+                        "timestamp": int(timestamp),
+                        "cwd": None if cwd == "-" else cwd,
+                        "command": command,
+                    }
+                )
+        return commands
+
+    def get_log_templates(self, session_id: str, pane: str = None) -> Dict[str, Dict]:
+        """Get each pane's output clustered into log templates with counts"""
+        command = f"templates:{session_id}" + (f":{pane}" if pane else "")
+        response = self._send_command(command)
+        if not response or response.startswith("ERROR"):
+            return {}
+
+        header = re.compile(r"^=== PANE (\S+) \((.*)\) lines=(\d+) templates=(\d+) ===$")
+        entry = re.compile(r"^\s*(\d+) x (.*)$")
+        panes = {}
+        current = None
+        for line in response.split("\n"):
+            match = header.match(line)
+            if match:
+                pane_index, title, lines, templates = match.groups()
+                current = {"title": title, "lines": int(lines), "templates": []}
+                panes[pane_index] = current
+                continue
+            if current is None:
+                continue
+            if line.strip().startswith("e.g. ") and current["templates"]:
+                current["templates"][-1]["example"] = line.strip()[5:]
+                continue
+            match = entry.match(line)
+            if match:
+                current["templates"].append(
+                    {"count": int(match.group(1)), "template": match.group(2)}
+                )
+        return panes
+
+    def retrieve(
+        self, session_id: str, question: str, top_k: int = 5, budget: int = 6000
+    ) -> List[Dict]:
+        """Get the scrollback windows most relevant to a question (BM25)"""
+        question = " ".join(question.split())
+        response = self._send_command(
+            f"retrieve:{session_id}:{top_k}:{budget}:{question}"
+        )
+        if not response or response.startswith("ERROR"):
+            return []
+
+        header = re.compile(
+            r"^=== WINDOW (\S+) \((.*)\) seq=(\d+)-(\d+) score=([\d.]+) ===$"
+        )
+        windows = []
+        for line in response.split("\n"):
+            match = header.match(line)
+            if match:
+                pane, title, first, last, score = match.groups()
+                windows.append(
+                    {
+                        "pane": pane,
+                        "title": title,
+                        "first_seq": int(first),
+                        "last_seq": int(last),
+                        "score": float(score),
+                        "lines": [],
+                    }
+                )
+            elif windows and not line.startswith("Windows:"):
+                windows[-1]["lines"].append(line)
+        for window in windows:
+            window["text"] = "\n".join(window.pop("lines")).rstrip("\n")
+        return windows
+
+    def search(self, query: str, top_k: int = 10) -> Dict:
+        """Search scrollback across every session (and shard, if aggregating)"""
+        query = " ".join(query.split())
+        response = self._send_command(f"search:{top_k}:{query}")
+        results = {"shards": None, "results": []}
+        if not response or response.startswith("ERROR"):
+            return results
+
+        header = re.compile(
+            r"^=== RESULT (\S+) (\S+) \((.*)\) seq=(\d+)-(\d+) "
+            r"score=([\d.]+) ===$"
+        )
+        for line in response.split("\n"):
+            match = header.match(line)
+            if match:
+                session, pane, title, first, last, score = match.groups()
+                results["results"].append(
+                    {
+                        "session": session,
+                        "pane": pane,
+                        "title": title,
+                        "first_seq": int(first),
+                        "last_seq": int(last),
+                        "score": float(score),
+                        "lines": [],
+                    }
+                )
+            elif line.startswith("Shards: "):
+                answered, total = line[8:].split("/")
+                results["shards"] = (int(answered), int(total))
+            elif results["results"] and line:
+                results["results"][-1]["lines"].append(line)
+        return results
+
+    def set_status_note(self, session_id: str, note: str) -> bool:
+        """Add a note to the session's @muxgeist_status; empty clears it"""
+        note = " ".join(note.split())
+        response = self._send_command(f"note:{session_id}:{note}")
+        return response.startswith("OK")
+
+    def get_changes(self, session_id: str, since_seq: int) -> Optional[Dict]:
+        """Get per-pane line diffs since a snapshot sequence number"""
+        response = self._send_command(f"diff:{session_id}:{since_seq}")
+        if not response or response.startswith("ERROR"):
+            return None
+
+        header = re.compile(
+            r"^=== PANE (\S+) \((.*)\) base=(\d+)(~?) age=(\d+)s "
+            r"\+(\d+) -(\d+)( replaced)? ===$"
+        )
+        changes = {"seq": 0, "since": since_seq, "panes": []}
+        panes = changes["panes"]
+        for line in response.split("\n"):
+            match = header.match(line)
+            if match:
+                pane, title, base, approx, age, added, removed, replaced = (
+                    match.groups()
+                )
+                panes.append(
+                    {
+                        "pane": pane,
+                        "title": title,
+                        "base_seq": int(base),
+                        "exact": not approx,
+                        "age": int(age),
+                        "added": int(added),
+                        "removed": int(removed),
+                        "replaced": bool(replaced),
+                        "lines": [],
+                    }
+                )
+            elif panes:
+                if line:
+                    panes[-1]["lines"].append(line)
+            elif line.startswith("Seq: "):
+                changes["seq"] = int(line[5:])
+        for pane in panes:
+            pane["script"] = "\n".join(pane.pop("lines"))
+        return changes
+
+    def get_block_summaries(
+        self, session_id: str, seconds: int = 7200, budget: int = 1200
+    ) -> List[Dict]:
+        """Get precomputed summaries of older scrollback, oldest first per pane"""
+        response = self._send_command(f"summaries:{session_id}:{seconds}:{budget}")
+        if not response or response.startswith("ERROR"):
+            return []
+
+        header = re.compile(
+            r"^=== BLOCK (\S+) \((.*)\) level=(\d+) seq=(\d+)-(\d+) "
+            r"time=(\d+)-(\d+) hash=([0-9a-f]+) ===$"
+        )
+        blocks = []
+        for line in response.split("\n"):
+            match = header.match(line)
+            if match:
+                pane, title, level, first, last, start, end, block_hash = (
+                    match.groups()
+                )
+                blocks.append(
+                    {
+                        "pane": pane,
+                        "title": title,
+                        "level": int(level),
+                        "first_seq": int(first),
+                        "last_seq": int(last),
+                        "start": int(start),
+                        "end": int(end),
+                        "hash": block_hash,
+                        "lines": [],
+                    }
+                )
+            elif blocks and line:
+                blocks[-1]["lines"].append(line)
+        for block in blocks:
+            block["text"] = "\n".join(block.pop("lines"))
+        return blocks
+
+
+class SummaryCache:
+    """LLM summaries of sealed scrollback blocks, keyed by block hash"""
+
+    def __init__(self, cache_file: Path = None, max_entries: int = 2000):
+        self.cache_file = cache_file or (
+            Path.home() / ".cache" / "muxgeist" / "summaries.json"
+        )
+        self.max_entries = max_entries
+        self.entries = self._load()
+
+    def _load(self) -> Dict[str, str]:
+        try:
+            with open(self.cache_file, "r") as f:
+                return json.load(f)
+        except FileNotFoundError:
+            return {}
+        except Exception as e:
+            logger.warning(f"Ignoring unreadable summary cache: {e}")
+            return {}
+
+    def get(self, block_hash: str) -> Optional[str]:
+        return self.entries.get(block_hash)
+
+    def put(self, block_hash: str, summary: str):
+        self.entries.pop(block_hash, None)
+        self.entries[block_hash] = summary
+        # Dicts keep insertion order, so the oldest summaries go first
+        while len(self.entries) > self.max_entries:
+            del self.entries[next(iter(self.entries))]
+
+    def save(self):
+        try:
+            self.cache_file.parent.mkdir(parents=True, exist_ok=True)
+            tmp_file = self.cache_file.with_suffix(".tmp")
+            with open(tmp_file, "w") as f:
+                json.dump(self.entries, f)
+            os.replace(tmp_file, self.cache_file)
+        except Exception as e:
+            logger.warning(f"Failed to save summary cache: {e}")
+
+
+class _Flight:
+    """One in-progress call that other callers can wait on"""
+
+    def __init__(self):
+        self.done = threading.Event()
+        self.result = None
+        self.error = None
+        self.shared = False
+
+
+class SingleFlight:
+    """Coalesce identical concurrent calls into one.
+
+    Callers in this process wait on the leader's thread. Other processes
+    (more interactive panes, the CLI) find the leader's flight file, wait for
+    it to land and take its result; the result is handed only to those
+    waiters, so a caller arriving after it landed makes its own call. Saved
+    calls are counted in a metrics file shared by all processes.
+    """
+
+    LOCK_STRIPES = 64
+    POLL_INTERVAL = 0.05
+    FLIGHT_TIMEOUT = 300.0  # Seconds before a flight is taken as abandoned
+
+    def __init__(self, cache_dir: Path = None):
+        self.cache_dir = cache_dir or (
+            Path.home() / ".cache" / "muxgeist" / "singleflight"
+        )
+        self._lock = threading.Lock()
+        self._flights: Dict[str, _Flight] = {}
+        self.stats = {
+            "calls": 0,
+            "upstream": 0,
+            "shared_local": 0,
+            "shared_remote": 0,
+        }
+
+    @staticmethod
+    def key(*parts) -> str:
+        joined = "\0".join(str(part) for part in parts)
+        return hashlib.sha256(joined.encode()).hexdigest()
+
+    def do(self, key: str, fn, shareable=lambda result: True):
+        """Run fn once for every concurrent caller using the same key.
+
+        Results shareable() rejects (failures) still reach this process's
+        waiters but are not handed to other processes or counted as saved.
+        """
+        with self._lock:
+            self.stats["calls"] += 1
+            flight = self._flights.get(key)
+            leader = flight is None
+            if leader:
+                flight = self._flights[key] = _Flight()
+
+        if not leader:
+            flight.done.wait()
+            if flight.error:
+                raise flight.error
+            if flight.shared:
+                with self._lock:
+                    self.stats["shared_local"] += 1
+                self._record_saved("shared_local")
+            return flight.result
+
+        try:
+            flight.result = self._do_shared(key, fn, shareable)
+            flight.shared = shareable(flight.result)
+            return flight.result
+        except Exception as e:
+            flight.error = e
+            raise
+        finally:
+            with self._lock:
+                del self._flights[key]
+            flight.done.set()
+
+    def _do_shared(self, key: str, fn, shareable):
+        # Striped so the lock files never need cleaning up
+        stripe = hashlib.md5(key.encode()).digest()[0] % self.LOCK_STRIPES
+        try:
+            self.cache_dir.mkdir(parents=True, exist_ok=True)
+            lock_file = open(self.cache_dir / f"lock-{stripe}", "a")
+        except OSError as e:
+            logger.warning(f"Singleflight lock unavailable, calling directly: {e}")
+            return self._call(fn)
+
+        flight_path = self.cache_dir / f"{key}.flight"
+        with lock_file:
+            while True:
+                # The stripe lock only guards the flight files; it is never
+                # held across a provider call
+                with self._locked(lock_file):
+                    flight = self._live_flight(flight_path)
+                    if flight is None:
+                        flight_id = f"{os.getpid()}-{time.time_ns()}"
+                        self._write_json(
+                            flight_path,
+                            {
+                                "id": flight_id,
+                                "pid": os.getpid(),
+                                "started": time.time(),
+                                "waiters": 0,
+                            },
+                        )
+                    else:
+                        flight["waiters"] += 1
+                        self._write_json(flight_path, flight)
+
+                if flight is None:
+                    return self._lead(
+                        lock_file, flight_path, key, flight_id, fn, shareable
+                    )
+                landed, result = self._wait(lock_file, flight_path, key, flight["id"])
+                if landed:
+                    with self._lock:
+                        self.stats["shared_remote"] += 1
+                    self._record_saved("shared_remote")
+                    return result
+                # That flight failed or its process died: lead or join anew
+
+    def _call(self, fn):
+        with self._lock:
+            self.stats["upstream"] += 1
+        return fn()
+
+    def _lead(
+        self, lock_file, flight_path: Path, key: str, flight_id: str, fn, shareable
+    ):
+        """Make the call, then hand its result to the processes waiting on it"""
+        result, ok = None, False
+        try:
+            result = self._call(fn)
+            ok = shareable(result)
+            return result
+        finally:
+            with self._locked(lock_file):
+                flight = self._read_json(flight_path)
+                if flight and flight.get("id") == flight_id:
+                    self._unlink(flight_path)
+                    if flight.get("waiters"):
+                        self._write_json(
+                            self._result_path(key, flight_id),
+                            {
+                                "ok": ok,
+                                "result": result if ok else None,
+                                "waiters": flight["waiters"],
+                            },
+                        )
+                # Results left behind by waiters that died
+                for stale in self.cache_dir.glob(f"{key}.*.result"):
+                    try:
+                        if time.time() - stale.stat().st_mtime > self.FLIGHT_TIMEOUT:
+                            stale.unlink()
+                    except OSError:
+                        pass
+
+    def _wait(self, lock_file, flight_path: Path, key: str, flight_id: str):
+        """Wait for another process's flight: (True, result) once it lands
+        with a shareable result, (False, None) if it failed or was abandoned"""
+        result_path = self._result_path(key, flight_id)
+        while True:
+            time.sleep(self.POLL_INTERVAL)
+            with self._locked(lock_file):
+                landed = self._read_json(result_path)
+                if landed is not None:
+                    # The last waiter to take the result removes it
+                    landed["waiters"] -= 1
+                    if landed["waiters"] > 0:
+                        self._write_json(result_path, landed)
+                    else:
+                        self._unlink(result_path)
+                    return landed.get("ok", False), landed.get("result")
+                flight = self._live_flight(flight_path)
+                if flight is None or flight.get("id") != flight_id:
+                    return False, None
+
+    def _live_flight(self, path: Path):
+        """The flight recorded in path, unless it was abandoned"""
+        flight = self._read_json(path)
+        try:
+            if time.time() - flight["started"] > self.FLIGHT_TIMEOUT:
+                return None
+            os.kill(flight["pid"], 0)
+        except PermissionError:
+            pass
+        except (ProcessLookupError, KeyError, TypeError):
+            return None
+        return flight
+
+    def _result_path(self, key: str, flight_id: str) -> Path:
+        return self.cache_dir / f"{key}.{flight_id}.result"
+
+    @staticmethod
+    @contextmanager
+    def _locked(lock_file):
+        fcntl.flock(lock_file, fcntl.LOCK_EX)
+        try:
+            yield
+        finally:
+            fcntl.flock(lock_file, fcntl.LOCK_UN)
+
+    @staticmethod
+    def _read_json(path: Path):
+        try:
+            with open(path, "r") as f:
+                return json.load(f)
+        except (OSError, ValueError):
+            return None
+
+    @staticmethod
+    def _write_json(path: Path, data):
+        try:
+            tmp_path = path.with_suffix(f".{os.getpid()}.tmp")
+            with open(tmp_path, "w") as f:
+                json.dump(data, f)
+            os.replace(tmp_path, path)
+        except (OSError, TypeError) as e:
+            logger.warning(f"Failed to write singleflight state: {e}")
+
+    @staticmethod
+    def _unlink(path: Path):
+        try:
+            path.unlink()
+        except OSError:
+            pass
+
+    def _record_saved(self, kind: str):
+        """Bump the cross-process count of provider calls saved"""
+        try:
+            with open(self.cache_dir / "metrics.json", "a+") as f:
+                fcntl.flock(f, fcntl.LOCK_EX)
+                f.seek(0)
+                try:
+                    metrics = json.loads(f.read() or "{}")
+                except ValueError:
+                    metrics = {}
+                metrics[kind] = metrics.get(kind, 0) + 1
+                f.seek(0)
+                f.truncate()
+                json.dump(metrics, f)
+        except OSError as e:
+            logger.warning(f"Failed to record singleflight metrics: {e}")
+
+    def saved_calls(self) -> Dict[str, int]:
+        """Provider calls saved by coalescing, across all processes"""
+        try:
+            with open(self.cache_dir / "metrics.json", "r") as f:
+                return json.load(f)
+        except (OSError, ValueError):
+            return {}
+
+
+class ModelRouter:
+    """Send each request to a fast or a strong model.
+
+    Small and quick requests (recalling a command, condensing a block, a
+    short refresh) go to the fast model, large prompts and hard tasks
+    (failing builds, "why" questions) to the strong one. Each model's
+    latency per output token on quick-sized prompts is kept as a moving
+    average shared by all processes, and the fast route is skipped while it
+    is not actually the faster one.
+    """
+
+    # Fast models by the family of the strong model they stand in for. A
+    # strong model of no family here gets no fast route unless configured.
+    FAST_DEFAULTS = {
+        "claude-": "claude-3-5-haiku-20241022",
+        "gpt-": "gpt-4o-mini",
+        "anthropic/claude-": "anthropic/claude-3.5-haiku",
+        "openai/gpt-": "openai/gpt-4o-mini",
+    }
+    MIN_SAMPLES = 3  # Calls before a model's average is trusted
+
+    def __init__(
+        self,
+        provider: str,
+        config: ConfigManager,
+        strong_model: str,
+        state_dir: Path = None,
+    ):
+        routes = config.get(f"ai.{provider}.routes")
+        routes = routes if isinstance(routes, dict) else {}
+        fast = routes.get("fast") or {}
+        strong = routes.get("strong") or {}
+        self.routes = {
+            "strong": {
+                "model": strong.get("model") or strong_model,
+                "max_tokens": int(strong.get("max_tokens") or 1000),
+            },
+        }
+        fast_model = os.getenv(f"{provider.upper()}_FAST_MODEL") or fast.get("model")
+        if not fast_model:
+            strong_name = self.routes["strong"]["model"] or ""
+            for prefix, default in self.FAST_DEFAULTS.items():
+                if strong_name.startswith(prefix):
+                    fast_model = default
+        if fast_model:
+            self.routes["fast"] = {
+                "model": fast_model,
+                "max_tokens": int(fast.get("max_tokens") or 500),
+            }
+
+        routing = config.get("ai.routing")
+        routing = routing if isinstance(routing, dict) else {}
+        self.enabled = bool(routing.get("enabled", True))
+        self.fast_max_prompt_tokens = int(routing.get("fast_max_prompt_tokens", 3000))
+        self.alpha = float(routing.get("latency_alpha", 0.2))
+        self.probe_seconds = float(routing.get("probe_seconds", 300))
+        self.state_path = (state_dir or Path.home() / ".cache" / "muxgeist") / (
+            "latency.json"
+        )
+
+    @staticmethod
+    def estimate_tokens(prompt: str) -> int:
+        """About four characters per token for English and terminal text"""
+        return len(prompt) // 4 + 1
+
+    def choose(self, prompt: str, task: str, hard: bool = False) -> str:
+        """Pick "fast" or "strong" for a prompt of the given task"""
+        if (
+            not self.enabled
+            or "fast" not in self.routes
+            or hard
+            or self.estimate_tokens(prompt) > self.fast_max_prompt_tokens
+        ):
+            return "strong"
+        # Block summaries are background work, where only cost matters
+        if task != "summary" and not self._fast_is_faster():
+            return "strong"
+        return "fast"
+
+    def _fast_is_faster(self) -> bool:
+        latencies = self.latencies()
+        fast = latencies.get(self.routes["fast"]["model"])
+        strong = latencies.get(self.routes["strong"]["model"])
+        if not fast or not strong:
+            return True
+        if min(fast["samples"], strong["samples"]) < self.MIN_SAMPLES:
+            return True
+        # A fast model passed over for being slow is tried again now and then,
+        # or its average could never recover
+        if time.time() - fast["updated"] > self.probe_seconds:
+            return True
+        return fast["per_token"] < strong["per_token"]
+
+    def record(self, model: str, seconds: float, prompt: str, output: str):
+        """Fold one call's latency into the model's shared moving average.
+
+        Only prompts small enough for either route are compared, per output
+        token, so the strong model's long answers to big prompts do not make
+        it look slower than it is.
+        """
+        if self.estimate_tokens(prompt) > self.fast_max_prompt_tokens:
+            return
+        per_token = seconds / self.estimate_tokens(output)
+        try:
+            self.state_path.parent.mkdir(parents=True, exist_ok=True)
+            with open(self.state_path, "a+") as f:
+                fcntl.flock(f, fcntl.LOCK_EX)
+                f.seek(0)
+                try:
+                    latencies = json.loads(f.read() or "{}")
+                except ValueError:
+                    latencies = {}
+                entry = latencies.get(model)
+                if not isinstance(entry, dict) or "per_token" not in entry:
+                    entry = {"per_token": per_token, "samples": 0}
+                entry["per_token"] += self.alpha * (per_token - entry["per_token"])
+                entry["samples"] += 1
+                entry["updated"] = time.time()
+                latencies[model] = entry
+                f.seek(0)
+                f.truncate()
+                json.dump(latencies, f)
+        except OSError as e:
+            logger.warning(f"Failed to record model latency: {e}")
+
+    def latencies(self) -> Dict[str, Dict]:
+        """Each model's average seconds per output token, across all processes.
+
+        Entries recorded before latency was kept per token are left out.
+        """
+        try:
+            with open(self.state_path, "r") as f:
+                latencies = json.load(f)
+        except (OSError, ValueError):
+            return {}
+        return {
+            model: entry
+            for model, entry in latencies.items()
+            if isinstance(entry, dict) and "per_token" in entry
+        }
+
 
 class ContextAnalyzer:
     """Analyzes terminal context to extract meaningful information"""
@@ -443,6 +1223,9 @@ class AIClient:
                 f"Unsupported provider: {provider}. Use 'anthropic', 'openai', or 'openrouter'"
             )
 
+        self.singleflight = SingleFlight()
+        self.router = ModelRouter(provider, config_manager, self.model)
+
     def analyze_context(
         self,
         session_context: SessionContext,
@@ -455,20 +1238,137 @@ class AIClient:
         prompt = self._build_analysis_prompt(
             session_context, scrollback_analysis, project_analysis
         )
+        # Several distinct errors or failing tests want the stronger model
+        errors = [
+            d
+            for d in scrollback_analysis.get("diagnostics") or []
+            if d["severity"] == "error"
+        ]
+        hard = (
+            len(errors) >= 3
+            or len(scrollback_analysis.get("errors_found", [])) > 3
+            or any(
+                run.get("failed") for run in scrollback_analysis.get("test_runs") or []
+            )
+        )
+        return self._complete(prompt, "analysis", hard)
+
+    def answer_question(
+        self, session_context: SessionContext, question: str, windows: List[Dict]
+    ) -> str:
+        """Answer a question grounded in the retrieved scrollback windows"""
+        excerpts = "\n\n".join(
+            f"[pane {w['pane']}, lines {w['first_seq']}-{w['last_seq']}]\n{w['text']}"
+            for w in windows
+        )
+        prompt = f"""You are Muxgeist, a helpful AI assistant that lives in a terminal environment.
+Answer the user's question about their tmux session using the terminal output below.
+If the output does not contain the answer, say so briefly.
+
+CONTEXT:
+- Session: {session_context.session_id}
+- Current Directory: {session_context.cwd}
+
+RELEVANT TERMINAL OUTPUT (most relevant first):
+{excerpts or "(nothing matched the question)"}
+
+QUESTION: {question}
+
+Keep the answer concise and terminal-friendly.
+"""
+        # "What was that command" is recall; "why is the build failing" is not
+        hard = not windows or re.match(
+            r"\s*(why|how (do|can|should|to)|explain|debug|fix|what('s| is) wrong)",
+            question,
+            re.IGNORECASE,
+        )
+        return self._complete(prompt, "question", bool(hard))
+
+    def analyze_changes(self, session_context: SessionContext, changes: Dict) -> str:
+        """Refresh an earlier analysis from only what changed since"""
+        scripts = "\n\n".join(
+            f"[pane {p['pane']} ({p['title']}), +{p['added']} -{p['removed']} lines]\n"
+            f"{p['script']}"
+            for p in changes["panes"]
+        )
+        prompt = f"""You are Muxgeist, a helpful AI assistant that lives in a terminal environment.
+You analysed this tmux session earlier. Below is a line diff of each pane that
+changed since then ("+" new lines, "-" removed lines, "~" output that scrolled away).
+
+CONTEXT:
+- Session: {session_context.session_id}
+- Current Directory: {session_context.cwd}
+
+CHANGES:
+{scripts}
+
+Briefly say what happened in the meantime and whether anything needs attention.
+Keep it concise and terminal-friendly.
+"""
+        return self._complete(prompt, "changes")
+
+    def summarize_block(self, block: Dict) -> str:
+        """Condense one block's extractive summary into a line or two"""
+        prompt = f"""Summarise what happened in this stretch of terminal output in
+one or two short lines (under 200 characters). Mention commands, failures and
+outcomes; leave out timestamps and ids.
+
+{block['text']}
+"""
+        return self._complete(prompt, "summary", max_tokens=100).strip()
+
+    def _complete(
+        self, prompt: str, task: str, hard: bool = False, max_tokens: int = None
+    ) -> str:
+        """Send a single-turn prompt to the model routed for it.
+
+        A fast model that fails is retried once on the strong one.
+        """
+        route = self.router.choose(prompt, task, hard)
+        result = self._complete_with(route, prompt, max_tokens)
+        if route == "fast" and result.startswith("Analysis unavailable"):
+            logger.warning("Fast model failed, retrying with the strong one")
+            result = self._complete_with("strong", prompt, max_tokens)
+        return result
+
+    def _complete_with(self, route: str, prompt: str, max_tokens: int = None) -> str:
+        """Call one route's model, sharing the call with identical ones.
+
+        The prompt carries the session state, so identical prompts to the
+        same model are identical analyses.
+        """
+        model = self.router.routes[route]["model"]
+        limit = self.router.routes[route]["max_tokens"]
+        max_tokens = min(max_tokens, limit) if max_tokens else limit
+        key = SingleFlight.key(self.provider, model, max_tokens, prompt)
+        return self.singleflight.do(
+            key,
+            lambda: self._timed_call(model, prompt, max_tokens),
+            shareable=lambda result: not result.startswith("Analysis unavailable"),
+        )
 
+    def _timed_call(self, model: str, prompt: str, max_tokens: int) -> str:
+        started = time.monotonic()
+        result = self._call_provider(model, prompt, max_tokens)
+        if not result.startswith("Analysis unavailable"):
+            self.router.record(model, time.monotonic() - started, prompt, result)
+        return result
+
+    def _call_provider(self, model: str, prompt: str, max_tokens: int) -> str:
+        """Send a single-turn prompt to the configured provider"""
         try:
             if self.provider == "anthropic":
                 response = self.client.messages.create(
-                    model=self.model,
-                    max_tokens=1000,
+                    model=model,
+                    max_tokens=max_tokens,
                     messages=[{"role": "user", "content": prompt}],
                 )
                 return response.content[0].text
 
             elif self.provider in ["openai", "openrouter"]:
                 response = self.client.chat.completions.create(
-                    model=self.model,
-                    max_tokens=1000,
+                    model=model,
+                    max_tokens=max_tokens,
                     messages=[{"role": "user", "content": prompt}],
                 )
                 return response.choices[0].message.content
@@ -500,8 +1400,8 @@ RECENT ACTIVITY:
 - Recent Commands: {scrollback_analysis.get('recent_commands', [])[-3:]}
 
 ISSUES DETECTED:
-{scrollback_analysis.get('errors_found', [])}
-
+{self._format_issues(scrollback_analysis)}
+{self._format_test_runs(scrollback_analysis)}{self._format_log_patterns(scrollback_analysis)}{self._format_history(scrollback_analysis)}
 Please provide:
 1. A brief assessment of what the user is doing
 2. 2-3 specific, actionable suggestions
@@ -511,6 +1411,76 @@ Keep responses concise and terminal-friendly. Focus on being helpful, not verbos
 """
         return prompt
 
+    def _format_issues(self, scrollback_analysis: Dict) -> str:
+        """Prefer the daemon's structured diagnostics over raw error lines"""
+        diagnostics = scrollback_analysis.get("diagnostics") or []
+        if not diagnostics:
+            return str(scrollback_analysis.get("errors_found", []))
+
+        lines = []
+        for diag in diagnostics[:20]:
+            repeat = f" (x{diag['count']})" if diag["count"] > 1 else ""
+            lines.append(
+                f"- {diag['severity']} {diag['file']}:{diag['line']}:{diag['column']}"
+                f" [{diag['tool']}]{repeat}: {diag['message']}"
+            )
+            if diag["snippet"]:
+                lines.append(f"    {diag['snippet'][0].strip()}")
+            for note in diag["notes"][:1]:
+                lines.append(f"    note: {note}")
+        if len(diagnostics) > 20:
+            lines.append(f"- ... and {len(diagnostics) - 20} more")
+        return "\n".join(lines)
+
+    def _format_test_runs(self, scrollback_analysis: Dict) -> str:
+        """Summarise the latest test runs in a few hundred bytes"""
+        runs = scrollback_analysis.get("test_runs") or []
+        if not runs:
+            return ""
+
+        lines = ["TEST RESULTS:"]
+        for run in runs:
+            lines.append(
+                f"- pane {run['pane']}: {run['runner']} {run['state']}, "
+                f"{run.get('passed', 0)} passed, {run.get('failed', 0)} failed, "
+                f"{run.get('skipped', 0)} skipped in {run.get('duration', 0):.1f}s"
+            )
+            if run["failures"]:
+                lines.append(f"    failing: {', '.join(run['failures'])}")
+            for excerpt in run["excerpt"][:4]:
+                lines.append(f"    {excerpt.strip()}")
+        return "\n".join(lines) + "\n"
+
+    def _format_log_patterns(self, scrollback_analysis: Dict) -> str:
+        """Show log-tailing panes as "count x template" instead of raw lines"""
+        panes = scrollback_analysis.get("log_templates") or {}
+        lines = []
+        for pane_index, pane in panes.items():
+            templates = pane["templates"]
+            # Only worth it where lines collapse into few templates
+            if pane["lines"] < 50 or pane["lines"] < 10 * max(len(templates), 1):
+                continue
+            lines.append(f"- pane {pane_index} ({pane['lines']} lines):")
+            for tpl in templates[:8]:
+                lines.append(f"    {tpl['count']} x {tpl['template']}")
+        if not lines:
+            return ""
+        return "LOG PATTERNS:\n" + "\n".join(lines) + "\n"
+
+    def _format_history(self, scrollback_analysis: Dict) -> str:
+        """Older activity from the precomputed block summaries"""
+        blocks = scrollback_analysis.get("history_summaries") or []
+        if not blocks:
+            return ""
+
+        lines = ["EARLIER ACTIVITY (summarised, oldest first per pane):"]
+        for block in blocks:
+            start = datetime.fromtimestamp(block["start"]).strftime("%H:%M")
+            end = datetime.fromtimestamp(block["end"]).strftime("%H:%M")
+            text = "; ".join(line.strip() for line in block["text"].split("\n"))
+            lines.append(f"- pane {block['pane']} {start}-{end}: {text}")
+        return "\n".join(lines) + "\n"
+
 
 class MuxgeistAI:
     """Main AI service for Muxgeist"""
@@ -525,6 +1495,7 @@ class MuxgeistAI:
             ai_provider = self._detect_provider()
 
         self.ai_client = AIClient(ai_provider, self.config)
+        self.summary_cache = SummaryCache()
         logger.info(
             f"Initialized with {ai_provider} provider using model: {self.ai_client.model}"
         )
@@ -555,6 +1526,22 @@ class MuxgeistAI:
             context.scrollback
         )
         project_analysis = self.context_analyzer.analyze_project_context(context.cwd)
+        scrollback_analysis["diagnostics"] = self.daemon_client.get_diagnostics(
+            session_id
+        )
+        scrollback_analysis["test_runs"] = self.daemon_client.get_test_runs(session_id)
+        # Shell history files beat guessing commands from "$ " prompts
+        history_commands = self.daemon_client.get_recent_commands(session_id)
+        if history_commands:
+            scrollback_analysis["recent_commands"] = [
+                entry["command"] for entry in history_commands
+            ]
+        scrollback_analysis["log_templates"] = self.daemon_client.get_log_templates(
+            session_id
+        )
+        scrollback_analysis["history_summaries"] = self.get_history_summaries(
+            session_id
+        )
 
         # Get AI analysis
         ai_response = self.ai_client.analyze_context(
@@ -575,11 +1562,20 @@ class MuxgeistAI:
         requires_attention = (
             len(scrollback_analysis.get("errors_found", [])) > 0
             or scrollback_analysis.get("sentiment") == "frustrated"
+            or any(
+                d["severity"] == "error" for d in scrollback_analysis["diagnostics"]
+            )
+            or any(run.get("failed") for run in scrollback_analysis["test_runs"])
         )
 
         # Calculate confidence (simple heuristic)
         confidence = 0.8 if scrollback_analysis.get("tools_detected") else 0.5
 
+        # Shows up in status lines using #{@muxgeist_status}
+        self.daemon_client.set_status_note(
+            session_id, "🌟 needs attention" if requires_attention else "🌟 ready"
+        )
+
         return AnalysisResult(
             session_context=context,
             analysis=ai_response,
@@ -588,6 +1584,78 @@ class MuxgeistAI:
             requires_attention=requires_attention,
         )
 
+    def analyze_changes(
+        self, session_id: str, since_seq: int
+    ) -> Tuple[Optional[Dict], Optional[str]]:
+        """Diff the session against an earlier snapshot and comment on it.
+
+        Returns the changes (whose "seq" is the next since_seq) and the AI
+        commentary, which is None when nothing changed.
+        """
+        changes = self.daemon_client.get_changes(session_id, since_seq)
+        if changes is None or not changes["panes"]:
+            return changes, None
+
+        context = self.daemon_client.get_context(session_id)
+        if not context:
+            return changes, None
+        return changes, self.ai_client.analyze_changes(context, changes)
+
+    def _summary_settings(self) -> Tuple[int, int, bool]:
+        use_llm = self.config.get("summaries.use_llm", False)
+        if isinstance(use_llm, str):
+            use_llm = use_llm.lower() in ("1", "true", "yes")
+        return (
+            int(self.config.get("summaries.window_seconds", 7200)),
+            int(self.config.get("summaries.budget", 1200)),
+            bool(use_llm),
+        )
+
+    def get_history_summaries(self, session_id: str) -> List[Dict]:
+        """Block summaries for the prompt, preferring cached LLM summaries"""
+        seconds, budget, _ = self._summary_settings()
+        blocks = self.daemon_client.get_block_summaries(session_id, seconds, budget)
+        for block in blocks:
+            cached = self.summary_cache.get(block["hash"])
+            if cached:
+                block["text"] = cached
+        return blocks
+
+    def refresh_summaries(self, session_id: str) -> int:
+        """Summarise new blocks with the LLM ahead of time, if enabled.
+
+        Meant to run in the background so analysis only reads the cache.
+        Returns the number of blocks summarised.
+        """
+        seconds, budget, use_llm = self._summary_settings()
+        if not use_llm:
+            return 0
+
+        summarised = 0
+        for block in self.daemon_client.get_block_summaries(
+            session_id, seconds, budget
+        ):
+            if self.summary_cache.get(block["hash"]) or not block["text"]:
+                continue
+            summary = self.ai_client.summarize_block(block)
+            if summary and not summary.startswith("Analysis unavailable"):
+                self.summary_cache.put(block["hash"], summary)
+                summarised += 1
+        if summarised:
+            self.summary_cache.save()
+        return summarised
+
+    def answer_question(self, session_id: str, question: str) -> Optional[str]:
+        """Answer a question using only the scrollback relevant to it"""
+        context = self.daemon_client.get_context(session_id)
+        if not context:
+            logger.error(f"Failed to get context for session: {session_id}")
+            return None
+
+        windows = self.daemon_client.retrieve(session_id, question)
+        logger.info(f"Retrieved {len(windows)} windows for question")
+        return self.ai_client.answer_question(context, question, windows)
+
     def get_session_summary(self) -> str:
         """Get summary of all tracked sessions"""
         sessions = self.daemon_client.list_sessions()
@@ -614,6 +1682,7 @@ def main():
         )
         print("       python3 muxgeist_ai.py --providers")
         print("       python3 muxgeist_ai.py --config")
+        print("       python3 muxgeist_ai.py --stats")
         sys.exit(1)
 
     # Parse arguments
@@ -647,6 +1716,23 @@ def main():
                     print(f"  ✗ {provider_name}: No API key")
             return
 
+        if sys.argv[1] == "--stats":
+            saved = SingleFlight().saved_calls()
+            print("Provider calls saved by coalescing identical analyses:")
+            print(f"  in-process waiters: {saved.get('shared_local', 0)}")
+            print(f"  other processes:    {saved.get('shared_remote', 0)}")
+            latencies = ModelRouter(
+                provider or "anthropic", ConfigManager(), None
+            ).latencies()
+            if latencies:
+                print("Observed model latency per output token (moving average):")
+                for model, entry in sorted(latencies.items()):
+                    print(
+                        f"  {model}: {entry['per_token'] * 1000:.1f}ms"
+                        f" over {entry['samples']} calls"
+                    )
+            return
+
         if sys.argv[1] == "--providers":
             config = ConfigManager()
             print("Available AI providers:")
@@ -22,6 +22,31 @@ print_fail() {
     echo -e "${RED}FAIL:${NC} $1"
 }
 
+# New sessions on an idle tmux server can take a few polls to be noticed
+wait_for_session() {
+    for _ in $(seq 1 20); do
+        if ./muxgeist-client list | grep -q "/$1 "; then
+            return 0
+        fi
+        sleep 0.5
+    done
+}
+
+# Ask the daemon until its answer contains the expected text; the answer is
+# left in QUERY_OUTPUT either way
+query_until() {
+    local expected=$1
+    shift
+    for _ in $(seq 1 30); do
+        QUERY_OUTPUT=$(./muxgeist-client "$@")
+        if [[ $QUERY_OUTPUT == *"$expected"* ]]; then
+            return 0
+        fi
+        sleep 0.5
+    done
+    return 1
+}
+
 # Build first
 print_test "Building daemon and client"
 make clean && make
@@ -72,7 +97,18 @@ if [[ -n "$FIRST_SESSION" ]]; then
     fi
 fi
 
-# Test 4: Invalid command
+# Test 4: Diagnostics query
+if [[ -n "$FIRST_SESSION" ]]; then
+    print_test "Testing diagnostics command for session: $FIRST_SESSION"
+    DIAG_OUTPUT=$(./muxgeist-client diagnostics "$FIRST_SESSION")
+    if [[ $DIAG_OUTPUT == "Diagnostics:"* ]]; then
+        print_pass "Diagnostics command works"
+    else
+        print_fail "Diagnostics command failed: $DIAG_OUTPUT"
+    fi
+fi
+
+# Test 5: Invalid command
 print_test "Testing invalid command handling"
 INVALID_OUTPUT=$(./muxgeist-client invalid_command 2>/dev/null || true)
 if [[ $INVALID_OUTPUT == *"ERROR"* ]]; then
@@ -81,11 +117,459 @@ else
     print_fail "Invalid command not handled properly"
 fi
 
+# Test 6: Aggregator over two daemons
+print_test "Testing aggregator over two daemons"
+tmux new-session -d -s muxgeist-search-test -c /tmp \
+    'echo "ERROR quokka migration failed on shard $((6 * 7))"; echo done; sleep 60'
+wait_for_session muxgeist-search-test
+./muxgeist-daemon --socket /tmp/muxgeist-test-2.sock &
+SECOND_PID=$!
+./muxgeist-daemon --socket /tmp/muxgeist-test-agg.sock \
+    --aggregate one=/tmp/muxgeist.sock,two=/tmp/muxgeist-test-2.sock &
+AGGREGATOR_PID=$!
+sleep 3
+AGG_STATUS=$(MUXGEIST_SOCKET=/tmp/muxgeist-test-agg.sock ./muxgeist-client status)
+AGG_SEARCH=$(MUXGEIST_SOCKET=/tmp/muxgeist-test-agg.sock \
+    ./muxgeist-client "search:5:quokka migration")
+AGG_LISTED=$(MUXGEIST_SOCKET=/tmp/muxgeist-test-agg.sock ./muxgeist-client list)
+tmux kill-session -t muxgeist-search-test
+# The downstream daemon tells the aggregator the session is gone
+for _ in $(seq 1 30); do
+    AGG_LIST=$(MUXGEIST_SOCKET=/tmp/muxgeist-test-agg.sock ./muxgeist-client list)
+    if [[ $AGG_LIST != *"/muxgeist-search-test "* ]]; then
+        break
+    fi
+    sleep 0.5
+done
+if [[ $AGG_STATUS == *"across 2/2 shards"* && $AGG_SEARCH == *"Shards: 2/2"* && \
+      $AGG_SEARCH == *"=== RESULT one/"*"/muxgeist-search-test "* && \
+      $AGG_SEARCH == *"ERROR quokka migration failed on shard 42"* && \
+      $AGG_LISTED == *"one/"*"/muxgeist-search-test "* && \
+      $AGG_LIST != *"/muxgeist-search-test "* ]]; then
+    print_pass "Aggregator merges both daemons and drops a killed session"
+else
+    print_fail "Aggregator failed: $AGG_STATUS / $AGG_SEARCH / $AGG_LIST"
+fi
+kill $AGGREGATOR_PID $SECOND_PID
+wait $AGGREGATOR_PID $SECOND_PID 2>/dev/null || true
+
+# Test 7: Sharded daemon spreads sessions over its own processes
+print_test "Testing --shards"
+./muxgeist-daemon --socket /tmp/muxgeist-test-shards.sock --shards 2 &
+SHARDS_PID=$!
+sleep 3
+SHARDS_STATUS=$(MUXGEIST_SOCKET=/tmp/muxgeist-test-shards.sock \
+    ./muxgeist-client status)
+SHARDS_DUMP=$(MUXGEIST_SOCKET=/tmp/muxgeist-test-shards.sock \
+    ./muxgeist-client dump "$FIRST_SESSION" 2>&1 | head -c 4096)
+if [[ $SHARDS_STATUS == *"across 2/2 shards"* && \
+      ( -n "$SHARDS_DUMP" || -z "$FIRST_SESSION" ) && \
+      $SHARDS_DUMP != ERROR* ]]; then
+    print_pass "Shards answer through the parent: $SHARDS_STATUS"
+else
+    print_fail "Sharding failed: $SHARDS_STATUS / $SHARDS_DUMP"
+fi
+kill $SHARDS_PID
+wait $SHARDS_PID 2>/dev/null || true
+rm -f /tmp/muxgeist-test-shards.sock*
+
+# Test 8: A second daemon must not take over a live socket
+print_test "Testing that a live socket is not replaced"
+if ! ./muxgeist-daemon 2>/dev/null && ./muxgeist-client status >/dev/null; then
+    print_pass "Second daemon refused the live socket"
+else
+    print_fail "Second daemon replaced the running one"
+fi
+
+# Test 9: Following a session streams its new lines
+print_test "Testing follow"
+tmux new-session -d -s muxgeist-follow-test 'cd /tmp && bash'
+wait_for_session muxgeist-follow-test
+sleep 1
+MUXGEIST_NO_SPAWN=1 timeout 6 ./muxgeist-client follow muxgeist-follow-test \
+    > /tmp/muxgeist-follow.out 2>&1 &
+FOLLOW_PID=$!
+sleep 1
+tmux send-keys -t muxgeist-follow-test 'echo follow-$((6 * 7))-marker' Enter
+sleep 3
+DUMP_OUTPUT=$(./muxgeist-client dump muxgeist-follow-test --ndjson)
+GREP_OUTPUT=$(./muxgeist-client "grep:muxgeist-follow-test:0:FOLLOW-42")
+SIMILAR_OUTPUT=$(./muxgeist-client \
+    "similar:muxgeist-follow-test:3:follow-43-marker")
+tmux kill-session -t muxgeist-follow-test
+wait $FOLLOW_PID 2>/dev/null || true
+if grep -q "follow-42-marker" /tmp/muxgeist-follow.out; then
+    print_pass "Follow streamed the new line"
+else
+    print_fail "Follow missed the new line: $(cat /tmp/muxgeist-follow.out)"
+fi
+rm -f /tmp/muxgeist-follow.out
+
+# Test 10: Dumping the same session's history
+print_test "Testing dump"
+if [[ $DUMP_OUTPUT == *'"text":"follow-42-marker"}'* ]]; then
+    print_pass "Dump returned the session history"
+else
+    print_fail "Dump missed the history: $DUMP_OUTPUT"
+fi
+
+# Test 11: Filtered grep and similar-line lookups over the same history
+print_test "Testing grep and similar"
+if [[ $GREP_OUTPUT == *"] "*" follow-42-marker"* && \
+      $SIMILAR_OUTPUT == *"follow-42-marker"* ]]; then
+    print_pass "Grep and similar found the line"
+else
+    print_fail "Grep/similar missed the line: $GREP_OUTPUT / $SIMILAR_OUTPUT"
+fi
+
+# Test 12: Record a trace, anonymise it and replay it without tmux
+print_test "Testing trace record and replay"
+./muxgeist-daemon --socket /tmp/muxgeist-test-rec.sock \
+    --record /tmp/muxgeist-test.trace &
+RECORD_PID=$!
+sleep 3
+MUXGEIST_SOCKET=/tmp/muxgeist-test-rec.sock ./muxgeist-client status >/dev/null
+kill $RECORD_PID
+wait $RECORD_PID 2>/dev/null || true
+./muxgeist-daemon --anonymise /tmp/muxgeist-test.trace /tmp/muxgeist-test.anon
+REPLAY_OUTPUT=$(./muxgeist-daemon --replay /tmp/muxgeist-test.anon --speed max \
+    --socket /tmp/muxgeist-test-replay.sock | grep "^replay done")
+if [[ $REPLAY_OUTPUT == *"requests=1 "* ]]; then
+    print_pass "Replayed the anonymised trace: $REPLAY_OUTPUT"
+else
+    print_fail "Replay failed: $REPLAY_OUTPUT"
+fi
+rm -f /tmp/muxgeist-test.trace /tmp/muxgeist-test.anon
+
+# Test 13: Full-screen panes keep their redraws as frames
+print_test "Testing full-screen frame history"
+if command -v watch >/dev/null; then
+    tmux new-session -d -s muxgeist-watch-test 'watch -n 0.5 date +%s%N'
+    sleep 5
+    SCREEN_NOW=$(./muxgeist-client "screen:muxgeist-watch-test:0.0:0")
+    SCREEN_DIFF=$(./muxgeist-client "screen:muxgeist-watch-test:0.0:0:3")
+    tmux kill-session -t muxgeist-watch-test
+    if [[ $SCREEN_NOW == Frame:* && $SCREEN_NOW == *"Every 0.5s"* && \
+          $SCREEN_DIFF == *"Base: frame"* ]]; then
+        print_pass "$(echo "$SCREEN_NOW" | head -n2 | tr '\n' ' ')"
+    else
+        print_fail "Frames missing: $SCREEN_NOW / $SCREEN_DIFF"
+    fi
+else
+    print_pass "watch not installed, skipped"
+fi
+
+# Test 14: Lines are stored as UTF-8 with their display width
+print_test "Testing UTF-8 line widths"
+tmux new-session -d -s muxgeist-utf8-test "printf 'wide 日本語 ok 🚀\\ndone\\n'; sleep 30"
+wait_for_session muxgeist-utf8-test
+sleep 2
+UTF8_OUTPUT=$(./muxgeist-client dump muxgeist-utf8-test --ndjson)
+tmux kill-session -t muxgeist-utf8-test
+if [[ $UTF8_OUTPUT == *'"width":17,"text":"wide 日本語 ok 🚀"'* ]]; then
+    print_pass "Wide characters counted as two columns"
+else
+    print_fail "Unexpected widths: $UTF8_OUTPUT"
+fi
+
+# Test 15: A pane running tail -f is read from its file, losing nothing
+print_test "Testing file tailing"
+: > /tmp/muxgeist-tail.log
+tmux new-session -d -s muxgeist-tail-test -c /tmp 'bash'
+tmux send-keys -t muxgeist-tail-test 'tail -f muxgeist-tail.log' Enter
+for _ in $(seq 1 30); do
+    ./muxgeist-client status | grep -q "following" && break
+    sleep 0.5
+done
+for i in $(seq 1 1500); do
+    echo "tail-line-$i"
+done >> /tmp/muxgeist-tail.log
+sleep 2
+TAIL_LINES=$(./muxgeist-client dump muxgeist-tail-test | grep -c "^tail-line-" \
+    || true)
+tmux kill-session -t muxgeist-tail-test
+rm -f /tmp/muxgeist-tail.log
+if [ "$TAIL_LINES" = "1500" ]; then
+    print_pass "All 1500 lines written at once reached the history"
+else
+    print_fail "Tailed $TAIL_LINES of 1500 lines"
+fi
+
+# Test 16: Commands are read from the shell's history file as it grows
+print_test "Testing shell history commands"
+: > /tmp/muxgeist-bash-history
+tmux new-session -d -s muxgeist-history-test -c /tmp \
+    "env HISTFILE=/tmp/muxgeist-bash-history HISTTIMEFORMAT=%s \
+    PROMPT_COMMAND='history -a' bash --norc -i"
+wait_for_session muxgeist-history-test
+sleep 2
+tmux send-keys -t muxgeist-history-test 'echo history-check' Enter
+for _ in $(seq 1 20); do
+    HISTORY_OUTPUT=$(./muxgeist-client commands muxgeist-history-test)
+    [[ $HISTORY_OUTPUT == *"history-check"* ]] && break
+    sleep 0.5
+done
+tmux kill-session -t muxgeist-history-test
+rm -f /tmp/muxgeist-bash-history
+if [[ $HISTORY_OUTPUT == *"] "*" /tmp \$ echo history-check"* ]]; then
+    print_pass "Command attributed to its pane and directory"
+else
+    print_fail "Unexpected commands: $HISTORY_OUTPUT"
+fi
+
+# Test 17: Sampling profile of the daemon while it answers queries
+print_test "Testing profile"
+./muxgeist-client profile 2 > /tmp/muxgeist-profile.out 2>&1 &
+PROFILE_PID=$!
+for i in $(seq 1 100); do
+    ./muxgeist-client "search:5:error build failed" > /dev/null
+done
+wait $PROFILE_PID
+if grep -qE '^main(;[^ ]+)* [0-9]+$' /tmp/muxgeist-profile.out; then
+    print_pass "Folded stacks: $(wc -l < /tmp/muxgeist-profile.out) distinct"
+elif grep -q "No samples" /tmp/muxgeist-profile.out; then
+    print_pass "Profile ran, the daemon used too little CPU to sample"
+else
+    print_fail "Profile failed: $(head -n3 /tmp/muxgeist-profile.out)"
+fi
+rm -f /tmp/muxgeist-profile.out
+
+# Test 18: Dictionary compression of history-sized blocks
+print_test "Testing history compression benchmark"
+for i in $(seq 1 2000); do
+    echo "INFO [worker-$((i % 7))] job $i finished in $((i * 37 % 900))ms"
+done > /tmp/muxgeist-bench.txt
+BENCH_OUTPUT=$(./muxgeist-daemon --bench-history /tmp/muxgeist-bench.txt)
+if [[ $BENCH_OUTPUT == *"bench dictionary ratio="* ]]; then
+    print_pass "$(echo "$BENCH_OUTPUT" | grep "bench dictionary")"
+elif ! pkg-config --exists zlib 2>/dev/null; then
+    print_pass "Built without zlib, history stays uncompressed"
+else
+    print_fail "Benchmark failed: $BENCH_OUTPUT"
+fi
+rm -f /tmp/muxgeist-bench.txt
+
+# Test 19: Real compiler and interpreter output becomes structured diagnostics.
+# Each pane ends on a line of its own, as the cursor line is held back.
+print_test "Testing diagnostics from compiler and traceback output"
+cat > /tmp/muxgeist-diag.c <<'EOF'
+int main(void) {
+  return undeclared_var;
+}
+EOF
+cat > /tmp/muxgeist-diag.py <<'EOF'
+def load(config):
+    return config["name"] + config["paths"]["root"]
+
+try:
+    load({"name": "x", "paths": {}})
+except KeyError as e:
+    raise ValueError("bad config") from e
+EOF
+tmux new-session -d -s muxgeist-diag-test -c /tmp \
+    "${CC:-cc} -c muxgeist-diag.c -o /dev/null; python3 muxgeist-diag.py; \
+    echo done; sleep 30"
+wait_for_session muxgeist-diag-test
+query_until "ValueError: bad config" diagnostics muxgeist-diag-test || true
+DIAG_OUTPUT=$QUERY_OUTPUT
+tmux kill-session -t muxgeist-diag-test
+rm -f /tmp/muxgeist-diag.c /tmp/muxgeist-diag.py
+if [[ $DIAG_OUTPUT == *"error muxgeist-diag.c:2:10 [cc] x1: "* && \
+      $DIAG_OUTPUT == *"muxgeist-diag.py:2:0 [python] x1: KeyError: 'root'"* && \
+      $DIAG_OUTPUT == *'| return config["name"] + config["paths"]["root"]'* && \
+      $DIAG_OUTPUT == *"muxgeist-diag.py:7:0 [python] x1: ValueError: bad config"* && \
+      $DIAG_OUTPUT != *"^^"* && $DIAG_OUTPUT != *"above exception"* ]]; then
+    print_pass "Compiler error and both chained exceptions extracted"
+else
+    print_fail "Unexpected diagnostics: $DIAG_OUTPUT"
+fi
+
+# Test 20: A real pytest run is summarised with its failures
+print_test "Testing test-run summaries from pytest output"
+if python3 -m pytest --version >/dev/null 2>&1; then
+    cat > /tmp/test_muxgeist_sample.py <<'EOF'
+def test_one():
+    assert 1 + 1 == 2
+
+
+def test_two():
+    assert 1 == 2
+EOF
+    tmux new-session -d -s muxgeist-pytest-test -c /tmp \
+        "PYTHONDONTWRITEBYTECODE=1 python3 -m pytest -p no:cacheprovider \
+        test_muxgeist_sample.py; echo done; sleep 30"
+    wait_for_session muxgeist-pytest-test
+    query_until "finished" tests muxgeist-pytest-test || true
+    TESTS_OUTPUT=$QUERY_OUTPUT
+    tmux kill-session -t muxgeist-pytest-test
+    rm -f /tmp/test_muxgeist_sample.py
+    if [[ $TESTS_OUTPUT == *" pytest finished passed=1 failed=1 "* && \
+          $TESTS_OUTPUT == *"FAIL test_muxgeist_sample.py::test_two"* && \
+          $TESTS_OUTPUT == *"| E       assert 1 == 2"* ]]; then
+        print_pass "Run counted and its failure kept"
+    else
+        print_fail "Unexpected test runs: $TESTS_OUTPUT"
+    fi
+else
+    print_pass "pytest not installed, skipped"
+fi
+
+# Test 21: Service logs are mined into templates
+print_test "Testing log templates"
+cat > /tmp/muxgeist-log.sh <<'EOF'
+for i in $(seq 1 200); do
+    echo "INFO request id=$i path=/api/$((i % 5)) status=200"
+done
+echo "ERROR connection reset by peer 10.0.0.9:5432"
+for i in $(seq 1 100); do
+    echo "DEBUG cache hit key=$i"
+done
+echo done
+EOF
+tmux new-session -d -s muxgeist-log-test -c /tmp 'bash muxgeist-log.sh; sleep 60'
+wait_for_session muxgeist-log-test
+query_until "DEBUG cache hit" templates muxgeist-log-test || true
+TEMPLATES_OUTPUT=$QUERY_OUTPUT
+if [[ $TEMPLATES_OUTPUT == *" x INFO request id=<*> <*> status=<*>"* && \
+      $TEMPLATES_OUTPUT == *" x DEBUG cache hit key=<*>"* && \
+      $TEMPLATES_OUTPUT == *" 1 x ERROR connection reset by peer <*>"* ]]; then
+    print_pass "Requests, cache hits and the one error kept apart"
+else
+    print_fail "Unexpected templates: $TEMPLATES_OUTPUT"
+fi
+
+# Test 22: A question finds the scrollback window holding its answer
+print_test "Testing retrieval over the same logs"
+RETRIEVE_OUTPUT=$(./muxgeist-client \
+    "retrieve:muxgeist-log-test:2:2000:why was the connection reset?")
+FIRST_WINDOW=$(echo "$RETRIEVE_OUTPUT" | \
+    awk '/^=== WINDOW/ { n++ } n == 1 { print }')
+if [[ $FIRST_WINDOW == *"ERROR connection reset by peer 10.0.0.9:5432"* ]]; then
+    print_pass "$(echo "$FIRST_WINDOW" | head -n1)"
+else
+    print_fail "Error line not ranked first: $RETRIEVE_OUTPUT"
+fi
+
+# Test 23: Sealed blocks of the same logs are summarised, keeping the error
+print_test "Testing block summaries"
+SUMMARIES_OUTPUT=$(./muxgeist-client "summaries:muxgeist-log-test")
+tmux kill-session -t muxgeist-log-test
+rm -f /tmp/muxgeist-log.sh
+ERROR_BLOCK=$(echo "$SUMMARIES_OUTPUT" | \
+    grep -B4 "^ERROR connection reset by peer" | grep "^=== BLOCK" | tail -n1)
+if [[ $SUMMARIES_OUTPUT == "Blocks: "* && \
+      $ERROR_BLOCK == *" level=0 seq="*" hash="* ]]; then
+    print_pass "$ERROR_BLOCK"
+else
+    print_fail "Unexpected summaries: $SUMMARIES_OUTPUT"
+fi
+
+# Test 24: A diff since a context shows only what was printed after it
+print_test "Testing diff since a context"
+tmux new-session -d -s muxgeist-diff-test -c /tmp 'bash --norc'
+wait_for_session muxgeist-diff-test
+tmux send-keys -t muxgeist-diff-test 'echo diff-before-$((6 * 7))' Enter
+query_until "diff-before-42" context muxgeist-diff-test || true
+DIFF_SEQ=$(echo "$QUERY_OUTPUT" | sed -n 's/^Seq: //p')
+tmux send-keys -t muxgeist-diff-test 'echo diff-after-$((6 * 7))' Enter
+query_until "+diff-after-42" "diff:muxgeist-diff-test:$DIFF_SEQ" || true
+DIFF_OUTPUT=$QUERY_OUTPUT
+tmux kill-session -t muxgeist-diff-test
+if [[ -n $DIFF_SEQ && $DIFF_OUTPUT == *"Since: $DIFF_SEQ"* && \
+      $DIFF_OUTPUT == *"+diff-after-42"* && \
+      $DIFF_OUTPUT != *"+diff-before-42"* ]]; then
+    print_pass "Only the later line was added since Seq $DIFF_SEQ"
+else
+    print_fail "Unexpected diff since $DIFF_SEQ: $DIFF_OUTPUT"
+fi
+
+# Test 25: The session's diagnostics and note are pushed to @muxgeist_status,
+# and only when they change
+print_test "Testing @muxgeist_status"
+tmux new-session -d -s muxgeist-status-test -c /tmp \
+    "echo \"main.c:3:5: error: expected ';' before '}' token\"; echo done; sleep 60"
+wait_for_session muxgeist-status-test
+show_status() {
+    tmux show-options -qv -t muxgeist-status-test @muxgeist_status
+}
+for _ in $(seq 1 30); do
+    [[ $(show_status) == "✖1" ]] && break
+    sleep 0.5
+done
+STATUS_ERROR=$(show_status)
+./muxgeist-client "note:muxgeist-status-test:analysis ready" >/dev/null
+STATUS_NOTE=$(show_status)
+# Overwritten behind the daemon's back, it stays: the status has not changed
+tmux set-option -t muxgeist-status-test @muxgeist_status unchanged
+sleep 3
+STATUS_KEPT=$(show_status)
+./muxgeist-client "note:muxgeist-status-test:" >/dev/null
+STATUS_CLEARED=$(show_status)
+tmux kill-session -t muxgeist-status-test
+if [[ $STATUS_ERROR == "✖1" && $STATUS_NOTE == "✖1 analysis ready" && \
+      $STATUS_KEPT == "unchanged" && $STATUS_CLEARED == "✖1" ]]; then
+    print_pass "Status set on change only: $STATUS_NOTE"
+else
+    print_fail "Unexpected @muxgeist_status: $STATUS_ERROR / $STATUS_NOTE / $STATUS_KEPT / $STATUS_CLEARED"
+fi
+
+# Test 26: Sessions of the same name on several servers keep apart: two -L
+# servers and one -S socket given in MUXGEIST_TMUX_SOCKETS
+print_test "Testing sessions of the same name on several tmux servers"
+tmux new-session -d -s muxgeist-twin -c /tmp 'echo twin-on-default; echo done; sleep 60'
+tmux -L muxgeist-twin-l new-session -d -s muxgeist-twin -c /tmp \
+    'echo twin-on-label; echo done; sleep 60'
+tmux -S /tmp/muxgeist-twin.sock new-session -d -s muxgeist-twin -c /tmp \
+    'echo twin-on-socket; echo done; sleep 60'
+MUXGEIST_TMUX_SOCKETS=/tmp/muxgeist-twin.sock \
+    ./muxgeist-daemon --socket /tmp/muxgeist-test-twin.sock &
+TWIN_PID=$!
+sleep 1
+export MUXGEIST_SOCKET=/tmp/muxgeist-test-twin.sock
+query_until "muxgeist-twin.sock/muxgeist-twin " list || true
+TWIN_LIST=$QUERY_OUTPUT
+query_until "twin-on-label" context muxgeist-twin-l/muxgeist-twin || true
+TWIN_LABEL=$QUERY_OUTPUT
+query_until "twin-on-socket" context muxgeist-twin.sock/muxgeist-twin || true
+TWIN_SOCKET=$QUERY_OUTPUT
+query_until "twin-on-default" context muxgeist-twin || true
+TWIN_BARE=$QUERY_OUTPUT
+unset MUXGEIST_SOCKET
+kill $TWIN_PID
+wait $TWIN_PID 2>/dev/null || true
+tmux kill-session -t muxgeist-twin
+tmux -L muxgeist-twin-l kill-server
+tmux -S /tmp/muxgeist-twin.sock kill-server
+rm -f /tmp/muxgeist-test-twin.sock*
+if [[ $TWIN_LIST == *"default/muxgeist-twin "* && \
+      $TWIN_LIST == *"muxgeist-twin-l/muxgeist-twin "* && \
+      $TWIN_LIST == *"muxgeist-twin.sock/muxgeist-twin "* && \
+      $TWIN_LABEL == *"twin-on-label"* && $TWIN_LABEL != *"twin-on-default"* && \
+      $TWIN_SOCKET == *"twin-on-socket"* && \
+      $TWIN_BARE == *"twin-on-default"* && $TWIN_BARE != *"twin-on-label"* ]]; then
+    print_pass "Three servers, three sessions; the bare name is the default server's"
+else
+    print_fail "Sessions mixed up: $TWIN_LIST / $TWIN_LABEL / $TWIN_BARE"
+fi
+
 # Cleanup
 print_test "Cleaning up"
 kill $DAEMON_PID
 wait $DAEMON_PID 2>/dev/null || true
 
+# Test 27: The first request starts a daemon, warm from the snapshot
+print_test "Testing daemon start on first request"
+AUTO_STATUS=$(./muxgeist-client list)
+AUTO_PID=$(cat /tmp/muxgeist.sock.lock 2>/dev/null)
+if kill -0 "$AUTO_PID" 2>/dev/null && [[ -n "$AUTO_STATUS" || -z "$FIRST_SESSION" ]]; then
+    print_pass "Client started the daemon:"
+    echo "$AUTO_STATUS" | sed 's/^/  /'
+else
+    print_fail "Client did not start the daemon: $AUTO_STATUS"
+fi
+kill "$AUTO_PID" 2>/dev/null || true
+sleep 0.5
+
 if [[ $CREATED_SESSION == 1 ]]; then
     tmux kill-session -t muxgeist-test 2>/dev/null || true
 fi
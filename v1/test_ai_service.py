@@ -2,8 +2,10 @@
 
 import os
 import sys
+import hashlib
 import time
 import tempfile
+import threading
 import subprocess
 from pathlib import Path
 import unittest
@@ -18,6 +20,9 @@ from muxgeist_ai import (
     SessionContext,
     MuxgeistAI,
     AnalysisResult,
+    SingleFlight,
+    ModelRouter,
+    AIClient,
 )
 
 
@@ -46,6 +51,247 @@ class TestDaemonClient(unittest.TestCase):
             print(f"⚠ Could not list sessions: {e}")
 
 
+class TestSingleFlight(unittest.TestCase):
+    """Test coalescing of identical concurrent provider calls"""
+
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+        self.cache_dir = Path(self.tmp.name)
+
+    def tearDown(self):
+        self.tmp.cleanup()
+
+    def test_concurrent_callers_share_one_call(self):
+        """Test threads asking for the same key make one upstream call"""
+        flight = SingleFlight(self.cache_dir)
+        calls = []
+        started = threading.Event()
+
+        def slow_analysis():
+            calls.append(1)
+            started.set()
+            time.sleep(0.2)
+            return "analysis"
+
+        results = []
+        threads = [
+            threading.Thread(
+                target=lambda: results.append(flight.do("k", slow_analysis))
+            )
+            for _ in range(5)
+        ]
+        threads[0].start()
+        started.wait(5)
+        for thread in threads[1:]:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(results, ["analysis"] * 5)
+        self.assertEqual(flight.stats["shared_local"], 4)
+        self.assertEqual(flight.saved_calls()["shared_local"], 4)
+        print(f"✓ {flight.stats['shared_local']} calls coalesced in-process")
+
+    def test_result_shared_across_instances(self):
+        """Test a second process waits for the leader's in-flight call"""
+        first = SingleFlight(self.cache_dir)
+        second = SingleFlight(self.cache_dir)
+        calls = []
+        started = threading.Event()
+
+        def slow_analysis(result="analysis"):
+            calls.append(1)
+            started.set()
+            time.sleep(0.3)
+            return result
+
+        leader = threading.Thread(target=lambda: first.do("k", slow_analysis))
+        leader.start()
+        started.wait(5)
+        self.assertEqual(second.do("k", slow_analysis), "analysis")
+        leader.join()
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(second.stats["shared_remote"], 1)
+
+        # A landed result is not kept: a later caller makes its own call
+        self.assertEqual(second.do("k", slow_analysis), "analysis")
+        self.assertEqual(len(calls), 2)
+        self.assertEqual(list(self.cache_dir.glob("k.*")), [])
+
+        # A failed call is neither handed on nor counted: the waiter retries
+        started.clear()
+        leader = threading.Thread(
+            target=lambda: first.do(
+                "bad",
+                lambda: slow_analysis("Analysis unavailable: timeout"),
+                lambda result: False,
+            )
+        )
+        leader.start()
+        started.wait(5)
+        self.assertEqual(second.do("bad", lambda: "analysis"), "analysis")
+        leader.join()
+        self.assertEqual(second.stats["upstream"], 2)
+        self.assertEqual(second.saved_calls(), {"shared_remote": 1})
+        print("✓ In-flight result shared across processes")
+
+    def test_stripe_lock_not_held_across_call(self):
+        """Test another key on the same lock stripe is not held up"""
+        flight = SingleFlight(self.cache_dir)
+        other = SingleFlight(self.cache_dir)
+        stripe = lambda key: (
+            hashlib.md5(key.encode()).digest()[0] % SingleFlight.LOCK_STRIPES
+        )
+        neighbour = next(
+            f"n{i}" for i in range(1000) if stripe(f"n{i}") == stripe("k")
+        )
+        started = threading.Event()
+        release = threading.Event()
+
+        def blocked_analysis():
+            started.set()
+            release.wait(5)
+            return "analysis"
+
+        leader = threading.Thread(target=lambda: flight.do("k", blocked_analysis))
+        leader.start()
+        started.wait(5)
+        before = time.monotonic()
+        self.assertEqual(other.do(neighbour, lambda: "other"), "other")
+        self.assertLess(time.monotonic() - before, 1.0)
+        release.set()
+        leader.join()
+        print("✓ Provider call made outside the stripe lock")
+
+
+class TestModelRouter(unittest.TestCase):
+    """Test routing between fast and strong models"""
+
+    def setUp(self):
+        self.tmp = tempfile.TemporaryDirectory()
+        self.config = MagicMock()
+        self.config.get.side_effect = lambda key, default=None: {
+            "ai.anthropic.routes": {
+                "fast": {"model": "quick", "max_tokens": 300},
+                "strong": {"max_tokens": 1000},
+            },
+            "ai.routing": {"fast_max_prompt_tokens": 100},
+        }.get(key, default)
+        self.router = ModelRouter(
+            "anthropic", self.config, "deep", state_dir=Path(self.tmp.name)
+        )
+
+    def tearDown(self):
+        self.tmp.cleanup()
+
+    def test_routes_by_size_and_difficulty(self):
+        """Test small prompts go fast, large or hard ones strong"""
+        self.assertEqual(self.router.routes["fast"]["model"], "quick")
+        self.assertEqual(self.router.routes["strong"]["model"], "deep")
+        self.assertEqual(
+            self.router.choose("what was that command", "question"), "fast"
+        )
+        self.assertEqual(self.router.choose("x" * 1000, "question"), "strong")
+        self.assertEqual(self.router.choose("short", "analysis", hard=True), "strong")
+        print("✓ Routed by prompt size and difficulty")
+
+    def test_slow_fast_model_is_passed_over(self):
+        """Test observed latency moves quick requests to the faster model"""
+        answer = "x" * 400  # About 100 tokens
+        for _ in range(3):
+            self.router.record("quick", 9.0, "short", answer)
+            self.router.record("deep", 2.0, "short", answer)
+        self.assertEqual(self.router.choose("short", "question"), "strong")
+        # Background summaries keep the cheap model regardless
+        self.assertEqual(self.router.choose("short", "summary"), "fast")
+        self.assertEqual(self.router.latencies()["quick"]["samples"], 3)
+        print("✓ Slow fast model passed over")
+
+    def test_latency_compared_per_output_token(self):
+        """Test long answers and big prompts do not make a model look slow"""
+        for _ in range(3):
+            self.router.record("quick", 1.0, "short", "x" * 400)
+            self.router.record("deep", 4.0, "short", "x" * 4000)
+            self.router.record("deep", 60.0, "x" * 1000, "x" * 400)
+        latencies = self.router.latencies()
+        self.assertEqual(latencies["deep"]["samples"], 3)
+        self.assertLess(latencies["deep"]["per_token"], latencies["quick"]["per_token"])
+        self.assertEqual(self.router.choose("short", "question"), "strong")
+        print("✓ Latency compared per output token on quick-sized prompts")
+
+    def test_fast_route_only_within_family(self):
+        """Test the default fast model matches the strong model's family"""
+        config = MagicMock()
+        config.get.side_effect = lambda key, default=None: default
+        state_dir = Path(self.tmp.name)
+        claude = ModelRouter(
+            "openrouter", config, "anthropic/claude-3.5-sonnet", state_dir
+        )
+        self.assertEqual(claude.routes["fast"]["model"], "anthropic/claude-3.5-haiku")
+        llama = ModelRouter(
+            "openrouter", config, "meta-llama/llama-3.1-70b-instruct", state_dir
+        )
+        self.assertNotIn("fast", llama.routes)
+        self.assertEqual(llama.choose("short", "question"), "strong")
+        self.assertEqual(llama.choose("short", "summary"), "strong")
+        print("✓ No fast route outside the strong model's family")
+
+    def test_failed_fast_call_retries_strong(self):
+        """Test a failing fast model falls back to the strong one"""
+        client = AIClient.__new__(AIClient)
+        client.provider = "anthropic"
+        client.router = self.router
+        client.singleflight = SingleFlight(Path(self.tmp.name))
+        calls = []
+
+        def call_provider(model, prompt, max_tokens):
+            calls.append((model, max_tokens))
+            return "Analysis unavailable: overloaded" if model == "quick" else "ok"
+
+        client._call_provider = call_provider
+        self.assertEqual(client._complete("short", "question"), "ok")
+        self.assertEqual(calls, [("quick", 300), ("deep", 1000)])
+        self.assertNotIn("quick", self.router.latencies())
+        print("✓ Fast model failure retried on the strong model")
+
+
+class TestDaemonProtocol(unittest.TestCase):
+    """Test parsing of daemon responses without a running daemon"""
+
+    def setUp(self):
+        self.client = DaemonClient()
+
+    def test_connect_spawns_and_retries(self):
+        """Test that a missing daemon is started once and retried"""
+        attempts = []
+
+        def connect(path):
+            attempts.append(path)
+            if len(attempts) < 3:
+                raise FileNotFoundError(path)
+
+        self.client.auto_spawn = True
+        with patch("muxgeist_ai.socket.socket") as sock, patch.object(
+            self.client, "_spawn_daemon"
+        ) as spawn:
+            sock.return_value.connect.side_effect = connect
+            self.client._connect()
+
+        spawn.assert_called_once()
+        self.assertEqual(len(attempts), 3)
+        print("✓ Daemon started on demand after 2 failed connects")
+
+    def test_status_note(self):
+        """Test status notes are sent on one line"""
+        with patch.object(
+            self.client, "_send_command", return_value="OK: ✖2 ready"
+        ) as send:
+            self.assertTrue(self.client.set_status_note("test", "ready\n"))
+
+        send.assert_called_once_with("note:test:ready")
+
+
 class TestContextAnalyzer(unittest.TestCase):
     """Test context analysis functionality"""
 
@@ -263,6 +509,9 @@ def main():
     suite = unittest.TestSuite()
 
     # Add test classes
+    suite.addTests(loader.loadTestsFromTestCase(TestDaemonProtocol))
+    suite.addTests(loader.loadTestsFromTestCase(TestSingleFlight))
+    suite.addTests(loader.loadTestsFromTestCase(TestModelRouter))
     suite.addTests(loader.loadTestsFromTestCase(TestContextAnalyzer))
     suite.addTests(loader.loadTestsFromTestCase(TestMuxgeistAI))
 